@@ -0,0 +1,110 @@
+#!/bin/sh
+#
+# enginebench.sh
+#
+# Benchmark the output engines of zipfiles (-E, see zs_setengine()) on
+# Linux: for each of write(), O_DIRECT and mmap output, time writing
+# a stored archive of generated input files including sync, and report
+# the growth of the page cache during the run.  With -z entries are
+# deflated instead, which is usually CPU bound.
+#
+# Usage: ./enginebench.sh [-z] [-n runs] [-s MiB] [dir]
+#   -z      Deflate entries instead of storing
+#   -n      Runs per engine, default 3
+#   -s      Total size of generated input in MiB, default 1200
+#   dir     Directory for input and output on the file system to test,
+#           default is a temporary directory
+#
+# Dropping the page cache between runs requires root, otherwise the
+# page cache figures include data cached by earlier runs.
+
+runs=3
+size=1200
+method=-0
+label=stored
+
+while getopts "zn:s:" opt; do
+  case $opt in
+    z) method= ; label=deflated ;;
+    n) runs=$OPTARG ;;
+    s) size=$OPTARG ;;
+    *) echo "Usage: $0 [-z] [-n runs] [-s MiB] [dir]" >&2; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+zipfiles=$(cd "$(dirname "$0")" && pwd)/zipfiles
+
+if [ ! -x "$zipfiles" ]; then
+  echo "Build zipfiles first, e.g. make" >&2
+  exit 1
+fi
+
+if [ -n "$1" ]; then
+  dir=$1
+  mkdir -p "$dir" || exit 1
+else
+  dir=$(mktemp -d) || exit 1
+  trap 'rm -rf "$dir"' EXIT
+fi
+
+# Input of 16 files, half random and half compressible text
+count=16
+each=$((size / count))
+mkdir -p "$dir/input"
+idx=0
+while [ $idx -lt $count ]; do
+  file=$dir/input/file$idx
+  if [ ! -f "$file" ]; then
+    if [ $((idx % 2)) -eq 0 ]; then
+      head -c $((each * 1048576)) /dev/urandom > "$file"
+    else
+      yes "enginebench $idx compressible line of text" | head -c $((each * 1048576)) > "$file"
+    fi
+  fi
+  idx=$((idx + 1))
+done
+
+cached () {
+  awk '/^Cached:/ { print $2 }' /proc/meminfo
+}
+
+milliseconds () {
+  date +%s%3N
+}
+
+dropcache () {
+  sync
+  [ -w /proc/sys/vm/drop_caches ] && echo 3 > /proc/sys/vm/drop_caches
+}
+
+echo "Input: $count files, $((each * count)) MiB in $dir, entries $label"
+
+for engine in write direct mmap; do
+  times=
+  caches=
+  run=1
+  while [ $run -le $runs ]; do
+    rm -f "$dir/output.zip"
+    dropcache
+    before=$(cached)
+    start=$(milliseconds)
+
+    if [ $engine = write ]; then
+      (cd "$dir/input" && "$zipfiles" $method file* > "$dir/output.zip" 2>/dev/null) || exit 1
+    else
+      (cd "$dir/input" && "$zipfiles" $method -E $engine file* 1<> "$dir/output.zip" 2>/dev/null) || exit 1
+    fi
+    sync
+
+    end=$(milliseconds)
+    after=$(cached)
+    times="$times $((end - start))"
+    caches="$caches $(((after - before) / 1024))"
+    run=$((run + 1))
+  done
+
+  printf "%-7s ms:%s  page cache growth MB:%s\n" $engine "$times" "$caches"
+done
+
+rm -f "$dir/output.zip"
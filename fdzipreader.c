@@ -0,0 +1,1048 @@
+/***************************************************************************
+ * fdzipreader.c
+ *
+ * Random access reading of ZIP archives, such as those created with
+ * fdzipstream.c, from a memory mapped file descriptor.
+ *
+ * zlib is required for deflate decompression: http://www.zlib.net/
+ *
+ * What this will do for you:
+ *
+ * - Memory map an archive and index the Central Directory, including
+ *   ZIP64 structures, in a hash table by entry name.
+ * - Return pointers directly into the mapped archive for entry data,
+ *   which is the entry content itself for STORE'd entries.
+ * - Inflate DEFLATE'd entries on demand.
+ * - Extract all entries using a pool of threads.
+ *
+ * What this will NOT do for you:
+ *
+ * - Open/close files.
+ * - Read from non-seekable streams, the archive must be mappable.
+ * - Support multi-disk archives or encryption.
+ *
+ * Usage pattern
+ *
+ *  zr_open ()
+ *    for each wanted entry:
+ *      zr_find ()
+ *      zr_storeddata (), zr_entrydata () or zr_extract ()
+ *  zr_close ()
+ *
+ * or for all entries:
+ *
+ *  zr_open ()
+ *  zr_extractall ()
+ *  zr_close ()
+ *
+ ****
+ * LICENSE
+ *
+ * Copyright 2019 CTrabant
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ***************************************************************************/
+
+/* Allow this code to be skipped by declaring NOFDZIP */
+#ifndef NOFDZIP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "fdzipreader.h"
+
+/* Length of fixed portion of ZIP records */
+#define LOCALHEADERLENGTH    30
+#define CENTRALHEADERLENGTH  46
+#define ZIP64ENDRECORDLENGTH 56
+#define ZIP64ENDLOCATORLENGTH 20
+#define ENDHEADERLENGTH      22
+
+/* Maximum length of data passed to zlib in a single call, 1 GiB */
+#define ZR_ZLIB_CHUNK 1073741824
+
+static uint64_t zr_namehash ( const char *name, uint16_t length );
+static uint32_t zr_crc32 ( const uint8_t *data, uint64_t length );
+static int zr_seekpoint ( ZIPrentry *zrentry, uint64_t offset,
+                          uint64_t *seekOffset, uint64_t *compressedOffset );
+static int64_t zr_inflatechunks ( z_stream *zlstream, uint64_t *remainingIn,
+                                  uint8_t *buffer, uint64_t length );
+static uint16_t zr_getunit16 (const uint8_t *P);
+static uint32_t zr_getunit32 (const uint8_t *P);
+static uint64_t zr_getunit64 (const uint8_t *P);
+
+
+/***************************************************************************
+ * zr_open:
+ *
+ * Memory map the archive in the file descriptor and index the
+ * Central Directory by entry name.  Archives with ZIP64 structures
+ * are supported.
+ *
+ * The file descriptor must refer to a seekable, mappable file and
+ * must remain open until zr_close().
+ *
+ * @return a pointer to a ZIPreader struct on success or NULL on error.
+ ***************************************************************************/
+ZIPreader *
+zr_open ( int fd )
+{
+  ZIPreader *zr;
+  ZIPrentry *zrentry;
+  struct stat st;
+  const uint8_t *eocd = NULL;
+  const uint8_t *record;
+  const uint8_t *extra;
+  const uint8_t *extraend;
+  uint64_t cdsize;
+  uint64_t cdoffset;
+  uint64_t position;
+  uint64_t limit;
+  uint64_t bucket;
+  uint16_t extraID;
+  uint16_t extraLength;
+  int64_t idx;
+
+  if ( fstat (fd, &st) )
+    {
+      fprintf (stderr, "zr_open: Cannot stat file descriptor %d: %s\n",
+               fd, strerror(errno));
+      return NULL;
+    }
+
+  if ( st.st_size < ENDHEADERLENGTH )
+    {
+      fprintf (stderr, "zr_open: File descriptor %d is too small to be a ZIP archive\n", fd);
+      return NULL;
+    }
+
+  zr = (ZIPreader *) calloc (1, sizeof(ZIPreader));
+  if ( zr == NULL )
+    {
+      fprintf (stderr, "zr_open: Cannot allocate memory for ZIPreader\n");
+      return NULL;
+    }
+
+  zr->fd = fd;
+  zr->mapSize = st.st_size;
+  zr->map = mmap (NULL, zr->mapSize, PROT_READ, MAP_SHARED, fd, 0);
+
+  if ( zr->map == MAP_FAILED )
+    {
+      fprintf (stderr, "zr_open: Cannot map file descriptor %d: %s\n",
+               fd, strerror(errno));
+      free (zr);
+      return NULL;
+    }
+
+  /* Search backwards for End of Central Directory Record, allowing for a comment */
+  position = zr->mapSize - ENDHEADERLENGTH;
+  limit = ( position > 0xFFFF ) ? position - 0xFFFF : 0;
+  while ( 1 )
+    {
+      if ( zr_getunit32 (zr->map + position) == ENDHEADERSIG &&
+           position + ENDHEADERLENGTH + zr_getunit16 (zr->map + position + 20) <= zr->mapSize )
+        {
+          eocd = zr->map + position;
+          break;
+        }
+
+      if ( position == limit )
+        break;
+
+      position--;
+    }
+
+  if ( ! eocd )
+    {
+      fprintf (stderr, "zr_open: Cannot find End of Central Directory, not a ZIP archive?\n");
+      zr_close (zr);
+      return NULL;
+    }
+
+  zr->EntryCount = zr_getunit16 (eocd + 10);
+  cdsize = zr_getunit32 (eocd + 12);
+  cdoffset = zr_getunit32 (eocd + 16);
+
+  /* Use the ZIP64 End of Central Directory Record if any value is saturated */
+  if ( zr->EntryCount == 0xFFFF || cdsize == 0xFFFFFFFF || cdoffset == 0xFFFFFFFF )
+    {
+      position = eocd - zr->map;
+
+      if ( position >= ZIP64ENDLOCATORLENGTH &&
+           zr_getunit32 (eocd - ZIP64ENDLOCATORLENGTH) == ZIP64ENDLOCATORSIG )
+        {
+          position = zr_getunit64 (eocd - ZIP64ENDLOCATORLENGTH + 8);
+
+          if ( position + ZIP64ENDRECORDLENGTH > zr->mapSize ||
+               zr_getunit32 (zr->map + position) != ZIP64ENDRECORDSIG )
+            {
+              fprintf (stderr, "zr_open: Invalid ZIP64 End of Central Directory Record\n");
+              zr_close (zr);
+              return NULL;
+            }
+
+          record = zr->map + position;
+          zr->EntryCount = zr_getunit64 (record + 32);
+          cdsize = zr_getunit64 (record + 40);
+          cdoffset = zr_getunit64 (record + 48);
+        }
+    }
+
+  if ( cdoffset > zr->mapSize || cdsize > zr->mapSize - cdoffset ||
+       zr->EntryCount < 0 || (uint64_t)zr->EntryCount > cdsize / CENTRALHEADERLENGTH )
+    {
+      fprintf (stderr, "zr_open: Central Directory is beyond end of archive or invalid\n");
+      zr_close (zr);
+      return NULL;
+    }
+
+  zr->CentralDirectoryOffset = cdoffset;
+
+  /* Hash table size is the next power of 2 at least twice the entry count */
+  zr->hashSize = 16;
+  while ( zr->hashSize < (uint64_t)zr->EntryCount * 2 )
+    zr->hashSize <<= 1;
+
+  zr->entries = (ZIPrentry *) calloc ((zr->EntryCount) ? zr->EntryCount : 1, sizeof(ZIPrentry));
+  zr->hashtable = (int64_t *) malloc (zr->hashSize * sizeof(int64_t));
+
+  if ( ! zr->entries || ! zr->hashtable )
+    {
+      fprintf (stderr, "zr_open: Cannot allocate memory for %lld entry index\n",
+               (long long int) zr->EntryCount);
+      zr_close (zr);
+      return NULL;
+    }
+
+  memset (zr->hashtable, 0xFF, zr->hashSize * sizeof(int64_t));
+
+  madvise ((void *)(zr->map + (cdoffset & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1))),
+           cdsize + (cdoffset & (sysconf(_SC_PAGESIZE) - 1)), MADV_WILLNEED);
+
+  /* Parse each Central Directory Header into the entry index */
+  position = cdoffset;
+  for ( idx = 0; idx < zr->EntryCount; idx++ )
+    {
+      record = zr->map + position;
+
+      if ( position + CENTRALHEADERLENGTH > cdoffset + cdsize ||
+           zr_getunit32 (record) != CENTRALHEADERSIG )
+        {
+          fprintf (stderr, "zr_open: Invalid Central Directory Header for entry %lld\n",
+                   (long long int) idx);
+          zr_close (zr);
+          return NULL;
+        }
+
+      zrentry = &zr->entries[idx];
+      zrentry->GeneralFlag = zr_getunit16 (record + 8);
+      zrentry->CompressionMethod = zr_getunit16 (record + 10);
+      zrentry->DOSTime = zr_getunit16 (record + 12);
+      zrentry->DOSDate = zr_getunit16 (record + 14);
+      zrentry->CRC32 = zr_getunit32 (record + 16);
+      zrentry->CompressedSize = zr_getunit32 (record + 20);
+      zrentry->UncompressedSize = zr_getunit32 (record + 24);
+      zrentry->NameLength = zr_getunit16 (record + 28);
+      zrentry->ExtraLength = zr_getunit16 (record + 30);
+      zrentry->LocalHeaderOffset = zr_getunit32 (record + 42);
+      zrentry->Name = (const char *) record + CENTRALHEADERLENGTH;
+      zrentry->Extra = record + CENTRALHEADERLENGTH + zrentry->NameLength;
+
+      /* Next record follows the name, extra field and comment */
+      position += CENTRALHEADERLENGTH + zrentry->NameLength +
+        zrentry->ExtraLength + zr_getunit16 (record + 32);
+
+      if ( position > cdoffset + cdsize )
+        {
+          fprintf (stderr, "zr_open: Central Directory Header for entry %lld is truncated\n",
+                   (long long int) idx);
+          zr_close (zr);
+          return NULL;
+        }
+
+      /* Search extra field for ZIP64 values, present only for saturated fields */
+      extra = zrentry->Extra;
+      extraend = zrentry->Extra + zrentry->ExtraLength;
+      while ( extra + 4 <= extraend )
+        {
+          extraID = zr_getunit16 (extra);
+          extraLength = zr_getunit16 (extra + 2);
+          extra += 4;
+
+          if ( extra + extraLength > extraend )
+            break;
+
+          if ( extraID == 1 )
+            {
+              record = extra;
+
+              if ( zrentry->UncompressedSize == 0xFFFFFFFF && record + 8 <= extra + extraLength )
+                {
+                  zrentry->UncompressedSize = zr_getunit64 (record);
+                  record += 8;
+                }
+              if ( zrentry->CompressedSize == 0xFFFFFFFF && record + 8 <= extra + extraLength )
+                {
+                  zrentry->CompressedSize = zr_getunit64 (record);
+                  record += 8;
+                }
+              if ( zrentry->LocalHeaderOffset == 0xFFFFFFFF && record + 8 <= extra + extraLength )
+                {
+                  zrentry->LocalHeaderOffset = zr_getunit64 (record);
+                  record += 8;
+                }
+            }
+
+          extra += extraLength;
+        }
+
+      /* Add to head of hash chain, later duplicates are found first */
+      bucket = zr_namehash (zrentry->Name, zrentry->NameLength) & (zr->hashSize - 1);
+      zrentry->hashnext = zr->hashtable[bucket];
+      zr->hashtable[bucket] = idx;
+    }
+
+  return zr;
+}  /* End of zr_open() */
+
+
+/***************************************************************************
+ * zr_close:
+ *
+ * Unmap the archive and free all memory associated with a ZIPreader.
+ * The file descriptor is not closed.
+ ***************************************************************************/
+void
+zr_close ( ZIPreader *zr )
+{
+  if ( ! zr )
+    return;
+
+  if ( zr->map && zr->map != MAP_FAILED )
+    munmap ((void *)zr->map, zr->mapSize);
+
+  if ( zr->entries )
+    free (zr->entries);
+
+  if ( zr->hashtable )
+    free (zr->hashtable);
+
+  free (zr);
+}  /* End of zr_close() */
+
+
+/***************************************************************************
+ * zr_find:
+ *
+ * Find an entry by name using the Central Directory index.
+ *
+ * @return pointer to ZIPrentry if found, otherwise NULL.
+ ***************************************************************************/
+ZIPrentry *
+zr_find ( ZIPreader *zr, const char *name )
+{
+  ZIPrentry *zrentry;
+  size_t length;
+  int64_t idx;
+
+  if ( ! zr || ! name )
+    return NULL;
+
+  length = strlen (name);
+
+  if ( length > 0xFFFF )
+    return NULL;
+
+  idx = zr->hashtable[zr_namehash (name, length) & (zr->hashSize - 1)];
+  while ( idx >= 0 )
+    {
+      zrentry = &zr->entries[idx];
+
+      if ( zrentry->NameLength == length &&
+           ! memcmp (zrentry->Name, name, length) )
+        return zrentry;
+
+      idx = zrentry->hashnext;
+    }
+
+  return NULL;
+}  /* End of zr_find() */
+
+
+/***************************************************************************
+ * zr_entrydata:
+ *
+ * Locate the data for an entry in the mapped archive by reading the
+ * entry's Local File Header.  The returned pointer refers to
+ * CompressedSize bytes of data, for entries using the STORE method
+ * this is the entry content itself and no copy is needed.
+ *
+ * @return pointer to entry data on success and NULL on error.
+ ***************************************************************************/
+const uint8_t *
+zr_entrydata ( ZIPreader *zr, ZIPrentry *zrentry )
+{
+  const uint8_t *header;
+  uint64_t dataOffset;
+
+  if ( ! zr || ! zrentry )
+    return NULL;
+
+  if ( zrentry->LocalHeaderOffset + LOCALHEADERLENGTH > zr->mapSize )
+    {
+      fprintf (stderr, "zr_entrydata(%.*s): Local Header is beyond end of archive\n",
+               zrentry->NameLength, zrentry->Name);
+      return NULL;
+    }
+
+  header = zr->map + zrentry->LocalHeaderOffset;
+
+  if ( zr_getunit32 (header) != LOCALHEADERSIG )
+    {
+      fprintf (stderr, "zr_entrydata(%.*s): Invalid Local Header signature\n",
+               zrentry->NameLength, zrentry->Name);
+      return NULL;
+    }
+
+  dataOffset = zrentry->LocalHeaderOffset + LOCALHEADERLENGTH +
+    zr_getunit16 (header + 26) + zr_getunit16 (header + 28);
+
+  if ( dataOffset > zr->mapSize ||
+       zrentry->CompressedSize > zr->mapSize - dataOffset )
+    {
+      fprintf (stderr, "zr_entrydata(%.*s): Entry data is beyond end of archive\n",
+               zrentry->NameLength, zrentry->Name);
+      return NULL;
+    }
+
+  return zr->map + dataOffset;
+}  /* End of zr_entrydata() */
+
+
+/***************************************************************************
+ * zr_storeddata:
+ *
+ * Locate the content of a STORE'd entry in the mapped archive, as
+ * zr_entrydata(), after verifying that the compressed and uncompressed
+ * sizes match and the CRC-32 of the content.  The returned pointer
+ * refers to UncompressedSize bytes.
+ *
+ * @return pointer to entry content on success and NULL on error.
+ ***************************************************************************/
+const uint8_t *
+zr_storeddata ( ZIPreader *zr, ZIPrentry *zrentry )
+{
+  const uint8_t *data;
+  uint32_t crc;
+
+  if ( ! zr || ! zrentry )
+    return NULL;
+
+  if ( zrentry->CompressionMethod != ZS_STORE )
+    {
+      fprintf (stderr, "zr_storeddata(%.*s): Entry is not STORE'd\n",
+               zrentry->NameLength, zrentry->Name);
+      return NULL;
+    }
+
+  if ( zrentry->CompressedSize != zrentry->UncompressedSize )
+    {
+      fprintf (stderr, "zr_storeddata(%.*s): STORE'd entry sizes do not match\n",
+               zrentry->NameLength, zrentry->Name);
+      return NULL;
+    }
+
+  if ( ! (data = zr_entrydata (zr, zrentry)) )
+    return NULL;
+
+  crc = zr_crc32 (data, zrentry->UncompressedSize);
+
+  if ( crc != zrentry->CRC32 )
+    {
+      fprintf (stderr, "zr_storeddata(%.*s): CRC mismatch, expected 0x%08x, calculated 0x%08x\n",
+               zrentry->NameLength, zrentry->Name, zrentry->CRC32, crc);
+      return NULL;
+    }
+
+  return data;
+}  /* End of zr_storeddata() */
+
+
+/***************************************************************************
+ * zr_extract:
+ *
+ * Extract the content of an entry into the supplied buffer, which
+ * must be at least UncompressedSize bytes.  STORE'd entries are
+ * copied and DEFLATE'd entries are inflated, the CRC of the
+ * extracted content is verified.
+ *
+ * @return number of bytes extracted on success and -1 on error.
+ ***************************************************************************/
+int64_t
+zr_extract ( ZIPreader *zr, ZIPrentry *zrentry,
+             uint8_t *buffer, int64_t bufferSize )
+{
+  const uint8_t *data;
+  z_stream zlstream;
+  uint64_t remainingIn;
+  uint64_t remainingOut;
+  uint64_t chunk;
+  uint32_t crc;
+  int rv;
+
+  if ( ! zr || ! zrentry || ! buffer )
+    return -1;
+
+  if ( (uint64_t)bufferSize < zrentry->UncompressedSize )
+    {
+      fprintf (stderr, "zr_extract(%.*s): Buffer too small, need %llu bytes\n",
+               zrentry->NameLength, zrentry->Name,
+               (unsigned long long int) zrentry->UncompressedSize);
+      return -1;
+    }
+
+  if ( ! (data = zr_entrydata (zr, zrentry)) )
+    return -1;
+
+  if ( zrentry->CompressionMethod == ZS_STORE )
+    {
+      if ( zrentry->CompressedSize != zrentry->UncompressedSize )
+        {
+          fprintf (stderr, "zr_extract(%.*s): STORE'd entry sizes do not match\n",
+                   zrentry->NameLength, zrentry->Name);
+          return -1;
+        }
+
+      memcpy (buffer, data, zrentry->UncompressedSize);
+    }
+  else if ( zrentry->CompressionMethod == ZS_DEFLATE )
+    {
+      memset (&zlstream, 0, sizeof(z_stream));
+
+      if ( inflateInit2 (&zlstream, -MAX_WBITS) != Z_OK )
+        {
+          fprintf (stderr, "zr_extract: Error with inflateInit2()\n");
+          return -1;
+        }
+
+      zlstream.next_in = (uint8_t *)data;
+      zlstream.next_out = buffer;
+      remainingIn = zrentry->CompressedSize;
+      remainingOut = zrentry->UncompressedSize;
+
+      /* Inflate in chunks that fit zlib's 32-bit counters */
+      do
+        {
+          if ( zlstream.avail_in == 0 )
+            {
+              chunk = ( remainingIn > ZR_ZLIB_CHUNK ) ? ZR_ZLIB_CHUNK : remainingIn;
+              zlstream.avail_in = chunk;
+              remainingIn -= chunk;
+            }
+          if ( zlstream.avail_out == 0 )
+            {
+              chunk = ( remainingOut > ZR_ZLIB_CHUNK ) ? ZR_ZLIB_CHUNK : remainingOut;
+              zlstream.avail_out = chunk;
+              remainingOut -= chunk;
+            }
+
+          rv = inflate (&zlstream, Z_NO_FLUSH);
+        }
+      while ( rv == Z_OK && (zlstream.avail_in || remainingIn) &&
+              (zlstream.avail_out || remainingOut) );
+
+      inflateEnd (&zlstream);
+
+      if ( rv != Z_STREAM_END ||
+           zlstream.total_out != zrentry->UncompressedSize )
+        {
+          fprintf (stderr, "zr_extract(%.*s): Error inflating entry (zlib: %d)\n",
+                   zrentry->NameLength, zrentry->Name, rv);
+          return -1;
+        }
+    }
+  else
+    {
+      fprintf (stderr, "zr_extract(%.*s): Unsupported compression method %d\n",
+               zrentry->NameLength, zrentry->Name, zrentry->CompressionMethod);
+      return -1;
+    }
+
+  /* Verify CRC of extracted content */
+  crc = zr_crc32 (buffer, zrentry->UncompressedSize);
+
+  if ( crc != zrentry->CRC32 )
+    {
+      fprintf (stderr, "zr_extract(%.*s): CRC mismatch, expected 0x%08x, calculated 0x%08x\n",
+               zrentry->NameLength, zrentry->Name, zrentry->CRC32, crc);
+      return -1;
+    }
+
+  return zrentry->UncompressedSize;
+}  /* End of zr_extract() */
+
+
+/***************************************************************************
+ * zr_extractrange:
+ *
+ * Extract length bytes of the content of an entry, starting at
+ * uncompressed offset, into the supplied buffer.  STORE'd entries are
+ * copied directly.  DEFLATE'd entries are inflated starting from the
+ * nearest preceding seek point in the entry's seek index
+ * (ZS_EXTRA_SEEKINDEX, see zs_setseekpoints()), or from the start of
+ * the entry when there is no index.  The CRC cannot be verified for
+ * partial content.
+ *
+ * @return number of bytes extracted, less than length only at the end
+ * of the entry, on success and -1 on error.
+ ***************************************************************************/
+int64_t
+zr_extractrange ( ZIPreader *zr, ZIPrentry *zrentry, uint64_t offset,
+                  uint8_t *buffer, int64_t length )
+{
+  const uint8_t *data;
+  z_stream zlstream;
+  uint64_t seekOffset = 0;
+  uint64_t compressedOffset = 0;
+  uint64_t remainingIn;
+  int64_t skipped;
+  int64_t extracted;
+
+  if ( ! zr || ! zrentry || ! buffer || length < 0 )
+    return -1;
+
+  if ( offset >= zrentry->UncompressedSize )
+    return 0;
+
+  if ( (uint64_t)length > zrentry->UncompressedSize - offset )
+    length = zrentry->UncompressedSize - offset;
+
+  if ( length == 0 )
+    return 0;
+
+  if ( ! (data = zr_entrydata (zr, zrentry)) )
+    return -1;
+
+  if ( zrentry->CompressionMethod == ZS_STORE )
+    {
+      if ( zrentry->CompressedSize != zrentry->UncompressedSize )
+        {
+          fprintf (stderr, "zr_extractrange(%.*s): STORE'd entry sizes do not match\n",
+                   zrentry->NameLength, zrentry->Name);
+          return -1;
+        }
+
+      memcpy (buffer, data + offset, length);
+      return length;
+    }
+  else if ( zrentry->CompressionMethod != ZS_DEFLATE )
+    {
+      fprintf (stderr, "zr_extractrange(%.*s): Unsupported compression method %d\n",
+               zrentry->NameLength, zrentry->Name, zrentry->CompressionMethod);
+      return -1;
+    }
+
+  if ( zr_seekpoint (zrentry, offset, &seekOffset, &compressedOffset) )
+    return -1;
+
+  memset (&zlstream, 0, sizeof(z_stream));
+
+  if ( inflateInit2 (&zlstream, -MAX_WBITS) != Z_OK )
+    {
+      fprintf (stderr, "zr_extractrange: Error with inflateInit2()\n");
+      return -1;
+    }
+
+  zlstream.next_in = (uint8_t *)data + compressedOffset;
+  remainingIn = zrentry->CompressedSize - compressedOffset;
+
+  /* Inflate from seek point to offset, discarding output into buffer */
+  skipped = 0;
+  while ( seekOffset + skipped < offset )
+    {
+      extracted = zr_inflatechunks (&zlstream, &remainingIn, buffer,
+                                    ( (uint64_t)length < offset - seekOffset - skipped ) ?
+                                    (uint64_t)length : offset - seekOffset - skipped);
+      if ( extracted <= 0 )
+        break;
+
+      skipped += extracted;
+    }
+
+  extracted = ( seekOffset + skipped == offset ) ?
+    zr_inflatechunks (&zlstream, &remainingIn, buffer, length) : -1;
+
+  inflateEnd (&zlstream);
+
+  if ( extracted != length )
+    {
+      fprintf (stderr, "zr_extractrange(%.*s): Error inflating entry\n",
+               zrentry->NameLength, zrentry->Name);
+      return -1;
+    }
+
+  return extracted;
+}  /* End of zr_extractrange() */
+
+
+/***************************************************************************
+ * zr_seekpoint:
+ *
+ * Find the nearest seek point at or before an uncompressed offset in
+ * the seek index extra field of an entry.  Without an index the start
+ * of the entry is the only seek point.
+ *
+ * @return 0 on success and -1 on an invalid index.
+ ***************************************************************************/
+static int
+zr_seekpoint ( ZIPrentry *zrentry, uint64_t offset,
+               uint64_t *seekOffset, uint64_t *compressedOffset )
+{
+  const uint8_t *extra = zrentry->Extra;
+  const uint8_t *extraend = zrentry->Extra + zrentry->ExtraLength;
+  uint16_t length;
+  int32_t count;
+  int32_t low, high, mid;
+
+  *seekOffset = 0;
+  *compressedOffset = 0;
+
+  while ( extra && extra + 4 <= extraend )
+    {
+      length = zr_getunit16 (extra + 2);
+
+      if ( extra + 4 + length > extraend )
+        break;
+
+      if ( zr_getunit16 (extra) == ZS_EXTRA_SEEKINDEX )
+        {
+          /* Binary search for last point at or before offset */
+          count = length / 16;
+          low = 0;
+          high = count - 1;
+          while ( low <= high )
+            {
+              mid = low + (high - low) / 2;
+
+              if ( zr_getunit64 (extra + 4 + mid * 16) <= offset )
+                {
+                  *seekOffset = zr_getunit64 (extra + 4 + mid * 16);
+                  *compressedOffset = zr_getunit64 (extra + 4 + mid * 16 + 8);
+                  low = mid + 1;
+                }
+              else
+                {
+                  high = mid - 1;
+                }
+            }
+
+          if ( *compressedOffset > zrentry->CompressedSize )
+            {
+              fprintf (stderr, "zr_seekpoint(%.*s): Invalid seek index\n",
+                       zrentry->NameLength, zrentry->Name);
+              return -1;
+            }
+
+          return 0;
+        }
+
+      extra += 4 + length;
+    }
+
+  return 0;
+}  /* End of zr_seekpoint() */
+
+
+/***************************************************************************
+ * zr_inflatechunks:
+ *
+ * Inflate up to length bytes into buffer, providing input from
+ * remainingIn in chunks that fit zlib's 32-bit counters.
+ *
+ * @return number of bytes inflated, less than length at end of the
+ * stream, on success and -1 on error.
+ ***************************************************************************/
+static int64_t
+zr_inflatechunks ( z_stream *zlstream, uint64_t *remainingIn,
+                   uint8_t *buffer, uint64_t length )
+{
+  uint64_t inflated = 0;
+  uint64_t chunk;
+  int rv = Z_OK;
+
+  while ( inflated < length && rv == Z_OK )
+    {
+      if ( zlstream->avail_in == 0 )
+        {
+          if ( *remainingIn == 0 )
+            break;
+
+          chunk = ( *remainingIn > ZR_ZLIB_CHUNK ) ? ZR_ZLIB_CHUNK : *remainingIn;
+          zlstream->avail_in = chunk;
+          *remainingIn -= chunk;
+        }
+
+      chunk = ( length - inflated > ZR_ZLIB_CHUNK ) ? ZR_ZLIB_CHUNK : length - inflated;
+      zlstream->next_out = buffer + inflated;
+      zlstream->avail_out = chunk;
+
+      rv = inflate (zlstream, Z_NO_FLUSH);
+
+      inflated += chunk - zlstream->avail_out;
+    }
+
+  if ( rv != Z_OK && rv != Z_STREAM_END )
+    return -1;
+
+  return inflated;
+}  /* End of zr_inflatechunks() */
+
+
+/* Shared state for zr_extractall() worker threads */
+typedef struct zrextractall_s
+{
+  ZIPreader *zr;
+  int (*callback)( ZIPreader*, ZIPrentry*, const uint8_t*, int64_t, void* );
+  void *userdata;
+  pthread_mutex_t lock;
+  int64_t nextEntry;
+  int error;
+} ZRextractall;
+
+
+/***************************************************************************
+ * zr_extractall_worker:
+ *
+ * Thread worker for zr_extractall(), extract entries in turn and pass
+ * the content to the callback until all entries are done or an error
+ * occurs in any worker.
+ *
+ * STORE'd entries are passed to the callback directly from the mapped
+ * archive, DEFLATE'd entries are inflated into a temporary buffer.
+ ***************************************************************************/
+static void *
+zr_extractall_worker ( void *arg )
+{
+  ZRextractall *state = arg;
+  ZIPrentry *zrentry;
+  const uint8_t *data;
+  uint8_t *buffer;
+  int64_t idx;
+  int rv;
+
+  while ( 1 )
+    {
+      pthread_mutex_lock (&state->lock);
+      idx = ( state->error ) ? state->zr->EntryCount : state->nextEntry++;
+      pthread_mutex_unlock (&state->lock);
+
+      if ( idx >= state->zr->EntryCount )
+        break;
+
+      zrentry = &state->zr->entries[idx];
+      buffer = NULL;
+      rv = -1;
+
+      /* Sizes and CRC of STORE'd entries are verified, mismatches reported */
+      if ( zrentry->CompressionMethod == ZS_STORE )
+        {
+          if ( (data = zr_storeddata (state->zr, zrentry)) )
+            rv = state->callback (state->zr, zrentry, data,
+                                  zrentry->UncompressedSize, state->userdata);
+        }
+      else
+        {
+          if ( ! (buffer = (uint8_t *) malloc ((zrentry->UncompressedSize) ?
+                                               zrentry->UncompressedSize : 1)) )
+            fprintf (stderr, "zr_extractall(%.*s): Cannot allocate %llu bytes\n",
+                     zrentry->NameLength, zrentry->Name,
+                     (unsigned long long int) zrentry->UncompressedSize);
+          else if ( zr_extract (state->zr, zrentry, buffer, zrentry->UncompressedSize) >= 0 )
+            rv = state->callback (state->zr, zrentry, buffer,
+                                  zrentry->UncompressedSize, state->userdata);
+        }
+
+      if ( buffer )
+        free (buffer);
+
+      if ( rv )
+        {
+          pthread_mutex_lock (&state->lock);
+          state->error = 1;
+          pthread_mutex_unlock (&state->lock);
+          break;
+        }
+    }
+
+  return NULL;
+}  /* End of zr_extractall_worker() */
+
+
+/***************************************************************************
+ * zr_extractall:
+ *
+ * Extract all entries and pass the content of each to the callback
+ * function, which should return 0 on success and non-zero to stop
+ * extraction:
+ *
+ * int callback (ZIPreader *zr, ZIPrentry *zrentry,
+ *               const uint8_t *data, int64_t dataSize, void *userdata)
+ *
+ * When threads is more than 1, entries are extracted by that many
+ * threads and the callback is called concurrently in no particular
+ * entry order.  The data pointer is only valid during the callback.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zr_extractall ( ZIPreader *zr, int threads,
+                int (*callback)( ZIPreader*, ZIPrentry*,
+                                 const uint8_t*, int64_t, void* ),
+                void *userdata )
+{
+  ZRextractall state;
+  pthread_t *tids;
+  int started;
+  int idx;
+  int rv;
+
+  if ( ! zr || ! callback )
+    return -1;
+
+  state.zr = zr;
+  state.callback = callback;
+  state.userdata = userdata;
+  state.nextEntry = 0;
+  state.error = 0;
+  pthread_mutex_init (&state.lock, NULL);
+
+  if ( threads > zr->EntryCount )
+    threads = zr->EntryCount;
+
+  if ( threads <= 1 )
+    {
+      zr_extractall_worker (&state);
+    }
+  else
+    {
+      if ( ! (tids = (pthread_t *) malloc (threads * sizeof(pthread_t))) )
+        {
+          fprintf (stderr, "zr_extractall: Cannot allocate memory for threads\n");
+          pthread_mutex_destroy (&state.lock);
+          return -1;
+        }
+
+      for ( started = 0; started < threads; started++ )
+        {
+          if ( (rv = pthread_create (&tids[started], NULL, zr_extractall_worker, &state)) )
+            {
+              fprintf (stderr, "zr_extractall: Cannot create thread: %s\n", strerror(rv));
+              break;
+            }
+        }
+
+      /* Run in this thread if no worker threads could be started */
+      if ( started == 0 )
+        zr_extractall_worker (&state);
+
+      for ( idx = 0; idx < started; idx++ )
+        pthread_join (tids[idx], NULL);
+
+      free (tids);
+    }
+
+  pthread_mutex_destroy (&state.lock);
+
+  return ( state.error ) ? -1 : 0;
+}  /* End of zr_extractall() */
+
+
+/***************************************************************************
+ * zr_namehash:
+ *
+ * Calculate a 64-bit FNV-1a hash of an entry name.
+ *
+ * @return hash value.
+ ***************************************************************************/
+static uint64_t
+zr_namehash ( const char *name, uint16_t length )
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  uint16_t idx;
+
+  for ( idx = 0; idx < length; idx++ )
+    {
+      hash ^= (uint8_t) name[idx];
+      hash *= 0x100000001b3ULL;
+    }
+
+  return hash;
+}
+
+
+/***************************************************************************
+ * zr_crc32:
+ *
+ * Calculate the CRC-32 of data in chunks that fit zlib's 32-bit length.
+ *
+ * @return CRC-32 value.
+ ***************************************************************************/
+static uint32_t
+zr_crc32 ( const uint8_t *data, uint64_t length )
+{
+  uint32_t crc = crc32 (0L, Z_NULL, 0);
+  uint64_t chunk;
+
+  while ( length > 0 )
+    {
+      chunk = ( length > ZR_ZLIB_CHUNK ) ? ZR_ZLIB_CHUNK : length;
+      crc = crc32 (crc, data, chunk);
+      data += chunk;
+      length -= chunk;
+    }
+
+  return crc;
+}
+
+
+/***************************************************************************
+ *
+ * Helper functions to read little-endian integer values from any
+ * alignment in the mapped archive.
+ *
+ ***************************************************************************/
+static uint16_t zr_getunit16 (const uint8_t *P)
+{
+  return (uint16_t)P[0] | ((uint16_t)P[1] << 8);
+}
+static uint32_t zr_getunit32 (const uint8_t *P)
+{
+  return (uint32_t)P[0] | ((uint32_t)P[1] << 8) |
+    ((uint32_t)P[2] << 16) | ((uint32_t)P[3] << 24);
+}
+static uint64_t zr_getunit64 (const uint8_t *P)
+{
+  return (uint64_t)zr_getunit32 (P) | ((uint64_t)zr_getunit32 (P + 4) << 32);
+}
+
+#endif /* NOFDZIP */
@@ -0,0 +1,76 @@
+/* Allow this code to be skipped by declaring NOFDZIP */
+#ifndef NOFDZIP
+
+#ifndef FDZIPREADER_H
+#define FDZIPREADER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fdzipstream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ZIP archive entry as described by the Central Directory */
+typedef struct zipreaderentry_s
+{
+  uint16_t GeneralFlag;
+  uint16_t CompressionMethod;
+  uint16_t DOSDate;
+  uint16_t DOSTime;
+  uint32_t CRC32;
+  uint64_t CompressedSize;
+  uint64_t UncompressedSize;
+  uint64_t LocalHeaderOffset;
+  uint16_t NameLength;
+  const char *Name;              /* Pointer into mapped archive, NOT NULL terminated */
+  uint16_t ExtraLength;
+  const uint8_t *Extra;          /* Pointer into mapped archive, Central Directory extra field */
+  int64_t hashnext;              /* Index of next entry in hash chain or -1 */
+} ZIPrentry;
+
+/* ZIP archive reader, a memory mapped archive and Central Directory index */
+typedef struct zipreader_s
+{
+  int fd;
+  const uint8_t *map;
+  uint64_t mapSize;
+  uint64_t CentralDirectoryOffset;
+  int64_t EntryCount;
+  ZIPrentry *entries;
+  int64_t *hashtable;            /* Index of first entry in hash chain or -1 */
+  uint64_t hashSize;
+} ZIPreader;
+
+
+extern ZIPreader * zr_open ( int fd );
+
+extern void zr_close ( ZIPreader *zr );
+
+extern ZIPrentry * zr_find ( ZIPreader *zr, const char *name );
+
+extern const uint8_t * zr_entrydata ( ZIPreader *zr, ZIPrentry *zrentry );
+
+extern const uint8_t * zr_storeddata ( ZIPreader *zr, ZIPrentry *zrentry );
+
+extern int64_t zr_extract ( ZIPreader *zr, ZIPrentry *zrentry,
+                            uint8_t *buffer, int64_t bufferSize );
+
+extern int64_t zr_extractrange ( ZIPreader *zr, ZIPrentry *zrentry, uint64_t offset,
+                                 uint8_t *buffer, int64_t length );
+
+extern int zr_extractall ( ZIPreader *zr, int threads,
+                           int (*callback)( ZIPreader*, ZIPrentry*,
+                                            const uint8_t*, int64_t, void* ),
+                           void *userdata );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FDZIPREADER_H */
+
+#endif /* NOFDZIP */
@@ -46,6 +46,29 @@
  *  zs_finish ()
  *  zs_free ()
  *
+ * Adding entries to an existing archive in a seekable file:
+ *  zs_initappend ()
+ *    add entries as above
+ *  zs_finish ()
+ *  zs_free ()
+ *
+ * Merging existing archives without recompression:
+ *  zs_init ()
+ *    for each input archive:
+ *      zs_mergearchive ()
+ *  zs_finish ()
+ *  zs_free ()
+ *
+ * Output may be framed with HTTP/1.1 chunked transfer encoding for
+ * writing directly to a client, see zs_setchunked().
+ *
+ * Continuing an interrupted archive in a seekable file from its
+ * last checkpoint, see zs_setcheckpoint():
+ *  zs_resume ()
+ *    add entries not yet in the archive as above
+ *  zs_finish ()
+ *  zs_free ()
+ *
  ****
  * To use archive entry compression methods other than the included
  * STORE and DEFLATE methods you must create and register callback
@@ -72,6 +95,29 @@
  *
  * These three functions must be registered, through zs_registermethod(),
  * with any ZIPstream that will use them.
+ *
+ * Version 2 methods, registered through zs_registermethod2(), replace
+ * process() with:
+ *
+ * int32_t process (ZIPstream *zstream, ZIPentry *zentry,
+ *                  const uint8_t *entry, int64_t entrySize, int64_t *entryConsumed,
+ *                  int flush, uint8_t *writeBuffer, int64_t writeBufferSize,
+ *                  ZIPspan *output)
+ *
+ *   The flush mode is ZS_METHOD_NOFLUSH, ZS_METHOD_SYNC, ZS_METHOD_FULL
+ *   or ZS_METHOD_FINISH, entry is NULL only when finishing.  Output is
+ *   returned in the output span, either placed in writeBuffer or
+ *   pointing to memory of the method that remains valid until the next
+ *   call for the entry, which avoids a copy for methods with their own
+ *   buffers.  The callback is repeated with the remaining input until
+ *   it returns 0.
+ *   Return: 1 when more output is pending, 0 when all input is consumed
+ *   and the flush is complete and <0 on error
+ *
+ * With the ZS_METHOD_CRC flag the CRC-32 of entry data is not
+ * calculated, the method sets ZIPentry.CRC32 itself, e.g. for codecs
+ * that calculate it while encoding.  Version 1 methods are called
+ * through an adapter, a flush is requested by ZIPentry.flushpending.
  ****
  * LICENSE
  *
@@ -93,7 +139,17 @@
 /* Allow this code to be skipped by declaring NOFDZIP */
 #ifndef NOFDZIP
 
-#define FDZIPVERSION 2.4
+#define FDZIPVERSION 3.0
+
+/* Enable copy_file_range() and other extensions on Linux */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE
+#endif
+
+/* Enable rand_s() on Windows, for encryption salts */
+#if (defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)) && !defined(_CRT_RAND_S)
+  #define _CRT_RAND_S
+#endif
 
 #include <assert.h>
 #include <stdio.h>
@@ -103,51 +159,415 @@
 #include <string.h>
 #include <errno.h>
 
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  #include <io.h>
+  #include <windows.h>
+#else
+  #include <unistd.h>
+  #include <sys/uio.h>
+#endif
+
+#if defined(__linux__)
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/sendfile.h>
+  #include <sys/stat.h>
+#endif
+
+#ifndef ZS_NOTHREADS
+  #include <pthread.h>
+  #include <stdatomic.h>
+#endif
+
 #include <zlib.h>
 
+/* SHA and AES instructions are selected at run time on x86-64 */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #define ZS_SHANI 1
+  #define ZS_AESNI 1
+  #include <cpuid.h>
+  #include <immintrin.h>
+#endif
+
 #include "fdzipstream.h"
 
 #define BIT_SET(a,b) ((a) |= (1<<(b)))
 
+/* Flush requests to methods, values of ZIPentry.flushpending, which
+ * are also the flush modes given to version 2 methods */
+#define ZS_FLUSH_SYNC ZS_METHOD_SYNC  /* Write all data, e.g. Z_SYNC_FLUSH */
+#define ZS_FLUSH_FULL ZS_METHOD_FULL  /* Write all data and reset state for a seek point, e.g. Z_FULL_FLUSH */
+
+/* Input bytes hashed per step, interleaving CRC and hash while data is in cache */
+#define ZS_HASH_STEP 65536
+
+/* Checkpoint state file: signature "FZCK", version and sizes of the
+ * header and of the fixed part of entry records, see zs_checkpoint() */
+#define ZS_CHECKPOINT_SIG     0x4B435A46
+#define ZS_CHECKPOINT_VERSION 1
+#define ZS_CHECKPOINT_HEADER  20
+#define ZS_CHECKPOINT_RECORD  42
+
+/* SHA-256 state of an entry in progress, also SHA-1 state using five
+ * state words for WinZip AES */
+typedef struct zssha256_s
+{
+  uint32_t state[8];
+  uint64_t length;               /* Total bytes hashed */
+  uint8_t block[64];             /* Partial block */
+  uint32_t fill;                 /* Bytes in partial block */
+  void (*blocks)( uint32_t *state, const uint8_t *data, size_t count );
+} ZSsha256;
+
+/* WinZip AES: AES-256 key length, PBKDF2 iterations, and input bytes
+ * per step of encryption and authentication while data is in cache */
+#define ZS_AES_KEY_LENGTH 32
+#define ZS_AES_ITERATIONS 1000
+#define ZS_AES_STEP 16384
+
+/* State of an entry encrypted with WinZip AES (AE-2), wrapping the
+ * method and private data of the entry, see zs_setencryption() */
+typedef struct zsaes_s
+{
+  ZIPmethod *method;             /* Wrapped method */
+  void *methoddata;              /* Private data of wrapped method */
+  uint8_t roundkeys[240];        /* AES-256 expanded key */
+  uint64_t counter;              /* Last CTR block number used */
+  uint8_t pad[16];               /* Key stream of partially used block */
+  uint32_t padused;              /* Bytes of pad used */
+  ZSsha256 hmac;                 /* HMAC-SHA1 inner hash of encrypted data */
+  ZSsha256 outer;                /* HMAC-SHA1 outer hash after key block */
+  uint8_t header[ZS_AES_SALT_LENGTH + 2]; /* Salt and password verifier */
+  uint8_t mac[ZS_AES_MAC_LENGTH];  /* Authentication code */
+  const uint8_t *pending;        /* Output of wrapped method in its memory, to encrypt */
+  int64_t pendingsize;           /* Bytes of pending output */
+  int32_t innerrc;               /* Return value of wrapped method for pending output */
+  int8_t stage;                  /* 0 = header pending, 1 = data, 2 = code pending, 3 = complete */
+  void (*ctr)( const uint8_t *roundkeys, uint64_t counter, uint8_t *data, size_t count );
+} ZSaes;
+
+/* Maximum bytes of idle buffers kept in the pool, 16 MiB */
+#define ZS_POOL_IDLE 16777216
+
+/* Idle buffer in the pool, stored at the start of the buffer itself */
+typedef struct zspoolbuffer_s
+{
+  struct zspoolbuffer_s *next;
+  int64_t size;
+} ZSpoolbuffer;
+
+/* Process-wide pool of stream buffers and accounting of memory used by
+ * buffers and compression state for the global budget */
+static struct
+{
+#ifndef ZS_NOTHREADS
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+  int64_t budget;                /* Maximum bytes allocated, 0 = unlimited */
+  int64_t allocated;             /* Bytes allocated, including idle buffers */
+  int64_t idle;                  /* Bytes of idle buffers */
+  int32_t waiting;               /* Number of threads waiting for memory */
+  ZSpoolbuffer *free;            /* List of idle buffers */
+} zs_pool = {
+#ifndef ZS_NOTHREADS
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+#endif
+  0, 0, 0, 0, NULL
+};
+
+#ifndef ZS_NOTHREADS
+/* Set while a budget is set, read without the pool lock by streams
+ * deciding whether to return their buffer after a call */
+static atomic_int zs_poolbudgeted = 0;
+#endif
+
+/* Determine little-endian hosts at compile time, others are handled generically */
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || \
+  defined(_M_IX86) || defined(_M_X64) || defined(_M_AMD64) || defined(_M_ARM64)
+  #define ZS_LITTLE_ENDIAN 1
+#endif
+
+#ifndef ZS_NOTHREADS
+/* Pipelined output: a single-producer, single-consumer lock-free ring
+ * of ZS_BUFFER_SIZE buffers, filled by the compressing thread and
+ * written to the output descriptor by a writer thread.  The mutex and
+ * condition are only used to sleep when the ring is full or empty. */
+typedef struct zspipeline_s
+{
+  int32_t count;                 /* Number of buffers in ring */
+  uint8_t **data;
+  int64_t *length;
+  int64_t fill;                  /* Bytes in current, unpublished, buffer */
+  _Atomic uint64_t head;         /* Buffers published by producer */
+  _Atomic uint64_t tail;         /* Buffers written by consumer */
+  _Atomic int producerWaiting;
+  _Atomic int consumerWaiting;
+  _Atomic int stop;
+  _Atomic int failed;
+  int64_t failstatus;            /* Return value of failed write() */
+  int failerrno;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ZSpipeline;
+
+/* Output data shared by destinations, freed when the last reference is released */
+typedef struct zsfanbuffer_s
+{
+  int32_t refs;                  /* Queued items referencing the data */
+  uint8_t data[];
+} ZSfanbuffer;
+
+/* Part of a shared buffer queued for a destination */
+typedef struct zsfanitem_s
+{
+  ZSfanbuffer *buffer;
+  const uint8_t *data;
+  int64_t size;
+  struct zsfanitem_s *next;
+} ZSfanitem;
+
+/* Additional output destination written by its own thread, see zs_addoutput() */
+typedef struct zsdestination_s
+{
+  int fd;
+  int policy;                    /* ZS_OUTPUT_FAILALL or ZS_OUTPUT_DROP */
+  int64_t limit;                 /* Maximum bytes queued */
+  int64_t queued;                /* Bytes queued, including the item being written */
+  int64_t written;               /* Bytes written to the destination */
+  int8_t active;                 /* Flag: destination is written, cleared when dropped */
+  int8_t pipe;                   /* Flag: destination is a pipe, written with tee() */
+  ZSfanitem *first;
+  ZSfanitem *last;
+  struct zsfanout_s *fanout;
+  pthread_t thread;
+  pthread_cond_t cond;           /* Signals queued data to the thread */
+  struct zsdestination_s *next;
+} ZSdestination;
+
+/* Fan-out of output to additional destinations.  Output is written to
+ * the stream descriptor as usual and queued for each destination as
+ * references to one shared copy.  When the stream descriptor and a
+ * destination are pipes, output is staged in a pipe and duplicated to
+ * idle destinations with tee() and moved to the descriptor with
+ * splice(), without copying.  The mutex protects all queues. */
+typedef struct zsfanout_s
+{
+  ZSdestination *first;
+  int8_t stop;
+  int8_t failed;                 /* Flag: a ZS_OUTPUT_FAILALL destination failed */
+  int failerrno;
+  int teepipe[2];                /* Staging pipe for tee(), -1 = not used */
+  int64_t teesize;               /* Capacity of staging pipe */
+  pthread_mutex_t lock;
+  pthread_cond_t space;          /* Signals queued data written */
+} ZSfanout;
+#endif
+
+#if defined(__linux__)
+/* Output engine for local files, see zs_setengine().  The engine is
+ * started on the first write to a descriptor and finished by
+ * zs_finish(), so each part of rotated output is started anew.  Output
+ * is placed in buffer, the aligned block for O_DIRECT or the current
+ * mapped window, which starts at file offset position. */
+typedef struct zsengine_s
+{
+  int type;                      /* ZS_ENGINE_DIRECT or ZS_ENGINE_MMAP */
+  int fd;                        /* Descriptor engine is started on, -1 = none */
+  int flags;                     /* File status flags before O_DIRECT */
+  int failed;                    /* errno of failed output, 0 = none */
+  uint8_t *block;                /* Aligned block buffer for O_DIRECT */
+  uint8_t *buffer;               /* Current output buffer: block or mapped window */
+  int64_t size;                  /* Size of buffer */
+  int64_t fill;                  /* Bytes of buffer used */
+  int64_t position;              /* File offset of buffer */
+  int64_t allocated;             /* File bytes allocated for mapping */
+  int64_t synced;                /* Write-back started below this offset */
+  int64_t dropped;               /* Written and dropped from page cache below this offset */
+} ZSengine;
+#endif
+
+/* Concurrently submitted entry, see zs_submitbegin() */
+struct zipsubmission_s
+{
+  ZIPstream *zstream;
+  ZIPentry *zentry;
+  uint8_t *data;                 /* Compressed entry data */
+  int64_t size;
+  int64_t allocated;
+  int64_t memorycharge;          /* Bytes of data charged to memory budget */
+#ifndef ZS_NOTHREADS
+  struct zipsubmission_s *_Atomic next;
+#endif
+};
+
+/* Minimum free space of submission data buffer for each process() call */
+#define ZS_SUBMIT_CHUNK 65536
+
+/* Maximum submission data buffer, an entry limited to 0xFFFFFFFF bytes */
+#define ZS_SUBMIT_MAXIMUM (0xFFFFFFFFLL + ZS_SUBMIT_CHUNK)
+
+#ifndef ZS_NOTHREADS
+/* Concurrent submission: completed entries are pushed by any thread to
+ * a lock-free multi-producer, single-consumer queue (intrusive list
+ * with a stub node) and written by a single writer thread.  The mutex
+ * and condition are only used to sleep when the queue is empty or
+ * while waiting for it to drain. */
+typedef struct zsconcurrent_s
+{
+  ZIPsubmission *_Atomic head;   /* Most recently pushed, producers */
+  ZIPsubmission *tail;           /* Next to pop, consumer */
+  ZIPsubmission stub;
+  _Atomic int64_t pending;       /* Submitted and not yet written */
+  _Atomic int consumerWaiting;
+  _Atomic int drainWaiting;
+  _Atomic int stop;
+  _Atomic int failed;
+  int64_t failstatus;            /* Return value of failed write() */
+  int failerrno;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ZSconcurrent;
+#endif
+
+static void zs_teardown ( ZIPstream *zs );
+static ZIPentry *zs_beginentry ( ZIPstream *zstream, char *name, time_t modtime, int methodID,
+                                 int8_t raw, uint32_t crc, uint64_t uncompressedSize,
+                                 int64_t *writestatus );
 static int64_t zs_writedata ( ZIPstream *zstream, uint8_t *writeBuffer, int64_t writeBufferSize );
+static int64_t zs_writefd ( int fd, uint8_t *writeBuffer, int64_t writeBufferSize );
+static uint8_t *zs_outputbuffer ( ZIPstream *zstream, int64_t *size );
+static int64_t zs_outputcommit ( ZIPstream *zstream, uint8_t *buffer, int64_t size );
+static void zs_outputflush ( ZIPstream *zstream );
+static void zs_enginestop ( ZIPstream *zstream );
+static int zs_enginefinish ( ZIPstream *zstream );
+#if defined(__linux__)
+static int zs_enginestart ( ZIPstream *zstream );
+static int zs_engineadvance ( ZIPstream *zstream );
+static int zs_enginemap ( ZSengine *engine, int64_t offset );
+static int zs_enginepwrite ( int fd, uint8_t *data, int64_t size, int64_t offset );
+#endif
+static int64_t zs_pipelinedrain ( ZIPstream *zstream );
+static void zs_pipelinestop ( ZIPstream *zstream );
+static int64_t zs_writeoutput ( ZIPstream *zstream, uint8_t *writeBuffer, int64_t writeBufferSize );
+static int64_t zs_writechunked ( ZIPstream *zstream, uint8_t *writeBuffer, int64_t writeBufferSize );
+static int zs_fanoutdrain ( ZIPstream *zstream );
+static void zs_fanoutstop ( ZIPstream *zstream );
+#ifndef ZS_NOTHREADS
+static uint8_t *zs_pipelineslot ( ZSpipeline *pipeline );
+static void zs_pipelinepublish ( ZSpipeline *pipeline );
+static void *zs_pipelinewriter ( void *arg );
+static int64_t zs_fanoutwrite ( ZIPstream *zstream, uint8_t *data, int64_t size );
+static void *zs_fanoutwriter ( void *arg );
+static void zs_fanoutfail ( ZSdestination *dest, int error, const char *reason );
+static void zs_concurrentpush ( ZSconcurrent *concurrent, ZIPsubmission *submission );
+static ZIPsubmission *zs_concurrentpop ( ZSconcurrent *concurrent );
+static void *zs_concurrentwriter ( void *arg );
+static int zs_writesubmission ( ZIPstream *zstream, ZIPsubmission *submission,
+                                int64_t *writestatus );
+#endif
+static int zs_concurrentstop ( ZIPstream *zstream, int drain );
+static void zs_freesubmission ( ZIPsubmission *submission );
+static int zs_submitprocess ( ZIPsubmission *submission, uint8_t *entry, int64_t entrySize );
+static int64_t zs_readdata ( int fd, int64_t offset, uint8_t *readBuffer, int64_t readBufferSize );
+static int zs_readdirectory ( int fd, ZIPstream *zstream, int64_t *cdoffset );
+static int64_t zs_copydata ( ZIPstream *zstream, int fd, int64_t offset, int64_t length );
+static void zs_truncateentries ( ZIPstream *zstream, ZIPentry *lastEntry, int32_t entryCount );
+static int zs_entryoffsetcmp ( const void *a, const void *b );
+static int zs_rotate ( ZIPstream *zstream, int64_t *writestatus );
+static void zs_freeparts ( ZIPstream *zstream );
 static uint32_t zs_datetime_unixtodos ( time_t t );
+static int64_t zs_milliseconds ( void );
+static int64_t zs_microseconds ( void );
+static int32_t zs_methodprocess ( ZIPmethod *method, ZIPstream *zstream, ZIPentry *zentry,
+                                  const uint8_t *entry, int64_t entrySize, int64_t *entryConsumed,
+                                  int flush, uint8_t *writeBuffer, int64_t writeBufferSize,
+                                  ZIPspan *output );
+static void zs_checksum ( ZIPentry *zentry, const uint8_t *data, int64_t size );
+static int zs_checkpointdue ( ZIPstream *zstream );
+static int zs_readcheckpoint ( int fd, ZIPstream *zstream, const char *path );
+static int zs_hashfinish ( ZIPentry *zentry );
+static int zs_writemanifest ( ZIPstream *zstream, int64_t *writestatus );
+static ZSsha256 *zs_sha256_init ( void );
+static void zs_sha256_update ( ZSsha256 *sha, const uint8_t *data, size_t size );
+static void zs_sha256_final ( ZSsha256 *sha, uint8_t *digest );
+static void zs_sha256_blocks ( uint32_t *state, const uint8_t *data, size_t count );
+static void zs_shapad ( ZSsha256 *sha );
+static void zs_sha1_init ( ZSsha256 *sha );
+static void zs_sha1_final ( ZSsha256 *sha, uint8_t *digest );
+static void zs_sha1_blocks ( uint32_t *state, const uint8_t *data, size_t count );
+#ifdef ZS_SHANI
+static void zs_sha256_blocks_shani ( uint32_t *state, const uint8_t *data, size_t count );
+static void zs_sha1_blocks_shani ( uint32_t *state, const uint8_t *data, size_t count );
+#endif
+static void zs_hmac_sha1_key ( const uint8_t *key, size_t keyLength,
+                               ZSsha256 *inner, ZSsha256 *outer );
+static void zs_pbkdf2_sha1 ( const uint8_t *password, size_t passwordLength,
+                             const uint8_t *salt, size_t saltLength, int iterations,
+                             uint8_t *key, size_t keyLength );
+static void zs_aes_expandkey ( const uint8_t *key, uint8_t *roundkeys );
+static void zs_aes_block ( const uint8_t *roundkeys, uint8_t *state );
+static void zs_aes_ctr ( const uint8_t *roundkeys, uint64_t counter, uint8_t *data, size_t count );
+#ifdef ZS_AESNI
+static void zs_aes_ctr_aesni ( const uint8_t *roundkeys, uint64_t counter, uint8_t *data, size_t count );
+static void zs_aes_ctr_vaes ( const uint8_t *roundkeys, uint64_t counter, uint8_t *data, size_t count );
+static int zs_avxenabled ( void );
+#endif
+static void zs_aes_ctrselect ( ZSaes *aes );
+static void zs_aes_xor ( ZSaes *aes, uint8_t *data, size_t size );
+static void zs_aes_crypt ( ZSaes *aes, uint8_t *data, int64_t size );
+static int zs_random ( uint8_t *buffer, size_t size );
+static void zs_adapt ( ZIPstream *zstream );
+static void zs_memorycharge ( int64_t *charge, int64_t size, int wait );
+static void zs_memoryuncharge ( int64_t *charge );
+static int zs_acquirebuffer ( ZIPstream *zstream );
+static void zs_releasebuffer ( ZIPstream *zstream );
+static void zs_returnbuffer ( ZIPstream *zstream );
+static int64_t zs_nextboundary ( ZIPstream *zstream, ZIPentry *zentry );
+static int zs_addseekpoint ( ZIPentry *zentry );
+static void zs_putunit16 (uint8_t *P, uint16_t V);
+static void zs_putunit32 (uint8_t *P, uint32_t V);
+static void zs_putunit64 (uint8_t *P, uint64_t V);
 static void zs_packunit16 (ZIPstream *ZS, int *O, uint16_t V);
 static void zs_packunit32 (ZIPstream *ZS, int *O, uint32_t V);
 static void zs_packunit64 (ZIPstream *ZS, int *O, uint64_t V);
+static uint16_t zs_getunit16 (const uint8_t *P);
+static uint32_t zs_getunit32 (const uint8_t *P);
+static uint64_t zs_getunit64 (const uint8_t *P);
 
 
 /***************************************************************************
  * zs_store_process:
  *
- * The process() callback for the STORE method.
+ * The version 2 process() callback for the STORE method.  The entry
+ * data itself is returned as output, without copying.
  *
- * @return number of bytes ready for writing in writeBuffer or <0 on error.
+ * @return 0 when all input is consumed or <0 on error.
  ***************************************************************************/
 static int32_t
 zs_store_process ( ZIPstream *zstream, ZIPentry *zentry,
-                   uint8_t *entry, int64_t entrySize, int64_t *entryConsumed,
-                   uint8_t *writeBuffer, int64_t writeBufferSize )
+                   const uint8_t *entry, int64_t entrySize, int64_t *entryConsumed,
+                   int flush, uint8_t *writeBuffer, int64_t writeBufferSize,
+                   ZIPspan *output )
 {
   /* Avoid warnings for arguments not used in this implementation */
   (void)zstream;
   (void)zentry;
+  (void)flush;
+  (void)writeBuffer;
+  (void)writeBufferSize;
 
-  if ( ! entry || entrySize <= 0 )
-    return 0;
-
-  if ( entrySize < writeBufferSize )
-    {
-      writeBufferSize = entrySize;
-    }
-
-  memcpy ( writeBuffer, entry, writeBufferSize );
+  output->data = entry;
+  output->size = ( entry && entrySize > 0 ) ? entrySize : 0;
 
   if ( entryConsumed )
     {
-      *entryConsumed = writeBufferSize;
+      *entryConsumed = output->size;
     }
 
-  return writeBufferSize;
+  return 0;
 }  /* End of zs_store_process() */
 
 
@@ -163,8 +583,6 @@ zs_deflate_init ( ZIPstream *zstream, ZIPentry *zentry )
 {
   z_stream *zlstream;
 
-  (void)zstream; /* Avoid warning for unused parameter */
-
   /* Allocate ZLIB stream entry and store at private method pointer */
   zlstream = (z_stream *) calloc (1, sizeof(z_stream));
   if ( ! zlstream )
@@ -174,7 +592,7 @@ zs_deflate_init ( ZIPstream *zstream, ZIPentry *zentry )
     }
   zentry->methoddata = zlstream;
 
-  /* Allocate deflate zlib stream state & initialize */
+  /* Allocate deflate zlib stream state & initialize, sized by the memory profile */
   zlstream->zalloc = Z_NULL;
   zlstream->zfree = Z_NULL;
   zlstream->opaque = Z_NULL;
@@ -182,8 +600,10 @@ zs_deflate_init ( ZIPstream *zstream, ZIPentry *zentry )
   zlstream->total_out = 0;
   zlstream->data_type = Z_BINARY;
 
-  if ( deflateInit2 (zlstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
-                     -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK )
+  zentry->CompressionLevel = zstream->Level;
+
+  if ( deflateInit2 (zlstream, zentry->CompressionLevel, Z_DEFLATED,
+                     -zstream->WindowBits, zstream->MemLevel, Z_DEFAULT_STRATEGY) != Z_OK )
     {
       fprintf (stderr, "zs_deflate_init: Error with deflateInit2()\n");
       return -1;
@@ -196,21 +616,20 @@ zs_deflate_init ( ZIPstream *zstream, ZIPentry *zentry )
 /***************************************************************************
  * zs_deflate_process:
  *
- * Process data for deflate method.
+ * The version 2 process() callback for the deflate method.
  *
- * @return number of bytes ready for writing in writeBuffer or <0 on error.
+ * @return 1 when more output is pending, 0 when complete or <0 on error.
  ***************************************************************************/
 static int32_t
 zs_deflate_process( ZIPstream *zstream, ZIPentry *zentry,
-                    uint8_t *entry, int64_t entrySize, int64_t *entryConsumed,
-                    uint8_t* writeBuffer, int64_t writeBufferSize )
+                    const uint8_t *entry, int64_t entrySize, int64_t *entryConsumed,
+                    int flush, uint8_t* writeBuffer, int64_t writeBufferSize,
+                    ZIPspan *output )
 {
   z_stream *zlstream;
-  int flush;
+  int zflush;
   int rv;
 
-  (void)zstream; /* Avoid warning for unused parameter */
-
   if ( ! zentry )
     return -1;
 
@@ -219,17 +638,58 @@ zs_deflate_process( ZIPstream *zstream, ZIPentry *zentry,
   if ( ! zlstream )
     return -1;
 
-  zlstream->next_in = entry;
-  zlstream->avail_in = ( entry ) ? entrySize : 0;
+  if ( entryConsumed )
+    *entryConsumed = 0;
+
+  output->data = writeBuffer;
+  output->size = 0;
+
+  zlstream->next_in = (Bytef *) entry;
+  zlstream->avail_in = 0;
   zlstream->next_out = writeBuffer;
   zlstream->avail_out = writeBufferSize;
 
-  flush = ( entry ) ? Z_NO_FLUSH : Z_FINISH;
+  /* Apply a changed stream level to the entry in progress, data so far
+   * is compressed at the old level first, retried when output space
+   * is insufficient (Z_BUF_ERROR) */
+  if ( flush == ZS_METHOD_NOFLUSH && zstream->Level > 0 &&
+       zentry->CompressionLevel != zstream->Level )
+    {
+      rv = deflateParams (zlstream, zstream->Level, Z_DEFAULT_STRATEGY);
+
+      if ( rv == Z_OK )
+        {
+          zentry->CompressionLevel = zstream->Level;
+        }
+      else if ( rv != Z_BUF_ERROR )
+        {
+          fprintf (stderr, "zs_deflate_process: Error with deflateParams(): %d\n", rv);
+          return -1;
+        }
+
+      if ( zlstream->avail_out == 0 )
+        {
+          output->size = writeBufferSize;
+          return 1;
+        }
+    }
+
+  zlstream->avail_in = ( entry ) ? entrySize : 0;
+
+  /* Sync flush when requested by flush policy and full flush,
+   * resetting compression state, for seek points */
+  zflush = ( flush == ZS_METHOD_FINISH ) ? Z_FINISH :
+    ( flush == ZS_METHOD_FULL ) ? Z_FULL_FLUSH :
+    ( flush == ZS_METHOD_SYNC ) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+  rv = deflate ( zlstream, zflush );
 
-  rv = deflate ( zlstream, flush );
+  /* No progress is possible when there is nothing to process or flush */
+  if ( rv == Z_BUF_ERROR && zlstream->avail_in == 0 && zflush != Z_FINISH )
+    return 0;
 
-  if ( ! (entry && rv == Z_OK) &&
-       ! (!entry && rv == Z_STREAM_END) )
+  if ( ! (rv == Z_OK) &&
+       ! (zflush == Z_FINISH && rv == Z_STREAM_END) )
     {
       fprintf (stderr, "zs_deflate_process: Error with deflate():\n");
 
@@ -250,8 +710,15 @@ zs_deflate_process( ZIPstream *zstream, ZIPentry *zentry,
       *entryConsumed = entrySize - zlstream->avail_in;
     }
 
-  /* Return number of bytes ready in writeBuffer */
-  return (writeBufferSize - zlstream->avail_out);
+  output->size = writeBufferSize - zlstream->avail_out;
+
+  /* Complete when the stream is finished, when all input is consumed
+   * without a flush, or flushed with output space remaining */
+  if ( rv == Z_STREAM_END ||
+       (zlstream->avail_in == 0 && (zflush == Z_NO_FLUSH || zlstream->avail_out > 0)) )
+    return 0;
+
+  return 1;
 }
 
 
@@ -291,824 +758,7190 @@ zs_deflate_finish ( ZIPstream *zstream, ZIPentry *zentry )
 
 
 /***************************************************************************
- * zs_registermethod:
- *
- * Initialize a new ZIPmethod entry and add it to the method list for
- * the supplied ZIPstream.
- *
- * Each method requires an ID, mind that the ZIP APPNOTE defines some
- * specific IDs already.  Each method is also required to provide
- * three functions:
+ * zs_aes_init:
  *
- * init()     : Initialization to start an entry, optional.
- * process()  : Process new data and/or flush to finalize an entry, required.
- * finish()   : Finalize an entry, cleanup, optional.
- *
- * Optional function pointers should NULL if no action is needed.
+ * Initialization for the WinZip AES method, which wraps the method
+ * given in the methoddata of the entry by zs_beginentry().  A random
+ * salt is generated, the encryption key, authentication key and
+ * password verifier are derived from the stream password and the
+ * wrapped method is initialized.
  *
- * @return a pointer to a ZIPmethod struct on success or NULL on error.
+ * @return 0 on sucess and non-zero on error.
  ***************************************************************************/
-ZIPmethod *
-zs_registermethod ( ZIPstream *zs, int32_t methodID,
-                    int32_t (*init)( ZIPstream*, ZIPentry* ),
-                    int32_t (*process)( ZIPstream*, ZIPentry*,
-                                        uint8_t*, int64_t, int64_t*,
-                                        uint8_t*, int64_t ),
-                    int32_t (*finish)( ZIPstream*, ZIPentry* )
-                    )
+static int32_t
+zs_aes_init ( ZIPstream *zstream, ZIPentry *zentry )
 {
-  ZIPmethod *method = zs->firstMethod;
+  ZIPmethod *method = zentry->methoddata;
+  uint8_t keys[ZS_AES_KEY_LENGTH * 2 + 2];
+  ZSaes *aes;
 
-  /* Require a process() callback for the method */
-  if ( ! process )
+  if ( ! (aes = (ZSaes *) calloc (1, sizeof(ZSaes))) )
     {
-      fprintf (stderr, "Compression method (%d) must provide a process() callback\n",
-               methodID);
-      return NULL;
+      fprintf (stderr, "zs_aes_init: Cannot allocate memory\n");
+      return -1;
     }
 
-  /* Search for existing method */
-  while ( method )
+  if ( zs_random (aes->header, ZS_AES_SALT_LENGTH) )
     {
-      if ( method->ID == methodID )
-        {
-          fprintf (stderr, "Compression method (%d) already registered\n",
-                   methodID);
-          return NULL;
-        }
-
-      method = method->next;
+      fprintf (stderr, "zs_aes_init: Cannot generate random salt\n");
+      free (aes);
+      return -1;
     }
 
-  /* Allocate and initialize new method */
-  method = (ZIPmethod *) calloc (1, sizeof(ZIPmethod));
+  /* Encryption key, authentication key and 2-byte password verifier */
+  zs_pbkdf2_sha1 ((const uint8_t *)zstream->password, strlen (zstream->password),
+                  aes->header, ZS_AES_SALT_LENGTH, ZS_AES_ITERATIONS,
+                  keys, sizeof(keys));
 
-  if ( method == NULL )
+  zs_aes_expandkey (keys, aes->roundkeys);
+  zs_hmac_sha1_key (keys + ZS_AES_KEY_LENGTH, ZS_AES_KEY_LENGTH, &aes->hmac, &aes->outer);
+  memcpy (aes->header + ZS_AES_SALT_LENGTH, keys + ZS_AES_KEY_LENGTH * 2, 2);
+  memset (keys, 0, sizeof(keys));
+
+  aes->method = method;
+  aes->padused = sizeof(aes->pad);
+  zs_aes_ctrselect (aes);
+
+  zentry->methoddata = NULL;
+
+  if ( method->init && method->init (zstream, zentry) )
     {
-      fprintf (stderr, "Cannot allocate memory for method\n");
-      return NULL;
+      free (aes);
+      return -1;
     }
 
-  method->ID = methodID;
-  method->init = init;
-  method->process = process;
-  method->finish = finish;
-
-  /* Add new method to ZIPstream list */
-  method->next = zs->firstMethod;
-  zs->firstMethod = method;
+  aes->methoddata = zentry->methoddata;
+  zentry->methoddata = aes;
 
-  return method;
-}  /* End of zs_registermethod() */
+  return 0;
+}  /* End of zs_aes_init() */
 
 
 /***************************************************************************
- * zs_init:
+ * zs_aes_process:
  *
- * Initialize and return an ZIPstream struct. If a pointer to an
- * existing ZIPstream is supplied it will be re-initizlied, otherwise
- * memory will be allocated.
+ * The version 2 process() callback for the WinZip AES method.  The salt
+ * and password verifier are returned first, then output of the wrapped
+ * method encrypted, with AES-256 in CTR mode and HMAC-SHA1 of the
+ * encrypted data applied in the same pass, and finally the
+ * authentication code when the wrapped method is finished.
  *
- * @return a pointer to a ZIPstream struct on success or NULL on error.
+ * Output placed in writeBuffer by the wrapped method is encrypted in
+ * place, output in memory of the wrapped method is copied to
+ * writeBuffer in parts and encrypted there.
+ *
+ * @return 1 when more output is pending, 0 when complete or <0 on error.
  ***************************************************************************/
-ZIPstream *
-zs_init ( int fd, ZIPstream *zs )
+static int32_t
+zs_aes_process ( ZIPstream *zstream, ZIPentry *zentry,
+                 const uint8_t *entry, int64_t entrySize, int64_t *entryConsumed,
+                 int flush, uint8_t *writeBuffer, int64_t writeBufferSize,
+                 ZIPspan *output )
 {
-  ZIPentry *zentry, *zefree;
-  ZIPmethod *method, *mfree;
+  ZSaes *aes = zentry->methoddata;
+  uint8_t digest[20];
+  int32_t rc;
 
-  if ( ! zs )
+  if ( entryConsumed )
+    *entryConsumed = 0;
+
+  output->data = writeBuffer;
+  output->size = 0;
+
+  if ( aes->stage == 0 )
     {
-      zs = (ZIPstream *) malloc (sizeof(ZIPstream));
+      output->data = aes->header;
+      output->size = sizeof(aes->header);
+      aes->stage = 1;
+
+      return 1;
     }
-  else
+
+  if ( aes->stage == 2 )
+    {
+      output->data = aes->mac;
+      output->size = ZS_AES_MAC_LENGTH;
+      aes->stage = 3;
+
+      return 0;
+    }
+
+  if ( aes->stage == 3 )
+    return 0;
+
+  if ( aes->pendingsize == 0 )
     {
-      zentry = zs->FirstEntry;
-      while ( zentry )
+      /* Process with the wrapped method and its own private data */
+      zentry->methoddata = aes->methoddata;
+      rc = zs_methodprocess (aes->method, zstream, zentry, entry, entrySize, entryConsumed,
+                             flush, writeBuffer, writeBufferSize, output);
+      aes->methoddata = zentry->methoddata;
+      zentry->methoddata = aes;
+
+      if ( rc < 0 )
+        return rc;
+
+      aes->innerrc = rc;
+
+      if ( output->data == writeBuffer )
         {
-          zefree = zentry;
-          zentry = zentry->next;
-          free (zefree);
+          zs_aes_crypt (aes, writeBuffer, output->size);
         }
-
-      method = zs->firstMethod;
-      while ( method )
+      else
         {
-          mfree = method;
-          method = method->next;
-          free (mfree);
+          aes->pending = output->data;
+          aes->pendingsize = output->size;
+          output->data = writeBuffer;
+          output->size = 0;
         }
     }
 
-  if ( zs == NULL )
+  if ( aes->pendingsize > 0 )
     {
-      fprintf (stderr, "zs_init: Cannot allocate memory for ZIPstream\n");
-      return NULL;
-    }
-
-  memset (zs, 0, sizeof (ZIPstream));
+      output->size = ( aes->pendingsize < writeBufferSize ) ? aes->pendingsize : writeBufferSize;
+      memcpy (writeBuffer, aes->pending, output->size);
+      zs_aes_crypt (aes, writeBuffer, output->size);
 
-  zs->fd = fd;
+      aes->pending += output->size;
+      aes->pendingsize -= output->size;
 
-  /* Register the included ZS_STORE and ZS_DEFLATE compression methods */
-  if ( ! zs_registermethod ( zs, ZS_STORE,
-                             NULL,
-                             zs_store_process,
-                             NULL ) )
-    {
-      free (zs);
-      return NULL;
+      if ( aes->pendingsize > 0 )
+        return 1;
     }
 
-  if ( ! zs_registermethod ( zs, ZS_DEFLATE,
-                             zs_deflate_init,
-                             zs_deflate_process,
-                             zs_deflate_finish ) )
+  if ( aes->innerrc > 0 )
+    return 1;
+
+  /* Authentication code is the truncated HMAC-SHA1 of encrypted data */
+  if ( flush == ZS_METHOD_FINISH )
     {
-      free (zs);
-      return NULL;
+      zs_sha1_final (&aes->hmac, digest);
+      zs_sha256_update (&aes->outer, digest, sizeof(digest));
+      zs_sha1_final (&aes->outer, digest);
+
+      memcpy (aes->mac, digest, ZS_AES_MAC_LENGTH);
+      aes->stage = 2;
+
+      return 1;
     }
 
-  return zs;
-}  /* End of zs_init() */
+  return 0;
+}  /* End of zs_aes_process() */
 
 
 /***************************************************************************
- * zs_free:
+ * zs_aes_finish:
  *
- * Free all memory associated with a ZIPstream including all ZIPentry
- * structures.
+ * Closeout for the WinZip AES method, finishes the wrapped method and
+ * clears the keys.  The CRC-32 is not recorded for AE-2 entries.
+ *
+ * @return 0 on success and non-zero on error.
  ***************************************************************************/
-void
-zs_free ( ZIPstream *zs )
+static int32_t
+zs_aes_finish ( ZIPstream *zstream, ZIPentry *zentry )
 {
-  ZIPentry *zentry, *zefree;
-  ZIPmethod *method, *mfree;
+  ZSaes *aes = zentry->methoddata;
+  int32_t rc = 0;
 
-  if ( ! zs )
-    return;
+  zentry->methoddata = aes->methoddata;
 
-  zentry = zs->FirstEntry;
-  while ( zentry )
-    {
-      zefree = zentry;
-      zentry = zentry->next;
-      free (zefree);
-    }
+  if ( aes->method->finish )
+    rc = aes->method->finish (zstream, zentry);
 
-  method = zs->firstMethod;
-  while ( method )
-    {
-      mfree = method;
-      method = method->next;
-      free (mfree);
-    }
+  zentry->methoddata = NULL;
+  zentry->CRC32 = 0;
 
-  free (zs);
+  memset (aes, 0, sizeof(ZSaes));
+  free (aes);
 
-}  /* End of zs_free() */
+  return rc;
+}  /* End of zs_aes_finish() */
 
 
 /***************************************************************************
- * zs_writeentry:
- *
- * Write ZIP archive entry contained in a memory buffer using the
- * specified compression methodID.
+ * zs_addmethod:
  *
- * The methodID argument specifies the compression methodID to be used
- * for this entry.  Included methods are:
- *   Z_STORE   - no compression
- *   Z_DEFLATE - deflate compression
- *
- * The entry modified time (modtime) is stored in UTC.
- *
- * If specified, writestatus will be set to the output of write() when
- * a write error occurs, otherwise it will be set to 0.
+ * Allocate a new ZIPmethod entry, checking that the method ID is not
+ * already registered, and add it to the method list for the supplied
+ * ZIPstream.
  *
- * @return pointer to ZIPentry on success and NULL on error.
+ * @return a pointer to a ZIPmethod struct on success or NULL on error.
  ***************************************************************************/
-ZIPentry *
-zs_writeentry ( ZIPstream *zstream, uint8_t *entry, int64_t entrySize,
-                char *name, time_t modtime, int methodID, int64_t *writestatus )
+static ZIPmethod *
+zs_addmethod ( ZIPstream *zs, int32_t methodID )
 {
-  ZIPentry *zentry = NULL;
+  ZIPmethod *method = zs->firstMethod;
 
-  if ( writestatus )
-    *writestatus = 0;
+  /* Search for existing method */
+  while ( method )
+    {
+      if ( method->ID == methodID )
+        {
+          fprintf (stderr, "Compression method (%d) already registered\n",
+                   methodID);
+          return NULL;
+        }
 
-  if ( ! zstream )
-    return NULL;
+      method = method->next;
+    }
 
-  if ( entrySize > 0xFFFFFFFF )
+  /* Allocate and initialize new method */
+  method = (ZIPmethod *) calloc (1, sizeof(ZIPmethod));
+
+  if ( method == NULL )
     {
-      fprintf (stderr, "zs_writeentry(%s): Individual entries cannot exceed %lld bytes\n",
-               (name) ? name : "", (long long) 0xFFFFFFFF);
+      fprintf (stderr, "Cannot allocate memory for method\n");
       return NULL;
     }
 
-  /* Begin entry */
-  if ( ! (zentry = zs_entrybegin ( zstream, name, modtime, methodID, writestatus )) )
+  method->ID = methodID;
+
+  /* Add new method to ZIPstream list */
+  method->next = zs->firstMethod;
+  zs->firstMethod = method;
+
+  return method;
+}  /* End of zs_addmethod() */
+
+
+/***************************************************************************
+ * zs_registermethod:
+ *
+ * Initialize a new ZIPmethod entry and add it to the method list for
+ * the supplied ZIPstream.
+ *
+ * Each method requires an ID, mind that the ZIP APPNOTE defines some
+ * specific IDs already.  Each method is also required to provide
+ * three functions:
+ *
+ * init()     : Initialization to start an entry, optional.
+ * process()  : Process new data and/or flush to finalize an entry, required.
+ * finish()   : Finalize an entry, cleanup, optional.
+ *
+ * Optional function pointers should NULL if no action is needed.
+ *
+ * These are version 1 methods, called through an adapter, see
+ * zs_registermethod2() for methods that return their own output.
+ *
+ * @return a pointer to a ZIPmethod struct on success or NULL on error.
+ ***************************************************************************/
+ZIPmethod *
+zs_registermethod ( ZIPstream *zs, int32_t methodID,
+                    int32_t (*init)( ZIPstream*, ZIPentry* ),
+                    int32_t (*process)( ZIPstream*, ZIPentry*,
+                                        uint8_t*, int64_t, int64_t*,
+                                        uint8_t*, int64_t ),
+                    int32_t (*finish)( ZIPstream*, ZIPentry* )
+                    )
+{
+  ZIPmethod *method;
+
+  /* Require a process() callback for the method */
+  if ( ! process )
     {
+      fprintf (stderr, "Compression method (%d) must provide a process() callback\n",
+               methodID);
       return NULL;
     }
 
-  /* Process entry data and flush */
-  if ( ! zs_entrydata (zstream, zentry, entry, entrySize, writestatus) )
+  if ( ! (method = zs_addmethod (zs, methodID)) )
+    return NULL;
+
+  method->version = 1;
+  method->init = init;
+  method->process = process;
+  method->finish = finish;
+
+  return method;
+}  /* End of zs_registermethod() */
+
+
+/***************************************************************************
+ * zs_registermethod2:
+ *
+ * Initialize a new version 2 ZIPmethod entry and add it to the method
+ * list for the supplied ZIPstream.
+ *
+ * The process() callback of a version 2 method is given an explicit
+ * flush mode and returns output in a ZIPspan, either placed in the
+ * write buffer or in memory of the method, see the description at
+ * the top of this file.  With the ZS_METHOD_CRC flag the method sets
+ * the CRC-32 of entries itself.
+ *
+ * @return a pointer to a ZIPmethod struct on success or NULL on error.
+ ***************************************************************************/
+ZIPmethod *
+zs_registermethod2 ( ZIPstream *zs, int32_t methodID, uint32_t flags,
+                     int32_t (*init)( ZIPstream*, ZIPentry* ),
+                     int32_t (*process)( ZIPstream*, ZIPentry*,
+                                         const uint8_t*, int64_t, int64_t*,
+                                         int, uint8_t*, int64_t,
+                                         ZIPspan* ),
+                     int32_t (*finish)( ZIPstream*, ZIPentry* )
+                     )
+{
+  ZIPmethod *method;
+
+  /* Require a process() callback for the method */
+  if ( ! process )
     {
+      fprintf (stderr, "Compression method (%d) must provide a process() callback\n",
+               methodID);
       return NULL;
     }
 
-  /* End entry */
-  if ( ! zs_entryend (zstream, zentry, writestatus) )
+  if ( ! (method = zs_addmethod (zs, methodID)) )
+    return NULL;
+
+  method->version = 2;
+  method->flags = flags;
+  method->init = init;
+  method->process2 = process;
+  method->finish = finish;
+
+  return method;
+}  /* End of zs_registermethod2() */
+
+
+/***************************************************************************
+ * zs_methodprocess:
+ *
+ * Call the process() callback of a method with the version 2
+ * interface.  Version 1 callbacks are adapted: finishing is signalled
+ * by a NULL entry, a flush by ZIPentry.flushpending, and output is
+ * always placed in writeBuffer.
+ *
+ * @return 1 when more output is pending, 0 when complete or <0 on error.
+ ***************************************************************************/
+static int32_t
+zs_methodprocess ( ZIPmethod *method, ZIPstream *zstream, ZIPentry *zentry,
+                   const uint8_t *entry, int64_t entrySize, int64_t *entryConsumed,
+                   int flush, uint8_t *writeBuffer, int64_t writeBufferSize,
+                   ZIPspan *output )
+{
+  static uint8_t empty[1];
+  int32_t writeSize;
+  int64_t consumed = 0;
+
+  if ( method->version >= 2 )
+    return method->process2 (zstream, zentry, entry, entrySize, entryConsumed,
+                             flush, writeBuffer, writeBufferSize, output);
+
+  if ( flush == ZS_METHOD_FINISH )
+    entry = NULL;
+  else if ( ! entry )
+    entry = empty;
+
+  writeSize = method->process (zstream, zentry, (uint8_t *) entry,
+                               ( entry ) ? entrySize : 0, &consumed,
+                               writeBuffer, writeBufferSize);
+
+  if ( writeSize < 0 )
+    return writeSize;
+
+  if ( entryConsumed )
+    *entryConsumed = ( entry ) ? consumed : 0;
+
+  output->data = writeBuffer;
+  output->size = writeSize;
+
+  /* Complete when no more output, or all input consumed and no flush
+   * pending, a version 1 method clears a flush request when done */
+  if ( writeSize == 0 ||
+       (entry && consumed >= entrySize &&
+        (flush == ZS_METHOD_NOFLUSH || ! zentry->flushpending)) )
+    return 0;
+
+  return 1;
+}  /* End of zs_methodprocess() */
+
+
+/***************************************************************************
+ * zs_init:
+ *
+ * Initialize and return an ZIPstream struct. If a pointer to an
+ * existing ZIPstream is supplied it will be re-initizlied, otherwise
+ * memory will be allocated.  On error an allocated struct is freed, a
+ * supplied struct is torn down and left zeroed to the caller.
+ *
+ * @return a pointer to a ZIPstream struct on success or NULL on error.
+ ***************************************************************************/
+ZIPstream *
+zs_init ( int fd, ZIPstream *zs )
+{
+  int allocated = ( zs == NULL );
+
+  if ( ! zs )
+    {
+      zs = (ZIPstream *) malloc (sizeof(ZIPstream));
+    }
+  else
+    {
+      zs_teardown (zs);
+    }
+
+  if ( zs == NULL )
     {
+      fprintf (stderr, "zs_init: Cannot allocate memory for ZIPstream\n");
       return NULL;
     }
 
-  return zentry;
-}  /* End of zs_writeentry() */
+  memset (zs, 0, sizeof (ZIPstream));
+
+  zs->fd = fd;
+  zs->WindowBits = MAX_WBITS;
+  zs->MemLevel = DEF_MEM_LEVEL;
+  zs->BufferSize = ZS_BUFFER_SIZE;
+  zs->Level = Z_DEFAULT_COMPRESSION;
+
+  /* Register the included ZS_STORE and ZS_DEFLATE compression methods */
+  if ( ! zs_registermethod2 ( zs, ZS_STORE, 0,
+                              NULL,
+                              zs_store_process,
+                              NULL ) ||
+       ! zs_registermethod2 ( zs, ZS_DEFLATE, 0,
+                              zs_deflate_init,
+                              zs_deflate_process,
+                              zs_deflate_finish ) )
+    {
+      if ( allocated )
+        zs_free (zs);
+      else
+        zs_teardown (zs);
+
+      return NULL;
+    }
+
+  return zs;
+}  /* End of zs_init() */
 
 
 /***************************************************************************
- * zs_entrybegin:
+ * zs_initappend:
  *
- * Begin a streaming entry by writing a Local File Header to the
- * output stream.  The modtime argument sets the modification time
- * stamp for the entry.
+ * Initialize and return a ZIPstream struct for adding entries to an
+ * existing archive in a seekable, readable and writable file
+ * descriptor.  The existing End of Central Directory Record, ZIP64
+ * structures and Central Directory are parsed into ZIPentry records
+ * and the output stream is positioned at the old Central Directory.
+ * New entries overwrite the old Central Directory and zs_finish()
+ * writes a combined Central Directory and truncates the file.
  *
- * The methodID argument specifies the compression method to be used
- * for this entry.  Included methods are:
- *   Z_STORE   - no compression
- *   Z_DEFLATE - deflate compression
+ * The fields written by this code and all extra fields other than
+ * ZIP64 are retained for existing entries, comments are dropped.
+ * Until zs_finish() completes the archive has no valid Central
+ * Directory.
  *
- * The entry modified time (modtime) is stored in UTC.
+ * If a pointer to an existing ZIPstream is supplied it will be
+ * re-initialized, otherwise memory will be allocated.  On error an
+ * allocated struct is freed, a supplied struct is torn down and left
+ * zeroed to the caller.
  *
- * If specified, writestatus will be set to the output of write() when
- * a write error occurs, otherwise it will be set to 0.
+ * @return a pointer to a ZIPstream struct on success or NULL on error.
+ ***************************************************************************/
+ZIPstream *
+zs_initappend ( int fd, ZIPstream *zs )
+{
+  int64_t cdoffset;
+  int allocated = ( zs == NULL );
+
+  if ( ! (zs = zs_init (fd, zs)) )
+    return NULL;
+
+  if ( zs_readdirectory (fd, zs, &cdoffset) )
+    {
+      if ( allocated )
+        zs_free (zs);
+      else
+        zs_teardown (zs);
+
+      return NULL;
+    }
+
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  if ( _lseeki64 (fd, cdoffset, SEEK_SET) != cdoffset )
+  #else
+  if ( lseek (fd, cdoffset, SEEK_SET) != cdoffset )
+  #endif
+    {
+      fprintf (stderr, "zs_initappend: Cannot seek to Central Directory: %s\n", strerror(errno));
+
+      if ( allocated )
+        zs_free (zs);
+      else
+        zs_teardown (zs);
+
+      return NULL;
+    }
+
+  zs->WriteOffset = cdoffset;
+  zs->Appending = 1;
+
+  return zs;
+}  /* End of zs_initappend() */
+
+
+/***************************************************************************
+ * zs_resume:
  *
- * @return pointer to ZIPentry on success and NULL on error.
+ * Initialize a ZIPstream to continue an archive in a seekable file
+ * that was interrupted, from the state saved in the checkpoint file at
+ * path, see zs_setcheckpoint().  The entries of the checkpoint are
+ * restored and the file is truncated after the last entry completed
+ * at the checkpoint, any later data is discarded.  New entries are
+ * added as usual, the caller skips entries already in the stream.
+ *
+ * The file must contain at least the data of the checkpoint and the
+ * Local Header of the last entry must match, otherwise it is not
+ * changed.
+ *
+ * If a pointer to an existing ZIPstream is supplied it will be
+ * re-initialized, otherwise memory will be allocated.  On error an
+ * allocated struct is freed, a supplied struct is torn down and left
+ * zeroed to the caller.
+ *
+ * @return a pointer to a ZIPstream struct on success or NULL on error.
  ***************************************************************************/
-ZIPentry *
-zs_entrybegin ( ZIPstream *zstream, char *name, time_t modtime, int methodID,
-                int64_t *writestatus )
+ZIPstream *
+zs_resume ( int fd, ZIPstream *zs, const char *path )
 {
-  ZIPentry *zentry;
-  ZIPmethod *method;
-  int64_t lwritestatus;
-  int32_t packed;
-  uint32_t u32;
+  int allocated = ( zs == NULL );
 
-  if ( writestatus )
-    *writestatus = 0;
+  if ( ! path )
+    return NULL;
 
-  if ( ! zstream || ! name )
+  if ( ! (zs = zs_init (fd, zs)) )
     return NULL;
 
-  /* Search for method ID */
-  method = zstream->firstMethod;
-  while ( method )
-    {
-      if ( method->ID == methodID )
+  if ( zs_readcheckpoint (fd, zs, path) )
+    {
+      if ( allocated )
+        zs_free (zs);
+      else
+        zs_teardown (zs);
+
+      return NULL;
+    }
+
+  return zs;
+}  /* End of zs_resume() */
+
+
+/***************************************************************************
+ * zs_free:
+ *
+ * Free all memory associated with a ZIPstream including all ZIPentry
+ * structures.
+ ***************************************************************************/
+void
+zs_free ( ZIPstream *zs )
+{
+  if ( ! zs )
+    return;
+
+  zs_teardown (zs);
+  free (zs);
+
+}  /* End of zs_free() */
+
+
+/***************************************************************************
+ * zs_teardown:
+ *
+ * Release everything held by a ZIPstream: entries, registered methods,
+ * output threads, engine, stream buffer and settings, leaving the
+ * struct itself zeroed to the caller.  Used by zs_init() to
+ * re-initialize an existing ZIPstream, by zs_free() and on errors of
+ * the init functions with a ZIPstream supplied by the caller.
+ ***************************************************************************/
+static void
+zs_teardown ( ZIPstream *zs )
+{
+  ZIPentry *zentry, *zefree;
+  ZIPmethod *method, *mfree;
+
+  zentry = zs->FirstEntry;
+  while ( zentry )
+    {
+      zefree = zentry;
+      zentry = zentry->next;
+      free (zefree->seekpoints);
+      free (zefree->CentralExtra);
+      free (zefree->hashstate);
+      free (zefree);
+    }
+
+  method = zs->firstMethod;
+  while ( method )
+    {
+      mfree = method;
+      method = method->next;
+      free (mfree);
+    }
+
+  zs_freeparts (zs);
+  zs_concurrentstop (zs, 0);
+  zs_pipelinestop (zs);
+  zs_fanoutstop (zs);
+  zs_enginestop (zs);
+  zs->entrycharged = 0;
+  zs_returnbuffer (zs);
+  free (zs->HashManifest);
+  free (zs->checkpointpath);
+  free (zs->chunktrailers);
+  zs_setencryption (zs, NULL);
+
+  memset (zs, 0, sizeof (ZIPstream));
+}  /* End of zs_teardown() */
+
+
+/***************************************************************************
+ * zs_setrotation:
+ *
+ * Enable rotation of output into multiple, independent archives.
+ * When a part has reached maxPartSize bytes or maxPartEntries entries,
+ * whichever is first and if non-zero, the part is finished when the
+ * next entry is started.  Each part is a complete archive.
+ *
+ * The nextpart() callback is called after a part is finished and must
+ * return the file descriptor for the next part, or -1 on error:
+ *
+ * int nextpart (ZIPstream *zstream, int32_t partNumber, void *userdata)
+ *
+ * The descriptor of the finished part remains in zstream->fd during
+ * the callback, closing it is the responsibility of the caller.
+ *
+ * A ZIPpart record is kept for each finished part, including the last
+ * part finished by zs_finish(), as a manifest of all parts.
+ *
+ * Entries of a finished part are freed, any ZIPentry pointers for
+ * those entries are invalid after the next zs_entrybegin().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setrotation ( ZIPstream *zstream, int64_t maxPartSize, int32_t maxPartEntries,
+                 int (*nextpart)( ZIPstream*, int32_t, void* ),
+                 void *userdata )
+{
+  if ( ! zstream || ! nextpart )
+    return -1;
+
+  if ( zstream->fanout || zstream->checkpointpath || zstream->ChunkSize )
+    {
+      fprintf (stderr, "zs_setrotation: Rotation cannot be used with additional outputs, "
+               "checkpoints or chunked output\n");
+      return -1;
+    }
+
+  if ( maxPartSize <= 0 && maxPartEntries <= 0 )
+    {
+      fprintf (stderr, "zs_setrotation: A maximum part size or entry count is required\n");
+      return -1;
+    }
+
+  zstream->MaxPartSize = maxPartSize;
+  zstream->MaxPartEntries = maxPartEntries;
+  zstream->nextpart = nextpart;
+  zstream->nextpartdata = userdata;
+
+  return 0;
+}  /* End of zs_setrotation() */
+
+
+/***************************************************************************
+ * zs_setpipeline:
+ *
+ * Enable pipelined output, where writing to the output descriptor is
+ * performed by a dedicated writer thread.  Compressed output is placed
+ * directly into a ring of the specified number of preallocated
+ * buffers, each ZS_BUFFER_SIZE bytes, and full buffers are handed to
+ * the writer thread through a lock-free single-producer,
+ * single-consumer queue.  Compression continues while the output
+ * descriptor is blocked until all buffers are full.
+ *
+ * Write errors are reported by a later call, at the latest by
+ * zs_finish(), which waits for all output to be written.
+ *
+ * Not available when compiled with ZS_NOTHREADS.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setpipeline ( ZIPstream *zstream, int32_t buffers )
+{
+#ifndef ZS_NOTHREADS
+  ZSpipeline *pipeline;
+  int32_t idx;
+  int rv;
+
+  if ( ! zstream || zstream->pipeline )
+    return -1;
+
+  if ( zstream->engine )
+    {
+      fprintf (stderr, "zs_setpipeline: Pipelined output cannot be used with an output engine\n");
+      return -1;
+    }
+
+  if ( buffers < 2 )
+    buffers = 2;
+
+  if ( ! (pipeline = (ZSpipeline *) calloc (1, sizeof(ZSpipeline))) ||
+       ! (pipeline->data = (uint8_t **) calloc (buffers, sizeof(uint8_t *))) ||
+       ! (pipeline->length = (int64_t *) calloc (buffers, sizeof(int64_t))) )
+    {
+      fprintf (stderr, "zs_setpipeline: Cannot allocate memory for pipeline\n");
+      if ( pipeline )
+        free (pipeline->data);
+      free (pipeline);
+      return -1;
+    }
+
+  pthread_mutex_init (&pipeline->lock, NULL);
+  pthread_cond_init (&pipeline->cond, NULL);
+  pipeline->count = buffers;
+  zstream->pipeline = pipeline;
+
+  for ( idx = 0; idx < buffers; idx++ )
+    {
+      if ( ! (pipeline->data[idx] = (uint8_t *) malloc (ZS_BUFFER_SIZE)) )
+        {
+          fprintf (stderr, "zs_setpipeline: Cannot allocate memory for pipeline buffers\n");
+          zs_pipelinestop (zstream);
+          return -1;
+        }
+    }
+
+  if ( (rv = pthread_create (&pipeline->thread, NULL, zs_pipelinewriter, zstream)) )
+    {
+      fprintf (stderr, "zs_setpipeline: Cannot create writer thread: %s\n", strerror(rv));
+      pipeline->thread = 0;
+      zs_pipelinestop (zstream);
+      return -1;
+    }
+
+  return 0;
+#else
+  (void)zstream;
+  (void)buffers;
+
+  fprintf (stderr, "zs_setpipeline: Pipelined output not supported without threads\n");
+
+  return -1;
+#endif
+}  /* End of zs_setpipeline() */
+
+
+/***************************************************************************
+ * zs_setengine:
+ *
+ * Select the engine writing output, for archives written to local
+ * files.  ZS_ENGINE_WRITE, the default, uses write() and works with
+ * any descriptor.  For regular files on Linux:
+ *
+ * ZS_ENGINE_DIRECT sets O_DIRECT on the descriptor and writes whole
+ * blocks from an aligned buffer of ZS_DIRECT_SIZE bytes, into which
+ * compressed data is placed directly, bypassing the page cache.  The
+ * last partial block is padded and the file truncated by zs_finish().
+ * The file system must support O_DIRECT.
+ *
+ * ZS_ENGINE_MMAP preallocates the file with fallocate() and maps it in
+ * windows of ZS_MMAP_WINDOW bytes, into which compressed data is
+ * placed directly.  Completed windows are written back in the
+ * background with sync_file_range() and dropped from the page cache
+ * one window later.  The descriptor must be open for reading and
+ * writing.  The file system must support fallocate(), otherwise
+ * mapping the first window fails with EOPNOTSUPP when output starts
+ * and ZS_ENGINE_WRITE or ZS_ENGINE_DIRECT should be used instead.
+ *
+ * Output starts at the current offset of the descriptor, which is
+ * left at the end of the archive by zs_finish(), so appending and
+ * rotation work as usual.  Cannot be combined with pipelined output
+ * or zs_writerange().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setengine ( ZIPstream *zstream, int engine )
+{
+#if defined(__linux__)
+  if ( ! zstream || zstream->engine )
+    return -1;
+
+  if ( engine == ZS_ENGINE_WRITE )
+    return 0;
+
+  if ( engine != ZS_ENGINE_DIRECT && engine != ZS_ENGINE_MMAP )
+    {
+      fprintf (stderr, "zs_setengine: Unknown output engine %d\n", engine);
+      return -1;
+    }
+
+  if ( zstream->pipeline )
+    {
+      fprintf (stderr, "zs_setengine: An output engine cannot be used with pipelined output\n");
+      return -1;
+    }
+
+  if ( zstream->fanout )
+    {
+      fprintf (stderr, "zs_setengine: An output engine cannot be used with additional outputs\n");
+      return -1;
+    }
+
+  if ( zstream->ChunkSize )
+    {
+      fprintf (stderr, "zs_setengine: An output engine cannot be used with chunked output\n");
+      return -1;
+    }
+
+  if ( ! (zstream->engine = (ZSengine *) calloc (1, sizeof(ZSengine))) )
+    {
+      fprintf (stderr, "zs_setengine: Cannot allocate memory for output engine\n");
+      return -1;
+    }
+
+  zstream->engine->type = engine;
+  zstream->engine->fd = -1;
+
+  if ( engine == ZS_ENGINE_DIRECT &&
+       posix_memalign ((void **) &zstream->engine->block, ZS_DIRECT_ALIGN, ZS_DIRECT_SIZE) )
+    {
+      fprintf (stderr, "zs_setengine: Cannot allocate memory for output engine\n");
+      zs_enginestop (zstream);
+      return -1;
+    }
+
+  return 0;
+#else
+  if ( ! zstream )
+    return -1;
+
+  if ( engine == ZS_ENGINE_WRITE )
+    return 0;
+
+  fprintf (stderr, "zs_setengine: Output engines are only supported on Linux\n");
+
+  return -1;
+#endif
+}  /* End of zs_setengine() */
+
+
+/***************************************************************************
+ * zs_addoutput:
+ *
+ * Add a destination to which all output is also written, e.g. to
+ * stream an archive to a client and to a cache file in one pass.
+ * Each destination is written by its own thread from a queue of
+ * references to output shared by all destinations, holding at most
+ * limit bytes (ZS_OUTPUT_LIMIT when 0), so a slow destination does
+ * not slow the others until its queue is full.  When the queue is
+ * full or writing fails, the policy applies:
+ *
+ * ZS_OUTPUT_FAILALL waits for a full queue to be written, a write
+ * error fails the stream, reported by a later call and at the latest
+ * by zs_finish().
+ *
+ * ZS_OUTPUT_DROP stops writing to the destination, which is left with
+ * a partial archive, and the stream continues.
+ *
+ * On Linux, when the stream descriptor and a destination are pipes,
+ * output is duplicated to the destination with tee() while its queue
+ * is empty, without copying.
+ *
+ * Destinations must be added before any output is written and are not
+ * closed.  SIGPIPE should be ignored when a pipe or socket destination
+ * may be closed by its reader.  zs_finish() waits for all destinations to be written.
+ * Cannot be combined with appending, rotation, an output engine or
+ * zs_writerange().  Not available when compiled with ZS_NOTHREADS.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_addoutput ( ZIPstream *zstream, int fd, int policy, int64_t limit )
+{
+#ifndef ZS_NOTHREADS
+  ZSfanout *fanout;
+  ZSdestination *dest;
+  ZSdestination **link;
+  int rv;
+#if defined(__linux__)
+  struct stat st;
+  int teesize;
+#endif
+
+  if ( ! zstream || fd < 0 )
+    return -1;
+
+  if ( policy != ZS_OUTPUT_FAILALL && policy != ZS_OUTPUT_DROP )
+    {
+      fprintf (stderr, "zs_addoutput: Unknown output policy %d\n", policy);
+      return -1;
+    }
+
+  if ( zstream->WriteOffset || zstream->Appending || zstream->nextpart || zstream->engine ||
+       zstream->ChunkSize )
+    {
+      fprintf (stderr, "zs_addoutput: Outputs must be added to a new stream, without appending, "
+               "rotation, output engine or chunked output\n");
+      return -1;
+    }
+
+  if ( ! (fanout = zstream->fanout) )
+    {
+      if ( ! (fanout = (ZSfanout *) calloc (1, sizeof(ZSfanout))) )
+        {
+          fprintf (stderr, "zs_addoutput: Cannot allocate memory\n");
+          return -1;
+        }
+
+      pthread_mutex_init (&fanout->lock, NULL);
+      pthread_cond_init (&fanout->space, NULL);
+      fanout->teepipe[0] = -1;
+      fanout->teepipe[1] = -1;
+      zstream->fanout = fanout;
+    }
+
+  if ( ! (dest = (ZSdestination *) calloc (1, sizeof(ZSdestination))) )
+    {
+      fprintf (stderr, "zs_addoutput: Cannot allocate memory\n");
+      return -1;
+    }
+
+  dest->fd = fd;
+  dest->policy = policy;
+  dest->limit = ( limit > 0 ) ? limit : ZS_OUTPUT_LIMIT;
+  dest->active = 1;
+  dest->fanout = fanout;
+  pthread_cond_init (&dest->cond, NULL);
+
+#if defined(__linux__)
+  /* Stage output in a pipe for tee() when writing from a pipe to pipes */
+  if ( ! fstat (fd, &st) && S_ISFIFO (st.st_mode) &&
+       ! fstat (zstream->fd, &st) && S_ISFIFO (st.st_mode) )
+    {
+      if ( fanout->teepipe[0] < 0 && ! pipe2 (fanout->teepipe, O_CLOEXEC) )
+        {
+          fcntl (fanout->teepipe[1], F_SETPIPE_SZ, ZS_BUFFER_SIZE);
+
+          if ( (teesize = fcntl (fanout->teepipe[1], F_GETPIPE_SZ)) > 0 )
+            {
+              fanout->teesize = teesize;
+            }
+          else
+            {
+              close (fanout->teepipe[0]);
+              close (fanout->teepipe[1]);
+              fanout->teepipe[0] = -1;
+              fanout->teepipe[1] = -1;
+            }
+        }
+
+      dest->pipe = ( fanout->teepipe[0] >= 0 );
+    }
+#endif
+
+  if ( (rv = pthread_create (&dest->thread, NULL, zs_fanoutwriter, dest)) )
+    {
+      fprintf (stderr, "zs_addoutput: Cannot create writer thread: %s\n", strerror(rv));
+      pthread_cond_destroy (&dest->cond);
+      free (dest);
+      return -1;
+    }
+
+  /* Add destination to end of list */
+  for ( link = &fanout->first; *link; link = &(*link)->next );
+  *link = dest;
+
+  return 0;
+#else
+  (void)zstream;
+  (void)fd;
+  (void)policy;
+  (void)limit;
+
+  fprintf (stderr, "zs_addoutput: Additional outputs not supported without threads\n");
+
+  return -1;
+#endif
+}  /* End of zs_addoutput() */
+
+
+/***************************************************************************
+ * zs_setcheckpoint:
+ *
+ * Enable checkpoints of a long-running archive, written to the state
+ * file at path with zs_checkpoint() at the first entry boundary after
+ * intervalSeconds seconds or intervalEntries entries since the last
+ * checkpoint, whichever is first and if non-zero.  An interrupted
+ * archive is continued with zs_resume(), repeating at most the work
+ * since the last checkpoint.
+ *
+ * The output must be a seekable file.  Cannot be combined with
+ * rotation.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setcheckpoint ( ZIPstream *zstream, const char *path,
+                   int32_t intervalSeconds, int32_t intervalEntries )
+{
+  char *name;
+
+  if ( ! zstream || ! path )
+    return -1;
+
+  if ( intervalSeconds <= 0 && intervalEntries <= 0 )
+    {
+      fprintf (stderr, "zs_setcheckpoint: A checkpoint interval or entry count is required\n");
+      return -1;
+    }
+
+  if ( zstream->nextpart || zstream->ChunkSize )
+    {
+      fprintf (stderr, "zs_setcheckpoint: Checkpoints cannot be used with rotation or chunked output\n");
+      return -1;
+    }
+
+  if ( ! (name = (char *) malloc (strlen (path) + 1)) )
+    {
+      fprintf (stderr, "zs_setcheckpoint: Cannot allocate memory\n");
+      return -1;
+    }
+
+  strcpy (name, path);
+
+  free (zstream->checkpointpath);
+  zstream->checkpointpath = name;
+  zstream->CheckpointInterval = ( intervalSeconds > 0 ) ? intervalSeconds : 0;
+  zstream->CheckpointEntries = ( intervalEntries > 0 ) ? intervalEntries : 0;
+  zstream->checkpointtime = zs_milliseconds ();
+  zstream->checkpointcount = zstream->EntryCount;
+
+  return 0;
+}  /* End of zs_setcheckpoint() */
+
+
+/***************************************************************************
+ * zs_checkpoint:
+ *
+ * Save the state of the stream, the records of completed entries and
+ * the offset following them, to a compact state file at path for
+ * zs_resume().  An entry in progress is not included.  Pipelined and
+ * engine output is written and the output file synchronized first,
+ * the state file is written to path.tmp, synchronized and renamed, so
+ * a checkpoint is either complete or the previous one remains.
+ *
+ * The state file contains a header of signature, version, offset and
+ * entry count, an entry record for each completed entry with the
+ * Central Directory fields, name and extra fields, and a CRC-32 of
+ * all preceding bytes, all little-endian.
+ *
+ * With concurrent submission only the writer thread may write
+ * checkpoints, as set by zs_setcheckpoint().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_checkpoint ( ZIPstream *zstream, const char *path )
+{
+  uint8_t record[ZS_CHECKPOINT_RECORD];
+  ZIPentry *zentry;
+  FILE *fp = NULL;
+  char *tmppath;
+  uint32_t crc;
+  int32_t count;
+  int32_t idx;
+  int64_t offset;
+  int rv = -1;
+
+  if ( ! zstream || ! path )
+    return -1;
+
+  if ( zstream->nextpart )
+    {
+      fprintf (stderr, "zs_checkpoint: Checkpoints cannot be used with rotation\n");
+      return -1;
+    }
+
+#ifndef ZS_NOTHREADS
+  if ( zstream->concurrent &&
+       ! pthread_equal (pthread_self (), zstream->concurrent->thread) )
+    {
+      fprintf (stderr, "zs_checkpoint: Checkpoints of concurrent submissions are written by the writer thread\n");
+      return -1;
+    }
+#endif
+
+  /* An entry in progress is repeated when resuming, from its Local Header */
+  count = zstream->EntryCount;
+  offset = zstream->WriteOffset;
+
+  if ( zstream->entrycharged && zstream->LastEntry )
+    {
+      count--;
+      offset = zstream->LastEntry->LocalHeaderOffset;
+    }
+
+  /* All output up to the checkpoint must be in the file */
+  if ( zstream->pipeline && zs_pipelinedrain (zstream) )
+    {
+      fprintf (stderr, "zs_checkpoint: Error writing pipelined output: %s\n", strerror(errno));
+      return -1;
+    }
+
+  zs_outputflush (zstream);
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  if ( _commit (zstream->fd) )
+#else
+  if ( fsync (zstream->fd) )
+#endif
+    {
+      fprintf (stderr, "zs_checkpoint: Cannot synchronize output: %s\n", strerror(errno));
+      return -1;
+    }
+
+  if ( ! (tmppath = (char *) malloc (strlen (path) + 5)) )
+    {
+      fprintf (stderr, "zs_checkpoint: Cannot allocate memory\n");
+      return -1;
+    }
+
+  sprintf (tmppath, "%s.tmp", path);
+
+  if ( ! (fp = fopen (tmppath, "wb")) )
+    {
+      fprintf (stderr, "zs_checkpoint: Cannot open %s: %s\n", tmppath, strerror(errno));
+      free (tmppath);
+      return -1;
+    }
+
+  zs_putunit32 (record, ZS_CHECKPOINT_SIG);
+  zs_putunit16 (record + 4, ZS_CHECKPOINT_VERSION);
+  zs_putunit16 (record + 6, 0);
+  zs_putunit64 (record + 8, offset);
+  zs_putunit32 (record + 16, count);
+  crc = crc32 (0L, record, ZS_CHECKPOINT_HEADER);
+
+  if ( fwrite (record, ZS_CHECKPOINT_HEADER, 1, fp) != 1 )
+    goto done;
+
+  for ( zentry = zstream->FirstEntry, idx = 0; zentry && idx < count;
+        zentry = zentry->next, idx++ )
+    {
+      zs_putunit16 (record, zentry->ZipVersion);
+      zs_putunit16 (record + 2, zentry->GeneralFlag);
+      zs_putunit16 (record + 4, zentry->CompressionMethod);
+      zs_putunit16 (record + 6, zentry->DOSTime);
+      zs_putunit16 (record + 8, zentry->DOSDate);
+      zs_putunit32 (record + 10, zentry->CRC32);
+      zs_putunit64 (record + 14, zentry->CompressedSize);
+      zs_putunit64 (record + 22, zentry->UncompressedSize);
+      zs_putunit64 (record + 30, zentry->LocalHeaderOffset);
+      zs_putunit16 (record + 38, zentry->NameLength);
+      zs_putunit16 (record + 40, zentry->CentralExtraLength);
+
+      crc = crc32 (crc, record, ZS_CHECKPOINT_RECORD);
+      crc = crc32 (crc, (uint8_t *)zentry->Name, zentry->NameLength);
+
+      if ( fwrite (record, ZS_CHECKPOINT_RECORD, 1, fp) != 1 ||
+           fwrite (zentry->Name, 1, zentry->NameLength, fp) != zentry->NameLength )
+        goto done;
+
+      if ( zentry->CentralExtraLength > 0 )
+        {
+          crc = crc32 (crc, zentry->CentralExtra, zentry->CentralExtraLength);
+
+          if ( fwrite (zentry->CentralExtra, 1, zentry->CentralExtraLength, fp) !=
+               zentry->CentralExtraLength )
+            goto done;
+        }
+    }
+
+  zs_putunit32 (record, crc);
+
+  if ( fwrite (record, 4, 1, fp) != 1 || fflush (fp) )
+    goto done;
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  if ( _commit (_fileno (fp)) )
+#else
+  if ( fsync (fileno (fp)) )
+#endif
+    goto done;
+
+  rv = 0;
+
+ done:
+  if ( fclose (fp) )
+    rv = -1;
+
+  /* Replace the previous checkpoint */
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  if ( ! rv && ! MoveFileExA (tmppath, path, MOVEFILE_REPLACE_EXISTING) )
+    {
+      errno = EIO;
+      rv = -1;
+    }
+#else
+  if ( ! rv && rename (tmppath, path) )
+    rv = -1;
+#endif
+
+  if ( rv )
+    {
+      fprintf (stderr, "zs_checkpoint: Error writing %s: %s\n", path, strerror(errno));
+      remove (tmppath);
+    }
+  else
+    {
+      zstream->checkpointtime = zs_milliseconds ();
+      zstream->checkpointcount = count;
+    }
+
+  free (tmppath);
+
+  return rv;
+}  /* End of zs_checkpoint() */
+
+
+/***************************************************************************
+ * zs_setchunked:
+ *
+ * Frame all output with HTTP/1.1 chunked transfer encoding, e.g. to
+ * write an archive as the body of a response directly to a client
+ * socket after the caller has written the headers.  Each write of
+ * output becomes chunks of at most chunkSize bytes, 0 for the size of
+ * the stream buffer (256 KiB by default), with the size line, data and
+ * CRLF written by a single writev() without copying the data.
+ * zs_finish() writes the last chunk and any trailer fields added with
+ * zs_addtrailer().  ZIPstream.WriteOffset counts archive bytes only.
+ *
+ * Must be set on a new stream.  Cannot be combined with appending,
+ * rotation, output engines, additional outputs, checkpoints or
+ * zs_writerange().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setchunked ( ZIPstream *zstream, int64_t chunkSize )
+{
+  if ( ! zstream || chunkSize < 0 )
+    return -1;
+
+  if ( zstream->WriteOffset || zstream->Appending || zstream->nextpart || zstream->engine ||
+       zstream->fanout || zstream->checkpointpath )
+    {
+      fprintf (stderr, "zs_setchunked: Chunked output must be set on a new stream, without "
+               "appending, rotation, output engine, additional outputs or checkpoints\n");
+      return -1;
+    }
+
+  zstream->ChunkSize = ( chunkSize > 0 ) ? chunkSize : zstream->BufferSize;
+
+  return 0;
+}  /* End of zs_setchunked() */
+
+
+/***************************************************************************
+ * zs_addtrailer:
+ *
+ * Add a trailer field written after the last chunk of chunked output
+ * by zs_finish(), e.g. a checksum or size known only at the end.  The
+ * caller should announce trailer fields with a Trailer header.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_addtrailer ( ZIPstream *zstream, const char *name, const char *value )
+{
+  size_t length;
+  size_t existing;
+  char *trailers;
+
+  if ( ! zstream || ! name || ! value )
+    return -1;
+
+  if ( ! zstream->ChunkSize )
+    {
+      fprintf (stderr, "zs_addtrailer: Trailer fields require chunked output\n");
+      return -1;
+    }
+
+  if ( ! *name || strpbrk (name, ":\r\n \t") || strpbrk (value, "\r\n") )
+    {
+      fprintf (stderr, "zs_addtrailer: Invalid trailer field name or value\n");
+      return -1;
+    }
+
+  existing = ( zstream->chunktrailers ) ? strlen (zstream->chunktrailers) : 0;
+  length = strlen (name) + strlen (value) + 4;
+
+  if ( ! (trailers = (char *) realloc (zstream->chunktrailers, existing + length + 1)) )
+    {
+      fprintf (stderr, "zs_addtrailer: Cannot allocate memory\n");
+      return -1;
+    }
+
+  sprintf (trailers + existing, "%s: %s\r\n", name, value);
+  zstream->chunktrailers = trailers;
+
+  return 0;
+}  /* End of zs_addtrailer() */
+
+
+/***************************************************************************
+ * zs_setflush:
+ *
+ * Set the default flush policy for entries begun after this call,
+ * for low-latency streaming of live data.  An entry is flushed, for
+ * DEFLATE with Z_SYNC_FLUSH, by zs_entrydata() when intervalMs
+ * milliseconds have passed or intervalBytes of input have been added
+ * since the last flush, whichever comes first.  A value of 0 disables
+ * the respective trigger.  The policy of an individual entry can be
+ * changed with the FlushInterval and FlushBytes fields of the ZIPentry.
+ *
+ * Each flush costs compression ratio, at least 4-5 bytes of output
+ * and a reset of block statistics.  The number of flushes is counted
+ * in ZIPentry.FlushCount and ZIPstream.FlushCount.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setflush ( ZIPstream *zstream, int32_t intervalMs, int64_t intervalBytes )
+{
+  if ( ! zstream || intervalMs < 0 || intervalBytes < 0 )
+    return -1;
+
+  zstream->FlushInterval = intervalMs;
+  zstream->FlushBytes = intervalBytes;
+
+  return 0;
+}  /* End of zs_setflush() */
+
+
+/***************************************************************************
+ * zs_setseekpoints:
+ *
+ * Set the seek point interval for DEFLATE entries begun after this
+ * call.  Every interval bytes of uncompressed data the compressor is
+ * fully flushed (Z_FULL_FLUSH), resetting its state, so that
+ * decompression can start at that point.  The pairs of uncompressed
+ * and compressed offsets of each seek point are written as a seek
+ * index extra field (ZS_EXTRA_SEEKINDEX) in the Central Directory
+ * Header of the entry: a sequence of little-endian 64-bit pairs of
+ * uncompressed offset and compressed offset relative to the start of
+ * entry data.  When an entry reaches ZS_SEEKPOINTS_MAX seek points
+ * every other point is dropped and its interval is doubled.
+ *
+ * Readers use the index to inflate ranges of an entry starting from
+ * the nearest seek point, see zr_extractrange().  A value of 0
+ * disables seek points.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setseekpoints ( ZIPstream *zstream, int64_t interval )
+{
+  if ( ! zstream || interval < 0 )
+    return -1;
+
+  zstream->SeekInterval = interval;
+
+  return 0;
+}  /* End of zs_setseekpoints() */
+
+
+/***************************************************************************
+ * zs_setlevel:
+ *
+ * Set the DEFLATE compression level (0-9, or -1 for the zlib default)
+ * for entries begun after this call, levels 1-9 also apply to an
+ * entry in progress from the next zs_entrydata().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setlevel ( ZIPstream *zstream, int level )
+{
+  if ( ! zstream || level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION )
+    return -1;
+
+  zstream->Level = level;
+
+  return 0;
+}  /* End of zs_setlevel() */
+
+
+/***************************************************************************
+ * zs_setadaptive:
+ *
+ * Enable adaptive compression, adjusting the DEFLATE level between
+ * minLevel and maxLevel (1-9) to where output is the bottleneck.  A
+ * maxLevel of 0 disables adaptive compression.
+ *
+ * For every ZS_ADAPT_WINDOW bytes of input added by zs_entrydata() the
+ * time spent waiting for output (write(), or a free buffer with
+ * pipelined output) is compared with the time spent processing.  When
+ * waiting exceeds processing the link is the bottleneck and the level
+ * is raised, when waiting is less than a quarter of processing the CPU
+ * is and the level is lowered.  A change requires hysteresis (default
+ * ZS_ADAPT_HYSTERESIS when 0) consecutive windows in agreement and is
+ * applied to the entry in progress with deflateParams().
+ *
+ * A minLevel of 0 allows falling back to STORE: when lowered below
+ * level 1, DEFLATE entries begun subsequently are stored until the
+ * level is raised again.  The current level is ZIPstream.Level, the
+ * number of changes ZIPstream.LevelChanges and the final level of an
+ * entry ZIPentry.CompressionLevel.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setadaptive ( ZIPstream *zstream, int minLevel, int maxLevel, int32_t hysteresis )
+{
+  if ( ! zstream )
+    return -1;
+
+  if ( maxLevel && (minLevel < 0 || maxLevel > Z_BEST_COMPRESSION ||
+                    minLevel > maxLevel || hysteresis < 0) )
+    {
+      fprintf (stderr, "zs_setadaptive: Invalid levels %d to %d, hysteresis %d\n",
+               minLevel, maxLevel, hysteresis);
+      return -1;
+    }
+
+  zstream->AdaptiveMin = minLevel;
+  zstream->AdaptiveMax = maxLevel;
+  zstream->AdaptiveHysteresis = ( hysteresis ) ? hysteresis : ZS_ADAPT_HYSTERESIS;
+  zstream->adaptwait = 0;
+  zstream->adaptbusy = 0;
+  zstream->adaptinput = 0;
+  zstream->adaptvotes = 0;
+
+  if ( ! maxLevel )
+    return 0;
+
+  /* Start at the zlib default level within bounds */
+  zstream->Level = 6;
+  if ( zstream->Level > maxLevel )
+    zstream->Level = maxLevel;
+  if ( zstream->Level < minLevel || zstream->Level < 1 )
+    zstream->Level = ( minLevel > 1 ) ? minLevel : 1;
+
+  return 0;
+}  /* End of zs_setadaptive() */
+
+
+/***************************************************************************
+ * zs_sethash:
+ *
+ * Set the content hash algorithm for entries begun after this call,
+ * ZS_HASH_SHA256 or ZS_HASH_NONE.  The hash is computed in the same
+ * pass over entry data as the CRC-32 and stored in the Central
+ * Directory Header of each entry as a private extra field
+ * (ZS_EXTRA_HASH): one byte of algorithm followed by the digest.
+ * SHA-256 uses the SHA extensions of x86-64 processors when available.
+ *
+ * If manifest is not NULL, zs_finish() adds an entry of that name
+ * listing the digest and name of each hashed entry in the format of
+ * sha256sum, so that extracted files can be checked with
+ * "sha256sum -c".  When rotating output each part has its own
+ * manifest.
+ *
+ * Content hashes cannot be combined with encryption, the unencrypted
+ * digest in the Central Directory would identify the plaintext of
+ * encrypted entries, see zs_setencryption().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_sethash ( ZIPstream *zstream, int algorithm, const char *manifest )
+{
+  char *name = NULL;
+
+  if ( ! zstream || (algorithm != ZS_HASH_NONE && algorithm != ZS_HASH_SHA256) )
+    return -1;
+
+  if ( algorithm != ZS_HASH_NONE && zstream->password )
+    {
+      fprintf (stderr, "zs_sethash: Content hashes cannot be combined with encryption\n");
+      return -1;
+    }
+
+  if ( manifest )
+    {
+      if ( ! (name = (char *) malloc (strlen (manifest) + 1)) )
+        {
+          fprintf (stderr, "zs_sethash: Cannot allocate memory\n");
+          return -1;
+        }
+
+      strcpy (name, manifest);
+    }
+
+  free (zstream->HashManifest);
+  zstream->HashManifest = name;
+  zstream->HashAlgorithm = algorithm;
+
+  return 0;
+}  /* End of zs_sethash() */
+
+
+/***************************************************************************
+ * zs_setencryption:
+ *
+ * Encrypt entries begun after this call with WinZip AES-256 (AE-2)
+ * using password, or stop encrypting when password is NULL.  The
+ * ZS_AES method is registered and wraps the requested method of each
+ * entry: output of STORE, DEFLATE or pre-encoded data is encrypted in
+ * place with AES in CTR mode and authenticated with HMAC-SHA1 in the
+ * same pass over the output buffer.  Keys are derived per entry from
+ * the password and a random salt with PBKDF2-HMAC-SHA1.  AES uses the
+ * VAES or AES-NI instructions of x86-64 processors when available.
+ *
+ * Encrypted entries are recorded with method ZS_AES, an AES extra
+ * field (ZS_EXTRA_AES) holding the actual method, and no CRC-32, as
+ * specified for AE-2.  Names and sizes are not encrypted.  Seek points
+ * and concurrent submission do not apply to encrypted entries.  As
+ * AE-2 stores no fingerprint of the plaintext, encryption cannot be
+ * combined with content hashes, see zs_sethash().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setencryption ( ZIPstream *zstream, const char *password )
+{
+  ZIPmethod *method;
+
+  if ( ! zstream )
+    return -1;
+
+  if ( zstream->password )
+    {
+      memset (zstream->password, 0, strlen (zstream->password));
+      free (zstream->password);
+      zstream->password = NULL;
+    }
+
+  if ( ! password )
+    return 0;
+
+  if ( ! *password )
+    {
+      fprintf (stderr, "zs_setencryption: Password cannot be empty\n");
+      return -1;
+    }
+
+  if ( zstream->HashAlgorithm != ZS_HASH_NONE )
+    {
+      fprintf (stderr, "zs_setencryption: Encryption cannot be combined with content hashes\n");
+      return -1;
+    }
+
+  for ( method = zstream->firstMethod; method; method = method->next )
+    if ( method->ID == ZS_AES )
+      break;
+
+  if ( ! method &&
+       ! zs_registermethod2 (zstream, ZS_AES, ZS_METHOD_CRC,
+                             zs_aes_init, zs_aes_process, zs_aes_finish) )
+    return -1;
+
+  if ( method && method->process2 != zs_aes_process )
+    {
+      fprintf (stderr, "zs_setencryption: Method ID %d is registered for another method\n", ZS_AES);
+      return -1;
+    }
+
+  if ( ! (zstream->password = (char *) malloc (strlen (password) + 1)) )
+    {
+      fprintf (stderr, "zs_setencryption: Cannot allocate memory\n");
+      return -1;
+    }
+
+  strcpy (zstream->password, password);
+
+  return 0;
+}  /* End of zs_setencryption() */
+
+
+/***************************************************************************
+ * zs_setmemoryprofile:
+ *
+ * Set the memory profile of a stream: the deflate window bits (9-15)
+ * and memory level (1-9) used for entries begun after this call, and
+ * the size of the stream buffer (at least ZS_BUFFER_MINIMUM).  A value
+ * of 0 selects the default (MAX_WBITS, DEF_MEM_LEVEL and
+ * ZS_BUFFER_SIZE).  The ZS_LOWMEM_* values are a low-memory profile
+ * for many concurrent streams, using about 20 KiB of deflate state
+ * instead of about 256 KiB, at some cost in compression ratio.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setmemoryprofile ( ZIPstream *zstream, int windowBits, int memLevel,
+                      int32_t bufferSize )
+{
+  if ( ! zstream )
+    return -1;
+
+  if ( (windowBits && (windowBits < 9 || windowBits > MAX_WBITS)) ||
+       (memLevel && (memLevel < 1 || memLevel > MAX_MEM_LEVEL)) ||
+       (bufferSize && bufferSize < ZS_BUFFER_MINIMUM) )
+    {
+      fprintf (stderr, "zs_setmemoryprofile: Invalid profile, window bits %d, memory level %d, buffer size %d\n",
+               windowBits, memLevel, bufferSize);
+      return -1;
+    }
+
+  /* Return any buffer of the previous size */
+  zs_returnbuffer (zstream);
+
+  zstream->WindowBits = ( windowBits ) ? windowBits : MAX_WBITS;
+  zstream->MemLevel = ( memLevel ) ? memLevel : DEF_MEM_LEVEL;
+  zstream->BufferSize = ( bufferSize ) ? bufferSize : ZS_BUFFER_SIZE;
+
+  return 0;
+}  /* End of zs_setmemoryprofile() */
+
+
+/***************************************************************************
+ * zs_setmemorybudget:
+ *
+ * Set a process-wide budget, in bytes, for memory used by stream
+ * buffers and deflate state of all streams, 0 for no limit.  With a
+ * budget, stream buffers are borrowed from a shared pool only during
+ * calls, without one they are kept by a stream until its entry ends.  Each entry is charged its buffer
+ * and deflate state (per the memory profile) when begun and until
+ * ended.  When a charge would exceed the budget, idle pool buffers are
+ * released and then the calling thread waits until memory is returned
+ * by other streams, applying backpressure instead of exhausting memory.
+ *
+ * Waiting relies on other threads making progress, streams driven from
+ * a single thread should use a budget large enough for all of them.
+ * Not available when compiled with ZS_NOTHREADS.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setmemorybudget ( int64_t budget )
+{
+#ifndef ZS_NOTHREADS
+  if ( budget < 0 )
+    return -1;
+
+  pthread_mutex_lock (&zs_pool.lock);
+  zs_pool.budget = budget;
+  atomic_store (&zs_poolbudgeted, ( budget > 0 ) ? 1 : 0);
+  pthread_cond_broadcast (&zs_pool.cond);
+  pthread_mutex_unlock (&zs_pool.lock);
+
+  return 0;
+#else
+  (void)budget;
+
+  fprintf (stderr, "zs_setmemorybudget: Memory budget not supported without threads\n");
+
+  return -1;
+#endif
+}  /* End of zs_setmemorybudget() */
+
+
+/***************************************************************************
+ * zs_memoryused:
+ *
+ * Return the number of bytes currently charged to the global budget:
+ * stream buffers, including idle pool buffers, and the estimated
+ * deflate state of entries in progress.  Without threads memory is not
+ * accounted and 0 is returned.
+ *
+ * @return number of bytes allocated.
+ ***************************************************************************/
+int64_t
+zs_memoryused ( void )
+{
+  int64_t allocated;
+
+#ifndef ZS_NOTHREADS
+  pthread_mutex_lock (&zs_pool.lock);
+#endif
+  allocated = zs_pool.allocated;
+#ifndef ZS_NOTHREADS
+  pthread_mutex_unlock (&zs_pool.lock);
+#endif
+
+  return allocated;
+}  /* End of zs_memoryused() */
+
+
+/***************************************************************************
+ * zs_entryaddextra:
+ *
+ * Add an extra field, with specified ID and data, to the Central
+ * Directory Header of an entry.  Space for a ZIP64 extra field is
+ * reserved within the 65535 byte limit of all extra fields.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_entryaddextra ( ZIPentry *zentry, uint16_t id,
+                   const uint8_t *data, uint16_t length )
+{
+  uint8_t *extra;
+
+  if ( ! zentry || (! data && length) )
+    return -1;
+
+  if ( (int32_t)zentry->CentralExtraLength + 4 + length > 0xFFFF - 12 )
+    {
+      fprintf (stderr, "zs_entryaddextra(%s): Extra fields exceed maximum length\n",
+               zentry->Name);
+      return -1;
+    }
+
+  if ( ! (extra = (uint8_t *) realloc (zentry->CentralExtra,
+                                       zentry->CentralExtraLength + 4 + length)) )
+    {
+      fprintf (stderr, "zs_entryaddextra(%s): Cannot allocate memory\n", zentry->Name);
+      return -1;
+    }
+
+  zs_putunit16 (extra + zentry->CentralExtraLength, id);
+  zs_putunit16 (extra + zentry->CentralExtraLength + 2, length);
+  if ( length )
+    memcpy (extra + zentry->CentralExtraLength + 4, data, length);
+
+  zentry->CentralExtra = extra;
+  zentry->CentralExtraLength += 4 + length;
+
+  return 0;
+}  /* End of zs_entryaddextra() */
+
+
+/***************************************************************************
+ * zs_entryhash:
+ *
+ * Find the content hash of a completed entry in its Central Directory
+ * extra fields, see zs_sethash().  If specified, algorithm is set to
+ * the hash algorithm.
+ *
+ * @return pointer to digest or NULL if the entry has no known hash.
+ ***************************************************************************/
+const uint8_t *
+zs_entryhash ( ZIPentry *zentry, int *algorithm )
+{
+  uint32_t offset = 0;
+  uint16_t length;
+
+  if ( ! zentry )
+    return NULL;
+
+  while ( offset + 4 <= zentry->CentralExtraLength )
+    {
+      length = zs_getunit16 (zentry->CentralExtra + offset + 2);
+
+      if ( offset + 4 + length > zentry->CentralExtraLength )
+        break;
+
+      if ( zs_getunit16 (zentry->CentralExtra + offset) == ZS_EXTRA_HASH &&
+           length == 1 + ZS_SHA256_LENGTH &&
+           zentry->CentralExtra[offset + 4] == ZS_HASH_SHA256 )
+        {
+          if ( algorithm )
+            *algorithm = ZS_HASH_SHA256;
+
+          return zentry->CentralExtra + offset + 5;
+        }
+
+      offset += 4 + length;
+    }
+
+  return NULL;
+}  /* End of zs_entryhash() */
+
+
+/***************************************************************************
+ * zs_writeentry:
+ *
+ * Write ZIP archive entry contained in a memory buffer using the
+ * specified compression methodID.
+ *
+ * The methodID argument specifies the compression methodID to be used
+ * for this entry.  Included methods are:
+ *   Z_STORE   - no compression
+ *   Z_DEFLATE - deflate compression
+ *
+ * The entry modified time (modtime) is stored in UTC.
+ *
+ * If specified, writestatus will be set to the output of write() when
+ * a write error occurs, otherwise it will be set to 0.
+ *
+ * @return pointer to ZIPentry on success and NULL on error.
+ ***************************************************************************/
+ZIPentry *
+zs_writeentry ( ZIPstream *zstream, uint8_t *entry, int64_t entrySize,
+                char *name, time_t modtime, int methodID, int64_t *writestatus )
+{
+  ZIPentry *zentry = NULL;
+
+  if ( writestatus )
+    *writestatus = 0;
+
+  if ( ! zstream )
+    return NULL;
+
+  if ( entrySize > 0xFFFFFFFF )
+    {
+      fprintf (stderr, "zs_writeentry(%s): Individual entries cannot exceed %lld bytes\n",
+               (name) ? name : "", (long long) 0xFFFFFFFF);
+      return NULL;
+    }
+
+  /* Begin entry */
+  if ( ! (zentry = zs_entrybegin ( zstream, name, modtime, methodID, writestatus )) )
+    {
+      return NULL;
+    }
+
+  /* Process entry data and flush */
+  if ( ! zs_entrydata (zstream, zentry, entry, entrySize, writestatus) )
+    {
+      return NULL;
+    }
+
+  /* End entry */
+  if ( ! zs_entryend (zstream, zentry, writestatus) )
+    {
+      return NULL;
+    }
+
+  return zentry;
+}  /* End of zs_writeentry() */
+
+
+/***************************************************************************
+ * zs_entrybegin:
+ *
+ * Begin a streaming entry by writing a Local File Header to the
+ * output stream.  The modtime argument sets the modification time
+ * stamp for the entry.
+ *
+ * The methodID argument specifies the compression method to be used
+ * for this entry.  Included methods are:
+ *   Z_STORE   - no compression
+ *   Z_DEFLATE - deflate compression
+ *
+ * The entry modified time (modtime) is stored in UTC.
+ *
+ * If specified, writestatus will be set to the output of write() when
+ * a write error occurs, otherwise it will be set to 0.
+ *
+ * @return pointer to ZIPentry on success and NULL on error.
+ ***************************************************************************/
+ZIPentry *
+zs_entrybegin ( ZIPstream *zstream, char *name, time_t modtime, int methodID,
+                int64_t *writestatus )
+{
+  return zs_beginentry (zstream, name, modtime, methodID, 0, 0, 0, writestatus);
+}  /* End of zs_entrybegin() */
+
+
+/***************************************************************************
+ * zs_entrybeginraw:
+ *
+ * Begin a streaming entry of pre-encoded data, e.g. already deflated,
+ * with compression method methodID.  Data given to zs_entrydata() is
+ * written verbatim, the CRC-32 and uncompressed size of the original
+ * data must be specified.  Content hashes, flush policies and seek
+ * points are not applied.  The entry is otherwise like one begun with
+ * zs_entrybegin(), see zs_predictsize().
+ *
+ * If specified, writestatus will be set to the output of write() when
+ * a write error occurs, otherwise it will be set to 0.
+ *
+ * @return pointer to ZIPentry on success and NULL on error.
+ ***************************************************************************/
+ZIPentry *
+zs_entrybeginraw ( ZIPstream *zstream, char *name, time_t modtime, int methodID,
+                   uint32_t crc, uint64_t uncompressedSize, int64_t *writestatus )
+{
+  if ( uncompressedSize > 0xFFFFFFFF )
+    {
+      fprintf (stderr, "zs_entrybeginraw(%s): Individual entries cannot exceed %lld bytes\n",
+               ( name ) ? name : "", (long long) 0xFFFFFFFF);
+      return NULL;
+    }
+
+  return zs_beginentry (zstream, name, modtime, methodID, 1, crc,
+                        uncompressedSize, writestatus);
+}  /* End of zs_entrybeginraw() */
+
+
+/***************************************************************************
+ * zs_beginentry:
+ *
+ * Begin a streaming entry for zs_entrybegin() and zs_entrybeginraw().
+ * Pre-encoded (raw) entries are processed with the STORE method while
+ * recorded with methodID, crc and uncompressedSize.
+ *
+ * @return pointer to ZIPentry on success and NULL on error.
+ ***************************************************************************/
+static ZIPentry *
+zs_beginentry ( ZIPstream *zstream, char *name, time_t modtime, int methodID,
+                int8_t raw, uint32_t crc, uint64_t uncompressedSize,
+                int64_t *writestatus )
+{
+  ZIPentry *zentry;
+  ZIPmethod *method;
+  ZIPmethod *aesmethod = NULL;
+  uint8_t aesextra[7];
+  int64_t lwritestatus;
+  int32_t packed;
+  uint32_t u32;
+
+  if ( writestatus )
+    *writestatus = 0;
+
+  if ( ! zstream || ! name )
+    return NULL;
+
+  /* Adaptive compression has fallen back to STORE */
+  if ( ! raw && methodID == ZS_DEFLATE && zstream->AdaptiveMax > 0 && zstream->Level == 0 )
+    methodID = ZS_STORE;
+
+  /* Finish this part and start the next if a rotation threshold is reached */
+  if ( zstream->nextpart && zstream->EntryCount > 0 &&
+       ( (zstream->MaxPartSize > 0 && zstream->WriteOffset >= zstream->MaxPartSize) ||
+         (zstream->MaxPartEntries > 0 && zstream->EntryCount >= zstream->MaxPartEntries) ) )
+    {
+      if ( zs_rotate (zstream, writestatus) )
+        return NULL;
+    }
+
+  /* Search for method ID, pre-encoded data is stored */
+  method = zstream->firstMethod;
+  while ( method )
+    {
+      if ( method->ID == (( raw ) ? ZS_STORE : methodID) )
+        break;
+
+      method = method->next;
+    }
+
+  if ( ! method )
+    {
+      fprintf (stderr, "Cannot find method ID %d\n", methodID);
+      return NULL;
+    }
+
+  /* Encrypted entries are processed by the AES method wrapping the method */
+  if ( zstream->password )
+    {
+      for ( aesmethod = zstream->firstMethod; aesmethod; aesmethod = aesmethod->next )
+        if ( aesmethod->ID == ZS_AES )
+          break;
+
+      if ( ! aesmethod )
+        {
+          fprintf (stderr, "Cannot find method ID %d\n", ZS_AES);
+          return NULL;
+        }
+    }
+
+  /* Allocate and initialize new entry */
+  zentry = (ZIPentry *) calloc (1, sizeof(ZIPentry));
+  if ( zentry == NULL )
+    {
+      fprintf (stderr, "Cannot allocate memory for entry\n");
+      return NULL;
+    }
+
+  zentry->ZipVersion = 20;  /* Default version for extraction (2.0) */
+  zentry->GeneralFlag = 0;
+  u32 = zs_datetime_unixtodos (modtime);
+  zentry->CompressionMethod = methodID;
+  zentry->DOSDate = (uint16_t) (u32 >> 16);
+  zentry->DOSTime = (uint16_t) (u32 & 0xFFFF);
+  zentry->CRC32 = ( raw ) ? crc : crc32 (0L, Z_NULL, 0);
+  zentry->CompressedSize = 0;
+  zentry->UncompressedSize = ( raw ) ? uncompressedSize : 0;
+  zentry->LocalHeaderOffset = zstream->WriteOffset;
+  strncpy (zentry->Name, name, ZENTRY_NAME_LENGTH - 1);
+  zentry->NameLength = strlen (zentry->Name);
+  zentry->method = method;
+  zentry->methoddata = NULL;
+  zentry->raw = raw;
+  zentry->FlushInterval = ( raw ) ? 0 : zstream->FlushInterval;
+  zentry->FlushBytes = ( raw ) ? 0 : zstream->FlushBytes;
+  zentry->flushtime = ( zentry->FlushInterval > 0 ) ? zs_milliseconds () : 0;
+  zentry->SeekInterval = ( methodID == ZS_DEFLATE && ! raw ) ? zstream->SeekInterval : 0;
+
+  if ( ! raw && zstream->HashAlgorithm == ZS_HASH_SHA256 &&
+       ! (zentry->hashstate = zs_sha256_init ()) )
+    {
+      fprintf (stderr, "Cannot allocate memory for entry hash\n");
+      free (zentry);
+      return NULL;
+    }
+
+  /* WinZip AE-2: method 99, encrypted flag, no CRC and an extra field
+   * with version, vendor "AE", strength 3 (AES-256) and actual method */
+  if ( aesmethod )
+    {
+      zentry->ZipVersion = 51;
+      BIT_SET (zentry->GeneralFlag, 0);
+      zentry->CompressionMethod = ZS_AES;
+      zentry->CRC32 = 0;
+      zentry->method = aesmethod;
+      zentry->methoddata = method;  /* Wrapped method for zs_aes_init() */
+      zentry->SeekInterval = 0;
+
+      zs_putunit16 (aesextra, 2);
+      aesextra[2] = 'A';
+      aesextra[3] = 'E';
+      aesextra[4] = 3;
+      zs_putunit16 (aesextra + 5, methodID);
+
+      if ( zs_entryaddextra (zentry, ZS_EXTRA_AES, aesextra, sizeof(aesextra)) )
+        {
+          fprintf (stderr, "Cannot add AES extra field\n");
+          free (zentry->hashstate);
+          free (zentry);
+          return NULL;
+        }
+    }
+
+  /* Add new entry to stream list */
+  if ( ! zstream->FirstEntry )
+    {
+      zstream->FirstEntry = zentry;
+      zstream->LastEntry = zentry;
+    }
+  else
+    {
+      zstream->LastEntry->next = zentry;
+      zstream->LastEntry = zentry;
+    }
+
+  zstream->EntryCount++;
+
+  /* Set bit to denote streaming */
+  BIT_SET (zentry->GeneralFlag, 3);
+
+  /* Charge stream buffer and deflate state for the duration of the
+   * entry, waiting within the global memory budget */
+  zs_releasebuffer (zstream);
+  zs_memorycharge (&zstream->memorycharge, zstream->BufferSize +
+                   (( methodID == ZS_DEFLATE && ! raw ) ?
+                    (1 << (zstream->WindowBits + 2)) + (1 << (zstream->MemLevel + 9)) + 8192 : 0), 1);
+  zstream->entrycharged = 1;
+
+  /* Method initialization callback */
+  if ( zentry->method->init &&
+       zentry->method->init (zstream, zentry) )
+    {
+      fprintf (stderr, "Error with method (%d) init callback\n",
+               zentry->method->ID);
+      return NULL;
+    }
+
+  if ( zs_acquirebuffer (zstream) )
+    return NULL;
+
+  /* Write the Local File Header, with zero'd CRC and sizes (for streaming),
+   * and the AES extra field of encrypted entries */
+  packed = 0;
+  zs_packunit32 (zstream, &packed, LOCALHEADERSIG);              /* Data Description signature */
+  zs_packunit16 (zstream, &packed, zentry->ZipVersion);
+  zs_packunit16 (zstream, &packed, zentry->GeneralFlag);
+  zs_packunit16 (zstream, &packed, zentry->CompressionMethod);
+  zs_packunit16 (zstream, &packed, zentry->DOSTime);             /* DOS file modification time */
+  zs_packunit16 (zstream, &packed, zentry->DOSDate);             /* DOS file modification date */
+  zs_packunit32 (zstream, &packed, zentry->CRC32);               /* CRC-32 value of entry */
+  zs_packunit32 (zstream, &packed, zentry->CompressedSize);      /* Compressed entry size */
+  zs_packunit32 (zstream, &packed, zentry->UncompressedSize);    /* Uncompressed entry size */
+  zs_packunit16 (zstream, &packed, zentry->NameLength);          /* File/entry name length */
+  zs_packunit16 (zstream, &packed, ( aesmethod ) ?
+                 zentry->CentralExtraLength : 0);                /* Extra field length */
+  /* File/entry name */
+  memcpy (zstream->buffer+packed, zentry->Name, zentry->NameLength); packed += zentry->NameLength;
+
+  if ( aesmethod )
+    {
+      memcpy (zstream->buffer+packed, zentry->CentralExtra, zentry->CentralExtraLength);
+      packed += zentry->CentralExtraLength;
+    }
+
+  lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
+  if ( lwritestatus != packed )
+    {
+      fprintf (stderr, "Error writing ZIP local header: %s\n", strerror(errno));
+
+      if ( writestatus )
+        *writestatus = lwritestatus;
+
+      zs_releasebuffer (zstream);
+      return NULL;
+    }
+
+  zs_releasebuffer (zstream);
+
+  return zentry;
+}  /* End of zs_beginentry() */
+
+
+/***************************************************************************
+ * zs_entrydata:
+ *
+ * Write a chunk of entry data, of size entrySize, to the output
+ * stream according to the parameters already set for the stream and
+ * entry.
+ *
+ * When entry is NULL this signals a flush of any internal buffers.
+ * No further data is expected after this.
+ *
+ * When the entry flush policy is due, after FlushBytes of input or
+ * FlushInterval milliseconds since the last flush, the method is
+ * requested to flush (Z_SYNC_FLUSH for DEFLATE) so that all data is
+ * written to the output descriptor.
+ *
+ * If specified, writestatus will be set to the output of write() when
+ * a write error occurs, otherwise it will be set to 0.
+ *
+ * @return pointer to ZIPentry on success and NULL on error.
+ ***************************************************************************/
+ZIPentry *
+zs_entrydata ( ZIPstream *zstream, ZIPentry *zentry, uint8_t *entry,
+               int64_t entrySize, int64_t *writestatus )
+{
+  uint8_t *outputBuffer;
+  int64_t outputSize;
+  ZIPspan output;
+  int32_t rc = 0;
+  int64_t lwritestatus;
+  int64_t consumed = 0;
+  int64_t remaining = 0;
+  int8_t flushing = 0;
+  int flush = ZS_METHOD_FINISH;
+  int64_t chunk;
+  int64_t adaptstart = 0;
+  int64_t adaptwait = 0;
+
+  if ( writestatus )
+    *writestatus = 0;
+
+  if ( ! zstream || ! zentry )
+    return NULL;
+
+  /* Split input at flush policy, seek point and adaptive window byte boundaries */
+  if ( entry && (zentry->FlushBytes > 0 || zentry->SeekInterval > 0 ||
+                 zstream->AdaptiveMax > 0) &&
+       entrySize > zs_nextboundary (zstream, zentry) )
+    {
+      while ( entrySize > 0 )
+        {
+          chunk = zs_nextboundary (zstream, zentry);
+          if ( chunk > entrySize )
+            chunk = entrySize;
+
+          if ( ! zs_entrydata (zstream, zentry, entry, chunk, writestatus) )
+            return NULL;
+
+          entry += chunk;
+          entrySize -= chunk;
+        }
+
+      return zentry;
+    }
+
+  /* Processed data is written via the stream buffer without pipelined output or engine */
+  if ( ! zstream->pipeline && ! zstream->engine && zs_acquirebuffer (zstream) )
+    return NULL;
+
+  if ( zstream->AdaptiveMax > 0 )
+    {
+      adaptstart = zs_microseconds ();
+      adaptwait = zstream->adaptwait;
+    }
+
+  if ( entry )
+    {
+      /* Calculate, or continue calculation of, CRC32 and content hash */
+      if ( ! zentry->raw )
+        zs_checksum (zentry, entry, entrySize);
+
+      remaining = entrySize;
+
+      /* Request flush if policy is due */
+      if ( zentry->FlushBytes > 0 || zentry->FlushInterval > 0 )
+        {
+          zentry->flushinput += entrySize;
+
+          if ( (zentry->FlushBytes > 0 && zentry->flushinput >= zentry->FlushBytes) ||
+               (zentry->FlushInterval > 0 &&
+                (zs_milliseconds () - zentry->flushtime) >= zentry->FlushInterval) )
+            zentry->flushpending = ZS_FLUSH_SYNC;
+        }
+
+      /* Request full flush at seek points */
+      if ( zentry->SeekInterval > 0 && entrySize > 0 &&
+           (zentry->UncompressedSize + entrySize) % zentry->SeekInterval == 0 )
+        zentry->flushpending = ZS_FLUSH_FULL;
+
+      flushing = zentry->flushpending;
+      flush = flushing;
+    }
+
+  /* Call method callback for processing data until all input is consumed
+   * and any flush is complete, processed data is placed directly in the
+   * next output buffer or written from memory of the method */
+  while ( (outputBuffer = zs_outputbuffer (zstream, &outputSize)) )
+    {
+      rc = zs_methodprocess (zentry->method, zstream, zentry,
+                             entry, remaining, &consumed, flush,
+                             outputBuffer, outputSize, &output);
+      if ( rc < 0 )
+        break;
+
+      /* Write processed data to stream */
+      if ( output.size > 0 )
+        {
+          if ( output.data == outputBuffer )
+            lwritestatus = zs_outputcommit (zstream, outputBuffer, output.size);
+          else
+            lwritestatus = zs_writedata (zstream, (uint8_t *) output.data, output.size);
+
+          if ( lwritestatus != output.size )
+            {
+              fprintf (stderr, "zs_entrydata: Error writing ZIP entry data (%d): %s\n",
+                       zstream->fd, strerror(errno));
+
+              if ( writestatus )
+                *writestatus = lwritestatus;
+
+              zs_releasebuffer (zstream);
+              return NULL;
+            }
+
+          zentry->CompressedSize += output.size;
+        }
+
+      if ( entry )
+        {
+          entry += consumed;
+          remaining -= consumed;
+        }
+
+      if ( rc == 0 )
+        break;
+    }
+
+  if ( ! outputBuffer )
+    {
+      fprintf (stderr, "zs_entrydata: Error writing ZIP entry data (%d): %s\n",
+               zstream->fd, strerror(errno));
+
+      if ( writestatus )
+        *writestatus = -1;
+
+      zs_releasebuffer (zstream);
+      return NULL;
+    }
+
+  if ( rc < 0 )
+    {
+      fprintf (stderr, "zs_entrydata: Process callback failed\n");
+      zs_releasebuffer (zstream);
+      return NULL;
+    }
+
+  if ( entry && ! zentry->raw )
+    {
+      zentry->UncompressedSize += entrySize;
+    }
+
+  /* Account processing time, excluding waiting for output, and adapt level */
+  if ( entry && zstream->AdaptiveMax > 0 )
+    {
+      zstream->adaptbusy += zs_microseconds () - adaptstart -
+        (zstream->adaptwait - adaptwait);
+      zstream->adaptinput += entrySize;
+
+      if ( zstream->adaptinput >= ZS_ADAPT_WINDOW )
+        zs_adapt (zstream);
+    }
+
+  /* Complete flush, methods that do not buffer data ignore the request,
+   * and push any pipelined output to the writer thread */
+  if ( entry && flushing )
+    {
+      zentry->flushpending = 0;
+      zentry->flushinput = 0;
+      zentry->flushtime = ( zentry->FlushInterval > 0 ) ? zs_milliseconds () : 0;
+      zentry->FlushCount++;
+      zstream->FlushCount++;
+
+      if ( flushing == ZS_FLUSH_FULL && zs_addseekpoint (zentry) )
+        {
+          zs_releasebuffer (zstream);
+          return NULL;
+        }
+
+      zs_outputflush (zstream);
+    }
+
+  zs_releasebuffer (zstream);
+
+  return zentry;
+}  /* End of zs_entrydata() */
+
+
+/***************************************************************************
+ * zs_entryflush:
+ *
+ * Flush a streaming entry, as done by the flush policy, so that all
+ * data given to zs_entrydata() so far is written to the output
+ * descriptor.  For DEFLATE this is a Z_SYNC_FLUSH and more entry data
+ * may follow.  Intended for callers that flush on their own schedule,
+ * e.g. from a timer while no new data is available.
+ *
+ * If specified, writestatus will be set to the output of write() when
+ * a write error occurs, otherwise it will be set to 0.
+ *
+ * @return pointer to ZIPentry on success and NULL on error.
+ ***************************************************************************/
+ZIPentry *
+zs_entryflush ( ZIPstream *zstream, ZIPentry *zentry, int64_t *writestatus )
+{
+  static uint8_t empty[1];
+
+  if ( ! zstream || ! zentry )
+    return NULL;
+
+  zentry->flushpending = ZS_FLUSH_SYNC;
+
+  return zs_entrydata (zstream, zentry, empty, 0, writestatus);
+}  /* End of zs_entryflush() */
+
+
+/***************************************************************************
+ * zs_entryend:
+ *
+ * End a streaming entry by writing a Data Description record to
+ * output stream.
+ *
+ * If specified, writestatus will be set to the output of write() when
+ * a write error occurs, otherwise it will be set to 0.
+ *
+ * @return pointer to ZIPentry on success and NULL on error.
+ ***************************************************************************/
+ZIPentry *
+zs_entryend ( ZIPstream *zstream, ZIPentry *zentry, int64_t *writestatus)
+{
+  int64_t lwritestatus;
+  int32_t packed;
+  int32_t idx;
+
+  if ( writestatus )
+    *writestatus = 0;
+
+  if ( ! zstream || ! zentry )
+    return NULL;
+
+  /* Flush the entry */
+  if ( ! zs_entrydata (zstream, zentry, NULL, 0, &lwritestatus) )
+    {
+      fprintf (stderr, "Error flushing entry (writestatus: %lld)\n",
+               (long long int)lwritestatus);
+
+      if ( writestatus )
+        *writestatus = lwritestatus;
+
+      return NULL;
+    }
+
+  /* Method finish callback */
+  if ( zentry->method->finish &&
+       zentry->method->finish (zstream, zentry) )
+    {
+      fprintf (stderr, "Error with method (%d) finish callback\n",
+               zentry->method->ID);
+      return NULL;
+    }
+
+  /* Add content hash to Central Directory extra fields */
+  if ( zentry->hashstate && zs_hashfinish (zentry) )
+    return NULL;
+
+  /* Add seek index to Central Directory extra fields, converting
+   * offsets to little-endian order in place */
+  if ( zentry->seekcount > 0 )
+    {
+      for ( idx = 0; idx < zentry->seekcount * 2; idx++ )
+        zs_putunit64 ((uint8_t *)(zentry->seekpoints + idx), zentry->seekpoints[idx]);
+
+      if ( zs_entryaddextra (zentry, ZS_EXTRA_SEEKINDEX, (uint8_t *)zentry->seekpoints,
+                             zentry->seekcount * 16) )
+        {
+          fprintf (stderr, "Cannot add seek index for %s\n", zentry->Name);
+          return NULL;
+        }
+
+      free (zentry->seekpoints);
+      zentry->seekpoints = NULL;
+      zentry->seekcount = 0;
+    }
+
+  if ( zs_acquirebuffer (zstream) )
+    return NULL;
+
+  /* Write Data Description */
+  packed = 0;
+  zs_packunit32 (zstream, &packed, DATADESCRIPTIONSIG);       /* Data Description signature */
+  zs_packunit32 (zstream, &packed, zentry->CRC32);            /* CRC-32 value of entry */
+  zs_packunit32 (zstream, &packed, zentry->CompressedSize);   /* Compressed entry size */
+  zs_packunit32 (zstream, &packed, zentry->UncompressedSize); /* Uncompressed entry size */
+
+  lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
+  if ( lwritestatus != packed )
+    {
+      fprintf (stderr, "Error writing streaming ZIP data description: %s\n", strerror(errno));
+
+      if ( writestatus )
+        *writestatus = lwritestatus;
+
+      zs_releasebuffer (zstream);
+      return NULL;
+    }
+
+  /* Return buffer and charge of the entry */
+  zstream->entrycharged = 0;
+  zs_releasebuffer (zstream);
+
+  /* Write checkpoint when due at this entry boundary */
+  if ( zs_checkpointdue (zstream) )
+    return NULL;
+
+  return zentry;
+}  /* End of zs_entryend() */
+
+/***************************************************************************
+ * zs_setconcurrent:
+ *
+ * Enable concurrent submission of entries from multiple threads with
+ * zs_submitbegin(), zs_submitdata() and zs_submitend(), or
+ * zs_submitentry().  Each submitting thread compresses its entry
+ * privately into memory, completed entries are handed through a
+ * lock-free queue to a single writer thread that writes them, in
+ * completion order, with sizes and CRC in the Local Header.
+ *
+ * While enabled, entries must not be added with zs_entrybegin() or
+ * zs_writeentry().  zs_finish() waits for all submitted entries to be
+ * written and stops the writer thread.  Flush policies and seek points
+ * do not apply to submitted entries.
+ *
+ * Each submission holds all of its compressed data in memory until
+ * written, entries are limited to 0xFFFFFFFF bytes and larger ones
+ * are rejected by zs_submitdata().  Submission data is charged to the
+ * global budget of zs_setmemorybudget(): the first buffer of a
+ * submission waits for memory returned by written entries, applying
+ * backpressure to producers, later growth of an entry in progress is
+ * charged without waiting and may exceed the budget.  Submitted memory
+ * is therefore bounded by the budget plus the entries in progress, a
+ * thread should not begin a submission while holding another.
+ *
+ * Not available when compiled with ZS_NOTHREADS.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_setconcurrent ( ZIPstream *zstream )
+{
+#ifndef ZS_NOTHREADS
+  ZSconcurrent *concurrent;
+  int rv;
+
+  if ( ! zstream || zstream->concurrent )
+    return -1;
+
+  if ( ! (concurrent = (ZSconcurrent *) calloc (1, sizeof(ZSconcurrent))) )
+    {
+      fprintf (stderr, "zs_setconcurrent: Cannot allocate memory\n");
+      return -1;
+    }
+
+  atomic_store (&concurrent->stub.next, NULL);
+  atomic_store (&concurrent->head, &concurrent->stub);
+  concurrent->tail = &concurrent->stub;
+  pthread_mutex_init (&concurrent->lock, NULL);
+  pthread_cond_init (&concurrent->cond, NULL);
+  zstream->concurrent = concurrent;
+
+  if ( (rv = pthread_create (&concurrent->thread, NULL, zs_concurrentwriter, zstream)) )
+    {
+      fprintf (stderr, "zs_setconcurrent: Cannot create writer thread: %s\n", strerror(rv));
+      pthread_cond_destroy (&concurrent->cond);
+      pthread_mutex_destroy (&concurrent->lock);
+      free (concurrent);
+      zstream->concurrent = NULL;
+      return -1;
+    }
+
+  return 0;
+#else
+  (void)zstream;
+
+  fprintf (stderr, "zs_setconcurrent: Concurrent submission not supported without threads\n");
+
+  return -1;
+#endif
+}  /* End of zs_setconcurrent() */
+
+
+/***************************************************************************
+ * zs_submitbegin:
+ *
+ * Begin an entry to be submitted concurrently, see zs_setconcurrent().
+ * May be called by any thread, the returned submission must only be
+ * used by one thread at a time.
+ *
+ * @return pointer to ZIPsubmission on success and NULL on error.
+ ***************************************************************************/
+ZIPsubmission *
+zs_submitbegin ( ZIPstream *zstream, char *name, time_t modtime, int methodID )
+{
+  ZIPsubmission *submission;
+  ZIPentry *zentry;
+  ZIPmethod *method;
+  uint32_t u32;
+
+  if ( ! zstream || ! name )
+    return NULL;
+
+  if ( ! zstream->concurrent )
+    {
+      fprintf (stderr, "zs_submitbegin: Concurrent submission is not enabled\n");
+      return NULL;
+    }
+
+  if ( zstream->password )
+    {
+      fprintf (stderr, "zs_submitbegin: Encrypted entries cannot be submitted concurrently\n");
+      return NULL;
+    }
+
+  /* Search for method ID */
+  for ( method = zstream->firstMethod; method; method = method->next )
+    if ( method->ID == methodID )
+      break;
+
+  if ( ! method )
+    {
+      fprintf (stderr, "Cannot find method ID %d\n", methodID);
+      return NULL;
+    }
+
+  if ( ! (submission = (ZIPsubmission *) calloc (1, sizeof(ZIPsubmission))) ||
+       ! (zentry = (ZIPentry *) calloc (1, sizeof(ZIPentry))) )
+    {
+      fprintf (stderr, "Cannot allocate memory for submission\n");
+      free (submission);
+      return NULL;
+    }
+
+  submission->zstream = zstream;
+  submission->zentry = zentry;
+
+  /* Sizes and CRC are known when written, no streaming bit */
+  zentry->ZipVersion = 20;  /* Default version for extraction (2.0) */
+  zentry->GeneralFlag = 0;
+  u32 = zs_datetime_unixtodos (modtime);
+  zentry->CompressionMethod = methodID;
+  zentry->DOSDate = (uint16_t) (u32 >> 16);
+  zentry->DOSTime = (uint16_t) (u32 & 0xFFFF);
+  zentry->CRC32 = crc32 (0L, Z_NULL, 0);
+  strncpy (zentry->Name, name, ZENTRY_NAME_LENGTH - 1);
+  zentry->NameLength = strlen (zentry->Name);
+  zentry->method = method;
+
+  if ( zstream->HashAlgorithm == ZS_HASH_SHA256 &&
+       ! (zentry->hashstate = zs_sha256_init ()) )
+    {
+      fprintf (stderr, "Cannot allocate memory for entry hash\n");
+      zs_freesubmission (submission);
+      return NULL;
+    }
+
+  /* Method initialization callback */
+  if ( zentry->method->init &&
+       zentry->method->init (zstream, zentry) )
+    {
+      fprintf (stderr, "Error with method (%d) init callback\n",
+               zentry->method->ID);
+      zentry->methoddata = NULL;
+      zs_freesubmission (submission);
+      return NULL;
+    }
+
+  return submission;
+}  /* End of zs_submitbegin() */
+
+
+/***************************************************************************
+ * zs_submitprocess:
+ *
+ * Process data of a submission with the entry method, appending
+ * output to the submission data.  When entry is NULL the method is
+ * flushed.  Growth of the data buffer is charged to the memory budget,
+ * waiting only for the first charge of a submission, and compressed
+ * data beyond 0xFFFFFFFF bytes is an error.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_submitprocess ( ZIPsubmission *submission, uint8_t *entry, int64_t entrySize )
+{
+  ZIPentry *zentry = submission->zentry;
+  uint8_t *data;
+  int64_t allocated;
+  int64_t consumed = 0;
+  int64_t remaining = entrySize;
+  ZIPspan output;
+  int32_t rc;
+
+  while ( 1 )
+    {
+      /* Grow data buffer, doubling, to have space for output */
+      if ( submission->allocated - submission->size < ZS_SUBMIT_CHUNK )
+        {
+          allocated = ( submission->allocated ) ? submission->allocated * 2 : ZS_SUBMIT_CHUNK * 4;
+
+          if ( allocated > ZS_SUBMIT_MAXIMUM )
+            allocated = ZS_SUBMIT_MAXIMUM;
+
+          zs_memorycharge (&submission->memorycharge, allocated - submission->allocated,
+                           ( submission->memorycharge == 0 ));
+
+          if ( ! (data = (uint8_t *) realloc (submission->data, allocated)) )
+            {
+              fprintf (stderr, "zs_submitprocess(%s): Cannot allocate memory\n", zentry->Name);
+              return -1;
+            }
+
+          submission->data = data;
+          submission->allocated = allocated;
+        }
+
+      rc = zs_methodprocess (zentry->method, submission->zstream, zentry,
+                             entry, remaining, &consumed,
+                             ( entry ) ? ZS_METHOD_NOFLUSH : ZS_METHOD_FINISH,
+                             submission->data + submission->size,
+                             submission->allocated - submission->size, &output);
+      if ( rc < 0 )
+        {
+          fprintf (stderr, "zs_submitprocess(%s): Process callback failed\n", zentry->Name);
+          return -1;
+        }
+
+      /* Append output in memory of the method, growing data to fit */
+      if ( submission->size + output.size > 0xFFFFFFFF )
+        {
+          fprintf (stderr, "zs_submitprocess(%s): Individual entries cannot exceed %lld bytes\n",
+                   zentry->Name, (long long) 0xFFFFFFFF);
+          return -1;
+        }
+
+      if ( output.size > 0 && output.data != submission->data + submission->size )
+        {
+          for ( allocated = submission->allocated;
+                allocated - submission->size < output.size; allocated *= 2 );
+
+          if ( allocated > ZS_SUBMIT_MAXIMUM )
+            allocated = ZS_SUBMIT_MAXIMUM;
+
+          if ( allocated > submission->allocated )
+            {
+              zs_memorycharge (&submission->memorycharge, allocated - submission->allocated,
+                               ( submission->memorycharge == 0 ));
+
+              if ( ! (data = (uint8_t *) realloc (submission->data, allocated)) )
+                {
+                  fprintf (stderr, "zs_submitprocess(%s): Cannot allocate memory\n", zentry->Name);
+                  return -1;
+                }
+
+              submission->data = data;
+              submission->allocated = allocated;
+            }
+
+          memcpy (submission->data + submission->size, output.data, output.size);
+        }
+
+      submission->size += output.size;
+      zentry->CompressedSize += output.size;
+
+      if ( entry )
+        {
+          entry += consumed;
+          remaining -= consumed;
+        }
+
+      if ( rc == 0 )
+        break;
+    }
+
+  return 0;
+}  /* End of zs_submitprocess() */
+
+
+/***************************************************************************
+ * zs_submitdata:
+ *
+ * Compress a chunk of entry data, of size entrySize, into the private
+ * data of a submission.  Entries are limited to 0xFFFFFFFF bytes,
+ * uncompressed and compressed.  On error the submission is freed.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_submitdata ( ZIPsubmission *submission, uint8_t *entry, int64_t entrySize )
+{
+  ZIPentry *zentry;
+
+  if ( ! submission || ! entry || entrySize < 0 )
+    return -1;
+
+  zentry = submission->zentry;
+
+  if ( zentry->UncompressedSize + entrySize > 0xFFFFFFFF )
+    {
+      fprintf (stderr, "zs_submitdata(%s): Individual entries cannot exceed %lld bytes\n",
+               zentry->Name, (long long) 0xFFFFFFFF);
+      zs_freesubmission (submission);
+      return -1;
+    }
+
+  /* Calculate, or continue calculation of, CRC32 and content hash */
+  zs_checksum (zentry, entry, entrySize);
+
+  if ( zs_submitprocess (submission, entry, entrySize) )
+    {
+      zs_freesubmission (submission);
+      return -1;
+    }
+
+  zentry->UncompressedSize += entrySize;
+
+  return 0;
+}  /* End of zs_submitdata() */
+
+
+/***************************************************************************
+ * zs_submitend:
+ *
+ * Complete compression of a submission and queue it for writing.  The
+ * submission is owned by the writer thread after this call, and freed
+ * on error.  An error of the writer thread is reported by subsequent
+ * calls and by zs_finish().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_submitend ( ZIPsubmission *submission )
+{
+#ifndef ZS_NOTHREADS
+  ZSconcurrent *concurrent;
+  ZIPentry *zentry;
+
+  if ( ! submission )
+    return -1;
+
+  zentry = submission->zentry;
+  concurrent = submission->zstream->concurrent;
+
+  /* Flush the entry */
+  if ( zs_submitprocess (submission, NULL, 0) )
+    {
+      zs_freesubmission (submission);
+      return -1;
+    }
+
+  /* Method finish callback */
+  if ( zentry->method->finish &&
+       zentry->method->finish (submission->zstream, zentry) )
+    {
+      fprintf (stderr, "Error with method (%d) finish callback\n",
+               zentry->method->ID);
+      zentry->methoddata = NULL;
+      zs_freesubmission (submission);
+      return -1;
+    }
+  zentry->methoddata = NULL;
+
+  if ( zentry->hashstate && zs_hashfinish (zentry) )
+    {
+      zs_freesubmission (submission);
+      return -1;
+    }
+
+  if ( atomic_load (&concurrent->failed) )
+    {
+      fprintf (stderr, "zs_submitend(%s): Writer thread failed\n", zentry->Name);
+      zs_freesubmission (submission);
+      return -1;
+    }
+
+  /* Queue for writer thread, waking it if waiting */
+  atomic_fetch_add (&concurrent->pending, 1);
+  zs_concurrentpush (concurrent, submission);
+
+  if ( atomic_load (&concurrent->consumerWaiting) )
+    {
+      pthread_mutex_lock (&concurrent->lock);
+      pthread_cond_broadcast (&concurrent->cond);
+      pthread_mutex_unlock (&concurrent->lock);
+    }
+
+  return 0;
+#else
+  zs_freesubmission (submission);
+
+  return -1;
+#endif
+}  /* End of zs_submitend() */
+
+
+/***************************************************************************
+ * zs_submitentry:
+ *
+ * Submit a complete entry concurrently, see zs_setconcurrent().
+ * Equivalent to zs_submitbegin(), zs_submitdata() and zs_submitend().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_submitentry ( ZIPstream *zstream, uint8_t *entry, int64_t entrySize,
+                 char *name, time_t modtime, int methodID )
+{
+  ZIPsubmission *submission;
+
+  if ( ! (submission = zs_submitbegin (zstream, name, modtime, methodID)) )
+    return -1;
+
+  if ( entry && zs_submitdata (submission, entry, entrySize) )
+    return -1;
+
+  return zs_submitend (submission);
+}  /* End of zs_submitentry() */
+
+
+/***************************************************************************
+ * zs_mergearchive:
+ *
+ * Add all entries of an existing archive, in a seekable input file
+ * descriptor, to the output stream without recompression.  The Local
+ * File Header, data and Data Description of each entry are copied
+ * verbatim and entries are added to the ZIPstream with their Local
+ * Header offsets rebased to the output stream.  Any data preceding the
+ * first entry of the input archive is not copied.
+ *
+ * On Linux, copy_file_range() or sendfile() are used to copy data
+ * within the kernel when possible, otherwise data is copied through
+ * the ZIPstream buffer.
+ *
+ * If specified, writestatus will be set to the output of write() when
+ * a write error occurs, otherwise it will be set to 0.
+ *
+ * @return number of entries added on success and -1 on error.
+ ***************************************************************************/
+int32_t
+zs_mergearchive ( ZIPstream *zstream, int fd, int64_t *writestatus )
+{
+  ZIPentry *lastEntry;
+  ZIPentry *zentry;
+  ZIPentry **sorted = NULL;
+  int32_t entryCount;
+  int32_t count;
+  int32_t idx;
+  int64_t cdoffset;
+  int64_t lwritestatus;
+  uint64_t start;
+  uint64_t end;
+
+  if ( writestatus )
+    *writestatus = 0;
+
+  if ( ! zstream )
+    return -1;
+
+  lastEntry = zstream->LastEntry;
+  entryCount = zstream->EntryCount;
+
+  /* Read input Central Directory, appending entries to the stream list */
+  if ( zs_readdirectory (fd, zstream, &cdoffset) )
+    {
+      zs_truncateentries (zstream, lastEntry, entryCount);
+      return -1;
+    }
+
+  count = zstream->EntryCount - entryCount;
+
+  if ( count == 0 )
+    return 0;
+
+  if ( ! (sorted = (ZIPentry **) malloc (count * sizeof(ZIPentry *))) )
+    {
+      fprintf (stderr, "zs_mergearchive: Cannot allocate memory\n");
+      zs_truncateentries (zstream, lastEntry, entryCount);
+      return -1;
+    }
+
+  zentry = ( lastEntry ) ? lastEntry->next : zstream->FirstEntry;
+  for ( idx = 0; zentry; zentry = zentry->next )
+    sorted[idx++] = zentry;
+
+  /* Entries are copied in archive order, which is usually directory order */
+  qsort (sorted, count, sizeof(ZIPentry *), zs_entryoffsetcmp);
+
+  for ( idx = 0; idx < count; idx++ )
+    {
+      /* Each entry extends to the next entry or the Central Directory */
+      start = sorted[idx]->LocalHeaderOffset;
+      end = ( idx+1 < count ) ? sorted[idx+1]->LocalHeaderOffset : (uint64_t)cdoffset;
+
+      if ( end < start + 30 + sorted[idx]->NameLength + sorted[idx]->CompressedSize )
+        {
+          fprintf (stderr, "zs_mergearchive(%s): Entry overlaps following data\n",
+                   sorted[idx]->Name);
+          zs_truncateentries (zstream, lastEntry, entryCount);
+          zs_releasebuffer (zstream);
+          free (sorted);
+          return -1;
+        }
+
+      sorted[idx]->LocalHeaderOffset = zstream->WriteOffset;
+
+      lwritestatus = zs_copydata (zstream, fd, start, end - start);
+      if ( lwritestatus != (int64_t)(end - start) )
+        {
+          fprintf (stderr, "zs_mergearchive(%s): Error copying entry: %s\n",
+                   sorted[idx]->Name, strerror(errno));
+
+          if ( writestatus )
+            *writestatus = lwritestatus;
+
+          zs_truncateentries (zstream, lastEntry, entryCount);
+          free (sorted);
+          return -1;
+        }
+    }
+
+  free (sorted);
+  zs_releasebuffer (zstream);
+
+  /* Write checkpoint when due after the merged entries */
+  if ( zs_checkpointdue (zstream) )
+    return -1;
+
+  return count;
+}  /* End of zs_mergearchive() */
+
+
+/***************************************************************************
+ * zs_predictsize:
+ *
+ * Predict the exact size of the archive, as written by zs_finish(),
+ * if the planned entries are added next with zs_entrybegin() (for
+ * ZS_STORE) or zs_entrybeginraw() (for pre-encoded data of any other
+ * method) and no others.  Entries already in the stream, including
+ * those of an archive being appended to, and content hash extra fields
+ * are accounted for.  Each entry adds a Local File Header, its data and
+ * a Data Description, and a Central Directory Header with a ZIP64 extra
+ * field when its offset is beyond 4 GiB; ZIP64 end records are added
+ * when the Central Directory starts beyond 4 GiB, is 4 GiB or larger
+ * or has 65535 or more entries.  With encryption
+ * each entry adds AES extra fields, salt, verifier and authentication
+ * code.
+ *
+ * Prediction is not possible with rotation, concurrent submission, a
+ * hash manifest or entries larger than 4 GiB.
+ *
+ * @return predicted size in bytes on success and -1 on error.
+ ***************************************************************************/
+int64_t
+zs_predictsize ( ZIPstream *zstream, const ZIPplanentry *entries, int32_t count )
+{
+  ZIPentry *zentry;
+  uint64_t offset;
+  uint64_t cdsize = 0;
+  size_t nameLength;
+  int32_t idx;
+
+  if ( ! zstream || count < 0 || (count > 0 && ! entries) )
+    return -1;
+
+  if ( zstream->nextpart || zstream->concurrent || zstream->HashManifest )
+    {
+      fprintf (stderr, "zs_predictsize: Size cannot be predicted with rotation, "
+               "concurrent submission or a hash manifest\n");
+      return -1;
+    }
+
+  /* Central Directory Headers of existing entries */
+  for ( zentry = zstream->FirstEntry; zentry; zentry = zentry->next )
+    cdsize += 46 + zentry->NameLength + zentry->CentralExtraLength +
+      (( zentry->LocalHeaderOffset > 0xFFFFFFFF ) ? 12 : 0);
+
+  offset = zstream->WriteOffset;
+
+  for ( idx = 0; idx < count; idx++ )
+    {
+      if ( ! entries[idx].Name || entries[idx].Size > 0xFFFFFFFF )
+        {
+          fprintf (stderr, "zs_predictsize: Invalid planned entry %d\n", idx);
+          return -1;
+        }
+
+      /* Names are truncated as by zs_entrybegin() */
+      nameLength = strlen (entries[idx].Name);
+      if ( nameLength > ZENTRY_NAME_LENGTH - 1 )
+        nameLength = ZENTRY_NAME_LENGTH - 1;
+
+      cdsize += 46 + nameLength + (( offset > 0xFFFFFFFF ) ? 12 : 0) +
+        (( entries[idx].MethodID == ZS_STORE && zstream->HashAlgorithm == ZS_HASH_SHA256 ) ?
+         4 + 1 + ZS_SHA256_LENGTH : 0) +
+        (( zstream->password ) ? 4 + 7 : 0);
+
+      /* Local File Header, data and Data Description */
+      offset += 30 + nameLength + entries[idx].Size + 16 +
+        (( zstream->password ) ?
+         4 + 7 + ZS_AES_SALT_LENGTH + 2 + ZS_AES_MAC_LENGTH : 0);
+    }
+
+  /* ZIP64 End of Central Directory Record and Locator, as by zs_finish() */
+  if ( offset > 0xFFFFFFFF || cdsize >= 0xFFFFFFFF ||
+       (int64_t) zstream->EntryCount + count >= 0xFFFF )
+    cdsize += 56 + 20;
+
+  /* End of Central Directory Record */
+  return (int64_t)(offset + cdsize + 22);
+}  /* End of zs_predictsize() */
+
+
+/***************************************************************************
+ * zs_writerange:
+ *
+ * Deterministically generate the archive of planned entries, in plan
+ * order with the planned modification times, and write only the byte
+ * range starting at offset of length bytes (0 for the rest of the
+ * archive) to the output descriptor, e.g. to serve an HTTP Range
+ * request or resume a download.  The bytes are identical to those of
+ * the same range of the complete archive, whose size is returned by
+ * zs_predictsize() for the same plan.
+ *
+ * All entries are written as pre-encoded data (see zs_entrybeginraw())
+ * with the planned CRC32 and, for methods other than ZS_STORE,
+ * UncompressedSize.  Entry data is only read, with the readentry
+ * callback, for the part of an entry within the range.  The callback
+ * must fill the buffer with length bytes of entry index starting at
+ * offset within the (encoded) entry data and return the number of
+ * bytes, or a negative value on error.  Cost is proportional to the
+ * range and the number of entries, not to the offset.
+ *
+ * The stream must be newly initialized and without pipelined output,
+ * output engine, rotation, concurrent submission, content hashes or
+ * encryption.  The archive is finished by this call.
+ *
+ * If specified, writestatus will be set to the output of write() when
+ * a write error occurs, otherwise it will be set to 0.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_writerange ( ZIPstream *zstream, const ZIPplanentry *entries, int32_t count,
+                uint64_t offset, uint64_t length,
+                int64_t (*readentry)( int32_t index, uint64_t offset,
+                                      uint8_t *buffer, int64_t length,
+                                      void *userdata ),
+                void *userdata, int64_t *writestatus )
+{
+  ZIPentry *zentry;
+  uint8_t *buffer;
+  uint64_t dataOffset;
+  uint64_t from;
+  uint64_t to;
+  int64_t chunk;
+  int rv = -1;
+  int32_t idx;
+
+  if ( writestatus )
+    *writestatus = 0;
+
+  if ( ! zstream || count < 0 || (count > 0 && (! entries || ! readentry)) ||
+       offset > INT64_MAX || length > INT64_MAX - offset )
+    return -1;
+
+  if ( zstream->EntryCount || zstream->WriteOffset || zstream->pipeline ||
+       zstream->engine || zstream->nextpart || zstream->concurrent ||
+       zstream->HashAlgorithm || zstream->HashManifest || zstream->password ||
+       zstream->fanout || zstream->ChunkSize )
+    {
+      fprintf (stderr, "zs_writerange: Stream must be new, without pipelined output, output "
+               "engine, rotation, concurrent submission, content hashes, encryption, "
+               "additional outputs or chunked output\n");
+      return -1;
+    }
+
+  if ( ! (buffer = (uint8_t *) malloc (ZS_BUFFER_SIZE)) )
+    {
+      fprintf (stderr, "zs_writerange: Cannot allocate memory\n");
+      return -1;
+    }
+
+  /* Set output window, all output outside it is discarded */
+  zstream->rangestart = offset;
+  zstream->rangeend = ( length ) ? (int64_t)(offset + length) : INT64_MAX;
+
+  for ( idx = 0; idx < count; idx++ )
+    {
+      if ( ! (zentry = zs_entrybeginraw (zstream, (char *)entries[idx].Name,
+                                         entries[idx].ModTime, entries[idx].MethodID,
+                                         entries[idx].CRC32,
+                                         ( entries[idx].MethodID == ZS_STORE ) ?
+                                         entries[idx].Size : entries[idx].UncompressedSize,
+                                         writestatus)) )
+        break;
+
+      /* Part of entry data within the window */
+      dataOffset = zstream->WriteOffset;
+      from = ( offset > dataOffset ) ? offset - dataOffset : 0;
+      to = (uint64_t)zstream->rangeend - dataOffset;
+      if ( from > entries[idx].Size )
+        from = entries[idx].Size;
+      if ( (uint64_t)zstream->rangeend < dataOffset || to < from )
+        to = from;
+      if ( to > entries[idx].Size )
+        to = entries[idx].Size;
+
+      /* Skip data before the window, read and write data within it and
+       * skip data after it */
+      zentry->CompressedSize += from;
+      zstream->WriteOffset += from;
+
+      while ( from < to )
+        {
+          chunk = ( to - from > ZS_BUFFER_SIZE ) ? ZS_BUFFER_SIZE : (int64_t)(to - from);
+
+          if ( readentry (idx, from, buffer, chunk, userdata) != chunk )
+            {
+              fprintf (stderr, "zs_writerange: Cannot read data of %s\n", zentry->Name);
+              break;
+            }
+
+          if ( ! zs_entrydata (zstream, zentry, buffer, chunk, writestatus) )
+            break;
+
+          from += chunk;
+        }
+
+      if ( from < to )
+        break;
+
+      zentry->CompressedSize += entries[idx].Size - to;
+      zstream->WriteOffset += entries[idx].Size - to;
+
+      if ( ! zs_entryend (zstream, zentry, writestatus) )
+        break;
+    }
+
+  if ( idx == count && zs_finish (zstream, writestatus) == 0 )
+    rv = 0;
+
+  zstream->rangestart = 0;
+  zstream->rangeend = 0;
+  free (buffer);
+
+  return rv;
+}  /* End of zs_writerange() */
+
+
+/***************************************************************************
+ * zs_finish:
+ *
+ * Write end of ZIP archive structures (Central Directory, etc.).
+ *
+ * ZIP64 structures will be added to the Central Directory when the
+ * total length of the archive exceeds 0xFFFFFFFF bytes.
+ *
+ * If specified, writestatus will be set to the output of write() when
+ * a write error occurs, otherwise it will be set to 0.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+int
+zs_finish ( ZIPstream *zstream, int64_t *writestatus )
+{
+  ZIPentry *zentry;
+  ZIPpart *part;
+  int64_t lwritestatus;
+  int packed;
+
+  uint64_t cdsize;
+  uint64_t zip64endrecord;
+  int zip64 = 0;
+  int zip64end;
+
+  if ( writestatus )
+    *writestatus = 0;
+
+  if ( ! zstream )
+    return -1;
+
+  /* Write all submitted entries and stop the writer thread, unless
+   * called by the writer thread itself when rotating output */
+  if ( zstream->concurrent && zs_concurrentstop (zstream, 1) )
+    {
+      fprintf (stderr, "Error writing concurrently submitted entries: %s\n", strerror(errno));
+      return -1;
+    }
+
+  /* Add manifest of entry content hashes */
+  if ( zstream->HashManifest && zs_writemanifest (zstream, writestatus) )
+    {
+      fprintf (stderr, "Error writing hash manifest %s\n", zstream->HashManifest);
+      return -1;
+    }
+
+  if ( zs_acquirebuffer (zstream) )
+    return -1;
+
+  /* Store offset of Central Directory */
+  zstream->CentralDirectoryOffset = zstream->WriteOffset;
+
+  /* Write Central Directory Headers in batches, packed back-to-back into
+   * the write buffer until it cannot hold another header */
+  zentry = zstream->FirstEntry;
+  while ( zentry )
+    {
+      packed = 0;
+      while ( zentry &&
+              (packed == 0 ||
+               (packed + 46 + zentry->NameLength + 12 + zentry->CentralExtraLength) <=
+               zstream->BufferSize) )
+        {
+          zip64 = ( zentry->LocalHeaderOffset > 0xFFFFFFFF ) ? 1 : 0;
+
+          /* Central Directory Header, swapped to little-endian order */
+          zs_packunit32 (zstream, &packed, CENTRALHEADERSIG);    /* Central File Header signature */
+          zs_packunit16 (zstream, &packed, 0);                   /* Version made by */
+          zs_packunit16 (zstream, &packed, zentry->ZipVersion);  /* Version needed to extract */
+          zs_packunit16 (zstream, &packed, zentry->GeneralFlag); /* General purpose bit flag */
+          zs_packunit16 (zstream, &packed, zentry->CompressionMethod); /* Compression method */
+          zs_packunit16 (zstream, &packed, zentry->DOSTime);     /* DOS file modification time */
+          zs_packunit16 (zstream, &packed, zentry->DOSDate);     /* DOS file modification date */
+          zs_packunit32 (zstream, &packed, zentry->CRC32);       /* CRC-32 value of entry */
+          zs_packunit32 (zstream, &packed, zentry->CompressedSize); /* Compressed entry size */
+          zs_packunit32 (zstream, &packed, zentry->UncompressedSize); /* Uncompressed entry size */
+          zs_packunit16 (zstream, &packed, zentry->NameLength);  /* File/entry name length */
+          zs_packunit16 (zstream, &packed, (( zip64 ) ? 12 : 0) +
+                         zentry->CentralExtraLength);            /* Extra field length, switch for ZIP64 */
+          zs_packunit16 (zstream, &packed, 0);                   /* File/entry comment length */
+          zs_packunit16 (zstream, &packed, 0);                   /* Disk number start */
+          zs_packunit16 (zstream, &packed, 0);                   /* Internal file attributes */
+          zs_packunit32 (zstream, &packed, 0);                   /* External file attributes */
+          zs_packunit32 (zstream, &packed, ( zip64 ) ?
+                         0xFFFFFFFF : zentry->LocalHeaderOffset); /* Relative offset of Local Header */
+
+          /* File/entry name */
+          memcpy (zstream->buffer+packed, zentry->Name, zentry->NameLength);
+          packed += zentry->NameLength;
+
+          if ( zip64 )  /* ZIP64 Extra Field */
+            {
+              zs_packunit16 (zstream, &packed, 1);      /* Extra field ID, 1 = ZIP64 */
+              zs_packunit16 (zstream, &packed, 8);      /* Extra field data length */
+              zs_packunit64 (zstream, &packed, zentry->LocalHeaderOffset); /* Offset to Local Header */
+            }
+
+          /* Other extra fields, written directly if larger than the buffer */
+          if ( zentry->CentralExtraLength > 0 &&
+               (packed + zentry->CentralExtraLength) > zstream->BufferSize )
+            {
+              lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
+              if ( lwritestatus == packed )
+                {
+                  packed = zentry->CentralExtraLength;
+                  lwritestatus = zs_writedata (zstream, zentry->CentralExtra, packed);
+                }
+
+              if ( lwritestatus != packed )
+                {
+                  fprintf (stderr, "Error writing ZIP central directory header: %s\n", strerror(errno));
+
+                  if ( writestatus )
+                    *writestatus = lwritestatus;
+
+                  zs_releasebuffer (zstream);
+                  return -1;
+                }
+
+              packed = 0;
+              zentry = zentry->next;
+              break;
+            }
+          else if ( zentry->CentralExtraLength > 0 )
+            {
+              memcpy (zstream->buffer+packed, zentry->CentralExtra, zentry->CentralExtraLength);
+              packed += zentry->CentralExtraLength;
+            }
+
+          zentry = zentry->next;
+        }
+
+      lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
+      if ( lwritestatus != packed )
+        {
+          fprintf (stderr, "Error writing ZIP central directory header: %s\n", strerror(errno));
+
+          if ( writestatus )
+            *writestatus = lwritestatus;
+
+          zs_releasebuffer (zstream);
+          return -1;
+        }
+    }
+
+  /* Calculate size of Central Directory */
+  cdsize = zstream->WriteOffset - zstream->CentralDirectoryOffset;
+
+  /* Add ZIP64 structures if the offset, size or entry count of the
+   * Central Directory do not fit the End of Central Directory Record */
+  zip64end = ( zstream->CentralDirectoryOffset > 0xFFFFFFFF ||
+               cdsize >= 0xFFFFFFFF || zstream->EntryCount >= 0xFFFF ) ? 1 : 0;
+
+  if ( zip64end )
+    {
+      /* Note offset of ZIP64 End of Central Directory Record */
+      zip64endrecord = zstream->WriteOffset;
+
+      /* Write ZIP64 End of Central Directory Record, packing into write buffer and swapped to little-endian order */
+      packed = 0;
+      zs_packunit32 (zstream, &packed, ZIP64ENDRECORDSIG); /* ZIP64 End of Central Dir record */
+      zs_packunit64 (zstream, &packed, 44);                /* Size of this record after this field */
+      zs_packunit16 (zstream, &packed, 30);                /* Version made by */
+      zs_packunit16 (zstream, &packed, 45);                /* Version needed to extract */
+      zs_packunit32 (zstream, &packed, 0);                 /* Number of this disk */
+      zs_packunit32 (zstream, &packed, 0);                 /* Disk with start of the CD */
+      zs_packunit64 (zstream, &packed, zstream->EntryCount); /* Number of CD entries on this disk */
+      zs_packunit64 (zstream, &packed, zstream->EntryCount); /* Total number of CD entries */
+      zs_packunit64 (zstream, &packed, cdsize);            /* Size of Central Directory */
+      zs_packunit64 (zstream, &packed, zstream->CentralDirectoryOffset); /* Offset to Central Directory */
+
+      lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
+      if ( lwritestatus != packed )
+        {
+          fprintf (stderr, "Error writing ZIP64 end of central directory record: %s\n", strerror(errno));
+
+          if ( writestatus )
+            *writestatus = lwritestatus;
+
+          zs_releasebuffer (zstream);
+          return -1;
+        }
+
+      /* Write ZIP64 End of Central Directory Locator, packing into write buffer and swapped to little-endian order */
+      packed = 0;
+      zs_packunit32 (zstream, &packed, ZIP64ENDLOCATORSIG); /* ZIP64 End of Central Dir Locator */
+      zs_packunit32 (zstream, &packed, 0);                  /* Number of disk w/ ZIP64 End of CD */
+      zs_packunit64 (zstream, &packed, zip64endrecord);     /* Offset to ZIP64 End of CD */
+      zs_packunit32 (zstream, &packed, 1);                  /* Total number of disks */
+
+      lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
+      if ( lwritestatus != packed )
+        {
+          fprintf (stderr, "Error writing ZIP64 end of central directory locator: %s\n", strerror(errno));
+
+          if ( writestatus )
+            *writestatus = lwritestatus;
+
+          zs_releasebuffer (zstream);
+          return -1;
+        }
+    }
+
+  /* Write End of Central Directory Record, packing into write buffer and swapped to little-endian order */
+  packed = 0;
+  zs_packunit32 (zstream, &packed, ENDHEADERSIG);     /* End of Central Dir signature */
+  zs_packunit16 (zstream, &packed, 0);                /* Number of this disk */
+  zs_packunit16 (zstream, &packed, 0);                /* Number of disk with CD */
+  zs_packunit16 (zstream, &packed, (zstream->EntryCount >= 0xFFFF) ?
+                 0xFFFF : zstream->EntryCount);       /* Number of entries in CD this disk */
+  zs_packunit16 (zstream, &packed, (zstream->EntryCount >= 0xFFFF) ?
+                 0xFFFF : zstream->EntryCount);       /* Number of entries in CD */
+  zs_packunit32 (zstream, &packed, (cdsize >= 0xFFFFFFFF) ?
+                 0xFFFFFFFF : cdsize);                /* Size of Central Directory */
+  zs_packunit32 (zstream, &packed, (zstream->CentralDirectoryOffset > 0xFFFFFFFF) ?
+                 0xFFFFFFFF : zstream->CentralDirectoryOffset); /* Offset to start of CD */
+  zs_packunit16 (zstream, &packed, 0);                /* ZIP file comment length */
+
+  lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
+  if ( lwritestatus != packed )
+    {
+      fprintf (stderr, "Error writing end of central directory record: %s\n", strerror(errno));
+
+      if ( writestatus )
+        *writestatus = lwritestatus;
+
+      zs_releasebuffer (zstream);
+      return -1;
+    }
+
+  zs_releasebuffer (zstream);
+
+  /* Wait for pipelined output to be written */
+  if ( zstream->pipeline && (lwritestatus = zs_pipelinedrain (zstream)) )
+    {
+      fprintf (stderr, "Error writing pipelined output: %s\n", strerror(errno));
+
+      if ( writestatus )
+        *writestatus = lwritestatus;
+
+      return -1;
+    }
+
+  /* Wait for additional outputs to be written */
+  if ( zstream->fanout && zs_fanoutdrain (zstream) )
+    {
+      fprintf (stderr, "Error writing additional output: %s\n", strerror(errno));
+
+      if ( writestatus )
+        *writestatus = -1;
+
+      return -1;
+    }
+
+  /* End chunked output with the last chunk, trailer fields and CRLF */
+  if ( zstream->ChunkSize )
+    {
+      if ( (lwritestatus = zs_writefd (zstream->fd, (uint8_t *) "0\r\n", 3)) != 3 ||
+           (zstream->chunktrailers &&
+            (lwritestatus = zs_writefd (zstream->fd, (uint8_t *) zstream->chunktrailers,
+                                        strlen (zstream->chunktrailers))) !=
+            (int64_t) strlen (zstream->chunktrailers)) ||
+           (lwritestatus = zs_writefd (zstream->fd, (uint8_t *) "\r\n", 2)) != 2 )
+        {
+          fprintf (stderr, "Error writing last chunk: %s\n", strerror(errno));
+
+          if ( writestatus )
+            *writestatus = lwritestatus;
+
+          return -1;
+        }
+    }
+
+  /* Write remaining engine output, truncate padding and preallocation */
+  if ( zstream->engine && zs_enginefinish (zstream) )
+    {
+      fprintf (stderr, "Error completing engine output: %s\n", strerror(errno));
+
+      if ( writestatus )
+        *writestatus = -1;
+
+      return -1;
+    }
+
+  /* Remove any remainder of a previous, longer, archive being appended to */
+  if ( zstream->Appending )
+    {
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+      if ( _chsize_s (zstream->fd, zstream->WriteOffset) )
+  #else
+      if ( ftruncate (zstream->fd, zstream->WriteOffset) )
+  #endif
+        {
+          fprintf (stderr, "Error truncating appended archive: %s\n", strerror(errno));
+          return -1;
+        }
+    }
+
+  /* Record completed part when rotating output */
+  if ( zstream->nextpart )
+    {
+      if ( ! (part = (ZIPpart *) calloc (1, sizeof(ZIPpart))) )
+        {
+          fprintf (stderr, "Cannot allocate memory for part\n");
+          return -1;
+        }
+
+      part->Number = zstream->PartNumber;
+      part->FirstEntry = zstream->PartFirstEntry;
+      part->EntryCount = zstream->EntryCount;
+      part->Offset = zstream->PartOffset;
+      part->Size = zstream->WriteOffset;
+
+      if ( ! zstream->FirstPart )
+        zstream->FirstPart = part;
+      else
+        zstream->LastPart->next = part;
+      zstream->LastPart = part;
+    }
+
+  return 0;
+}  /* End of zs_finish() */
+
+
+/***************************************************************************
+ * zs_rotate:
+ *
+ * Finish the current archive part, free its entries and start a new
+ * part using the descriptor returned by the nextpart() callback.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_rotate ( ZIPstream *zstream, int64_t *writestatus )
+{
+  int fd;
+
+  if ( zs_finish (zstream, writestatus) )
+    {
+      fprintf (stderr, "zs_rotate: Error finishing part %d\n", zstream->PartNumber);
+      return -1;
+    }
+
+  if ( (fd = zstream->nextpart (zstream, zstream->PartNumber + 1,
+                                zstream->nextpartdata)) < 0 )
+    {
+      fprintf (stderr, "zs_rotate: Cannot start part %d\n", zstream->PartNumber + 1);
+      return -1;
+    }
+
+  zstream->PartNumber++;
+  zstream->PartFirstEntry += zstream->EntryCount;
+  zstream->PartOffset += zstream->WriteOffset;
+
+  zs_truncateentries (zstream, NULL, 0);
+
+  zstream->fd = fd;
+  zstream->WriteOffset = 0;
+  zstream->CentralDirectoryOffset = 0;
+  zstream->Appending = 0;
+
+  return 0;
+}  /* End of zs_rotate() */
+
+
+/***************************************************************************
+ * zs_freeparts:
+ *
+ * Free all ZIPpart records of a ZIPstream.
+ ***************************************************************************/
+static void
+zs_freeparts ( ZIPstream *zstream )
+{
+  ZIPpart *part, *pfree;
+
+  part = zstream->FirstPart;
+  while ( part )
+    {
+      pfree = part;
+      part = part->next;
+      free (pfree);
+    }
+
+  zstream->FirstPart = NULL;
+  zstream->LastPart = NULL;
+}  /* End of zs_freeparts() */
+
+
+/***************************************************************************
+ * zs_writedata:
+ *
+ * Write data to the output stream.  With pipelined output the data is
+ * copied into the output buffer ring, with an output engine into its
+ * buffer, otherwise it is written to the output descriptor.
+ *
+ * The ZIPstream.WriteOffset value will be incremented accordingly.
+ *
+ * @return number of bytes written on success and return value of write() on error.
+ ***************************************************************************/
+static int64_t
+zs_writedata ( ZIPstream *zstream, uint8_t *writeBuffer, int64_t writeBufferSize )
+{
+  uint8_t *outputBuffer;
+  int64_t outputSize;
+  int64_t lwritestatus;
+  int64_t written;
+  int64_t waitstart;
+  int64_t from;
+  int64_t to;
+
+  if ( ! zstream || ! writeBuffer )
+    return 0;
+
+  if ( zstream->pipeline )
+    {
+      for ( written = 0; written < writeBufferSize; written += outputSize )
+        {
+          outputBuffer = zs_outputbuffer (zstream, &outputSize);
+
+          if ( outputSize > writeBufferSize - written )
+            outputSize = writeBufferSize - written;
+
+          memcpy (outputBuffer, writeBuffer + written, outputSize);
+
+          lwritestatus = zs_outputcommit (zstream, outputBuffer, outputSize);
+          if ( lwritestatus != outputSize )
+            return lwritestatus;
+        }
+
+      return written;
+    }
+
+#if defined(__linux__)
+  if ( zstream->engine )
+    {
+      for ( written = 0; written < writeBufferSize; written += outputSize )
+        {
+          if ( ! (outputBuffer = zs_outputbuffer (zstream, &outputSize)) )
+            return -1;
+
+          if ( outputSize > writeBufferSize - written )
+            outputSize = writeBufferSize - written;
+
+          memcpy (outputBuffer, writeBuffer + written, outputSize);
+
+          lwritestatus = zs_outputcommit (zstream, outputBuffer, outputSize);
+          if ( lwritestatus != outputSize )
+            return lwritestatus;
+        }
+
+      return written;
+    }
+#endif
+
+  /* Write only the part within the output window of zs_writerange() */
+  if ( zstream->rangeend > 0 )
+    {
+      from = ( zstream->rangestart > zstream->WriteOffset ) ?
+        zstream->rangestart - zstream->WriteOffset : 0;
+      to = ( zstream->rangeend - zstream->WriteOffset < writeBufferSize ) ?
+        zstream->rangeend - zstream->WriteOffset : writeBufferSize;
+
+      if ( from < to &&
+           (written = zs_writefd (zstream->fd, writeBuffer + from, to - from)) != to - from )
+        return written;
+
+      zstream->WriteOffset += writeBufferSize;
+
+      return writeBufferSize;
+    }
+
+  if ( zstream->AdaptiveMax > 0 )
+    {
+      waitstart = zs_microseconds ();
+      written = zs_writeoutput (zstream, writeBuffer, writeBufferSize);
+      zstream->adaptwait += zs_microseconds () - waitstart;
+    }
+  else
+    {
+      written = zs_writeoutput (zstream, writeBuffer, writeBufferSize);
+    }
+
+  if ( written > 0 )
+    zstream->WriteOffset += written;
+
+  return written;
+}  /* End of zs_writedata() */
+
+
+/***************************************************************************
+ * zs_writeoutput:
+ *
+ * Write data to the output descriptor and any additional output
+ * destinations, framed in chunks with chunked output.
+ *
+ * @return number of bytes written on success and return value of write() on error.
+ ***************************************************************************/
+static int64_t
+zs_writeoutput ( ZIPstream *zstream, uint8_t *writeBuffer, int64_t writeBufferSize )
+{
+#ifndef ZS_NOTHREADS
+  if ( zstream->fanout )
+    return zs_fanoutwrite (zstream, writeBuffer, writeBufferSize);
+#endif
+
+  if ( zstream->ChunkSize )
+    return zs_writechunked (zstream, writeBuffer, writeBufferSize);
+
+  return zs_writefd (zstream->fd, writeBuffer, writeBufferSize);
+}  /* End of zs_writeoutput() */
+
+
+/***************************************************************************
+ * zs_writechunked:
+ *
+ * Write data to the output descriptor as HTTP/1.1 chunks of at most
+ * ZIPstream.ChunkSize bytes.  The size line, data and trailing CRLF of
+ * each chunk are written with a single writev(), the data is not
+ * copied.  Incomplete writes are retried from where they stopped.
+ *
+ * @return number of bytes written on success and return value of write() on error.
+ ***************************************************************************/
+static int64_t
+zs_writechunked ( ZIPstream *zstream, uint8_t *writeBuffer, int64_t writeBufferSize )
+{
+  char sizeline[20];
+  int64_t written = 0;
+  int64_t chunk;
+  int64_t rv;
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  int length;
+
+  while ( written < writeBufferSize )
+    {
+      chunk = ( (writeBufferSize - written) > zstream->ChunkSize ) ?
+        zstream->ChunkSize : (writeBufferSize - written);
+
+      length = snprintf (sizeline, sizeof(sizeline), "%llx\r\n", (unsigned long long int) chunk);
+
+      if ( (rv = zs_writefd (zstream->fd, (uint8_t *) sizeline, length)) != length )
+        return rv;
+      if ( (rv = zs_writefd (zstream->fd, writeBuffer + written, chunk)) != chunk )
+        return rv;
+      if ( (rv = zs_writefd (zstream->fd, (uint8_t *) "\r\n", 2)) != 2 )
+        return rv;
+
+      written += chunk;
+    }
+#else
+  struct iovec iov[3];
+  int first;
+
+  while ( written < writeBufferSize )
+    {
+      chunk = ( (writeBufferSize - written) > zstream->ChunkSize ) ?
+        zstream->ChunkSize : (writeBufferSize - written);
+
+      iov[0].iov_base = sizeline;
+      iov[0].iov_len = snprintf (sizeline, sizeof(sizeline), "%llx\r\n",
+                                 (unsigned long long int) chunk);
+      iov[1].iov_base = writeBuffer + written;
+      iov[1].iov_len = chunk;
+      iov[2].iov_base = (void *) "\r\n";
+      iov[2].iov_len = 2;
+
+      for ( first = 0; first < 3; )
+        {
+          if ( (rv = writev (zstream->fd, iov + first, 3 - first)) <= 0 )
+            return rv;
+
+          /* Skip completely written parts and advance into a partial one */
+          while ( first < 3 && (size_t) rv >= iov[first].iov_len )
+            rv -= iov[first++].iov_len;
+
+          if ( first < 3 )
+            {
+              iov[first].iov_base = (uint8_t *) iov[first].iov_base + rv;
+              iov[first].iov_len -= rv;
+            }
+        }
+
+      written += chunk;
+    }
+#endif
+
+  return written;
+}  /* End of zs_writechunked() */
+
+
+/***************************************************************************
+ * zs_writefd:
+ *
+ * Write data to output descriptor in blocks of ZS_WRITE_SIZE bytes,
+ * retrying for incomplete writes.
+ *
+ * @return number of bytes written on success and return value of write() on error.
+ ***************************************************************************/
+static int64_t
+zs_writefd ( int fd, uint8_t *writeBuffer, int64_t writeBufferSize )
+{
+  int64_t lwritestatus;
+  size_t writeLength;
+  int64_t written;
+
+  /* Write blocks of ZS_WRITE_SIZE until done */
+  written = 0;
+  while ( written < writeBufferSize )
+    {
+      writeLength = ( (writeBufferSize - written) > ZS_WRITE_SIZE ) ?
+        ZS_WRITE_SIZE : (writeBufferSize - written);
+
+      lwritestatus = write (fd, writeBuffer+written, writeLength);
+
+      if ( lwritestatus <= 0 )
+        {
+          return lwritestatus;
+        }
+
+      written += lwritestatus;
+    }
+
+  return written;
+}  /* End of zs_writefd() */
+
+
+/***************************************************************************
+ * zs_outputbuffer:
+ *
+ * Return the buffer where the next output data should be placed and
+ * its size.  Data placed in the buffer is written with
+ * zs_outputcommit().
+ *
+ * With pipelined output this is the free space of the current ring
+ * buffer, which is published first if nearly full, with an output
+ * engine the free space of the engine buffer, which is written or
+ * remapped first if nearly full, otherwise it is the ZIPstream buffer.
+ *
+ * @return pointer to output buffer or NULL on output engine error.
+ ***************************************************************************/
+static uint8_t *
+zs_outputbuffer ( ZIPstream *zstream, int64_t *size )
+{
+#if defined(__linux__)
+  ZSengine *engine = zstream->engine;
+#endif
+#ifndef ZS_NOTHREADS
+  ZSpipeline *pipeline = zstream->pipeline;
+  uint8_t *slot;
+  int64_t waitstart;
+
+  if ( pipeline )
+    {
+      if ( ZS_BUFFER_SIZE - pipeline->fill < ZS_BUFFER_SIZE / 4 )
+        zs_pipelinepublish (pipeline);
+
+      *size = ZS_BUFFER_SIZE - pipeline->fill;
+
+      /* Waiting for a free buffer is the output cost for adaptive compression */
+      if ( zstream->AdaptiveMax > 0 )
+        {
+          waitstart = zs_microseconds ();
+          slot = zs_pipelineslot (pipeline);
+          zstream->adaptwait += zs_microseconds () - waitstart;
+        }
+      else
+        {
+          slot = zs_pipelineslot (pipeline);
+        }
+
+      return slot + pipeline->fill;
+    }
+#endif
+
+#if defined(__linux__)
+  if ( engine )
+    {
+      if ( engine->fd != zstream->fd && zs_enginestart (zstream) )
+        return NULL;
+
+      if ( engine->failed )
+        {
+          errno = engine->failed;
+          return NULL;
+        }
+
+      if ( engine->size - engine->fill < ZS_BUFFER_SIZE / 4 && zs_engineadvance (zstream) )
+        return NULL;
+
+      *size = engine->size - engine->fill;
+
+      return engine->buffer + engine->fill;
+    }
+#endif
+
+  *size = zstream->BufferSize;
+
+  return zstream->buffer;
+}  /* End of zs_outputbuffer() */
+
+
+/***************************************************************************
+ * zs_outputcommit:
+ *
+ * Write data placed in a buffer returned by zs_outputbuffer().  With
+ * pipelined output the data is committed to the current ring buffer,
+ * which is published when full, and any write error of the writer
+ * thread is returned.  With an output engine the data is committed to
+ * the engine buffer, written when the buffer is advanced.
+ *
+ * The ZIPstream.WriteOffset value will be incremented accordingly.
+ *
+ * @return number of bytes written on success and return value of write() on error.
+ ***************************************************************************/
+static int64_t
+zs_outputcommit ( ZIPstream *zstream, uint8_t *buffer, int64_t size )
+{
+#ifndef ZS_NOTHREADS
+  ZSpipeline *pipeline = zstream->pipeline;
+
+  if ( pipeline )
+    {
+      if ( atomic_load (&pipeline->failed) )
+        {
+          errno = pipeline->failerrno;
+          return pipeline->failstatus;
+        }
+
+      pipeline->fill += size;
+      zstream->WriteOffset += size;
+
+      if ( pipeline->fill >= ZS_BUFFER_SIZE )
+        zs_pipelinepublish (pipeline);
+
+      return size;
+    }
+#endif
+
+#if defined(__linux__)
+  if ( zstream->engine )
+    {
+      zstream->engine->fill += size;
+      zstream->WriteOffset += size;
+
+      return size;
+    }
+#endif
+
+  return zs_writedata (zstream, buffer, size);
+}  /* End of zs_outputcommit() */
+
+
+/***************************************************************************
+ * zs_outputflush:
+ *
+ * Hand any partially filled buffer of pipelined output to the writer
+ * thread without waiting for it to be written.  With the O_DIRECT
+ * engine the partial block is written padded, it is rewritten when
+ * complete; mapped output is already visible to readers.  Otherwise
+ * all data has already been written.
+ ***************************************************************************/
+static void
+zs_outputflush ( ZIPstream *zstream )
+{
+#if defined(__linux__)
+  ZSengine *engine = zstream->engine;
+  int64_t padded;
+#endif
+
+#ifndef ZS_NOTHREADS
+  if ( zstream->pipeline )
+    zs_pipelinepublish (zstream->pipeline);
+#endif
+
+#if defined(__linux__)
+  if ( engine && engine->type == ZS_ENGINE_DIRECT && engine->fd == zstream->fd &&
+       ! engine->failed && engine->fill > 0 )
+    {
+      padded = (engine->fill + ZS_DIRECT_ALIGN - 1) & ~((int64_t) ZS_DIRECT_ALIGN - 1);
+      memset (engine->buffer + engine->fill, 0, padded - engine->fill);
+
+      if ( zs_enginepwrite (engine->fd, engine->buffer, padded, engine->position) )
+        engine->failed = ( errno ) ? errno : EIO;
+    }
+#endif
+
+  (void)zstream;
+}  /* End of zs_outputflush() */
+
+/***************************************************************************
+ * zs_enginestop:
+ *
+ * Release the output engine of a ZIPstream without completing output,
+ * restoring the file status flags of a descriptor set for O_DIRECT.
+ ***************************************************************************/
+static void
+zs_enginestop ( ZIPstream *zstream )
+{
+#if defined(__linux__)
+  ZSengine *engine = zstream->engine;
+
+  if ( ! engine )
+    return;
+
+  if ( engine->type == ZS_ENGINE_MMAP && engine->buffer )
+    munmap (engine->buffer, engine->size);
+
+  if ( engine->type == ZS_ENGINE_DIRECT && engine->fd >= 0 )
+    fcntl (engine->fd, F_SETFL, engine->flags);
+
+  free (engine->block);
+  free (engine);
+
+  zstream->engine = NULL;
+#else
+  (void)zstream;
+#endif
+}  /* End of zs_enginestop() */
+
+
+/***************************************************************************
+ * zs_enginefinish:
+ *
+ * Complete output of the engine to the current descriptor: write the
+ * padded last block and clear O_DIRECT, or unmap the window and start
+ * write-back of the remainder.  The file is truncated to the end of
+ * the output, removing padding and preallocation, and the descriptor
+ * offset is set to the end.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_enginefinish ( ZIPstream *zstream )
+{
+#if defined(__linux__)
+  ZSengine *engine = zstream->engine;
+  int64_t padded;
+  int64_t end;
+  int rv = 0;
+
+  if ( ! engine || engine->fd != zstream->fd )
+    return 0;
+
+  if ( engine->failed )
+    {
+      errno = engine->failed;
+      rv = -1;
+    }
+
+  end = engine->position + engine->fill;
+
+  if ( engine->type == ZS_ENGINE_DIRECT )
+    {
+      padded = (engine->fill + ZS_DIRECT_ALIGN - 1) & ~((int64_t) ZS_DIRECT_ALIGN - 1);
+      memset (engine->buffer + engine->fill, 0, padded - engine->fill);
+
+      if ( ! rv && padded > 0 &&
+           zs_enginepwrite (engine->fd, engine->buffer, padded, engine->position) )
+        rv = -1;
+
+      if ( fcntl (engine->fd, F_SETFL, engine->flags) )
+        rv = -1;
+    }
+  else
+    {
+      if ( engine->buffer && munmap (engine->buffer, engine->size) )
+        rv = -1;
+
+      engine->buffer = NULL;
+
+      if ( end > engine->synced )
+        sync_file_range (engine->fd, engine->synced, end - engine->synced,
+                         SYNC_FILE_RANGE_WRITE);
+    }
+
+  if ( ! rv && (ftruncate (engine->fd, end) || lseek (engine->fd, end, SEEK_SET) != end) )
+    rv = -1;
+
+  engine->fd = -1;
+  engine->failed = 0;
+  engine->fill = 0;
+  engine->size = 0;
+
+  return rv;
+#else
+  (void)zstream;
+
+  return 0;
+#endif
+}  /* End of zs_enginefinish() */
+
+
+#if defined(__linux__)
+/***************************************************************************
+ * zs_enginestart:
+ *
+ * Start the output engine on the current descriptor at its current
+ * offset.  For O_DIRECT the buffer starts at the aligned offset below,
+ * with any preceding bytes of the block read from the file, and
+ * O_DIRECT is set.  For mapped output the first window is mapped.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_enginestart ( ZIPstream *zstream )
+{
+  ZSengine *engine = zstream->engine;
+  struct stat st;
+  int64_t offset;
+  int64_t head;
+
+  engine->fd = zstream->fd;
+  engine->failed = 0;
+
+  if ( (offset = lseek (engine->fd, 0, SEEK_CUR)) < 0 ||
+       fstat (engine->fd, &st) || ! S_ISREG (st.st_mode) )
+    {
+      fprintf (stderr, "Output engine requires a seekable regular file\n");
+      engine->fd = -1;
+      errno = EINVAL;
+      return -1;
+    }
+
+  if ( engine->type == ZS_ENGINE_DIRECT )
+    {
+      engine->buffer = engine->block;
+      engine->size = ZS_DIRECT_SIZE;
+      engine->position = offset & ~((int64_t) ZS_DIRECT_ALIGN - 1);
+      engine->fill = offset - engine->position;
+
+      head = ( engine->fill > 0 ) ?
+        zs_readdata (engine->fd, engine->position, engine->buffer, engine->fill) : 0;
+
+      if ( head != engine->fill ||
+           (engine->flags = fcntl (engine->fd, F_GETFL)) < 0 ||
+           fcntl (engine->fd, F_SETFL, engine->flags | O_DIRECT) )
+        {
+          fprintf (stderr, "Cannot start O_DIRECT output: %s\n", strerror(errno));
+          engine->fd = -1;
+          return -1;
+        }
+    }
+  else
+    {
+      engine->buffer = NULL;
+      engine->allocated = st.st_size;
+      engine->synced = engine->dropped = offset & ~((int64_t) sysconf (_SC_PAGESIZE) - 1);
+
+      if ( zs_enginemap (engine, offset) )
+        {
+          fprintf (stderr, "Cannot map output: %s\n", strerror(errno));
+          return -1;
+        }
+    }
+
+  return 0;
+}  /* End of zs_enginestart() */
+
+
+/***************************************************************************
+ * zs_engineadvance:
+ *
+ * Make room in a nearly full engine buffer.  For O_DIRECT the aligned
+ * part of the buffer is written and the remainder moved to the start,
+ * for mapped output the next window is mapped.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_engineadvance ( ZIPstream *zstream )
+{
+  ZSengine *engine = zstream->engine;
+  int64_t aligned;
+
+  if ( engine->type == ZS_ENGINE_MMAP )
+    return zs_enginemap (engine, engine->position + engine->fill);
+
+  aligned = engine->fill & ~((int64_t) ZS_DIRECT_ALIGN - 1);
+
+  if ( zs_enginepwrite (engine->fd, engine->buffer, aligned, engine->position) )
+    {
+      engine->failed = ( errno ) ? errno : EIO;
+      return -1;
+    }
+
+  memcpy (engine->buffer, engine->buffer + aligned, engine->fill - aligned);
+  engine->position += aligned;
+  engine->fill -= aligned;
+
+  return 0;
+}  /* End of zs_engineadvance() */
+
+
+/***************************************************************************
+ * zs_enginemap:
+ *
+ * Map the window of the output file containing offset, allocating file
+ * space with fallocate() as needed so stores into the mapping cannot
+ * fail, an error is returned if space cannot be allocated.  Write-back
+ * of the output before the window is started and output before the
+ * previous window, written back by now, is waited for and dropped
+ * from the page cache.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_enginemap ( ZSengine *engine, int64_t offset )
+{
+  int64_t start = offset & ~((int64_t) sysconf (_SC_PAGESIZE) - 1);
+
+  if ( engine->buffer )
+    munmap (engine->buffer, engine->size);
+
+  engine->buffer = NULL;
+
+  if ( start > engine->synced )
+    {
+      if ( engine->synced > engine->dropped )
+        {
+          sync_file_range (engine->fd, engine->dropped, engine->synced - engine->dropped,
+                           SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                           SYNC_FILE_RANGE_WAIT_AFTER);
+          posix_fadvise (engine->fd, engine->dropped, engine->synced - engine->dropped,
+                         POSIX_FADV_DONTNEED);
+          engine->dropped = engine->synced;
+        }
+
+      sync_file_range (engine->fd, engine->synced, start - engine->synced,
+                       SYNC_FILE_RANGE_WRITE);
+      engine->synced = start;
+    }
+
+  if ( start + ZS_MMAP_WINDOW > engine->allocated )
+    {
+      /* Not extended with ftruncate(), stores into a sparse mapping
+       * raise SIGBUS when the file system is full */
+      if ( fallocate (engine->fd, 0, engine->allocated,
+                      start + ZS_MMAP_WINDOW - engine->allocated) )
+        {
+          if ( errno == EOPNOTSUPP )
+            fprintf (stderr, "File system does not support fallocate(), "
+                     "use the write() or O_DIRECT output engine\n");
+
+          engine->failed = ( errno ) ? errno : EIO;
+          return -1;
+        }
+
+      engine->allocated = start + ZS_MMAP_WINDOW;
+    }
+
+  engine->buffer = (uint8_t *) mmap (NULL, ZS_MMAP_WINDOW, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, engine->fd, start);
+
+  if ( engine->buffer == MAP_FAILED )
+    {
+      engine->buffer = NULL;
+      engine->failed = ( errno ) ? errno : EIO;
+      return -1;
+    }
+
+  engine->size = ZS_MMAP_WINDOW;
+  engine->position = start;
+  engine->fill = offset - start;
+
+  return 0;
+}  /* End of zs_enginemap() */
+
+
+/***************************************************************************
+ * zs_enginepwrite:
+ *
+ * Write data to the output descriptor at an offset, retrying for
+ * incomplete writes.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_enginepwrite ( int fd, uint8_t *data, int64_t size, int64_t offset )
+{
+  ssize_t rv;
+
+  while ( size > 0 )
+    {
+      if ( (rv = pwrite (fd, data, size, offset)) <= 0 )
+        return -1;
+
+      data += rv;
+      size -= rv;
+      offset += rv;
+    }
+
+  return 0;
+}  /* End of zs_enginepwrite() */
+#endif
+
+
+#ifndef ZS_NOTHREADS
+/***************************************************************************
+ * zs_pipelinewriter:
+ *
+ * Writer thread for pipelined output, consumes published buffers from
+ * the ring and writes them to the output descriptor.  After a write
+ * error buffers continue to be consumed, but are not written, so the
+ * producer never waits indefinitely.
+ ***************************************************************************/
+static void *
+zs_pipelinewriter ( void *arg )
+{
+  ZIPstream *zstream = arg;
+  ZSpipeline *pipeline = zstream->pipeline;
+  int64_t lwritestatus;
+  uint64_t tail;
+  int32_t slot;
+
+  while ( 1 )
+    {
+      tail = atomic_load (&pipeline->tail);
+
+      /* Sleep while ring is empty */
+      if ( atomic_load (&pipeline->head) == tail )
+        {
+          pthread_mutex_lock (&pipeline->lock);
+          atomic_store (&pipeline->consumerWaiting, 1);
+          while ( atomic_load (&pipeline->head) == tail &&
+                  ! atomic_load (&pipeline->stop) )
+            pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+          atomic_store (&pipeline->consumerWaiting, 0);
+          pthread_mutex_unlock (&pipeline->lock);
+
+          if ( atomic_load (&pipeline->head) == tail )
+            break;
+
+          continue;
+        }
+
+      slot = tail % pipeline->count;
+
+      if ( ! atomic_load (&pipeline->failed) )
+        {
+          lwritestatus = zs_writeoutput (zstream, pipeline->data[slot], pipeline->length[slot]);
+
+          if ( lwritestatus != pipeline->length[slot] )
+            {
+              pipeline->failstatus = lwritestatus;
+              pipeline->failerrno = errno;
+              atomic_store (&pipeline->failed, 1);
+            }
+        }
+
+      atomic_store (&pipeline->tail, tail + 1);
+
+      /* Wake producer waiting for a free buffer or drain */
+      if ( atomic_load (&pipeline->producerWaiting) )
+        {
+          pthread_mutex_lock (&pipeline->lock);
+          pthread_cond_broadcast (&pipeline->cond);
+          pthread_mutex_unlock (&pipeline->lock);
+        }
+    }
+
+  return NULL;
+}  /* End of zs_pipelinewriter() */
+
+
+/***************************************************************************
+ * zs_pipelinewait:
+ *
+ * Wait until the writer thread has consumed all but a given number of
+ * published buffers.
+ ***************************************************************************/
+static void
+zs_pipelinewait ( ZSpipeline *pipeline, uint64_t pending )
+{
+  uint64_t head = atomic_load (&pipeline->head);
+
+  if ( head - atomic_load (&pipeline->tail) <= pending )
+    return;
+
+  pthread_mutex_lock (&pipeline->lock);
+  atomic_store (&pipeline->producerWaiting, 1);
+  while ( head - atomic_load (&pipeline->tail) > pending )
+    pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+  atomic_store (&pipeline->producerWaiting, 0);
+  pthread_mutex_unlock (&pipeline->lock);
+}  /* End of zs_pipelinewait() */
+
+
+/***************************************************************************
+ * zs_pipelineslot:
+ *
+ * Return the current buffer of the ring for the producer, waiting for
+ * the writer thread to free it if needed.
+ *
+ * @return pointer to current ring buffer.
+ ***************************************************************************/
+static uint8_t *
+zs_pipelineslot ( ZSpipeline *pipeline )
+{
+  zs_pipelinewait (pipeline, pipeline->count - 1);
+
+  return pipeline->data[atomic_load (&pipeline->head) % pipeline->count];
+}  /* End of zs_pipelineslot() */
+
+
+/***************************************************************************
+ * zs_pipelinepublish:
+ *
+ * Publish the current ring buffer, if it contains data, to the writer
+ * thread.
+ ***************************************************************************/
+static void
+zs_pipelinepublish ( ZSpipeline *pipeline )
+{
+  uint64_t head = atomic_load (&pipeline->head);
+
+  if ( pipeline->fill <= 0 )
+    return;
+
+  pipeline->length[head % pipeline->count] = pipeline->fill;
+  pipeline->fill = 0;
+
+  atomic_store (&pipeline->head, head + 1);
+
+  /* Wake writer thread waiting for data */
+  if ( atomic_load (&pipeline->consumerWaiting) )
+    {
+      pthread_mutex_lock (&pipeline->lock);
+      pthread_cond_broadcast (&pipeline->cond);
+      pthread_mutex_unlock (&pipeline->lock);
+    }
+}  /* End of zs_pipelinepublish() */
+#endif
+
+
+/***************************************************************************
+ * zs_pipelinedrain:
+ *
+ * Publish any buffered output and wait for the writer thread to write
+ * all published buffers.
+ *
+ * @return 0 on success and the return value of the failed write() on error.
+ ***************************************************************************/
+static int64_t
+zs_pipelinedrain ( ZIPstream *zstream )
+{
+#ifndef ZS_NOTHREADS
+  ZSpipeline *pipeline = zstream->pipeline;
+
+  if ( ! pipeline )
+    return 0;
+
+  zs_pipelinepublish (pipeline);
+  zs_pipelinewait (pipeline, 0);
+
+  if ( atomic_load (&pipeline->failed) )
+    {
+      errno = pipeline->failerrno;
+      return ( pipeline->failstatus ) ? pipeline->failstatus : -1;
+    }
+#else
+  (void)zstream;
+#endif
+
+  return 0;
+}  /* End of zs_pipelinedrain() */
+
+
+/***************************************************************************
+ * zs_pipelinestop:
+ *
+ * Stop the writer thread of pipelined output, discarding any data not
+ * yet written, and free the ring.
+ ***************************************************************************/
+static void
+zs_pipelinestop ( ZIPstream *zstream )
+{
+#ifndef ZS_NOTHREADS
+  ZSpipeline *pipeline = zstream->pipeline;
+  int32_t idx;
+
+  if ( ! pipeline )
+    return;
+
+  if ( pipeline->thread )
+    {
+      atomic_store (&pipeline->stop, 1);
+      pthread_mutex_lock (&pipeline->lock);
+      pthread_cond_broadcast (&pipeline->cond);
+      pthread_mutex_unlock (&pipeline->lock);
+      pthread_join (pipeline->thread, NULL);
+    }
+
+  pthread_cond_destroy (&pipeline->cond);
+  pthread_mutex_destroy (&pipeline->lock);
+
+  for ( idx = 0; idx < pipeline->count; idx++ )
+    free (pipeline->data[idx]);
+
+  free (pipeline->data);
+  free (pipeline->length);
+  free (pipeline);
+#endif
+
+  zstream->pipeline = NULL;
+}  /* End of zs_pipelinestop() */
+
+
+#ifndef ZS_NOTHREADS
+/***************************************************************************
+ * zs_fanoutwrite:
+ *
+ * Write data to the output descriptor and queue it for each active
+ * additional destination, as references to one shared copy.  Idle
+ * pipe destinations are first given as much as possible with tee()
+ * from the staging pipe, which is then moved to the output descriptor
+ * with splice().  Waits for or drops destinations with full queues
+ * according to their policy.
+ *
+ * @return number of bytes written on success and <0 on error.
+ ***************************************************************************/
+static int64_t
+zs_fanoutwrite ( ZIPstream *zstream, uint8_t *data, int64_t size )
+{
+  ZSfanout *fanout = zstream->fanout;
+  ZSfanbuffer *shared;
+  ZSdestination *dest;
+  ZSfanitem *item;
+  int64_t written = 0;
+  int64_t chunk;
+  int64_t teed;
+  int64_t rv;
+
+  while ( written < size )
+    {
+      chunk = size - written;
+
+#if defined(__linux__)
+      if ( fanout->teepipe[0] >= 0 )
+        {
+          if ( chunk > fanout->teesize )
+            chunk = fanout->teesize;
+
+          if ( (rv = zs_writefd (fanout->teepipe[1], data + written, chunk)) != chunk )
+            return rv;
+        }
+#endif
+
+      shared = NULL;
+
+      pthread_mutex_lock (&fanout->lock);
+
+      for ( dest = fanout->first; dest; dest = dest->next )
+        {
+          teed = 0;
+
+#if defined(__linux__)
+          /* Duplicate the staged chunk to an idle pipe without blocking */
+          if ( dest->active && dest->pipe && dest->queued == 0 )
+            {
+              rv = tee (fanout->teepipe[0], dest->fd, chunk, SPLICE_F_NONBLOCK);
+
+              if ( rv < 0 && errno != EAGAIN )
+                zs_fanoutfail (dest, errno, "writing");
+              else if ( rv > 0 )
+                teed = rv;
+
+              dest->written += teed;
+            }
+#endif
+
+          /* Wait for space or drop destination when the queue is full */
+          while ( dest->active && dest->queued > 0 &&
+                  dest->queued + chunk - teed > dest->limit )
+            {
+              if ( dest->policy == ZS_OUTPUT_DROP )
+                {
+                  zs_fanoutfail (dest, 0, "exceeding buffer limit");
+                  pthread_cond_signal (&dest->cond);
+                  break;
+                }
+
+              pthread_cond_wait (&fanout->space, &fanout->lock);
+            }
+
+          if ( ! dest->active || teed == chunk )
+            continue;
+
+          if ( ! shared )
+            {
+              if ( ! (shared = (ZSfanbuffer *) malloc (sizeof(ZSfanbuffer) + chunk)) )
+                {
+                  pthread_mutex_unlock (&fanout->lock);
+                  fprintf (stderr, "zs_fanoutwrite: Cannot allocate memory\n");
+                  errno = ENOMEM;
+                  return -1;
+                }
+
+              /* Referenced while queueing, destinations may write it while waiting */
+              memcpy (shared->data, data + written, chunk);
+              shared->refs = 1;
+            }
+
+          if ( ! (item = (ZSfanitem *) malloc (sizeof(ZSfanitem))) )
+            {
+              if ( --shared->refs == 0 )
+                free (shared);
+              pthread_mutex_unlock (&fanout->lock);
+              fprintf (stderr, "zs_fanoutwrite: Cannot allocate memory\n");
+              errno = ENOMEM;
+              return -1;
+            }
+
+          item->buffer = shared;
+          item->data = shared->data + teed;
+          item->size = chunk - teed;
+          item->next = NULL;
+          shared->refs++;
+
+          if ( dest->last )
+            dest->last->next = item;
+          else
+            dest->first = item;
+          dest->last = item;
+          dest->queued += item->size;
+
+          pthread_cond_signal (&dest->cond);
+        }
+
+      if ( shared && --shared->refs == 0 )
+        free (shared);
+
+      if ( fanout->failed )
+        {
+          pthread_mutex_unlock (&fanout->lock);
+          errno = fanout->failerrno;
+          return -1;
+        }
+
+      pthread_mutex_unlock (&fanout->lock);
+
+#if defined(__linux__)
+      /* Move the staged chunk to the output descriptor */
+      if ( fanout->teepipe[0] >= 0 )
+        {
+          for ( teed = 0; teed < chunk; teed += rv )
+            if ( (rv = splice (fanout->teepipe[0], NULL, zstream->fd, NULL,
+                               chunk - teed, SPLICE_F_MOVE)) <= 0 )
+              return rv;
+
+          written += chunk;
+          continue;
+        }
+#endif
+
+      if ( (rv = zs_writefd (zstream->fd, data + written, chunk)) != chunk )
+        return rv;
+
+      written += chunk;
+    }
+
+  return written;
+}  /* End of zs_fanoutwrite() */
+
+
+/***************************************************************************
+ * zs_fanoutfail:
+ *
+ * Stop writing to a destination after an error, or a full queue when
+ * the error is 0, failing the stream for ZS_OUTPUT_FAILALL
+ * destinations.  Queued data is released by the destination thread.
+ * Called with the fan-out mutex held.
+ ***************************************************************************/
+static void
+zs_fanoutfail ( ZSdestination *dest, int error, const char *reason )
+{
+  ZSfanout *fanout = dest->fanout;
+
+  dest->active = 0;
+
+  if ( dest->policy == ZS_OUTPUT_FAILALL )
+    {
+      fprintf (stderr, "Error %s output descriptor %d: %s\n", reason, dest->fd,
+               strerror(error));
+
+      if ( ! fanout->failed )
+        {
+          fanout->failed = 1;
+          fanout->failerrno = ( error ) ? error : EIO;
+        }
+    }
+  else
+    {
+      fprintf (stderr, "Dropping output descriptor %d after %lld bytes, %s%s%s\n",
+               dest->fd, (long long int) dest->written, reason,
+               ( error ) ? ": " : "", ( error ) ? strerror(error) : "");
+    }
+}  /* End of zs_fanoutfail() */
+
+
+/***************************************************************************
+ * zs_fanoutwriter:
+ *
+ * Thread writing the queue of a destination until stopped or dropped,
+ * queued data of a dropped destination is released.  Cancellation is
+ * only enabled while writing, to stop a dropped destination blocked by
+ * its reader.
+ ***************************************************************************/
+static void *
+zs_fanoutwriter ( void *arg )
+{
+  ZSdestination *dest = arg;
+  ZSfanout *fanout = dest->fanout;
+  ZSfanitem *item;
+  int64_t lwritestatus;
+  int error;
+  int state;
+
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
+  pthread_mutex_lock (&fanout->lock);
+
+  while ( 1 )
+    {
+      while ( dest->active && ! dest->first && ! fanout->stop )
+        pthread_cond_wait (&dest->cond, &fanout->lock);
+
+      if ( ! dest->active || ! dest->first )
+        break;
+
+      item = dest->first;
+      pthread_mutex_unlock (&fanout->lock);
+
+      pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, &state);
+      lwritestatus = zs_writefd (dest->fd, (uint8_t *) item->data, item->size);
+      pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
+      error = ( lwritestatus < 0 ) ? errno : EIO;
+
+      pthread_mutex_lock (&fanout->lock);
+
+      if ( ! (dest->first = item->next) )
+        dest->last = NULL;
+      dest->queued -= item->size;
+
+      if ( lwritestatus == item->size )
+        dest->written += lwritestatus;
+      else if ( dest->active )
+        zs_fanoutfail (dest, error, "writing");
+
+      if ( --item->buffer->refs == 0 )
+        free (item->buffer);
+      free (item);
+
+      pthread_cond_broadcast (&fanout->space);
+    }
+
+  /* Release queued data of a dropped destination */
+  while ( (item = dest->first) )
+    {
+      dest->first = item->next;
+
+      if ( --item->buffer->refs == 0 )
+        free (item->buffer);
+      free (item);
+    }
+
+  dest->last = NULL;
+  dest->queued = 0;
+  pthread_cond_broadcast (&fanout->space);
+  pthread_mutex_unlock (&fanout->lock);
+
+  return NULL;
+}  /* End of zs_fanoutwriter() */
+#endif
+
+
+/***************************************************************************
+ * zs_fanoutdrain:
+ *
+ * Wait until the queues of all active destinations are written.
+ *
+ * @return 0 on success and non-zero when a ZS_OUTPUT_FAILALL
+ * destination failed, with errno set.
+ ***************************************************************************/
+static int
+zs_fanoutdrain ( ZIPstream *zstream )
+{
+#ifndef ZS_NOTHREADS
+  ZSfanout *fanout = zstream->fanout;
+  ZSdestination *dest;
+
+  if ( ! fanout )
+    return 0;
+
+  pthread_mutex_lock (&fanout->lock);
+
+  for ( dest = fanout->first; dest; dest = dest->next )
+    while ( dest->active && dest->queued > 0 )
+      pthread_cond_wait (&fanout->space, &fanout->lock);
+
+  pthread_mutex_unlock (&fanout->lock);
+
+  if ( fanout->failed )
+    {
+      errno = fanout->failerrno;
+      return -1;
+    }
+#else
+  (void)zstream;
+#endif
+
+  return 0;
+}  /* End of zs_fanoutdrain() */
+
+
+/***************************************************************************
+ * zs_fanoutstop:
+ *
+ * Stop the threads of all additional output destinations after their
+ * queues are written, cancelling dropped destinations still blocked
+ * writing, and release the fan-out state.
+ ***************************************************************************/
+static void
+zs_fanoutstop ( ZIPstream *zstream )
+{
+#ifndef ZS_NOTHREADS
+  ZSfanout *fanout = zstream->fanout;
+  ZSdestination *dest;
+  ZSfanitem *item;
+  int8_t active;
+
+  if ( ! fanout )
+    return;
+
+  pthread_mutex_lock (&fanout->lock);
+  fanout->stop = 1;
+  for ( dest = fanout->first; dest; dest = dest->next )
+    pthread_cond_signal (&dest->cond);
+  pthread_mutex_unlock (&fanout->lock);
+
+  while ( (dest = fanout->first) )
+    {
+      pthread_mutex_lock (&fanout->lock);
+      active = dest->active;
+      pthread_mutex_unlock (&fanout->lock);
+
+      if ( ! active )
+        pthread_cancel (dest->thread);
+
+      pthread_join (dest->thread, NULL);
+
+      /* Release data left by a cancelled thread */
+      while ( (item = dest->first) )
+        {
+          dest->first = item->next;
+
+          if ( --item->buffer->refs == 0 )
+            free (item->buffer);
+          free (item);
+        }
+
+      fanout->first = dest->next;
+      pthread_cond_destroy (&dest->cond);
+      free (dest);
+    }
+
+  if ( fanout->teepipe[0] >= 0 )
+    {
+      close (fanout->teepipe[0]);
+      close (fanout->teepipe[1]);
+    }
+
+  pthread_cond_destroy (&fanout->space);
+  pthread_mutex_destroy (&fanout->lock);
+  free (fanout);
+#endif
+
+  zstream->fanout = NULL;
+}  /* End of zs_fanoutstop() */
+
+/***************************************************************************
+ * zs_freesubmission:
+ *
+ * Free a submission and its entry if not owned by the stream.
+ ***************************************************************************/
+static void
+zs_freesubmission ( ZIPsubmission *submission )
+{
+  ZIPentry *zentry;
+
+  if ( ! submission )
+    return;
+
+  if ( (zentry = submission->zentry) )
+    {
+      /* Release method state of an incomplete entry */
+      if ( zentry->methoddata && zentry->method->finish )
+        zentry->method->finish (submission->zstream, zentry);
+
+      free (zentry->seekpoints);
+      free (zentry->CentralExtra);
+      free (zentry->hashstate);
+      free (zentry);
+    }
+
+  free (submission->data);
+  zs_memoryuncharge (&submission->memorycharge);
+  free (submission);
+}  /* End of zs_freesubmission() */
+
+
+#ifndef ZS_NOTHREADS
+/***************************************************************************
+ * zs_writesubmission:
+ *
+ * Write a concurrently submitted entry, Local Header with known sizes
+ * and CRC followed by the compressed data, and add it to the stream
+ * entry list.  Called by the writer thread.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_writesubmission ( ZIPstream *zstream, ZIPsubmission *submission,
+                     int64_t *writestatus )
+{
+  ZIPentry *zentry = submission->zentry;
+  int64_t lwritestatus;
+  int32_t packed;
+
+  /* Finish this part and start the next if a rotation threshold is reached */
+  if ( zstream->nextpart && zstream->EntryCount > 0 &&
+       ( (zstream->MaxPartSize > 0 && zstream->WriteOffset >= zstream->MaxPartSize) ||
+         (zstream->MaxPartEntries > 0 && zstream->EntryCount >= zstream->MaxPartEntries) ) )
+    {
+      if ( zs_rotate (zstream, writestatus) )
+        return -1;
+    }
+
+  if ( zs_acquirebuffer (zstream) )
+    return -1;
+
+  zentry->LocalHeaderOffset = zstream->WriteOffset;
+
+  /* Write the Local File Header, with CRC and sizes */
+  packed = 0;
+  zs_packunit32 (zstream, &packed, LOCALHEADERSIG);              /* Local File Header signature */
+  zs_packunit16 (zstream, &packed, zentry->ZipVersion);
+  zs_packunit16 (zstream, &packed, zentry->GeneralFlag);
+  zs_packunit16 (zstream, &packed, zentry->CompressionMethod);
+  zs_packunit16 (zstream, &packed, zentry->DOSTime);             /* DOS file modification time */
+  zs_packunit16 (zstream, &packed, zentry->DOSDate);             /* DOS file modification date */
+  zs_packunit32 (zstream, &packed, zentry->CRC32);               /* CRC-32 value of entry */
+  zs_packunit32 (zstream, &packed, zentry->CompressedSize);      /* Compressed entry size */
+  zs_packunit32 (zstream, &packed, zentry->UncompressedSize);    /* Uncompressed entry size */
+  zs_packunit16 (zstream, &packed, zentry->NameLength);          /* File/entry name length */
+  zs_packunit16 (zstream, &packed, 0);                           /* Extra field length */
+  /* File/entry name */
+  memcpy (zstream->buffer+packed, zentry->Name, zentry->NameLength); packed += zentry->NameLength;
+
+  lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
+  if ( lwritestatus == packed && submission->size > 0 )
+    {
+      packed = submission->size;
+      lwritestatus = zs_writedata (zstream, submission->data, submission->size);
+    }
+
+  if ( lwritestatus != packed )
+    {
+      fprintf (stderr, "zs_writesubmission(%s): Error writing entry: %s\n",
+               zentry->Name, strerror(errno));
+
+      if ( writestatus )
+        *writestatus = lwritestatus;
+
+      zs_releasebuffer (zstream);
+      return -1;
+    }
+
+  zs_releasebuffer (zstream);
+
+  /* Add entry to stream list, now owned by the stream */
+  if ( ! zstream->FirstEntry )
+    zstream->FirstEntry = zentry;
+  else
+    zstream->LastEntry->next = zentry;
+  zstream->LastEntry = zentry;
+  zstream->EntryCount++;
+
+  submission->zentry = NULL;
+
+  /* Write checkpoint when due at this entry boundary */
+  if ( zs_checkpointdue (zstream) )
+    return -1;
+
+  return 0;
+}  /* End of zs_writesubmission() */
+
+
+/***************************************************************************
+ * zs_concurrentpush:
+ *
+ * Push a submission to the lock-free queue, safe for any number of
+ * concurrent producers.
+ ***************************************************************************/
+static void
+zs_concurrentpush ( ZSconcurrent *concurrent, ZIPsubmission *submission )
+{
+  ZIPsubmission *previous;
+
+  atomic_store (&submission->next, NULL);
+  previous = atomic_exchange (&concurrent->head, submission);
+  atomic_store (&previous->next, submission);
+}  /* End of zs_concurrentpush() */
+
+
+/***************************************************************************
+ * zs_concurrentpop:
+ *
+ * Pop the oldest submission from the lock-free queue, only called by
+ * the single consumer.  NULL is returned when the queue is empty or
+ * a push is in progress.
+ *
+ * @return pointer to ZIPsubmission or NULL.
+ ***************************************************************************/
+static ZIPsubmission *
+zs_concurrentpop ( ZSconcurrent *concurrent )
+{
+  ZIPsubmission *tail = concurrent->tail;
+  ZIPsubmission *next = atomic_load (&tail->next);
+
+  /* Skip stub node */
+  if ( tail == &concurrent->stub )
+    {
+      if ( ! next )
+        return NULL;
+
+      concurrent->tail = next;
+      tail = next;
+      next = atomic_load (&next->next);
+    }
+
+  if ( next )
+    {
+      concurrent->tail = next;
+      return tail;
+    }
+
+  /* Push in progress */
+  if ( tail != atomic_load (&concurrent->head) )
+    return NULL;
+
+  /* Last node, re-insert stub node behind it */
+  zs_concurrentpush (concurrent, &concurrent->stub);
+
+  if ( (next = atomic_load (&tail->next)) )
+    {
+      concurrent->tail = next;
+      return tail;
+    }
+
+  return NULL;
+}  /* End of zs_concurrentpop() */
+
+
+/***************************************************************************
+ * zs_concurrentwriter:
+ *
+ * Writer thread for concurrent submission, writes queued submissions
+ * in completion order.  After a write error submissions continue to be
+ * consumed, but are not written, so waiting threads are released.
+ ***************************************************************************/
+static void *
+zs_concurrentwriter ( void *arg )
+{
+  ZIPstream *zstream = arg;
+  ZSconcurrent *concurrent = zstream->concurrent;
+  ZIPsubmission *submission;
+  int64_t lwritestatus = 0;
+
+  while ( 1 )
+    {
+      /* Sleep while queue is empty */
+      if ( ! (submission = zs_concurrentpop (concurrent)) )
+        {
+          pthread_mutex_lock (&concurrent->lock);
+          atomic_store (&concurrent->consumerWaiting, 1);
+          while ( ! atomic_load (&concurrent->stop) &&
+                  ! (submission = zs_concurrentpop (concurrent)) )
+            pthread_cond_wait (&concurrent->cond, &concurrent->lock);
+          atomic_store (&concurrent->consumerWaiting, 0);
+          pthread_mutex_unlock (&concurrent->lock);
+
+          if ( ! submission )
+            break;
+        }
+
+      if ( ! atomic_load (&concurrent->failed) &&
+           zs_writesubmission (zstream, submission, &lwritestatus) )
+        {
+          concurrent->failstatus = ( lwritestatus ) ? lwritestatus : -1;
+          concurrent->failerrno = errno;
+          atomic_store (&concurrent->failed, 1);
+        }
+
+      zs_freesubmission (submission);
+
+      /* Wake thread waiting for the queue to drain */
+      if ( atomic_fetch_sub (&concurrent->pending, 1) == 1 &&
+           atomic_load (&concurrent->drainWaiting) )
+        {
+          pthread_mutex_lock (&concurrent->lock);
+          pthread_cond_broadcast (&concurrent->cond);
+          pthread_mutex_unlock (&concurrent->lock);
+        }
+    }
+
+  return NULL;
+}  /* End of zs_concurrentwriter() */
+#endif
+
+
+/***************************************************************************
+ * zs_concurrentstop:
+ *
+ * Stop the writer thread of concurrent submission, optionally waiting
+ * for all submitted entries to be written first, and free any entries
+ * not written.  Nothing is done when called by the writer thread.
+ *
+ * @return 0 on success and non-zero if the writer thread failed.
+ ***************************************************************************/
+static int
+zs_concurrentstop ( ZIPstream *zstream, int drain )
+{
+#ifndef ZS_NOTHREADS
+  ZSconcurrent *concurrent = zstream->concurrent;
+  ZIPsubmission *submission;
+  int rv = 0;
+
+  if ( ! concurrent || pthread_equal (pthread_self (), concurrent->thread) )
+    return 0;
+
+  if ( drain )
+    {
+      pthread_mutex_lock (&concurrent->lock);
+      atomic_store (&concurrent->drainWaiting, 1);
+      while ( atomic_load (&concurrent->pending) > 0 )
+        pthread_cond_wait (&concurrent->cond, &concurrent->lock);
+      atomic_store (&concurrent->drainWaiting, 0);
+      pthread_mutex_unlock (&concurrent->lock);
+    }
+
+  atomic_store (&concurrent->stop, 1);
+  pthread_mutex_lock (&concurrent->lock);
+  pthread_cond_broadcast (&concurrent->cond);
+  pthread_mutex_unlock (&concurrent->lock);
+  pthread_join (concurrent->thread, NULL);
+
+  while ( (submission = zs_concurrentpop (concurrent)) )
+    zs_freesubmission (submission);
+
+  if ( atomic_load (&concurrent->failed) )
+    {
+      errno = concurrent->failerrno;
+      rv = -1;
+    }
+
+  pthread_cond_destroy (&concurrent->cond);
+  pthread_mutex_destroy (&concurrent->lock);
+  free (concurrent);
+  zstream->concurrent = NULL;
+
+  return rv;
+#else
+  (void)zstream;
+  (void)drain;
+
+  return 0;
+#endif
+}  /* End of zs_concurrentstop() */
+
+
+/***************************************************************************
+ * zs_copydata:
+ *
+ * Copy data from a specified offset of a seekable input descriptor to
+ * the output descriptor.
+ *
+ * On Linux, copy_file_range() is tried first, which works between
+ * regular files and may share storage, then sendfile(), which works
+ * for any output.  With an output engine data is read directly into
+ * the engine buffer.  Otherwise, or when those fail before copying,
+ * data is read into the ZIPstream buffer and written with zs_writedata().
+ *
+ * The ZIPstream.WriteOffset value will be incremented accordingly.
+ *
+ * @return number of bytes copied on success and <0 on error.
+ ***************************************************************************/
+static int64_t
+zs_copydata ( ZIPstream *zstream, int fd, int64_t offset, int64_t length )
+{
+  int64_t lwritestatus;
+  int64_t copied = 0;
+  int64_t chunk;
+
+#if defined(__linux__)
+  uint8_t *outputBuffer;
+  loff_t inoffset = offset;
+  ssize_t rv;
+
+  /* Read directly into the output engine buffer */
+  while ( zstream->engine && copied < length )
+    {
+      if ( ! (outputBuffer = zs_outputbuffer (zstream, &chunk)) )
+        return -1;
+
+      if ( chunk > length - copied )
+        chunk = length - copied;
+
+      if ( zs_readdata (fd, offset + copied, outputBuffer, chunk) != chunk )
+        return -1;
+
+      lwritestatus = zs_outputcommit (zstream, outputBuffer, chunk);
+      if ( lwritestatus != chunk )
+        return lwritestatus;
+
+      copied += chunk;
+    }
+
+  /* Pipelined output must be written before copying directly */
+  if ( zstream->pipeline && (rv = zs_pipelinedrain (zstream)) )
+    return rv;
+
+  /* Copy within the kernel while it works, stopping on first failure,
+   * data for additional outputs or chunked output is copied through
+   * the stream buffer */
+  while ( ! zstream->fanout && ! zstream->ChunkSize && copied < length )
+    {
+      rv = copy_file_range (fd, &inoffset, zstream->fd, NULL,
+                            ( (length - copied) > ZS_WRITE_SIZE * 64 ) ?
+                            ZS_WRITE_SIZE * 64 : (length - copied), 0);
+      if ( rv <= 0 )
+        break;
+
+      zstream->WriteOffset += rv;
+      copied += rv;
+    }
+
+  while ( ! zstream->fanout && ! zstream->ChunkSize && copied < length )
+    {
+      rv = sendfile (zstream->fd, fd, &inoffset,
+                     ( (length - copied) > ZS_WRITE_SIZE * 64 ) ?
+                     ZS_WRITE_SIZE * 64 : (length - copied));
+      if ( rv <= 0 )
+        break;
+
+      zstream->WriteOffset += rv;
+      copied += rv;
+    }
+#endif
+
+  /* Copy remaining data through the stream buffer */
+  if ( copied < length && zs_acquirebuffer (zstream) )
+    return -1;
+
+  while ( copied < length )
+    {
+      chunk = ( (length - copied) > zstream->BufferSize ) ?
+        zstream->BufferSize : (length - copied);
+
+      if ( zs_readdata (fd, offset + copied, zstream->buffer, chunk) != chunk )
+        {
+          zs_releasebuffer (zstream);
+          return -1;
+        }
+
+      lwritestatus = zs_writedata (zstream, zstream->buffer, chunk);
+      if ( lwritestatus != chunk )
+        {
+          zs_releasebuffer (zstream);
+          return lwritestatus;
+        }
+
+      copied += chunk;
+    }
+
+  return copied;
+}  /* End of zs_copydata() */
+
+
+/***************************************************************************
+ * zs_truncateentries:
+ *
+ * Remove and free all entries following lastEntry from the ZIPstream
+ * entry list and reset the entry count, used to discard entries added
+ * by a failed operation.
+ ***************************************************************************/
+static void
+zs_truncateentries ( ZIPstream *zstream, ZIPentry *lastEntry, int32_t entryCount )
+{
+  ZIPentry *zentry, *zefree;
+
+  zentry = ( lastEntry ) ? lastEntry->next : zstream->FirstEntry;
+  while ( zentry )
+    {
+      zefree = zentry;
+      zentry = zentry->next;
+      free (zefree->seekpoints);
+      free (zefree->CentralExtra);
+      free (zefree->hashstate);
+      free (zefree);
+    }
+
+  if ( lastEntry )
+    lastEntry->next = NULL;
+  else
+    zstream->FirstEntry = NULL;
+
+  zstream->LastEntry = lastEntry;
+  zstream->EntryCount = entryCount;
+}  /* End of zs_truncateentries() */
+
+
+/***************************************************************************
+ * zs_entryoffsetcmp:
+ *
+ * qsort() comparison of ZIPentry pointers by Local Header offset.
+ ***************************************************************************/
+static int
+zs_entryoffsetcmp ( const void *a, const void *b )
+{
+  const ZIPentry *ea = *(ZIPentry * const *)a;
+  const ZIPentry *eb = *(ZIPentry * const *)b;
+
+  if ( ea->LocalHeaderOffset < eb->LocalHeaderOffset )
+    return -1;
+
+  return ( ea->LocalHeaderOffset > eb->LocalHeaderOffset ) ? 1 : 0;
+}
+
+
+/***************************************************************************
+ * zs_readdata:
+ *
+ * Read data from a specified offset of a seekable input descriptor,
+ * retrying for incomplete reads.
+ *
+ * @return number of bytes read on success and <0 on error.
+ ***************************************************************************/
+static int64_t
+zs_readdata ( int fd, int64_t offset, uint8_t *readBuffer, int64_t readBufferSize )
+{
+  int64_t lreadstatus;
+  int64_t readcount = 0;
+
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  if ( _lseeki64 (fd, offset, SEEK_SET) != offset )
+    return -1;
+  #endif
+
+  while ( readcount < readBufferSize )
+    {
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+      lreadstatus = _read (fd, readBuffer + readcount,
+                           (unsigned int)(( (readBufferSize - readcount) > ZS_WRITE_SIZE ) ?
+                                          ZS_WRITE_SIZE : (readBufferSize - readcount)));
+  #else
+      lreadstatus = pread (fd, readBuffer + readcount,
+                           ( (readBufferSize - readcount) > ZS_WRITE_SIZE ) ?
+                           ZS_WRITE_SIZE : (readBufferSize - readcount),
+                           offset + readcount);
+  #endif
+
+      if ( lreadstatus <= 0 )
+        return ( lreadstatus < 0 ) ? lreadstatus : readcount;
+
+      readcount += lreadstatus;
+    }
+
+  return readcount;
+}  /* End of zs_readdata() */
+
+
+/***************************************************************************
+ * zs_readdirectory:
+ *
+ * Read the Central Directory of an existing archive in a seekable
+ * input descriptor and add a ZIPentry for each record to the
+ * ZIPstream entry list.  The End of Central Directory Record is
+ * located, allowing for a trailing archive comment, and ZIP64
+ * structures are used when present.
+ *
+ * The offset of the Central Directory is returned in cdoffset.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_readdirectory ( int fd, ZIPstream *zstream, int64_t *cdoffset )
+{
+  ZIPentry *zentry;
+  ZIPmethod *method;
+  uint8_t *tail = NULL;
+  uint8_t *cd = NULL;
+  uint8_t *record;
+  uint8_t *extra;
+  uint8_t *extraend;
+  uint8_t *value;
+  uint8_t zip64record[56];
+  int64_t filesize;
+  int64_t tailsize;
+  int64_t position;
+  uint64_t entrycount;
+  uint64_t cdsize;
+  uint64_t idx;
+  uint16_t extraLength;
+  uint16_t nameLength;
+
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  filesize = _lseeki64 (fd, 0, SEEK_END);
+  #else
+  filesize = lseek (fd, 0, SEEK_END);
+  #endif
+
+  if ( filesize < 22 )
+    {
+      fprintf (stderr, "zs_readdirectory: Input is not seekable or too small to be an archive\n");
+      return -1;
+    }
+
+  /* Read tail: End of Central Directory Record, maximum comment and ZIP64 Locator */
+  tailsize = ( filesize > (22 + 0xFFFF + 20) ) ? (22 + 0xFFFF + 20) : filesize;
+
+  if ( ! (tail = (uint8_t *) malloc (tailsize)) )
+    {
+      fprintf (stderr, "zs_readdirectory: Cannot allocate memory\n");
+      return -1;
+    }
+
+  if ( zs_readdata (fd, filesize - tailsize, tail, tailsize) != tailsize )
+    {
+      fprintf (stderr, "zs_readdirectory: Error reading archive: %s\n", strerror(errno));
+      free (tail);
+      return -1;
+    }
+
+  /* Search backwards for End of Central Directory Record */
+  for ( position = tailsize - 22; position >= 0; position-- )
+    {
+      if ( zs_getunit32 (tail + position) == ENDHEADERSIG &&
+           position + 22 + zs_getunit16 (tail + position + 20) <= tailsize )
+        break;
+    }
+
+  if ( position < 0 )
+    {
+      fprintf (stderr, "zs_readdirectory: Cannot find End of Central Directory, not a ZIP archive?\n");
+      free (tail);
+      return -1;
+    }
+
+  entrycount = zs_getunit16 (tail + position + 10);
+  cdsize = zs_getunit32 (tail + position + 12);
+  *cdoffset = zs_getunit32 (tail + position + 16);
+
+  /* Use ZIP64 End of Central Directory Record if located */
+  if ( position >= 20 && zs_getunit32 (tail + position - 20) == ZIP64ENDLOCATORSIG )
+    {
+      if ( zs_readdata (fd, zs_getunit64 (tail + position - 20 + 8),
+                        zip64record, sizeof(zip64record)) != sizeof(zip64record) ||
+           zs_getunit32 (zip64record) != ZIP64ENDRECORDSIG )
+        {
+          fprintf (stderr, "zs_readdirectory: Cannot read ZIP64 End of Central Directory Record\n");
+          free (tail);
+          return -1;
+        }
+
+      entrycount = zs_getunit64 (zip64record + 32);
+      cdsize = zs_getunit64 (zip64record + 40);
+      *cdoffset = zs_getunit64 (zip64record + 48);
+    }
+
+  free (tail);
+
+  if ( *cdoffset < 0 || *cdoffset > filesize || cdsize > (uint64_t)(filesize - *cdoffset) ||
+       entrycount > cdsize / 46 || entrycount > INT32_MAX )
+    {
+      fprintf (stderr, "zs_readdirectory: Central Directory is beyond end of archive or invalid\n");
+      return -1;
+    }
+
+  /* Read the Central Directory */
+  if ( ! (cd = (uint8_t *) malloc ((cdsize) ? cdsize : 1)) )
+    {
+      fprintf (stderr, "zs_readdirectory: Cannot allocate %llu bytes for Central Directory\n",
+               (unsigned long long int) cdsize);
+      return -1;
+    }
+
+  if ( zs_readdata (fd, *cdoffset, cd, cdsize) != (int64_t)cdsize )
+    {
+      fprintf (stderr, "zs_readdirectory: Error reading Central Directory: %s\n", strerror(errno));
+      free (cd);
+      return -1;
+    }
+
+  /* Parse each Central Directory Header into a ZIPentry */
+  record = cd;
+  for ( idx = 0; idx < entrycount; idx++ )
+    {
+      if ( record + 46 > cd + cdsize || zs_getunit32 (record) != CENTRALHEADERSIG )
+        {
+          fprintf (stderr, "zs_readdirectory: Invalid Central Directory Header for entry %llu\n",
+                   (unsigned long long int) idx);
+          free (cd);
+          return -1;
+        }
+
+      nameLength = zs_getunit16 (record + 28);
+      extraLength = zs_getunit16 (record + 30);
+      extra = record + 46 + nameLength;
+      extraend = extra + extraLength;
+
+      if ( extraend + zs_getunit16 (record + 32) > cd + cdsize )
+        {
+          fprintf (stderr, "zs_readdirectory: Central Directory Header for entry %llu is truncated\n",
+                   (unsigned long long int) idx);
+          free (cd);
+          return -1;
+        }
+
+      if ( nameLength >= ZENTRY_NAME_LENGTH )
+        {
+          fprintf (stderr, "zs_readdirectory: Entry %llu name length (%d) exceeds maximum of %d\n",
+                   (unsigned long long int) idx, nameLength, ZENTRY_NAME_LENGTH - 1);
+          free (cd);
+          return -1;
+        }
+
+      if ( ! (zentry = (ZIPentry *) calloc (1, sizeof(ZIPentry))) )
+        {
+          fprintf (stderr, "zs_readdirectory: Cannot allocate memory for entry\n");
+          free (cd);
+          return -1;
+        }
+
+      zentry->ZipVersion = zs_getunit16 (record + 6);
+      zentry->GeneralFlag = zs_getunit16 (record + 8);
+      zentry->CompressionMethod = zs_getunit16 (record + 10);
+      zentry->DOSTime = zs_getunit16 (record + 12);
+      zentry->DOSDate = zs_getunit16 (record + 14);
+      zentry->CRC32 = zs_getunit32 (record + 16);
+      zentry->CompressedSize = zs_getunit32 (record + 20);
+      zentry->UncompressedSize = zs_getunit32 (record + 24);
+      zentry->LocalHeaderOffset = zs_getunit32 (record + 42);
+      zentry->NameLength = nameLength;
+      memcpy (zentry->Name, record + 46, nameLength);
+
+      /* Add to entry list first, freed with ZIPstream on error */
+      if ( ! zstream->FirstEntry )
+        zstream->FirstEntry = zentry;
+      else
+        zstream->LastEntry->next = zentry;
+      zstream->LastEntry = zentry;
+      zstream->EntryCount++;
+
+      /* Search extra fields for ZIP64 values, present only for saturated fields */
+      while ( extra + 4 <= extraend )
+        {
+          extraLength = zs_getunit16 (extra + 2);
+
+          if ( extra + 4 + extraLength > extraend )
+            break;
+
+          if ( zs_getunit16 (extra) == 1 )
+            {
+              value = extra + 4;
+
+              if ( zentry->UncompressedSize == 0xFFFFFFFF && value + 8 <= extra + 4 + extraLength )
+                {
+                  zentry->UncompressedSize = zs_getunit64 (value);
+                  value += 8;
+                }
+              if ( zentry->CompressedSize == 0xFFFFFFFF && value + 8 <= extra + 4 + extraLength )
+                {
+                  zentry->CompressedSize = zs_getunit64 (value);
+                  value += 8;
+                }
+              if ( zentry->LocalHeaderOffset == 0xFFFFFFFF && value + 8 <= extra + 4 + extraLength )
+                {
+                  zentry->LocalHeaderOffset = zs_getunit64 (value);
+                  value += 8;
+                }
+            }
+          /* Keep other extra fields, such as seek indexes */
+          else if ( zs_entryaddextra (zentry, zs_getunit16 (extra), extra + 4, extraLength) )
+            {
+              fprintf (stderr, "zs_readdirectory(%s): Cannot keep extra field\n", zentry->Name);
+              free (cd);
+              return -1;
+            }
+
+          extra += 4 + extraLength;
+        }
+
+      if ( zentry->CompressedSize > 0xFFFFFFFF || zentry->UncompressedSize > 0xFFFFFFFF )
+        {
+          fprintf (stderr, "zs_readdirectory(%s): Individual entries cannot exceed %lld bytes\n",
+                   zentry->Name, (long long) 0xFFFFFFFF);
+          free (cd);
+          return -1;
+        }
+
+      /* Associate registered method if available, only needed for new data */
+      for ( method = zstream->firstMethod; method; method = method->next )
+        if ( method->ID == zentry->CompressionMethod )
+          break;
+      zentry->method = method;
+
+      record = extraend + zs_getunit16 (record + 32);
+    }
+
+  free (cd);
+
+  return 0;
+}  /* End of zs_readdirectory() */
+
+
+/* DOS time start date is January 1, 1980 */
+#define DOSTIME_STARTDATE  0x00210000L
+
+/***************************************************************************
+ * zs_datetime_unixtodos:
+ *
+ * Convert Unix time_t to 4 byte DOS date and time.
+ *
+ * Routine adapted from sources:
+ *  Copyright (C) 2006 Michael Liebscher <johnnycanuck@users.sourceforge.net>
+ *
+ * @return converted 4-byte quantity on success and 0 on error.
+ ***************************************************************************/
+static uint32_t
+zs_datetime_unixtodos ( time_t t )
+{
+  struct tm s;
+
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  if ( gmtime_s (&s, &t) )
+    return 0;
+  #else
+  if ( gmtime_r (&t, &s) == NULL )
+    return 0;
+  #endif
+
+  s.tm_year += 1900;
+  s.tm_mon += 1;
+
+  return ( ((s.tm_year) < 1980) ? DOSTIME_STARTDATE :
+           (((uint32_t)(s.tm_year) - 1980) << 25) |
+           ((uint32_t)(s.tm_mon) << 21) |
+           ((uint32_t)(s.tm_mday) << 16) |
+           ((uint32_t)(s.tm_hour) << 11) |
+           ((uint32_t)(s.tm_min) << 5) |
+           ((uint32_t)(s.tm_sec) >> 1) );
+}
+
+
+/***************************************************************************
+ * zs_nextboundary:
+ *
+ * Determine the number of input bytes until the next flush policy or
+ * seek point boundary of an entry, or the end of the adaptive
+ * compression window of the stream.
+ *
+ * @return number of bytes to next boundary.
+ ***************************************************************************/
+static int64_t
+zs_nextboundary ( ZIPstream *zstream, ZIPentry *zentry )
+{
+  int64_t next = INT64_MAX;
+  int64_t seek;
+
+  if ( zstream->AdaptiveMax > 0 )
+    next = ZS_ADAPT_WINDOW - zstream->adaptinput;
+
+  if ( zentry->FlushBytes > 0 &&
+       zentry->FlushBytes - zentry->flushinput < next )
+    next = zentry->FlushBytes - zentry->flushinput;
+
+  if ( zentry->SeekInterval > 0 )
+    {
+      seek = zentry->SeekInterval - (zentry->UncompressedSize % zentry->SeekInterval);
+
+      if ( seek < next )
+        next = seek;
+    }
+
+  return next;
+}  /* End of zs_nextboundary() */
+
+
+/***************************************************************************
+ * zs_addseekpoint:
+ *
+ * Record a seek point at the current uncompressed and compressed
+ * offsets of an entry.  When ZS_SEEKPOINTS_MAX is reached every other
+ * point is dropped, the interval is doubled and the current point is
+ * only kept if it falls on the new interval.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_addseekpoint ( ZIPentry *zentry )
+{
+  uint64_t *points;
+  int32_t idx;
+
+  if ( zentry->seekcount >= ZS_SEEKPOINTS_MAX )
+    {
+      /* Keep points on multiples of the doubled interval */
+      for ( idx = 0; idx < zentry->seekcount / 2; idx++ )
+        {
+          zentry->seekpoints[idx*2] = zentry->seekpoints[(idx*2+1)*2];
+          zentry->seekpoints[idx*2+1] = zentry->seekpoints[(idx*2+1)*2+1];
+        }
+
+      zentry->seekcount /= 2;
+      zentry->SeekInterval *= 2;
+
+      if ( zentry->UncompressedSize % zentry->SeekInterval )
+        return 0;
+    }
+
+  if ( ! zentry->seekpoints )
+    {
+      if ( ! (points = (uint64_t *) malloc (ZS_SEEKPOINTS_MAX * 2 * sizeof(uint64_t))) )
+        {
+          fprintf (stderr, "zs_addseekpoint(%s): Cannot allocate memory\n", zentry->Name);
+          return -1;
+        }
+
+      zentry->seekpoints = points;
+    }
+
+  zentry->seekpoints[zentry->seekcount*2] = zentry->UncompressedSize;
+  zentry->seekpoints[zentry->seekcount*2+1] = zentry->CompressedSize;
+  zentry->seekcount++;
+
+  return 0;
+}  /* End of zs_addseekpoint() */
+
+
+/***************************************************************************
+ * zs_memorycharge:
+ *
+ * Charge memory to the global budget, adding size to the charge of a
+ * stream or submission.  If wait is set, wait while the budget would
+ * be exceeded: idle pool buffers are released first, then the thread
+ * waits for other streams to return memory.  Without wait the budget
+ * may be exceeded.
+ *
+ * Streams are charged before use, when holding no other charged
+ * memory, so that waiting threads cannot deadlock on partial charges.
+ * Memory that must be charged while holding a charge, or by a thread
+ * others depend on to return memory, is charged without waiting.
+ ***************************************************************************/
+static void
+zs_memorycharge ( int64_t *charge, int64_t size, int wait )
+{
+#ifndef ZS_NOTHREADS
+  ZSpoolbuffer *pbuffer;
+
+  pthread_mutex_lock (&zs_pool.lock);
+
+  while ( zs_pool.budget > 0 && zs_pool.allocated + size > zs_pool.budget &&
+          zs_pool.allocated > zs_pool.idle )
+    {
+      if ( zs_pool.free )
+        {
+          pbuffer = zs_pool.free;
+          zs_pool.free = pbuffer->next;
+          zs_pool.idle -= pbuffer->size;
+          zs_pool.allocated -= pbuffer->size;
+          free (pbuffer);
+          continue;
+        }
+
+      if ( ! wait )
+        break;
+
+      zs_pool.waiting++;
+      pthread_cond_wait (&zs_pool.cond, &zs_pool.lock);
+      zs_pool.waiting--;
+    }
+
+  zs_pool.allocated += size;
+  pthread_mutex_unlock (&zs_pool.lock);
+#else
+  (void)wait;
+#endif
+
+  *charge += size;
+}  /* End of zs_memorycharge() */
+
+
+/***************************************************************************
+ * zs_memoryuncharge:
+ *
+ * Return all memory of a charge to the global budget.
+ ***************************************************************************/
+static void
+zs_memoryuncharge ( int64_t *charge )
+{
+#ifndef ZS_NOTHREADS
+  if ( *charge > 0 )
+    {
+      pthread_mutex_lock (&zs_pool.lock);
+
+      zs_pool.allocated -= *charge;
+
+      if ( zs_pool.waiting )
+        pthread_cond_broadcast (&zs_pool.cond);
+
+      pthread_mutex_unlock (&zs_pool.lock);
+    }
+#endif
+
+  *charge = 0;
+}  /* End of zs_memoryuncharge() */
+
+
+/***************************************************************************
+ * zs_acquirebuffer:
+ *
+ * Borrow a stream buffer of ZIPstream.BufferSize from the pool, if
+ * not already held.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_acquirebuffer ( ZIPstream *zstream )
+{
+#ifndef ZS_NOTHREADS
+  ZSpoolbuffer **plink;
+#endif
+
+  if ( zstream->buffer )
+    return 0;
+
+  /* Charge buffer when not covered by the charge of an entry, the
+   * writer thread of concurrent submission returns the memory of
+   * queued submissions and is charged without waiting */
+  if ( ! zstream->entrycharged )
+    zs_memorycharge (&zstream->memorycharge, zstream->BufferSize,
+                     ( zstream->concurrent == NULL ));
+
+#ifndef ZS_NOTHREADS
+  /* Reuse idle buffer of the same size */
+  pthread_mutex_lock (&zs_pool.lock);
+  for ( plink = &zs_pool.free; *plink; plink = &(*plink)->next )
+    {
+      if ( (*plink)->size == zstream->BufferSize )
+        {
+          zstream->buffer = (uint8_t *) *plink;
+          *plink = (*plink)->next;
+          zs_pool.idle -= zstream->BufferSize;
+          zs_pool.allocated -= zstream->BufferSize;
+          break;
+        }
+    }
+  pthread_mutex_unlock (&zs_pool.lock);
+
+  if ( zstream->buffer )
+    return 0;
+#endif
+
+  if ( ! (zstream->buffer = (uint8_t *) malloc (zstream->BufferSize)) )
+    {
+      fprintf (stderr, "Cannot allocate %d bytes for stream buffer\n", zstream->BufferSize);
+      return -1;
+    }
+
+  return 0;
+}  /* End of zs_acquirebuffer() */
+
+
+/***************************************************************************
+ * zs_releasebuffer:
+ *
+ * Release the stream buffer, if held, at the end of a call.  While an
+ * entry is in progress and no budget is set the buffer stays with the
+ * stream, avoiding the pool lock on every call; with a budget or when
+ * the stream is idle it is returned with zs_returnbuffer().  Without
+ * threads there is no pool and the buffer stays with the stream until
+ * zs_free().
+ ***************************************************************************/
+static void
+zs_releasebuffer ( ZIPstream *zstream )
+{
+#ifndef ZS_NOTHREADS
+  if ( zstream->buffer && zstream->entrycharged &&
+       ! atomic_load_explicit (&zs_poolbudgeted, memory_order_relaxed) )
+    return;
+
+  zs_returnbuffer (zstream);
+#else
+  if ( ! zstream->entrycharged )
+    zs_memoryuncharge (&zstream->memorycharge);
+#endif
+}  /* End of zs_releasebuffer() */
+
+
+/***************************************************************************
+ * zs_returnbuffer:
+ *
+ * Return the stream buffer, if held, to the pool.  Buffers are kept
+ * idle up to ZS_POOL_IDLE bytes and within the budget, otherwise
+ * freed.  Any charge of the stream that is not for an entry is
+ * returned.
+ ***************************************************************************/
+static void
+zs_returnbuffer ( ZIPstream *zstream )
+{
+#ifndef ZS_NOTHREADS
+  ZSpoolbuffer *pbuffer;
+#endif
+
+  if ( zstream->buffer )
+    {
+#ifndef ZS_NOTHREADS
+      pthread_mutex_lock (&zs_pool.lock);
+
+      if ( zs_pool.idle + zstream->BufferSize <= ZS_POOL_IDLE &&
+           (zs_pool.budget == 0 ||
+            zs_pool.allocated + zstream->BufferSize <= zs_pool.budget) )
+        {
+          pbuffer = (ZSpoolbuffer *) zstream->buffer;
+          pbuffer->size = zstream->BufferSize;
+          pbuffer->next = zs_pool.free;
+          zs_pool.free = pbuffer;
+          zs_pool.idle += zstream->BufferSize;
+          zs_pool.allocated += zstream->BufferSize;
+          zstream->buffer = NULL;
+        }
+
+      pthread_mutex_unlock (&zs_pool.lock);
+#endif
+
+      free (zstream->buffer);
+      zstream->buffer = NULL;
+    }
+
+  if ( ! zstream->entrycharged )
+    zs_memoryuncharge (&zstream->memorycharge);
+}  /* End of zs_returnbuffer() */
+
+
+/***************************************************************************
+ * zs_milliseconds:
+ *
+ * Return a monotonic clock value in milliseconds.
+ ***************************************************************************/
+static int64_t
+zs_milliseconds ( void )
+{
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  return (int64_t) GetTickCount64 ();
+#else
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+
+/***************************************************************************
+ * zs_checksum:
+ *
+ * Update the CRC-32 and any content hash of an entry.  With a hash,
+ * both are updated in steps of ZS_HASH_STEP bytes so that data is read
+ * from memory once.  Encrypted (AE-2) entries have no CRC-32.
+ ***************************************************************************/
+static void
+zs_checksum ( ZIPentry *zentry, const uint8_t *data, int64_t size )
+{
+  int8_t crc = ! (zentry->method && (zentry->method->flags & ZS_METHOD_CRC));
+  int64_t step;
+
+  if ( ! zentry->hashstate )
+    {
+      if ( crc )
+        zentry->CRC32 = crc32 (zentry->CRC32, data, size);
+      return;
+    }
+
+  while ( size > 0 )
+    {
+      step = ( size > ZS_HASH_STEP ) ? ZS_HASH_STEP : size;
+
+      if ( crc )
+        zentry->CRC32 = crc32 (zentry->CRC32, data, step);
+      zs_sha256_update (zentry->hashstate, data, step);
+
+      data += step;
+      size -= step;
+    }
+}  /* End of zs_checksum() */
+
+
+/***************************************************************************
+ * zs_checkpointdue:
+ *
+ * Write a checkpoint if enabled and the interval or entry count since
+ * the last checkpoint is reached, see zs_setcheckpoint().  Called at
+ * entry boundaries.
+ *
+ * @return 0 on success or when not due and non-zero on error.
+ ***************************************************************************/
+static int
+zs_checkpointdue ( ZIPstream *zstream )
+{
+  if ( ! zstream->checkpointpath )
+    return 0;
+
+  if ( (zstream->CheckpointEntries > 0 &&
+        zstream->EntryCount - zstream->checkpointcount >= zstream->CheckpointEntries) ||
+       (zstream->CheckpointInterval > 0 &&
+        zs_milliseconds () - zstream->checkpointtime >= (int64_t) zstream->CheckpointInterval * 1000) )
+    return zs_checkpoint (zstream, zstream->checkpointpath);
+
+  return 0;
+}  /* End of zs_checkpointdue() */
+
+
+/***************************************************************************
+ * zs_readcheckpoint:
+ *
+ * Read a checkpoint state file written by zs_checkpoint(), adding its
+ * entries to the stream list, verify it against the output file and
+ * truncate the file at the checkpoint offset, positioned for writing.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_readcheckpoint ( int fd, ZIPstream *zstream, const char *path )
+{
+  uint8_t record[ZS_CHECKPOINT_RECORD];
+  uint8_t header[30 + ZENTRY_NAME_LENGTH];
+  ZIPentry *zentry;
+  FILE *fp;
+  uint32_t crc;
+  int32_t count;
+  int32_t idx;
+  int64_t offset;
+  int64_t filesize;
+
+  if ( ! (fp = fopen (path, "rb")) )
+    {
+      fprintf (stderr, "zs_resume: Cannot open %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  if ( fread (record, ZS_CHECKPOINT_HEADER, 1, fp) != 1 ||
+       zs_getunit32 (record) != ZS_CHECKPOINT_SIG ||
+       zs_getunit16 (record + 4) != ZS_CHECKPOINT_VERSION )
+    {
+      fprintf (stderr, "zs_resume: %s is not a checkpoint state file\n", path);
+      fclose (fp);
+      return -1;
+    }
+
+  offset = zs_getunit64 (record + 8);
+  count = zs_getunit32 (record + 16);
+  crc = crc32 (0L, record, ZS_CHECKPOINT_HEADER);
+
+  for ( idx = 0; idx < count; idx++ )
+    {
+      if ( fread (record, ZS_CHECKPOINT_RECORD, 1, fp) != 1 ||
+           zs_getunit16 (record + 38) >= ZENTRY_NAME_LENGTH )
+        break;
+
+      if ( ! (zentry = (ZIPentry *) calloc (1, sizeof(ZIPentry))) )
+        {
+          fprintf (stderr, "zs_resume: Cannot allocate memory\n");
+          fclose (fp);
+          return -1;
+        }
+
+      zentry->ZipVersion = zs_getunit16 (record);
+      zentry->GeneralFlag = zs_getunit16 (record + 2);
+      zentry->CompressionMethod = zs_getunit16 (record + 4);
+      zentry->DOSTime = zs_getunit16 (record + 6);
+      zentry->DOSDate = zs_getunit16 (record + 8);
+      zentry->CRC32 = zs_getunit32 (record + 10);
+      zentry->CompressedSize = zs_getunit64 (record + 14);
+      zentry->UncompressedSize = zs_getunit64 (record + 22);
+      zentry->LocalHeaderOffset = zs_getunit64 (record + 30);
+      zentry->NameLength = zs_getunit16 (record + 38);
+      zentry->CentralExtraLength = zs_getunit16 (record + 40);
+
+      /* Add entry to stream list, freed with the stream on error */
+      if ( ! zstream->FirstEntry )
+        zstream->FirstEntry = zentry;
+      else
+        zstream->LastEntry->next = zentry;
+      zstream->LastEntry = zentry;
+      zstream->EntryCount++;
+
+      if ( zentry->CentralExtraLength > 0 &&
+           ! (zentry->CentralExtra = (uint8_t *) malloc (zentry->CentralExtraLength)) )
+        {
+          fprintf (stderr, "zs_resume: Cannot allocate memory\n");
+          fclose (fp);
+          return -1;
+        }
+
+      if ( fread (zentry->Name, 1, zentry->NameLength, fp) != zentry->NameLength ||
+           fread (zentry->CentralExtra, 1, zentry->CentralExtraLength, fp) !=
+           zentry->CentralExtraLength ||
+           zentry->LocalHeaderOffset + 30 + zentry->NameLength > (uint64_t) offset )
         break;
 
-      method = method->next;
+      crc = crc32 (crc, record, ZS_CHECKPOINT_RECORD);
+      crc = crc32 (crc, (uint8_t *)zentry->Name, zentry->NameLength);
+      if ( zentry->CentralExtraLength > 0 )
+        crc = crc32 (crc, zentry->CentralExtra, zentry->CentralExtraLength);
     }
 
-  if ( ! method )
+  if ( idx < count || fread (record, 4, 1, fp) != 1 || zs_getunit32 (record) != crc )
     {
-      fprintf (stderr, "Cannot find method ID %d\n", methodID);
-      return NULL;
+      fprintf (stderr, "zs_resume: Checkpoint state file %s is corrupt\n", path);
+      fclose (fp);
+      return -1;
     }
 
-  /* Allocate and initialize new entry */
-  zentry = (ZIPentry *) calloc (1, sizeof(ZIPentry));
-  if ( zentry == NULL )
+  fclose (fp);
+
+  /* Output must contain the checkpoint, ending with the last entry */
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  filesize = _lseeki64 (fd, 0, SEEK_END);
+#else
+  filesize = lseek (fd, 0, SEEK_END);
+#endif
+
+  if ( filesize < offset )
     {
-      fprintf (stderr, "Cannot allocate memory for entry\n");
-      return NULL;
+      fprintf (stderr, "zs_resume: Output of %lld bytes is shorter than checkpoint at %lld\n",
+               (long long int) filesize, (long long int) offset);
+      return -1;
     }
 
-  zentry->ZipVersion = 20;  /* Default version for extraction (2.0) */
-  zentry->GeneralFlag = 0;
-  u32 = zs_datetime_unixtodos (modtime);
-  zentry->CompressionMethod = methodID;
-  zentry->DOSDate = (uint16_t) (u32 >> 16);
-  zentry->DOSTime = (uint16_t) (u32 & 0xFFFF);
-  zentry->CRC32 = crc32 (0L, Z_NULL, 0);
-  zentry->CompressedSize = 0;
-  zentry->UncompressedSize = 0;
-  zentry->LocalHeaderOffset = zstream->WriteOffset;
-  strncpy (zentry->Name, name, ZENTRY_NAME_LENGTH - 1);
-  zentry->NameLength = strlen (zentry->Name);
-  zentry->method = method;
-  zentry->methoddata = NULL;
-
-  /* Add new entry to stream list */
-  if ( ! zstream->FirstEntry )
+  if ( (zentry = zstream->LastEntry) &&
+       (zs_readdata (fd, zentry->LocalHeaderOffset, header, 30 + zentry->NameLength) !=
+        30 + zentry->NameLength ||
+        zs_getunit32 (header) != LOCALHEADERSIG ||
+        zs_getunit16 (header + 26) != zentry->NameLength ||
+        memcmp (header + 30, zentry->Name, zentry->NameLength)) )
     {
-      zstream->FirstEntry = zentry;
-      zstream->LastEntry = zentry;
+      fprintf (stderr, "zs_resume: Output does not match checkpoint, no Local Header for %s\n",
+               zentry->Name);
+      return -1;
     }
-  else
+
+  /* Discard data after the checkpoint */
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  if ( _chsize_s (fd, offset) || _lseeki64 (fd, offset, SEEK_SET) != offset )
+#else
+  if ( ftruncate (fd, offset) || lseek (fd, offset, SEEK_SET) != offset )
+#endif
     {
-      zstream->LastEntry->next = zentry;
-      zstream->LastEntry = zentry;
+      fprintf (stderr, "zs_resume: Cannot truncate output at checkpoint: %s\n", strerror(errno));
+      return -1;
     }
 
-  zstream->EntryCount++;
+  zstream->WriteOffset = offset;
+  zstream->checkpointcount = zstream->EntryCount;
 
-  /* Set bit to denote streaming */
-  BIT_SET (zentry->GeneralFlag, 3);
+  return 0;
+}  /* End of zs_readcheckpoint() */
 
-  /* Method initialization callback */
-  if ( zentry->method->init &&
-       zentry->method->init (zstream, zentry) )
+
+/***************************************************************************
+ * zs_hashfinish:
+ *
+ * Complete the content hash of an entry and add it to the Central
+ * Directory extra fields, see zs_sethash().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_hashfinish ( ZIPentry *zentry )
+{
+  uint8_t field[1 + ZS_SHA256_LENGTH];
+
+  field[0] = ZS_HASH_SHA256;
+  zs_sha256_final (zentry->hashstate, field + 1);
+
+  free (zentry->hashstate);
+  zentry->hashstate = NULL;
+
+  if ( zs_entryaddextra (zentry, ZS_EXTRA_HASH, field, sizeof(field)) )
     {
-      fprintf (stderr, "Error with method (%d) init callback\n",
-               zentry->method->ID);
-      return NULL;
+      fprintf (stderr, "Cannot add content hash for %s\n", zentry->Name);
+      return -1;
     }
 
-  /* Write the Local File Header, with zero'd CRC and sizes (for streaming) */
-  packed = 0;
-  zs_packunit32 (zstream, &packed, LOCALHEADERSIG);              /* Data Description signature */
-  zs_packunit16 (zstream, &packed, zentry->ZipVersion);
-  zs_packunit16 (zstream, &packed, zentry->GeneralFlag);
-  zs_packunit16 (zstream, &packed, zentry->CompressionMethod);
-  zs_packunit16 (zstream, &packed, zentry->DOSTime);             /* DOS file modification time */
-  zs_packunit16 (zstream, &packed, zentry->DOSDate);             /* DOS file modification date */
-  zs_packunit32 (zstream, &packed, zentry->CRC32);               /* CRC-32 value of entry */
-  zs_packunit32 (zstream, &packed, zentry->CompressedSize);      /* Compressed entry size */
-  zs_packunit32 (zstream, &packed, zentry->UncompressedSize);    /* Uncompressed entry size */
-  zs_packunit16 (zstream, &packed, zentry->NameLength);          /* File/entry name length */
-  zs_packunit16 (zstream, &packed, 0);                           /* Extra field length */
-  /* File/entry name */
-  memcpy (zstream->buffer+packed, zentry->Name, zentry->NameLength); packed += zentry->NameLength;
+  return 0;
+}  /* End of zs_hashfinish() */
 
-  lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
-  if ( lwritestatus != packed )
+
+/***************************************************************************
+ * zs_writemanifest:
+ *
+ * Add an entry named ZIPstream.HashManifest listing the content hash
+ * and name of each hashed entry in sha256sum format.  The manifest is
+ * not hashed itself and does not trigger rotation of output.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+zs_writemanifest ( ZIPstream *zstream, int64_t *writestatus )
+{
+  static const char hex[] = "0123456789abcdef";
+  int (*nextpart)( ZIPstream*, int32_t, void* );
+  ZIPentry *zentry;
+  ZIPentry *manifest;
+  const uint8_t *digest;
+  int8_t algorithm;
+  char *buffer;
+  int64_t fill = 0;
+  int rv = -1;
+  int idx;
+
+  if ( ! (buffer = (char *) malloc (ZS_HASH_STEP)) )
     {
-      fprintf (stderr, "Error writing ZIP local header: %s\n", strerror(errno));
+      fprintf (stderr, "zs_writemanifest: Cannot allocate memory\n");
+      return -1;
+    }
 
-      if ( writestatus )
-        *writestatus = lwritestatus;
+  nextpart = zstream->nextpart;
+  algorithm = zstream->HashAlgorithm;
+  zstream->nextpart = NULL;
+  zstream->HashAlgorithm = ZS_HASH_NONE;
 
-      return NULL;
+  if ( (manifest = zs_entrybegin (zstream, zstream->HashManifest, time (NULL),
+                                  ZS_DEFLATE, writestatus)) )
+    {
+      for ( zentry = zstream->FirstEntry; zentry != manifest; zentry = zentry->next )
+        {
+          if ( ! (digest = zs_entryhash (zentry, NULL)) )
+            continue;
+
+          /* Write lines when the buffer cannot hold another */
+          if ( fill + 2 * ZS_SHA256_LENGTH + 3 + zentry->NameLength > ZS_HASH_STEP )
+            {
+              if ( ! zs_entrydata (zstream, manifest, (uint8_t *)buffer, fill, writestatus) )
+                break;
+
+              fill = 0;
+            }
+
+          for ( idx = 0; idx < ZS_SHA256_LENGTH; idx++ )
+            {
+              buffer[fill++] = hex[digest[idx] >> 4];
+              buffer[fill++] = hex[digest[idx] & 0xF];
+            }
+
+          buffer[fill++] = ' ';
+          buffer[fill++] = ' ';
+          memcpy (buffer + fill, zentry->Name, zentry->NameLength);
+          fill += zentry->NameLength;
+          buffer[fill++] = '\n';
+        }
+
+      if ( zentry == manifest &&
+           (fill == 0 || zs_entrydata (zstream, manifest, (uint8_t *)buffer, fill, writestatus)) &&
+           zs_entryend (zstream, manifest, writestatus) )
+        rv = 0;
     }
 
-  return zentry;
-}  /* End of zs_entrybegin() */
+  zstream->nextpart = nextpart;
+  zstream->HashAlgorithm = algorithm;
+  free (buffer);
+
+  return rv;
+}  /* End of zs_writemanifest() */
 
 
 /***************************************************************************
- * zs_entrydata:
- *
- * Write a chunk of entry data, of size entrySize, to the output
- * stream according to the parameters already set for the stream and
- * entry.
- *
- * When entry is NULL this signals a flush of any internal buffers.
- * No further data is expected after this.
  *
- * If specified, writestatus will be set to the output of write() when
- * a write error occurs, otherwise it will be set to 0.
+ * SHA-256 (FIPS 180-4) for content hashes.  Blocks are processed with
+ * the SHA extensions of x86-64 processors when detected at run time,
+ * otherwise in portable C.
  *
- * @return pointer to ZIPentry on success and NULL on error.
  ***************************************************************************/
-ZIPentry *
-zs_entrydata ( ZIPstream *zstream, ZIPentry *zentry, uint8_t *entry,
-               int64_t entrySize, int64_t *writestatus )
+static const uint32_t zs_sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Allocate and initialize SHA-256 state, selecting the block function */
+static ZSsha256 *
+zs_sha256_init ( void )
 {
-  int32_t writeSize = 0;
-  int64_t lwritestatus;
-  int64_t consumed = 0;
-  int64_t remaining = 0;
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  ZSsha256 *sha;
+#ifdef ZS_SHANI
+  unsigned int eax, ebx, ecx, edx;
+#endif
+
+  if ( ! (sha = (ZSsha256 *) calloc (1, sizeof(ZSsha256))) )
+    return NULL;
 
-  if ( writestatus )
-    *writestatus = 0;
+  memcpy (sha->state, initial, sizeof(initial));
+  sha->blocks = zs_sha256_blocks;
 
-  if ( ! zstream || ! zentry )
-    return NULL;
+#ifdef ZS_SHANI
+  /* SHA extensions: CPUID.7.0:EBX bit 29, with SSE4.1: CPUID.1:ECX bit 19 */
+  if ( __get_cpuid (1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 19)) &&
+       __get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)) )
+    sha->blocks = zs_sha256_blocks_shani;
+#endif
 
-  if ( entry )
+  return sha;
+}
+
+/* Add data to SHA-256 hash */
+static void
+zs_sha256_update ( ZSsha256 *sha, const uint8_t *data, size_t size )
+{
+  size_t count;
+
+  sha->length += size;
+
+  if ( sha->fill )
     {
-      /* Calculate, or continue calculation of, CRC32 */
-      zentry->CRC32 = crc32 (zentry->CRC32, (uint8_t *)entry, entrySize);
+      count = ( size < 64 - sha->fill ) ? size : 64 - sha->fill;
+      memcpy (sha->block + sha->fill, data, count);
+      sha->fill += count;
+      data += count;
+      size -= count;
 
-      remaining = entrySize;
+      if ( sha->fill < 64 )
+        return;
+
+      sha->blocks (sha->state, sha->block, 1);
+      sha->fill = 0;
     }
 
-  /* Call method callback for processing data until all input is consumed */
-  while ( (writeSize = zentry->method->process( zstream, zentry,
-                                                entry, remaining, &consumed,
-                                                zstream->buffer,
-                                                sizeof(zstream->buffer)) ) > 0 )
+  if ( size >= 64 )
     {
-      /* Write processed data to stream */
-      lwritestatus = zs_writedata (zstream, zstream->buffer, writeSize);
-      if ( lwritestatus != writeSize )
-        {
-          fprintf (stderr, "zs_entrydata: Error writing ZIP entry data (%d): %s\n",
-                   zstream->fd, strerror(errno));
+      sha->blocks (sha->state, data, size / 64);
+      data += size & ~(size_t)63;
+      size &= 63;
+    }
 
-          if ( writestatus )
-            *writestatus = lwritestatus;
+  if ( size )
+    {
+      memcpy (sha->block, data, size);
+      sha->fill = size;
+    }
+}
 
-          return NULL;
-        }
+/* Pad and complete SHA-256 hash, writing the big-endian digest */
+static void
+zs_sha256_final ( ZSsha256 *sha, uint8_t *digest )
+{
+  int idx;
 
-      zentry->CompressedSize += writeSize;
+  zs_shapad (sha);
 
-      if ( entry )
-        {
-          entry += consumed;
-          remaining -= consumed;
+  for ( idx = 0; idx < 32; idx++ )
+    digest[idx] = (uint8_t)(sha->state[idx / 4] >> (24 - 8 * (idx % 4)));
+}
 
-          if ( remaining <= 0 )
-            break;
-        }
+/* Append padding and the big-endian bit length, shared with SHA-1 */
+static void
+zs_shapad ( ZSsha256 *sha )
+{
+  uint64_t bits = sha->length * 8;
+  int idx;
+
+  sha->block[sha->fill++] = 0x80;
+
+  if ( sha->fill > 56 )
+    {
+      memset (sha->block + sha->fill, 0, 64 - sha->fill);
+      sha->blocks (sha->state, sha->block, 1);
+      sha->fill = 0;
     }
 
-  if ( writeSize < 0 )
+  memset (sha->block + sha->fill, 0, 56 - sha->fill);
+  for ( idx = 0; idx < 8; idx++ )
+    sha->block[56 + idx] = (uint8_t)(bits >> (56 - 8 * idx));
+
+  sha->blocks (sha->state, sha->block, 1);
+}
+
+#define ZS_ROTR32(X,N) (((X) >> (N)) | ((X) << (32 - (N))))
+
+/* Process 64-byte blocks in portable C */
+static void
+zs_sha256_blocks ( uint32_t *state, const uint8_t *data, size_t count )
+{
+  uint32_t w[64];
+  uint32_t a, b, c, d, e, f, g, h;
+  uint32_t t1, t2;
+  int idx;
+
+  while ( count-- )
     {
-      fprintf (stderr, "zs_entrydata: Process callback failed\n");
-      return NULL;
+      for ( idx = 0; idx < 16; idx++, data += 4 )
+        w[idx] = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+          ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+
+      for ( ; idx < 64; idx++ )
+        w[idx] = w[idx-16] + w[idx-7] +
+          (ZS_ROTR32(w[idx-15], 7) ^ ZS_ROTR32(w[idx-15], 18) ^ (w[idx-15] >> 3)) +
+          (ZS_ROTR32(w[idx-2], 17) ^ ZS_ROTR32(w[idx-2], 19) ^ (w[idx-2] >> 10));
+
+      a = state[0]; b = state[1]; c = state[2]; d = state[3];
+      e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+      for ( idx = 0; idx < 64; idx++ )
+        {
+          t1 = h + (ZS_ROTR32(e, 6) ^ ZS_ROTR32(e, 11) ^ ZS_ROTR32(e, 25)) +
+            ((e & f) ^ (~e & g)) + zs_sha256_k[idx] + w[idx];
+          t2 = (ZS_ROTR32(a, 2) ^ ZS_ROTR32(a, 13) ^ ZS_ROTR32(a, 22)) +
+            ((a & b) ^ (a & c) ^ (b & c));
+          h = g; g = f; f = e; e = d + t1;
+          d = c; c = b; b = a; a = t1 + t2;
+        }
+
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+      state[4] += e; state[5] += f; state[6] += g; state[7] += h;
     }
+}
 
-  if ( entry )
+#ifdef ZS_SHANI
+/* Process 64-byte blocks with the x86 SHA extensions, four rounds per
+ * message group, next message groups derived with SHA256MSG1/2 */
+__attribute__((target("sha,sse4.1")))
+static void
+zs_sha256_blocks_shani ( uint32_t *state, const uint8_t *data, size_t count )
+{
+  const __m128i mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, save0, save1, msg, tmp;
+  __m128i group[4];
+  int idx;
+
+  /* Reorder state into ABEF and CDGH as used by SHA256RNDS2 */
+  tmp = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *)&state[0]), 0xB1);
+  state1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *)&state[4]), 0x1B);
+  state0 = _mm_alignr_epi8 (tmp, state1, 8);
+  state1 = _mm_blend_epi16 (state1, tmp, 0xF0);
+
+  while ( count-- )
     {
-      zentry->UncompressedSize += entrySize;
+      save0 = state0;
+      save1 = state1;
+
+      for ( idx = 0; idx < 16; idx++ )
+        {
+          if ( idx < 4 )
+            {
+              group[idx] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data + 16 * idx)), mask);
+            }
+          else
+            {
+              tmp = _mm_sha256msg1_epu32 (group[idx & 3], group[(idx + 1) & 3]);
+              tmp = _mm_add_epi32 (tmp, _mm_alignr_epi8 (group[(idx + 3) & 3], group[(idx + 2) & 3], 4));
+              group[idx & 3] = _mm_sha256msg2_epu32 (tmp, group[(idx + 3) & 3]);
+            }
+
+          msg = _mm_add_epi32 (group[idx & 3], _mm_loadu_si128 ((const __m128i *)&zs_sha256_k[4 * idx]));
+          state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);
+          msg = _mm_shuffle_epi32 (msg, 0x0E);
+          state0 = _mm_sha256rnds2_epu32 (state0, state1, msg);
+        }
+
+      state0 = _mm_add_epi32 (state0, save0);
+      state1 = _mm_add_epi32 (state1, save1);
+      data += 64;
     }
 
-  return zentry;
-}  /* End of zs_entrydata() */
+  /* Reorder ABEF and CDGH back into state */
+  tmp = _mm_shuffle_epi32 (state0, 0x1B);
+  state1 = _mm_shuffle_epi32 (state1, 0xB1);
+  state0 = _mm_blend_epi16 (tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8 (state1, tmp, 8);
+
+  _mm_storeu_si128 ((__m128i *)&state[0], state0);
+  _mm_storeu_si128 ((__m128i *)&state[4], state1);
+}
+#endif
 
 
 /***************************************************************************
- * zs_entryend:
- *
- * End a streaming entry by writing a Data Description record to
- * output stream.
  *
- * If specified, writestatus will be set to the output of write() when
- * a write error occurs, otherwise it will be set to 0.
+ * SHA-1 (FIPS 180-4) for HMAC-SHA1 of WinZip AES, using the SHA-256
+ * state structure with five state words.  Blocks are processed with
+ * the SHA extensions of x86-64 processors when detected at run time,
+ * otherwise in portable C.
  *
- * @return pointer to ZIPentry on success and NULL on error.
  ***************************************************************************/
-ZIPentry *
-zs_entryend ( ZIPstream *zstream, ZIPentry *zentry, int64_t *writestatus)
+
+/* Initialize SHA-1 state in place, selecting the block function */
+static void
+zs_sha1_init ( ZSsha256 *sha )
 {
-  int64_t lwritestatus;
-  int32_t packed;
+  static const uint32_t initial[5] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+  };
+#ifdef ZS_SHANI
+  unsigned int eax, ebx, ecx, edx;
+#endif
+
+  memset (sha, 0, sizeof(ZSsha256));
+  memcpy (sha->state, initial, sizeof(initial));
+  sha->blocks = zs_sha1_blocks;
+
+#ifdef ZS_SHANI
+  /* SHA extensions: CPUID.7.0:EBX bit 29, with SSE4.1: CPUID.1:ECX bit 19 */
+  if ( __get_cpuid (1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 19)) &&
+       __get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)) )
+    sha->blocks = zs_sha1_blocks_shani;
+#endif
+}
 
-  if ( writestatus )
-    *writestatus = 0;
+/* Pad and complete SHA-1 hash, writing the big-endian digest */
+static void
+zs_sha1_final ( ZSsha256 *sha, uint8_t *digest )
+{
+  int idx;
 
-  if ( ! zstream || ! zentry )
-    return NULL;
+  zs_shapad (sha);
 
-  /* Flush the entry */
-  if ( ! zs_entrydata (zstream, zentry, NULL, 0, &lwritestatus) )
+  for ( idx = 0; idx < 20; idx++ )
+    digest[idx] = (uint8_t)(sha->state[idx / 4] >> (24 - 8 * (idx % 4)));
+}
+
+/* Process 64-byte blocks in portable C */
+static void
+zs_sha1_blocks ( uint32_t *state, const uint8_t *data, size_t count )
+{
+  uint32_t w[80];
+  uint32_t a, b, c, d, e, f, k, t;
+  int idx;
+
+  while ( count-- )
     {
-      fprintf (stderr, "Error flushing entry (writestatus: %lld)\n",
-               (long long int)lwritestatus);
+      for ( idx = 0; idx < 16; idx++, data += 4 )
+        w[idx] = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+          ((uint32_t)data[2] << 8) | (uint32_t)data[3];
 
-      if ( writestatus )
-        *writestatus = lwritestatus;
+      for ( ; idx < 80; idx++ )
+        w[idx] = ZS_ROTR32(w[idx-3] ^ w[idx-8] ^ w[idx-14] ^ w[idx-16], 31);
 
-      return NULL;
+      a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+
+      for ( idx = 0; idx < 80; idx++ )
+        {
+          if ( idx < 20 )
+            { f = (b & c) | (~b & d); k = 0x5A827999; }
+          else if ( idx < 40 )
+            { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+          else if ( idx < 60 )
+            { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+          else
+            { f = b ^ c ^ d; k = 0xCA62C1D6; }
+
+          t = ZS_ROTR32(a, 27) + f + e + k + w[idx];
+          e = d; d = c; c = ZS_ROTR32(b, 2); b = a; a = t;
+        }
+
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
     }
+}
 
-  /* Method finish callback */
-  if ( zentry->method->finish &&
-       zentry->method->finish (zstream, zentry) )
+#ifdef ZS_SHANI
+/* Process 64-byte blocks with the x86 SHA extensions, four rounds per
+ * message group, next message groups derived with SHA1MSG1/2 */
+__attribute__((target("sha,sse4.1")))
+static void
+zs_sha1_blocks_shani ( uint32_t *state, const uint8_t *data, size_t count )
+{
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, e0, save0, save1, previous, e;
+  __m128i group[4];
+  int idx;
+
+  /* Order state words with A, and E, in the highest lane */
+  abcd = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *)state), 0x1B);
+  e0 = _mm_set_epi32 ((int)state[4], 0, 0, 0);
+
+  while ( count-- )
     {
-      fprintf (stderr, "Error with method (%d) finish callback\n",
-               zentry->method->ID);
-      return NULL;
+      save0 = abcd;
+      save1 = e0;
+      previous = abcd;
+
+      /* Unrolled so the group index and round selector are constants */
+#if defined(__clang__)
+#pragma clang loop unroll(full)
+#else
+#pragma GCC unroll 20
+#endif
+      for ( idx = 0; idx < 20; idx++ )
+        {
+          if ( idx < 4 )
+            {
+              group[idx] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data + 16 * idx)), mask);
+            }
+          else
+            {
+              e = _mm_xor_si128 (_mm_sha1msg1_epu32 (group[idx & 3], group[(idx + 1) & 3]),
+                                 group[(idx + 2) & 3]);
+              group[idx & 3] = _mm_sha1msg2_epu32 (e, group[(idx + 3) & 3]);
+            }
+
+          e = ( idx == 0 ) ? _mm_add_epi32 (e0, group[0]) :
+            _mm_sha1nexte_epu32 (previous, group[idx & 3]);
+          previous = abcd;
+
+          /* Round function selector must be a constant */
+          switch ( idx / 5 )
+            {
+            case 0: abcd = _mm_sha1rnds4_epu32 (abcd, e, 0); break;
+            case 1: abcd = _mm_sha1rnds4_epu32 (abcd, e, 1); break;
+            case 2: abcd = _mm_sha1rnds4_epu32 (abcd, e, 2); break;
+            default: abcd = _mm_sha1rnds4_epu32 (abcd, e, 3); break;
+            }
+        }
+
+      e0 = _mm_sha1nexte_epu32 (previous, save1);
+      abcd = _mm_add_epi32 (abcd, save0);
+      data += 64;
     }
 
-  /* Write Data Description */
-  packed = 0;
-  zs_packunit32 (zstream, &packed, DATADESCRIPTIONSIG);       /* Data Description signature */
-  zs_packunit32 (zstream, &packed, zentry->CRC32);            /* CRC-32 value of entry */
-  zs_packunit32 (zstream, &packed, zentry->CompressedSize);   /* Compressed entry size */
-  zs_packunit32 (zstream, &packed, zentry->UncompressedSize); /* Uncompressed entry size */
+  _mm_storeu_si128 ((__m128i *)state, _mm_shuffle_epi32 (abcd, 0x1B));
+  state[4] = (uint32_t)_mm_extract_epi32 (e0, 3);
+}
+#endif
 
-  lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
-  if ( lwritestatus != packed )
+/* Set HMAC-SHA1 inner and outer hashes after the padded key blocks */
+static void
+zs_hmac_sha1_key ( const uint8_t *key, size_t keyLength, ZSsha256 *inner, ZSsha256 *outer )
+{
+  uint8_t block[64];
+  uint8_t digest[20];
+  size_t idx;
+
+  /* Keys longer than a block are hashed */
+  if ( keyLength > sizeof(block) )
     {
-      fprintf (stderr, "Error writing streaming ZIP data description: %s\n", strerror(errno));
+      zs_sha1_init (inner);
+      zs_sha256_update (inner, key, keyLength);
+      zs_sha1_final (inner, digest);
+      key = digest;
+      keyLength = sizeof(digest);
+    }
+
+  for ( idx = 0; idx < sizeof(block); idx++ )
+    block[idx] = (( idx < keyLength ) ? key[idx] : 0) ^ 0x36;
+  zs_sha1_init (inner);
+  zs_sha256_update (inner, block, sizeof(block));
+
+  for ( idx = 0; idx < sizeof(block); idx++ )
+    block[idx] ^= 0x36 ^ 0x5c;
+  zs_sha1_init (outer);
+  zs_sha256_update (outer, block, sizeof(block));
+
+  memset (block, 0, sizeof(block));
+}
 
-      if ( writestatus )
-        *writestatus = lwritestatus;
+/* Derive a key with PBKDF2-HMAC-SHA1 (RFC 8018) */
+static void
+zs_pbkdf2_sha1 ( const uint8_t *password, size_t passwordLength,
+                 const uint8_t *salt, size_t saltLength, int iterations,
+                 uint8_t *key, size_t keyLength )
+{
+  ZSsha256 inner, outer, sha;
+  uint8_t block[4];
+  uint8_t u[20];
+  uint8_t t[20];
+  uint32_t number;
+  size_t length;
+  size_t idx;
+  int iteration;
+
+  zs_hmac_sha1_key (password, passwordLength, &inner, &outer);
+
+  for ( number = 1; keyLength > 0; number++ )
+    {
+      block[0] = (uint8_t)(number >> 24); block[1] = (uint8_t)(number >> 16);
+      block[2] = (uint8_t)(number >> 8);  block[3] = (uint8_t)number;
+
+      sha = inner;
+      zs_sha256_update (&sha, salt, saltLength);
+      zs_sha256_update (&sha, block, sizeof(block));
+      zs_sha1_final (&sha, u);
+      sha = outer;
+      zs_sha256_update (&sha, u, sizeof(u));
+      zs_sha1_final (&sha, u);
+      memcpy (t, u, sizeof(t));
+
+      for ( iteration = 1; iteration < iterations; iteration++ )
+        {
+          sha = inner;
+          zs_sha256_update (&sha, u, sizeof(u));
+          zs_sha1_final (&sha, u);
+          sha = outer;
+          zs_sha256_update (&sha, u, sizeof(u));
+          zs_sha1_final (&sha, u);
+
+          for ( idx = 0; idx < sizeof(t); idx++ )
+            t[idx] ^= u[idx];
+        }
 
-      return NULL;
+      length = ( keyLength < sizeof(t) ) ? keyLength : sizeof(t);
+      memcpy (key, t, length);
+      key += length;
+      keyLength -= length;
     }
 
-  return zentry;
-}  /* End of zs_entryend() */
+  memset (t, 0, sizeof(t));
+  memset (u, 0, sizeof(u));
+}
 
 
 /***************************************************************************
- * zs_finish:
- *
- * Write end of ZIP archive structures (Central Directory, etc.).
- *
- * ZIP64 structures will be added to the Central Directory when the
- * total length of the archive exceeds 0xFFFFFFFF bytes.
  *
- * If specified, writestatus will be set to the output of write() when
- * a write error occurs, otherwise it will be set to 0.
+ * AES-256 (FIPS 197) in CTR mode as used by WinZip AES: a 128-bit
+ * counter block with a little-endian block number, starting at 1, in
+ * the first eight bytes.  The key stream is generated with VAES or
+ * AES-NI instructions when detected at run time, otherwise in
+ * portable C.
  *
- * @return 0 on success and non-zero on error.
  ***************************************************************************/
-int
-zs_finish ( ZIPstream *zstream, int64_t *writestatus )
+static const uint8_t zs_aes_sbox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+#define ZS_XTIME(X) ((uint8_t)(((X) << 1) ^ (((X) >> 7) * 0x1b)))
+
+/* Expand a 256-bit key into 15 round keys, in the byte order used by
+ * both the portable and the AES-NI/VAES implementations */
+static void
+zs_aes_expandkey ( const uint8_t *key, uint8_t *roundkeys )
 {
-  ZIPentry *zentry;
-  int64_t lwritestatus;
-  int packed;
+  uint8_t rcon = 1;
+  uint8_t temp[4];
+  uint8_t swap;
+  int idx;
 
-  uint64_t cdsize;
-  uint64_t zip64endrecord;
-  int zip64 = 0;
+  memcpy (roundkeys, key, ZS_AES_KEY_LENGTH);
 
-  if ( writestatus )
-    *writestatus = 0;
+  for ( idx = 8; idx < 60; idx++ )
+    {
+      memcpy (temp, roundkeys + 4 * (idx - 1), 4);
 
-  if ( ! zstream )
-    return -1;
+      if ( idx % 8 == 0 )
+        {
+          swap = temp[0];
+          temp[0] = zs_aes_sbox[temp[1]] ^ rcon;
+          temp[1] = zs_aes_sbox[temp[2]];
+          temp[2] = zs_aes_sbox[temp[3]];
+          temp[3] = zs_aes_sbox[swap];
+          rcon = ZS_XTIME(rcon);
+        }
+      else if ( idx % 8 == 4 )
+        {
+          temp[0] = zs_aes_sbox[temp[0]]; temp[1] = zs_aes_sbox[temp[1]];
+          temp[2] = zs_aes_sbox[temp[2]]; temp[3] = zs_aes_sbox[temp[3]];
+        }
 
-  /* Store offset of Central Directory */
-  zstream->CentralDirectoryOffset = zstream->WriteOffset;
+      roundkeys[4 * idx + 0] = roundkeys[4 * (idx - 8) + 0] ^ temp[0];
+      roundkeys[4 * idx + 1] = roundkeys[4 * (idx - 8) + 1] ^ temp[1];
+      roundkeys[4 * idx + 2] = roundkeys[4 * (idx - 8) + 2] ^ temp[2];
+      roundkeys[4 * idx + 3] = roundkeys[4 * (idx - 8) + 3] ^ temp[3];
+    }
+}
 
-  zentry = zstream->FirstEntry;
-  while ( zentry )
+/* Encrypt one block in place in portable C */
+static void
+zs_aes_block ( const uint8_t *roundkeys, uint8_t *state )
+{
+  uint8_t t[16];
+  uint8_t a0, a1, a2, a3, x;
+  int round, col, row, idx;
+
+  for ( idx = 0; idx < 16; idx++ )
+    state[idx] ^= roundkeys[idx];
+
+  for ( round = 1; round <= 14; round++ )
     {
-      zip64 = ( zentry->LocalHeaderOffset > 0xFFFFFFFF ) ? 1 : 0;
+      /* SubBytes and ShiftRows */
+      for ( col = 0; col < 4; col++ )
+        for ( row = 0; row < 4; row++ )
+          t[4 * col + row] = zs_aes_sbox[state[4 * ((col + row) & 3) + row]];
 
-      /* Write Central Directory Header, packing into write buffer and swapped to little-endian order */
-      packed = 0;
-      zs_packunit32 (zstream, &packed, CENTRALHEADERSIG);    /* Central File Header signature */
-      zs_packunit16 (zstream, &packed, 0);                   /* Version made by */
-      zs_packunit16 (zstream, &packed, zentry->ZipVersion);  /* Version needed to extract */
-      zs_packunit16 (zstream, &packed, zentry->GeneralFlag); /* General purpose bit flag */
-      zs_packunit16 (zstream, &packed, zentry->CompressionMethod); /* Compression method */
-      zs_packunit16 (zstream, &packed, zentry->DOSTime);     /* DOS file modification time */
-      zs_packunit16 (zstream, &packed, zentry->DOSDate);     /* DOS file modification date */
-      zs_packunit32 (zstream, &packed, zentry->CRC32);       /* CRC-32 value of entry */
-      zs_packunit32 (zstream, &packed, zentry->CompressedSize); /* Compressed entry size */
-      zs_packunit32 (zstream, &packed, zentry->UncompressedSize); /* Uncompressed entry size */
-      zs_packunit16 (zstream, &packed, zentry->NameLength);  /* File/entry name length */
-      zs_packunit16 (zstream, &packed, ( zip64 ) ? 12 : 0 ); /* Extra field length, switch for ZIP64 */
-      zs_packunit16 (zstream, &packed, 0);                   /* File/entry comment length */
-      zs_packunit16 (zstream, &packed, 0);                   /* Disk number start */
-      zs_packunit16 (zstream, &packed, 0);                   /* Internal file attributes */
-      zs_packunit32 (zstream, &packed, 0);                   /* External file attributes */
-      zs_packunit32 (zstream, &packed, ( zip64 ) ?
-                     0xFFFFFFFF : zentry->LocalHeaderOffset); /* Relative offset of Local Header */
-
-      /* File/entry name */
-      memcpy (zstream->buffer+packed, zentry->Name, zentry->NameLength);
-      packed += zentry->NameLength;
-
-      if ( zip64 )  /* ZIP64 Extra Field */
-        {
-          zs_packunit16 (zstream, &packed, 1);      /* Extra field ID, 1 = ZIP64 */
-          zs_packunit16 (zstream, &packed, 8);      /* Extra field data length */
-          zs_packunit64 (zstream, &packed, zentry->LocalHeaderOffset); /* Offset to Local Header */
+      /* MixColumns, except in the last round */
+      if ( round < 14 )
+        {
+          for ( col = 0; col < 16; col += 4 )
+            {
+              a0 = t[col]; a1 = t[col + 1]; a2 = t[col + 2]; a3 = t[col + 3];
+              x = a0 ^ a1 ^ a2 ^ a3;
+              t[col]     = a0 ^ x ^ ZS_XTIME(a0 ^ a1);
+              t[col + 1] = a1 ^ x ^ ZS_XTIME(a1 ^ a2);
+              t[col + 2] = a2 ^ x ^ ZS_XTIME(a2 ^ a3);
+              t[col + 3] = a3 ^ x ^ ZS_XTIME(a3 ^ a0);
+            }
         }
 
-      lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
-      if ( lwritestatus != packed )
-        {
-          fprintf (stderr, "Error writing ZIP central directory header: %s\n", strerror(errno));
+      for ( idx = 0; idx < 16; idx++ )
+        state[idx] = t[idx] ^ roundkeys[16 * round + idx];
+    }
+}
 
-          if ( writestatus )
-            *writestatus = lwritestatus;
+/* XOR count blocks with the key stream of blocks counter+1 onwards, portable C */
+static void
+zs_aes_ctr ( const uint8_t *roundkeys, uint64_t counter, uint8_t *data, size_t count )
+{
+  uint8_t block[16];
+  int idx;
 
-          return -1;
-        }
+  while ( count-- )
+    {
+      memset (block, 0, sizeof(block));
+      zs_putunit64 (block, ++counter);
+      zs_aes_block (roundkeys, block);
 
-      zentry = zentry->next;
+      for ( idx = 0; idx < 16; idx++ )
+        data[idx] ^= block[idx];
+
+      data += 16;
     }
+}
 
-  /* Calculate size of Central Directory */
-  cdsize = zstream->WriteOffset - zstream->CentralDirectoryOffset;
+#ifdef ZS_AESNI
+/* XOR count blocks with the key stream using AES-NI, eight blocks in
+ * flight to cover instruction latency */
+__attribute__((target("aes,sse4.1")))
+static void
+zs_aes_ctr_aesni ( const uint8_t *roundkeys, uint64_t counter, uint8_t *data, size_t count )
+{
+  __m128i key[15];
+  __m128i block[8];
+  size_t blocks;
+  size_t idx;
+  int round;
 
-  /* Add ZIP64 structures if offset to Central Directory is beyond limit */
-  if ( zstream->CentralDirectoryOffset > 0xFFFFFFFF )
+  for ( round = 0; round < 15; round++ )
+    key[round] = _mm_loadu_si128 ((const __m128i *)(roundkeys + 16 * round));
+
+  while ( count > 0 )
     {
-      /* Note offset of ZIP64 End of Central Directory Record */
-      zip64endrecord = zstream->WriteOffset;
+      blocks = ( count < 8 ) ? count : 8;
 
-      /* Write ZIP64 End of Central Directory Record, packing into write buffer and swapped to little-endian order */
-      packed = 0;
-      zs_packunit32 (zstream, &packed, ZIP64ENDRECORDSIG); /* ZIP64 End of Central Dir record */
-      zs_packunit64 (zstream, &packed, 44);                /* Size of this record after this field */
-      zs_packunit16 (zstream, &packed, 30);                /* Version made by */
-      zs_packunit16 (zstream, &packed, 45);                /* Version needed to extract */
-      zs_packunit32 (zstream, &packed, 0);                 /* Number of this disk */
-      zs_packunit32 (zstream, &packed, 0);                 /* Disk with start of the CD */
-      zs_packunit64 (zstream, &packed, zstream->EntryCount); /* Number of CD entries on this disk */
-      zs_packunit64 (zstream, &packed, zstream->EntryCount); /* Total number of CD entries */
-      zs_packunit64 (zstream, &packed, cdsize);            /* Size of Central Directory */
-      zs_packunit64 (zstream, &packed, zstream->CentralDirectoryOffset); /* Offset to Central Directory */
+      for ( idx = 0; idx < blocks; idx++ )
+        block[idx] = _mm_xor_si128 (_mm_set_epi64x (0, (long long)(counter + 1 + idx)), key[0]);
 
-      lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
-      if ( lwritestatus != packed )
+      for ( round = 1; round < 14; round++ )
+        for ( idx = 0; idx < blocks; idx++ )
+          block[idx] = _mm_aesenc_si128 (block[idx], key[round]);
+
+      for ( idx = 0; idx < blocks; idx++ )
         {
-          fprintf (stderr, "Error writing ZIP64 end of central directory record: %s\n", strerror(errno));
+          block[idx] = _mm_aesenclast_si128 (block[idx], key[14]);
+          _mm_storeu_si128 ((__m128i *)(data + 16 * idx),
+                            _mm_xor_si128 (block[idx],
+                                           _mm_loadu_si128 ((const __m128i *)(data + 16 * idx))));
+        }
 
-          if ( writestatus )
-            *writestatus = lwritestatus;
+      counter += blocks;
+      count -= blocks;
+      data += 16 * blocks;
+    }
+}
 
-          return -1;
-        }
+/* XOR count blocks with the key stream using 256-bit VAES, two blocks
+ * per register and sixteen blocks in flight, the remainder with AES-NI */
+__attribute__((target("vaes,avx2")))
+static void
+zs_aes_ctr_vaes ( const uint8_t *roundkeys, uint64_t counter, uint8_t *data, size_t count )
+{
+  __m256i key[15];
+  __m256i block[8];
+  int round;
+  int idx;
 
-      /* Write ZIP64 End of Central Directory Locator, packing into write buffer and swapped to little-endian order */
-      packed = 0;
-      zs_packunit32 (zstream, &packed, ZIP64ENDLOCATORSIG); /* ZIP64 End of Central Dir Locator */
-      zs_packunit32 (zstream, &packed, 0);                  /* Number of disk w/ ZIP64 End of CD */
-      zs_packunit64 (zstream, &packed, zip64endrecord);     /* Offset to ZIP64 End of CD */
-      zs_packunit32 (zstream, &packed, 1);                  /* Total number of disks */
+  for ( round = 0; round < 15; round++ )
+    key[round] = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *)(roundkeys + 16 * round)));
 
-      lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
-      if ( lwritestatus != packed )
-        {
-          fprintf (stderr, "Error writing ZIP64 end of central directory locator: %s\n", strerror(errno));
+  while ( count >= 16 )
+    {
+      for ( idx = 0; idx < 8; idx++ )
+        block[idx] = _mm256_xor_si256 (_mm256_set_epi64x (0, (long long)(counter + 2 * idx + 2),
+                                                          0, (long long)(counter + 2 * idx + 1)),
+                                       key[0]);
 
-          if ( writestatus )
-            *writestatus = lwritestatus;
+      for ( round = 1; round < 14; round++ )
+        for ( idx = 0; idx < 8; idx++ )
+          block[idx] = _mm256_aesenc_epi128 (block[idx], key[round]);
 
-          return -1;
+      for ( idx = 0; idx < 8; idx++ )
+        {
+          block[idx] = _mm256_aesenclast_epi128 (block[idx], key[14]);
+          _mm256_storeu_si256 ((__m256i *)(data + 32 * idx),
+                               _mm256_xor_si256 (block[idx],
+                                                 _mm256_loadu_si256 ((const __m256i *)(data + 32 * idx))));
         }
+
+      counter += 16;
+      count -= 16;
+      data += 256;
     }
 
-  /* Write End of Central Directory Record, packing into write buffer and swapped to little-endian order */
-  packed = 0;
-  zs_packunit32 (zstream, &packed, ENDHEADERSIG);     /* End of Central Dir signature */
-  zs_packunit16 (zstream, &packed, 0);                /* Number of this disk */
-  zs_packunit16 (zstream, &packed, 0);                /* Number of disk with CD */
-  zs_packunit16 (zstream, &packed, zstream->EntryCount); /* Number of entries in CD this disk */
-  zs_packunit16 (zstream, &packed, zstream->EntryCount); /* Number of entries in CD */
-  zs_packunit32 (zstream, &packed, cdsize);           /* Size of Central Directory */
-  zs_packunit32 (zstream, &packed, (zstream->CentralDirectoryOffset > 0xFFFFFFFF) ?
-                 0xFFFFFFFF : zstream->CentralDirectoryOffset); /* Offset to start of CD */
-  zs_packunit16 (zstream, &packed, 0);                /* ZIP file comment length */
+  if ( count > 0 )
+    zs_aes_ctr_aesni (roundkeys, counter, data, count);
+}
 
-  lwritestatus = zs_writedata (zstream, zstream->buffer, packed);
-  if ( lwritestatus != packed )
+/* Return non-zero if the OS saves AVX (YMM) state, XGETBV bits 1 and 2 */
+static int
+zs_avxenabled ( void )
+{
+  uint32_t eax, edx;
+
+  __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+
+  return (eax & 6) == 6;
+}
+#endif
+
+/* Select the fastest CTR implementation supported by the processor */
+static void
+zs_aes_ctrselect ( ZSaes *aes )
+{
+#ifdef ZS_AESNI
+  unsigned int eax, ebx, ecx, edx;
+
+  /* AES-NI: CPUID.1:ECX bit 25, with SSE4.1: bit 19, OSXSAVE: bit 27 */
+  if ( __get_cpuid (1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 25)) && (ecx & (1u << 19)) )
     {
-      fprintf (stderr, "Error writing end of central directory record: %s\n", strerror(errno));
+      /* VAES: CPUID.7.0:ECX bit 9, with AVX2: CPUID.7.0:EBX bit 5 */
+      if ( (ecx & (1u << 27)) && zs_avxenabled () &&
+           __get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx) &&
+           (ecx & (1u << 9)) && (ebx & (1u << 5)) )
+        aes->ctr = zs_aes_ctr_vaes;
+      else
+        aes->ctr = zs_aes_ctr_aesni;
 
-      if ( writestatus )
-        *writestatus = lwritestatus;
+      return;
+    }
+#endif
 
-      return -1;
+  aes->ctr = zs_aes_ctr;
+}
+
+/* Encrypt data of any length in place, continuing the key stream */
+static void
+zs_aes_xor ( ZSaes *aes, uint8_t *data, size_t size )
+{
+  size_t blocks;
+
+  /* Rest of a partially used key stream block */
+  while ( aes->padused < sizeof(aes->pad) && size > 0 )
+    {
+      *data++ ^= aes->pad[aes->padused++];
+      size--;
     }
 
-  return 0;
-}  /* End of zs_finish() */
+  if ( size >= 16 )
+    {
+      blocks = size / 16;
+      aes->ctr (aes->roundkeys, aes->counter, data, blocks);
+      aes->counter += blocks;
+      data += 16 * blocks;
+      size -= 16 * blocks;
+    }
 
+  /* Key stream block for a partial block, the rest is kept */
+  if ( size > 0 )
+    {
+      memset (aes->pad, 0, sizeof(aes->pad));
+      aes->ctr (aes->roundkeys, aes->counter, aes->pad, 1);
+      aes->counter++;
 
-/***************************************************************************
- * zs_writedata:
- *
- * Write data to output descriptor in blocks of ZS_WRITE_SIZE bytes.
- *
- * The ZIPstream.WriteOffset value will be incremented accordingly.
- *
- * @return number of bytes written on success and return value of write() on error.
- ***************************************************************************/
-static int64_t
-zs_writedata ( ZIPstream *zstream, uint8_t *writeBuffer, int64_t writeBufferSize )
-{
-  int64_t lwritestatus;
-  size_t writeLength;
-  int64_t written;
+      for ( aes->padused = 0; aes->padused < size; aes->padused++ )
+        data[aes->padused] ^= aes->pad[aes->padused];
+    }
+}
 
-  if ( ! zstream || ! writeBuffer )
-    return 0;
+/* Encrypt data in place and add it to the HMAC in steps of
+ * ZS_AES_STEP bytes, so data is authenticated while in cache */
+static void
+zs_aes_crypt ( ZSaes *aes, uint8_t *data, int64_t size )
+{
+  int64_t step;
 
-  /* Write blocks of ZS_WRITE_SIZE until done */
-  written = 0;
-  while ( written < writeBufferSize )
+  while ( size > 0 )
     {
-      writeLength = ( (writeBufferSize - written) > ZS_WRITE_SIZE ) ?
-        ZS_WRITE_SIZE : (writeBufferSize - written);
+      step = ( size > ZS_AES_STEP ) ? ZS_AES_STEP : size;
 
-      lwritestatus = write (zstream->fd, writeBuffer+written, writeLength);
+      zs_aes_xor (aes, data, step);
+      zs_sha256_update (&aes->hmac, data, step);
 
-      if ( lwritestatus <= 0 )
-        {
-          return lwritestatus;
-        }
+      data += step;
+      size -= step;
+    }
+}
 
-      zstream->WriteOffset += lwritestatus;
-      written += lwritestatus;
+/* Fill a buffer with random bytes from the operating system */
+static int
+zs_random ( uint8_t *buffer, size_t size )
+{
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  unsigned int value;
+
+  while ( size > 0 )
+    {
+      if ( rand_s (&value) )
+        return -1;
+
+      *buffer++ = (uint8_t)value;
+      size--;
     }
 
-  return written;
-}  /* End of zs_writedata() */
+  return 0;
+#else
+  FILE *urandom;
+  size_t got;
 
+  if ( ! (urandom = fopen ("/dev/urandom", "rb")) )
+    return -1;
+
+  got = fread (buffer, 1, size, urandom);
+  fclose (urandom);
+
+  return ( got == size ) ? 0 : -1;
+#endif
+}
 
-/* DOS time start date is January 1, 1980 */
-#define DOSTIME_STARTDATE  0x00210000L
 
 /***************************************************************************
- * zs_datetime_unixtodos:
- *
- * Convert Unix time_t to 4 byte DOS date and time.
- *
- * Routine adapted from sources:
- *  Copyright (C) 2006 Michael Liebscher <johnnycanuck@users.sourceforge.net>
+ * zs_microseconds:
  *
- * @return converted 4-byte quantity on success and 0 on error.
+ * Return a monotonic clock value in microseconds.
  ***************************************************************************/
-static uint32_t
-zs_datetime_unixtodos ( time_t t )
+static int64_t
+zs_microseconds ( void )
 {
-  struct tm s;
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  LARGE_INTEGER counter, frequency;
 
-  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
-  if ( gmtime_s (&s, &t) )
-    return 0;
-  #else
-  if ( gmtime_r (&t, &s) == NULL )
-    return 0;
-  #endif
+  QueryPerformanceCounter (&counter);
+  QueryPerformanceFrequency (&frequency);
 
-  s.tm_year += 1900;
-  s.tm_mon += 1;
+  return (int64_t) (counter.QuadPart / frequency.QuadPart * 1000000 +
+                    counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+  struct timespec ts;
 
-  return ( ((s.tm_year) < 1980) ? DOSTIME_STARTDATE :
-           (((uint32_t)(s.tm_year) - 1980) << 25) |
-           ((uint32_t)(s.tm_mon) << 21) |
-           ((uint32_t)(s.tm_mday) << 16) |
-           ((uint32_t)(s.tm_hour) << 11) |
-           ((uint32_t)(s.tm_min) << 5) |
-           ((uint32_t)(s.tm_sec) >> 1) );
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
 }
 
 
 /***************************************************************************
- * Byte swapping routine:
- *
- * Functions for generalized, in-place byte swapping from host order
- * to little-endian.  A run-time test of byte order is conducted on
- * the first usage and a static variable is used to store the result
- * for later use.
- *
- * The byte-swapping requires memory-aligned quantities.
+ * zs_adapt:
  *
+ * Decide on a level change for adaptive compression at the end of a
+ * window: raise when waiting for output exceeded processing, lower
+ * when it was less than a quarter of processing, after hysteresis
+ * consecutive windows in agreement.  Level 0 selects STORE for
+ * subsequent DEFLATE entries, see zs_setadaptive().
  ***************************************************************************/
 static void
-zs_htolx ( void *data, int size )
+zs_adapt ( ZIPstream *zstream )
 {
-  static int le = -1;
-  int16_t host = 1;
+  int vote = 0;
+
+  if ( zstream->adaptwait > zstream->adaptbusy )
+    vote = 1;
+  else if ( zstream->adaptwait * 4 < zstream->adaptbusy )
+    vote = -1;
 
-  uint16_t *data2;
-  uint32_t *data4;
-  uint32_t h0, h1;
+  if ( vote == 0 )
+    zstream->adaptvotes = 0;
+  else if ( (vote > 0) == (zstream->adaptvotes > 0) )
+    zstream->adaptvotes += vote;
+  else
+    zstream->adaptvotes = vote;
 
-  /* Determine byte order, test for little-endianness */
-  if ( le < 0 )
+  if ( zstream->adaptvotes >= zstream->AdaptiveHysteresis &&
+       zstream->Level < zstream->AdaptiveMax )
     {
-      le = (*((int8_t *)(&host)));
+      zstream->Level++;
+      zstream->LevelChanges++;
+      zstream->adaptvotes = 0;
     }
-
-  /* Swap bytes if not little-endian, requires memory-aligned quantities */
-  if ( le == 0 )
+  else if ( zstream->adaptvotes <= -zstream->AdaptiveHysteresis &&
+            zstream->Level > zstream->AdaptiveMin )
     {
-      switch ( size )
-        {
-        case 2:
-          data2 = (uint16_t *) data;
-          *data2=(((*data2>>8)&0xff) | ((*data2&0xff)<<8));
-          break;
-        case 4:
-          data4 = (uint32_t *) data;
-          *data4=(((*data4>>24)&0xff) | ((*data4&0xff)<<24) |
-                  ((*data4>>8)&0xff00) | ((*data4&0xff00)<<8));
-          break;
-        case 8:
-          data4 = (uint32_t *) data;
+      zstream->Level--;
+      zstream->LevelChanges++;
+      zstream->adaptvotes = 0;
+    }
 
-          h0 = data4[0];
-          h0 = (((h0>>24)&0xff) | ((h0&0xff)<<24) |
-                ((h0>>8)&0xff00) | ((h0&0xff00)<<8));
+  zstream->adaptwait = 0;
+  zstream->adaptbusy = 0;
+  zstream->adaptinput = 0;
+}  /* End of zs_adapt() */
 
-          h1 = data4[1];
-          h1 = (((h1>>24)&0xff) | ((h1&0xff)<<24) |
-                ((h1>>8)&0xff00) | ((h1&0xff00)<<8));
 
-          data4[0] = h1;
-          data4[1] = h0;
-          break;
-        }
-    }
+/***************************************************************************
+ *
+ * Helper functions to write little-endian integer values at any
+ * alignment in a buffer.  Byte order is determined at compile time,
+ * little-endian hosts store values directly and other hosts store
+ * individual bytes.
+ *
+ ***************************************************************************/
+static void zs_putunit16 (uint8_t *P, uint16_t V)
+{
+#ifdef ZS_LITTLE_ENDIAN
+  memcpy (P, &V, 2);
+#else
+  P[0] = (uint8_t)V; P[1] = (uint8_t)(V >> 8);
+#endif
+}
+static void zs_putunit32 (uint8_t *P, uint32_t V)
+{
+#ifdef ZS_LITTLE_ENDIAN
+  memcpy (P, &V, 4);
+#else
+  P[0] = (uint8_t)V; P[1] = (uint8_t)(V >> 8);
+  P[2] = (uint8_t)(V >> 16); P[3] = (uint8_t)(V >> 24);
+#endif
+}
+static void zs_putunit64 (uint8_t *P, uint64_t V)
+{
+#ifdef ZS_LITTLE_ENDIAN
+  memcpy (P, &V, 8);
+#else
+  zs_putunit32 (P, (uint32_t)V);
+  zs_putunit32 (P + 4, (uint32_t)(V >> 32));
+#endif
 }
 
 
@@ -1120,21 +7953,39 @@ zs_htolx ( void *data, int size )
  ***************************************************************************/
 static void zs_packunit16 (ZIPstream *ZS, int *O, uint16_t V)
 {
-  memcpy (ZS->buffer+*O, &V, 2);
-  zs_htolx(ZS->buffer+*O, 2);
+  zs_putunit16 (ZS->buffer+*O, V);
   *O += 2;
 }
 static void zs_packunit32 (ZIPstream *ZS, int *O, uint32_t V)
 {
-  memcpy (ZS->buffer+*O, &V, 4);
-  zs_htolx(ZS->buffer+*O, 4);
+  zs_putunit32 (ZS->buffer+*O, V);
   *O += 4;
 }
 static void zs_packunit64 (ZIPstream *ZS, int *O, uint64_t V)
 {
-  memcpy (ZS->buffer+*O, &V, 8);
-  zs_htolx(ZS->buffer+*O, 8);
+  zs_putunit64 (ZS->buffer+*O, V);
   *O += 8;
 }
 
+
+/***************************************************************************
+ *
+ * Helper functions to read little-endian integer values from any
+ * alignment in a buffer.
+ *
+ ***************************************************************************/
+static uint16_t zs_getunit16 (const uint8_t *P)
+{
+  return (uint16_t)P[0] | ((uint16_t)P[1] << 8);
+}
+static uint32_t zs_getunit32 (const uint8_t *P)
+{
+  return (uint32_t)P[0] | ((uint32_t)P[1] << 8) |
+    ((uint32_t)P[2] << 16) | ((uint32_t)P[3] << 24);
+}
+static uint64_t zs_getunit64 (const uint8_t *P)
+{
+  return (uint64_t)zs_getunit32 (P) | ((uint64_t)zs_getunit32 (P + 4) << 32);
+}
+
 #endif /* NOFDZIP */
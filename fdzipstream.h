@@ -13,6 +13,12 @@
 extern "C" {
 #endif
 
+/* Threaded features, such as pipelined output, require POSIX threads */
+#if !defined(ZS_NOTHREADS) && \
+  (defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64))
+#  define ZS_NOTHREADS 1
+#endif
+
 #ifndef DEF_MEM_LEVEL
 #  if MAX_MEM_LEVEL >= 8
 #    define DEF_MEM_LEVEL 8
@@ -29,16 +35,64 @@ extern "C" {
 #define ZIP64ENDLOCATORSIG  (0x07064b50)
 #define ENDHEADERSIG        (0x06054b50)
 
+/* Private extra field IDs */
+#define ZS_EXTRA_SEEKINDEX  (0x4953)  /* "SI", seek index of DEFLATE entries */
+#define ZS_EXTRA_HASH       (0x4853)  /* "SH", algorithm and digest of entry data */
+
+/* Content hash algorithms, see zs_sethash() */
+#define ZS_HASH_NONE   0
+#define ZS_HASH_SHA256 1
+
+#define ZS_SHA256_LENGTH 32
+
+/* Maximum number of seek points per entry, interval is doubled when reached */
+#define ZS_SEEKPOINTS_MAX 2048
+
 /* Compression methods, match ZIP specification */
 #define ZS_STORE      0
 #define ZS_DEFLATE    8
+#define ZS_AES        99  /* WinZip AES encryption wrapping another method */
+
+/* WinZip AES extra field ID and sizes for AES-256, see zs_setencryption() */
+#define ZS_EXTRA_AES        (0x9901)
+#define ZS_AES_SALT_LENGTH  16
+#define ZS_AES_MAC_LENGTH   10
 
 /* Maximum single size to write(), 1 MiB */
 #define ZS_WRITE_SIZE 1048576
 
+/* Output engines for local files, see zs_setengine() */
+#define ZS_ENGINE_WRITE  0   /* write() to the descriptor, default */
+#define ZS_ENGINE_DIRECT 1   /* O_DIRECT writes of aligned blocks */
+#define ZS_ENGINE_MMAP   2   /* Output placed in mapped windows of a preallocated file */
+
+/* Error policies of additional output destinations, see zs_addoutput() */
+#define ZS_OUTPUT_FAILALL 0  /* Errors fail the stream, a full buffer waits for the destination */
+#define ZS_OUTPUT_DROP    1  /* Errors or a full buffer drop the destination */
+
+/* Default buffer limit of an additional output destination, 16 MiB */
+#define ZS_OUTPUT_LIMIT 16777216
+
+/* O_DIRECT block size and alignment, 4 MiB and 4 KiB, and mmap window, 64 MiB */
+#define ZS_DIRECT_SIZE  4194304
+#define ZS_DIRECT_ALIGN 4096
+#define ZS_MMAP_WINDOW  67108864
+
 /* Multi-use stream buffer, 256 KiB */
 #define ZS_BUFFER_SIZE 262144
 
+/* Minimum stream buffer size for memory profiles */
+#define ZS_BUFFER_MINIMUM 4096
+
+/* Low-memory profile: 4 KiB deflate window, small hash tables and buffer */
+#define ZS_LOWMEM_WINDOWBITS 12
+#define ZS_LOWMEM_MEMLEVEL   2
+#define ZS_LOWMEM_BUFFERSIZE 16384
+
+/* Adaptive compression: input bytes per level decision and default hysteresis */
+#define ZS_ADAPT_WINDOW     1048576
+#define ZS_ADAPT_HYSTERESIS 3
+
 /* Maximum length of file/entry name including NULL terminator */
 #define ZENTRY_NAME_LENGTH 256
 
@@ -58,9 +112,34 @@ typedef struct zipentry_s
   char Name[ZENTRY_NAME_LENGTH];
   struct zipmethod_s *method;    /* Pointer to compression method entry */
   void *methoddata;              /* A private pointer for method data */
+  int32_t FlushInterval;         /* Flush policy: milliseconds between flushes, 0 = off */
+  int64_t FlushBytes;            /* Flush policy: input bytes between flushes, 0 = off */
+  int64_t FlushCount;            /* Number of flushes of entry */
+  int8_t flushpending;           /* Flag: flush requested, private */
+  int64_t flushinput;            /* Input bytes since last flush, private */
+  int64_t flushtime;             /* Time of last flush in milliseconds, private */
+  int64_t SeekInterval;          /* Uncompressed bytes between seek points, 0 = off */
+  uint64_t *seekpoints;          /* Pairs of uncompressed and compressed offsets, private */
+  int32_t seekcount;             /* Number of seek points, private */
+  uint8_t *CentralExtra;         /* Central Directory extra fields, except ZIP64 */
+  uint16_t CentralExtraLength;
+  int8_t CompressionLevel;       /* DEFLATE level in use, changed by adaptive compression */
+  struct zssha256_s *hashstate;  /* Content hash state of entry in progress, private */
+  int8_t raw;                    /* Flag: pre-encoded data written verbatim, private */
   struct zipentry_s *next;
 } ZIPentry;
 
+/* Completed archive part when rotating output */
+typedef struct zippart_s
+{
+  int32_t Number;                /* Part number, starting at 0 */
+  int32_t FirstEntry;            /* Index of first entry counting across all parts */
+  int32_t EntryCount;
+  int64_t Offset;                /* Offset of part as if all parts were concatenated */
+  int64_t Size;
+  struct zippart_s *next;
+} ZIPpart;
+
 /* ZIP output stream managment */
 typedef struct zipstream_s
 {
@@ -71,18 +150,103 @@ typedef struct zipstream_s
   struct zipentry_s *FirstEntry;
   struct zipentry_s *LastEntry;
   struct zipmethod_s *firstMethod;
-  uint8_t buffer[ZS_BUFFER_SIZE];
+  int8_t Appending;              /* Flag: adding to an existing archive */
+  int64_t MaxPartSize;           /* Rotate output after a part reaches this size */
+  int32_t MaxPartEntries;        /* Rotate output after a part reaches this entry count */
+  int32_t PartNumber;
+  int32_t PartFirstEntry;
+  int64_t PartOffset;
+  struct zippart_s *FirstPart;
+  struct zippart_s *LastPart;
+  int (*nextpart)( struct zipstream_s *zstream, int32_t partNumber, void *userdata );
+  void *nextpartdata;
+  struct zspipeline_s *pipeline; /* Pipelined output state, private */
+  int32_t FlushInterval;         /* Default flush policy for new entries, see zs_setflush() */
+  int64_t FlushBytes;
+  int64_t FlushCount;            /* Number of flushes of all entries */
+  int64_t SeekInterval;          /* Default seek point interval for new entries, see zs_setseekpoints() */
+  int8_t WindowBits;             /* Memory profile: deflate window bits, see zs_setmemoryprofile() */
+  int8_t MemLevel;               /* Memory profile: deflate memory level */
+  int32_t BufferSize;            /* Memory profile: size of stream buffer */
+  uint8_t *buffer;               /* Stream buffer, kept during entries or borrowed from pool */
+  int64_t memorycharge;          /* Bytes charged to memory budget, private */
+  int8_t entrycharged;           /* Flag: charge covers an entry in progress, private */
+  struct zsconcurrent_s *concurrent; /* Concurrent submission state, private */
+  int8_t Level;                  /* DEFLATE level, -1 = zlib default, see zs_setlevel() */
+  int8_t AdaptiveMin;            /* Adaptive compression: minimum level, 0 = fall back to STORE */
+  int8_t AdaptiveMax;            /* Adaptive compression: maximum level, 0 = off, see zs_setadaptive() */
+  int32_t AdaptiveHysteresis;    /* Adaptive compression: consecutive agreeing windows per change */
+  int64_t LevelChanges;          /* Number of adaptive level changes */
+  int64_t adaptwait;             /* Microseconds waiting for output in window, private */
+  int64_t adaptbusy;             /* Microseconds processing in window, private */
+  int64_t adaptinput;            /* Input bytes in window, private */
+  int32_t adaptvotes;            /* Consecutive windows to raise (+) or lower (-), private */
+  int8_t HashAlgorithm;          /* Content hash of new entries, see zs_sethash() */
+  char *HashManifest;            /* Name of manifest entry written by zs_finish(), or NULL */
+  int64_t rangestart;            /* Output window of zs_writerange(), private */
+  int64_t rangeend;              /* End of output window, 0 = off, private */
+  struct zsengine_s *engine;     /* Output engine state, NULL = write(), private */
+  char *password;                /* Password for encryption of new entries, private */
+  struct zsfanout_s *fanout;     /* Additional output destinations, NULL = none, private */
+  char *checkpointpath;          /* State file of checkpoints, NULL = off, private */
+  int32_t CheckpointInterval;    /* Seconds between checkpoints, see zs_setcheckpoint() */
+  int32_t CheckpointEntries;     /* Entries between checkpoints */
+  int64_t checkpointtime;        /* Time of last checkpoint in milliseconds, private */
+  int32_t checkpointcount;       /* Entry count at last checkpoint, private */
+  int64_t ChunkSize;             /* HTTP/1.1 chunk size, 0 = not chunked, see zs_setchunked() */
+  char *chunktrailers;           /* Trailer fields written by zs_finish(), private */
 } ZIPstream;
 
 
+/* Planned entry for archive size prediction, see zs_predictsize(),
+ * and deterministic generation, see zs_writerange() */
+typedef struct zipplanentry_s
+{
+  const char *Name;
+  uint64_t Size;                 /* Size of STORE data or of pre-encoded data */
+  int32_t MethodID;              /* ZS_STORE, or method of pre-encoded data */
+  time_t ModTime;                /* Modification time, for zs_writerange() */
+  uint32_t CRC32;                /* CRC-32 of uncompressed data, for zs_writerange() */
+  uint64_t UncompressedSize;     /* Size of pre-encoded data when decoded, for zs_writerange() */
+} ZIPplanentry;
+
+
+/* Entry submitted concurrently, compressed privately by the submitting thread */
+typedef struct zipsubmission_s ZIPsubmission;
+
+
+/* Flush modes for version 2 method process() callbacks */
+#define ZS_METHOD_NOFLUSH 0      /* Consume input, output when ready */
+#define ZS_METHOD_SYNC    1      /* Output all data so far, e.g. Z_SYNC_FLUSH */
+#define ZS_METHOD_FULL    2      /* Output all data and reset state for a seek point */
+#define ZS_METHOD_FINISH  3      /* Output all data and complete the entry */
+
+/* Flags for version 2 methods, see zs_registermethod2() */
+#define ZS_METHOD_CRC     0x1    /* Method sets ZIPentry.CRC32 itself, not calculated */
+
+/* Output of a version 2 method process() callback, either in the
+ * writeBuffer given or in memory of the method, valid until the next
+ * call for the entry */
+typedef struct zipspan_s
+{
+  const uint8_t *data;
+  int64_t size;
+} ZIPspan;
+
 /* List of ZIP method (compression) implementations */
 typedef struct zipmethod_s
 {
   int32_t ID;
+  int32_t version;               /* Callback interface version, 1 or 2 */
+  uint32_t flags;                /* ZS_METHOD_* flags of version 2 methods */
   int32_t (*init)( ZIPstream *zstream, ZIPentry *zentry );
   int32_t (*process)( ZIPstream *zstream, ZIPentry *zentry,
                       uint8_t *entry, int64_t entrySize, int64_t *entryConsumed,
                       uint8_t* writeBuffer, int64_t writeBufferSize );
+  int32_t (*process2)( ZIPstream *zstream, ZIPentry *zentry,
+                       const uint8_t *entry, int64_t entrySize, int64_t *entryConsumed,
+                       int flush, uint8_t *writeBuffer, int64_t writeBufferSize,
+                       ZIPspan *output );
   int32_t (*finish)( ZIPstream *zstream, ZIPentry *zentry );
   struct zipmethod_s* next;
 } ZIPmethod;
@@ -96,10 +260,67 @@ extern  ZIPmethod * zs_registermethod ( ZIPstream *zs, int32_t methodID,
                                         int32_t (*finish)( ZIPstream*, ZIPentry* )
                                         );
 
+extern  ZIPmethod * zs_registermethod2 ( ZIPstream *zs, int32_t methodID, uint32_t flags,
+                                         int32_t (*init)( ZIPstream*, ZIPentry* ),
+                                         int32_t (*process)( ZIPstream*, ZIPentry*,
+                                                             const uint8_t*, int64_t, int64_t*,
+                                                             int, uint8_t*, int64_t,
+                                                             ZIPspan* ),
+                                         int32_t (*finish)( ZIPstream*, ZIPentry* )
+                                         );
+
 extern ZIPstream * zs_init ( int fd, ZIPstream *zs );
 
+extern ZIPstream * zs_initappend ( int fd, ZIPstream *zs );
+
+extern ZIPstream * zs_resume ( int fd, ZIPstream *zs, const char *path );
+
 extern void zs_free ( ZIPstream *zs );
 
+extern int zs_setrotation ( ZIPstream *zstream, int64_t maxPartSize, int32_t maxPartEntries,
+                            int (*nextpart)( ZIPstream*, int32_t, void* ),
+                            void *userdata );
+
+extern int zs_setpipeline ( ZIPstream *zstream, int32_t buffers );
+
+extern int zs_setengine ( ZIPstream *zstream, int engine );
+
+extern int zs_addoutput ( ZIPstream *zstream, int fd, int policy, int64_t limit );
+
+extern int zs_setcheckpoint ( ZIPstream *zstream, const char *path,
+                              int32_t intervalSeconds, int32_t intervalEntries );
+
+extern int zs_checkpoint ( ZIPstream *zstream, const char *path );
+
+extern int zs_setchunked ( ZIPstream *zstream, int64_t chunkSize );
+
+extern int zs_addtrailer ( ZIPstream *zstream, const char *name, const char *value );
+
+extern int zs_setflush ( ZIPstream *zstream, int32_t intervalMs, int64_t intervalBytes );
+
+extern int zs_setseekpoints ( ZIPstream *zstream, int64_t interval );
+
+extern int zs_entryaddextra ( ZIPentry *zentry, uint16_t id,
+                              const uint8_t *data, uint16_t length );
+
+extern int zs_setlevel ( ZIPstream *zstream, int level );
+
+extern int zs_setadaptive ( ZIPstream *zstream, int minLevel, int maxLevel,
+                            int32_t hysteresis );
+
+extern int zs_sethash ( ZIPstream *zstream, int algorithm, const char *manifest );
+
+extern int zs_setencryption ( ZIPstream *zstream, const char *password );
+
+extern const uint8_t * zs_entryhash ( ZIPentry *zentry, int *algorithm );
+
+extern int zs_setmemoryprofile ( ZIPstream *zstream, int windowBits, int memLevel,
+                                 int32_t bufferSize );
+
+extern int zs_setmemorybudget ( int64_t budget );
+
+extern int64_t zs_memoryused ( void );
+
 extern ZIPentry * zs_writeentry ( ZIPstream *zstream, uint8_t *entry, int64_t entrySize,
                                   char *name, time_t modtime, int methodID, int64_t *writestatus );
 
@@ -107,13 +328,46 @@ extern ZIPentry * zs_entrybegin ( ZIPstream *zstream, char *name,
                                   time_t modtime, int methodID,
                                   int64_t *writestatus );
 
+extern ZIPentry * zs_entrybeginraw ( ZIPstream *zstream, char *name,
+                                     time_t modtime, int methodID,
+                                     uint32_t crc, uint64_t uncompressedSize,
+                                     int64_t *writestatus );
+
 extern ZIPentry * zs_entrydata ( ZIPstream *zstream, ZIPentry *zentry,
                                  uint8_t *entry, int64_t entrySize,
                                  int64_t *writestatus );
 
+extern ZIPentry * zs_entryflush ( ZIPstream *zstream, ZIPentry *zentry,
+                                  int64_t *writestatus );
+
 extern ZIPentry * zs_entryend ( ZIPstream *zstream, ZIPentry *zentry,
                                 int64_t *writestatus);
 
+extern int zs_setconcurrent ( ZIPstream *zstream );
+
+extern ZIPsubmission * zs_submitbegin ( ZIPstream *zstream, char *name,
+                                        time_t modtime, int methodID );
+
+extern int zs_submitdata ( ZIPsubmission *submission,
+                           uint8_t *entry, int64_t entrySize );
+
+extern int zs_submitend ( ZIPsubmission *submission );
+
+extern int zs_submitentry ( ZIPstream *zstream, uint8_t *entry, int64_t entrySize,
+                            char *name, time_t modtime, int methodID );
+
+extern int32_t zs_mergearchive ( ZIPstream *zstream, int fd, int64_t *writestatus );
+
+extern int64_t zs_predictsize ( ZIPstream *zstream, const ZIPplanentry *entries,
+                                int32_t count );
+
+extern int zs_writerange ( ZIPstream *zstream, const ZIPplanentry *entries, int32_t count,
+                           uint64_t offset, uint64_t length,
+                           int64_t (*readentry)( int32_t index, uint64_t offset,
+                                                 uint8_t *buffer, int64_t length,
+                                                 void *userdata ),
+                           void *userdata, int64_t *writestatus );
+
 extern int zs_finish ( ZIPstream *zstream, int64_t *writestatus );
 
 
@@ -0,0 +1,1139 @@
+/***************************************************************************
+ * tar2zip.c
+ *
+ * Convert a tar stream, optionally gzip or zstd compressed, read from
+ * stdin into a ZIP archive written to stdout.  Member data is streamed
+ * from the tar stream into archive entries, nothing is written to the
+ * local file system.  All diagnostics are printed to stderr.
+ *
+ * Compile with:
+ *   cc -Wall fdzipstream.c tar2zip.c -o tar2zip -lz -lpthread
+ *
+ * For zstd compressed input add -DTAR2ZIP_ZSTD and -lzstd.
+ *
+ * Copyright 2019 CTrabant
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  #include <io.h>
+  #define TZ_NOTHREADS 1   /* No parallel compression */
+#else
+  #include <unistd.h>
+  #include <pthread.h>
+  #define O_BINARY 0
+#endif
+
+#include <zlib.h>
+
+#ifdef TAR2ZIP_ZSTD
+  #include <zstd.h>
+#endif
+
+#include "fdzipstream.h"
+
+/* Size of reads of member data passed to the archive */
+#define READ_SIZE 1048576
+
+/* Size of buffer for (compressed) input read from the descriptor */
+#define INPUT_SIZE 262144
+
+/* Maximum length of member names, including GNU and pax long names */
+#define NAME_LENGTH 4096
+
+/* Members up to this size are read into memory and compressed by
+ * worker threads, larger members are compressed by the reader */
+#define PARALLEL_MAXIMUM 16777216
+
+/* Maximum number of compression threads */
+#define PARALLEL_THREADS 64
+
+/* Input stream formats */
+#define FORMAT_TAR  0
+#define FORMAT_GZIP 1
+#define FORMAT_ZSTD 2
+
+/* Input stream, decompressed as it is read */
+typedef struct tarinput_s
+{
+  int fd;
+  int format;                    /* FORMAT_TAR, FORMAT_GZIP or FORMAT_ZSTD */
+  uint8_t raw[INPUT_SIZE];       /* Input read from the descriptor */
+  size_t rawsize;
+  size_t rawused;
+  int raweof;                    /* Flag: descriptor at end of file */
+  int framedone;                 /* Flag: compressed member/frame complete */
+  z_stream zstrm;
+#ifdef TAR2ZIP_ZSTD
+  ZSTD_DCtx *dctx;
+#endif
+} TARinput;
+
+/* Tar member header, with GNU and pax extensions applied */
+typedef struct tarmember_s
+{
+  char name[NAME_LENGTH];
+  char type;
+  uint64_t size;
+  time_t mtime;
+} TARmember;
+
+#ifndef TZ_NOTHREADS
+/* Member read into memory for compression by a worker thread */
+typedef struct tarjob_s
+{
+  char *name;
+  time_t mtime;
+  int method;
+  uint8_t *data;
+  int64_t size;
+  struct tarjob_s *next;
+} TARjob;
+
+/* Pool of worker threads submitting members concurrently */
+typedef struct tarpool_s
+{
+  ZIPstream *zstream;
+  pthread_t threads[PARALLEL_THREADS];
+  int count;
+  TARjob *head;
+  TARjob *tail;
+  int pending;                   /* Jobs queued, bounded to limit memory */
+  int finished;                  /* Flag: no more jobs */
+  int failed;                    /* Flag: a submission failed */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} TARpool;
+#endif
+
+static int openinput (TARinput *input, int fd);
+static int64_t readinput (TARinput *input, uint8_t *buffer, int64_t length);
+static int readheader (TARinput *input, TARmember *member);
+static int skipinput (TARinput *input, uint64_t length);
+static int64_t parsenumber (const char *field, int length);
+static void parsepax (const char *data, int64_t size, TARmember *member);
+static char *entryname (TARmember *member);
+#ifndef TZ_NOTHREADS
+static int startpool (TARpool *pool, ZIPstream *zstream, int threads);
+static int queuejob (TARpool *pool, TARjob *job);
+static int stoppool (TARpool *pool);
+#endif
+
+int main (int argc, char *argv[])
+{
+  ZIPstream *zstream = NULL;
+  ZIPentry *zentry = NULL;
+#ifndef TZ_NOTHREADS
+  ZIPsubmission *submission = NULL;
+  TARpool pool;
+  TARjob *job;
+#endif
+
+  TARinput *input = NULL;
+  TARmember member;
+  uint8_t *buffer = NULL;
+  char *name;
+  int64_t writestatus;
+  int64_t readsize;
+  uint64_t remaining;
+  int method = ZS_DEFLATE;
+  int entrymethod;
+  uint64_t padding;
+  int threads = 0;
+  int pipebuffers = 0;
+  int adaptmin = 0;
+  int adaptmax = 0;
+  int entries = 0;
+  int rv;
+  int idx;
+
+  /* Loop through input arguments and process options */
+  for ( idx=1; idx < argc; idx++ )
+    {
+      if ( ! strcmp (argv[idx], "-0") )
+        {
+          method = ZS_STORE;
+          fprintf (stderr, "Storing archive entries, no compression\n");
+        }
+      else if ( ! strcmp (argv[idx], "-j") && (idx+1) < argc )
+        {
+          threads = atoi (argv[++idx]);
+          if ( threads < 0 || threads > PARALLEL_THREADS )
+            {
+              fprintf (stderr, "Invalid thread count: %s\n", argv[idx]);
+              return 1;
+            }
+#ifdef TZ_NOTHREADS
+          fprintf (stderr, "Parallel compression is not supported on this platform\n");
+          return 1;
+#endif
+        }
+      else if ( ! strcmp (argv[idx], "-p") && (idx+1) < argc )
+        {
+          if ( (pipebuffers = atoi (argv[++idx])) <= 1 )
+            {
+              fprintf (stderr, "Invalid pipeline buffer count: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-A") && (idx+1) < argc )
+        {
+          if ( sscanf (argv[++idx], "%d:%d", &adaptmin, &adaptmax) != 2 ||
+               adaptmin < 0 || adaptmax < 1 || adaptmax > 9 || adaptmin > adaptmax )
+            {
+              fprintf (stderr, "Invalid adaptive levels: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else
+        {
+          fprintf (stderr, "tar2zip: convert a tar stream on stdin to a ZIP archive on stdout\n");
+          fprintf (stderr, "Usage: tar2zip [-0] [-j threads | -p buffers] [-A min:max] < input.tar > output.zip\n");
+          fprintf (stderr, "  -0  Store archive entries, default is to deflate entries\n");
+          fprintf (stderr, "  -j threads  Compress members in parallel using threads, members up\n");
+          fprintf (stderr, "              to %d MiB are buffered and added in completion order\n",
+                   PARALLEL_MAXIMUM / 1048576);
+          fprintf (stderr, "  -p buffers  Write output in a separate thread through a ring of buffers\n");
+          fprintf (stderr, "  -A min:max  Adapt deflate level to output speed, min 0 allows storing\n");
+          fprintf (stderr, "\n");
+          fprintf (stderr, "Input may be gzip%s compressed.  Regular files and directories are\n",
+#ifdef TAR2ZIP_ZSTD
+                   " or zstd"
+#else
+                   ""
+#endif
+                   );
+          fprintf (stderr, "added, links and special files are skipped.\n");
+          return ( strcmp (argv[idx], "-h") ) ? 1 : 0;
+        }
+    }
+
+  if ( threads && (pipebuffers || adaptmax) )
+    {
+      fprintf (stderr, "Parallel compression cannot be combined with -p or -A\n");
+      return 1;
+    }
+
+  /* Set stdin and stdout to binary mode for Windows platforms */
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  _setmode( _fileno( stdin ), _O_BINARY );
+  _setmode( _fileno( stdout ), _O_BINARY );
+  #endif
+
+  if ( ! (input = (TARinput *) calloc (1, sizeof(TARinput))) ||
+       ! (buffer = (uint8_t *) malloc (READ_SIZE)) )
+    {
+      fprintf (stderr, "Cannot allocate memory\n");
+      return 1;
+    }
+
+  if ( openinput (input, fileno(stdin)) )
+    return 1;
+
+  if ( (zstream = zs_init (fileno(stdout), NULL)) == NULL )
+    {
+      fprintf (stderr, "Error initializing ZIP archive\n");
+      return 1;
+    }
+
+  if ( pipebuffers && zs_setpipeline (zstream, pipebuffers) )
+    {
+      fprintf (stderr, "Error setting up output pipeline\n");
+      return 1;
+    }
+
+  if ( adaptmax && zs_setadaptive (zstream, adaptmin, adaptmax, 0) )
+    {
+      fprintf (stderr, "Error setting adaptive compression\n");
+      return 1;
+    }
+
+#ifndef TZ_NOTHREADS
+  if ( threads && startpool (&pool, zstream, threads) )
+    {
+      fprintf (stderr, "Error starting compression threads\n");
+      return 1;
+    }
+#endif
+
+  /* Loop through tar members */
+  while ( (rv = readheader (input, &member)) > 0 )
+    {
+      /* Member data is padded to a multiple of 512 bytes */
+      padding = (512 - member.size % 512) % 512;
+
+      if ( member.type != '0' && member.type != '5' )
+        {
+          fprintf (stderr, "Skipping %s, unsupported member type '%c'\n",
+                   member.name, member.type);
+
+          if ( skipinput (input, member.size + padding) )
+            return 1;
+
+          continue;
+        }
+
+      if ( ! (name = entryname (&member)) )
+        {
+          if ( skipinput (input, member.size + padding) )
+            return 1;
+
+          continue;
+        }
+
+      /* Directories are empty entries with a trailing slash */
+      entrymethod = ( member.type == '5' ) ? ZS_STORE : method;
+      remaining = ( member.type == '5' ) ? 0 : member.size;
+
+#ifndef TZ_NOTHREADS
+      /* Members that fit are read into memory for a worker thread */
+      if ( threads && remaining <= PARALLEL_MAXIMUM )
+        {
+          if ( ! (job = (TARjob *) calloc (1, sizeof(TARjob))) ||
+               ! (job->name = strdup (name)) ||
+               ! (job->data = (uint8_t *) malloc ((remaining) ? remaining : 1)) )
+            {
+              fprintf (stderr, "Cannot allocate memory for %s\n", name);
+              return 1;
+            }
+
+          job->mtime = member.mtime;
+          job->method = entrymethod;
+          job->size = remaining;
+
+          if ( readinput (input, job->data, remaining) != (int64_t) remaining )
+            {
+              fprintf (stderr, "Error reading data of %s\n", name);
+              return 1;
+            }
+
+          if ( queuejob (&pool, job) )
+            {
+              fprintf (stderr, "Error submitting entry for %s\n", name);
+              return 1;
+            }
+        }
+      /* Larger members are compressed while reading */
+      else if ( threads )
+        {
+          if ( ! (submission = zs_submitbegin (zstream, name, member.mtime, entrymethod)) )
+            {
+              fprintf (stderr, "Cannot submit ZIP entry for %s\n", name);
+              return 1;
+            }
+
+          while ( remaining > 0 )
+            {
+              readsize = ( remaining > READ_SIZE ) ? READ_SIZE : (int64_t) remaining;
+
+              if ( readinput (input, buffer, readsize) != readsize )
+                {
+                  fprintf (stderr, "Error reading data of %s\n", name);
+                  return 1;
+                }
+
+              if ( zs_submitdata (submission, buffer, readsize) )
+                {
+                  fprintf (stderr, "Error adding entry data to ZIP for %s\n", name);
+                  return 1;
+                }
+
+              remaining -= readsize;
+            }
+
+          if ( zs_submitend (submission) )
+            {
+              fprintf (stderr, "Cannot end ZIP entry for %s\n", name);
+              return 1;
+            }
+        }
+      else
+#endif
+        {
+          if ( ! (zentry = zs_entrybegin (zstream, name, member.mtime,
+                                          entrymethod, &writestatus)) )
+            {
+              fprintf (stderr, "Cannot begin ZIP entry for %s (writestatus: %lld)\n",
+                       name, (long long int) writestatus);
+              return 1;
+            }
+
+          while ( remaining > 0 )
+            {
+              readsize = ( remaining > READ_SIZE ) ? READ_SIZE : (int64_t) remaining;
+
+              if ( readinput (input, buffer, readsize) != readsize )
+                {
+                  fprintf (stderr, "Error reading data of %s\n", name);
+                  return 1;
+                }
+
+              if ( ! zs_entrydata (zstream, zentry, buffer, readsize, &writestatus) )
+                {
+                  fprintf (stderr, "Error adding entry data to ZIP for %s (writestatus: %lld)\n",
+                           name, (long long int) writestatus);
+                  return 1;
+                }
+
+              remaining -= readsize;
+            }
+
+          if ( ! zs_entryend (zstream, zentry, &writestatus) )
+            {
+              fprintf (stderr, "Cannot end ZIP entry for %s (writestatus: %lld)\n",
+                       name, (long long int) writestatus);
+              return 1;
+            }
+        }
+
+      entries++;
+
+      /* Skip any data of a directory member and the padding */
+      if ( skipinput (input, ((member.type == '5') ? member.size : 0) + padding) )
+        return 1;
+    } /* Done looping over tar members */
+
+  if ( rv < 0 )
+    return 1;
+
+#ifndef TZ_NOTHREADS
+  if ( threads && stoppool (&pool) )
+    {
+      fprintf (stderr, "Error compressing entries in parallel\n");
+      return 1;
+    }
+#endif
+
+  /* Finish ZIP archive */
+  if ( zs_finish (zstream, &writestatus) )
+    {
+      fprintf (stderr, "Error finishing ZIP archive (writestatus: %lld)\n",
+               (long long int) writestatus);
+      return 1;
+    }
+
+  fprintf (stderr, "Success, created archive with %d entries from %d members\n",
+           zstream->EntryCount, entries);
+
+  /* Cleanup */
+  zs_free (zstream);
+  free (buffer);
+
+  if ( input->format == FORMAT_GZIP )
+    inflateEnd (&input->zstrm);
+#ifdef TAR2ZIP_ZSTD
+  if ( input->format == FORMAT_ZSTD )
+    ZSTD_freeDCtx (input->dctx);
+#endif
+  free (input);
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * fillinput:
+ *
+ * Read from the input descriptor into the raw buffer when it has been
+ * consumed.
+ *
+ * @return number of unconsumed bytes, 0 at end of file and -1 on error.
+ ***************************************************************************/
+static int64_t
+fillinput (TARinput *input)
+{
+  int64_t readsize;
+
+  if ( input->rawused < input->rawsize )
+    return input->rawsize - input->rawused;
+
+  if ( input->raweof )
+    return 0;
+
+  do
+    readsize = read (input->fd, input->raw, sizeof(input->raw));
+  while ( readsize < 0 && errno == EINTR );
+
+  if ( readsize < 0 )
+    {
+      fprintf (stderr, "Error reading input: %s\n", strerror(errno));
+      return -1;
+    }
+
+  input->rawsize = readsize;
+  input->rawused = 0;
+  input->raweof = ( readsize == 0 );
+
+  return readsize;
+}
+
+
+/***************************************************************************
+ * openinput:
+ *
+ * Initialize an input stream and detect gzip or zstd compression
+ * from the leading magic bytes.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+openinput (TARinput *input, int fd)
+{
+  int64_t readsize;
+
+  input->fd = fd;
+
+  /* Read at least the magic bytes, pipes may return less */
+  while ( input->rawsize < 4 )
+    {
+      readsize = read (fd, input->raw + input->rawsize, sizeof(input->raw) - input->rawsize);
+
+      if ( readsize < 0 && errno == EINTR )
+        continue;
+
+      if ( readsize < 0 )
+        {
+          fprintf (stderr, "Error reading input: %s\n", strerror(errno));
+          return -1;
+        }
+
+      if ( readsize == 0 )
+        {
+          input->raweof = 1;
+          break;
+        }
+
+      input->rawsize += readsize;
+    }
+
+  if ( input->rawsize >= 2 && input->raw[0] == 0x1f && input->raw[1] == 0x8b )
+    {
+      input->format = FORMAT_GZIP;
+
+      /* Decode gzip wrapper only */
+      if ( inflateInit2 (&input->zstrm, 16 + MAX_WBITS) != Z_OK )
+        {
+          fprintf (stderr, "Cannot initialize gzip decompression\n");
+          return -1;
+        }
+    }
+  else if ( input->rawsize >= 4 && input->raw[0] == 0x28 && input->raw[1] == 0xb5 &&
+            input->raw[2] == 0x2f && input->raw[3] == 0xfd )
+    {
+#ifdef TAR2ZIP_ZSTD
+      input->format = FORMAT_ZSTD;
+
+      if ( ! (input->dctx = ZSTD_createDCtx ()) )
+        {
+          fprintf (stderr, "Cannot initialize zstd decompression\n");
+          return -1;
+        }
+#else
+      fprintf (stderr, "Input is zstd compressed, rebuild with -DTAR2ZIP_ZSTD -lzstd\n");
+      return -1;
+#endif
+    }
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * readinput:
+ *
+ * Read and decompress up to length bytes of the tar stream.
+ * Concatenated gzip members and zstd frames are decoded in sequence.
+ *
+ * @return number of bytes read, less than length only at the end of
+ * the stream, and -1 on error.
+ ***************************************************************************/
+static int64_t
+readinput (TARinput *input, uint8_t *buffer, int64_t length)
+{
+  int64_t total = 0;
+  int64_t available;
+  int64_t readsize;
+  int zrv;
+#ifdef TAR2ZIP_ZSTD
+  ZSTD_inBuffer zin;
+  ZSTD_outBuffer zout;
+  size_t zsrv;
+#endif
+
+  while ( total < length )
+    {
+      if ( input->format == FORMAT_TAR )
+        {
+          /* Consume buffered input, then read directly into the buffer */
+          if ( input->rawused < input->rawsize )
+            {
+              available = input->rawsize - input->rawused;
+              if ( available > length - total )
+                available = length - total;
+
+              memcpy (buffer + total, input->raw + input->rawused, available);
+              input->rawused += available;
+              total += available;
+              continue;
+            }
+
+          if ( input->raweof )
+            break;
+
+          readsize = read (input->fd, buffer + total, length - total);
+
+          if ( readsize < 0 && errno == EINTR )
+            continue;
+
+          if ( readsize < 0 )
+            {
+              fprintf (stderr, "Error reading input: %s\n", strerror(errno));
+              return -1;
+            }
+
+          if ( readsize == 0 )
+            input->raweof = 1;
+
+          total += readsize;
+          continue;
+        }
+
+      if ( (available = fillinput (input)) < 0 )
+        return -1;
+
+      if ( available == 0 )
+        {
+          if ( ! input->framedone )
+            {
+              fprintf (stderr, "Compressed input is truncated\n");
+              return -1;
+            }
+
+          break;
+        }
+
+      if ( input->format == FORMAT_GZIP )
+        {
+          /* Start the next of concatenated gzip members */
+          if ( input->framedone )
+            {
+              inflateReset (&input->zstrm);
+              input->framedone = 0;
+            }
+
+          input->zstrm.next_in = input->raw + input->rawused;
+          input->zstrm.avail_in = (uInt) available;
+          input->zstrm.next_out = buffer + total;
+          input->zstrm.avail_out = (uInt) (length - total);
+
+          zrv = inflate (&input->zstrm, Z_NO_FLUSH);
+
+          if ( zrv != Z_OK && zrv != Z_STREAM_END && zrv != Z_BUF_ERROR )
+            {
+              fprintf (stderr, "Error decompressing gzip input: %s\n",
+                       ( input->zstrm.msg ) ? input->zstrm.msg : "unknown error");
+              return -1;
+            }
+
+          input->rawused = input->rawsize - input->zstrm.avail_in;
+          total = length - input->zstrm.avail_out;
+          input->framedone = ( zrv == Z_STREAM_END );
+        }
+#ifdef TAR2ZIP_ZSTD
+      else if ( input->format == FORMAT_ZSTD )
+        {
+          zin.src = input->raw;
+          zin.size = input->rawsize;
+          zin.pos = input->rawused;
+          zout.dst = buffer;
+          zout.size = length;
+          zout.pos = total;
+
+          zsrv = ZSTD_decompressStream (input->dctx, &zout, &zin);
+
+          if ( ZSTD_isError (zsrv) )
+            {
+              fprintf (stderr, "Error decompressing zstd input: %s\n",
+                       ZSTD_getErrorName (zsrv));
+              return -1;
+            }
+
+          input->rawused = zin.pos;
+          total = zout.pos;
+          input->framedone = ( zsrv == 0 );
+        }
+#endif
+    }
+
+  return total;
+}
+
+
+/***************************************************************************
+ * skipinput:
+ *
+ * Read and discard length bytes of the tar stream.
+ *
+ * @return 0 on success and non-zero on error or end of stream.
+ ***************************************************************************/
+static int
+skipinput (TARinput *input, uint64_t length)
+{
+  uint8_t block[16384];
+  int64_t readsize;
+
+  while ( length > 0 )
+    {
+      readsize = ( length > sizeof(block) ) ? (int64_t) sizeof(block) : (int64_t) length;
+
+      if ( readinput (input, block, readsize) != readsize )
+        {
+          fprintf (stderr, "Unexpected end of tar stream\n");
+          return -1;
+        }
+
+      length -= readsize;
+    }
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * readheader:
+ *
+ * Read the next member header of the tar stream.  GNU long name ('L')
+ * and pax extended ('x') headers are read and applied to the member
+ * they precede, other extension headers are skipped.  The member data
+ * follows in the stream.
+ *
+ * @return 1 for a member, 0 at the end of the archive and -1 on error.
+ ***************************************************************************/
+static int
+readheader (TARinput *input, TARmember *member)
+{
+  uint8_t header[512];
+  char *data = NULL;
+  char longname[NAME_LENGTH] = "";
+  TARmember extended;
+  int64_t readsize;
+  int64_t checksum;
+  int64_t sum;
+  int64_t signedsum;
+  int idx;
+
+  memset (&extended, 0, sizeof(TARmember));
+  extended.mtime = -1;
+  extended.size = UINT64_MAX;
+
+  while ( 1 )
+    {
+      if ( (readsize = readinput (input, header, sizeof(header))) < 0 )
+        return -1;
+
+      /* End of stream without end-of-archive blocks is accepted */
+      if ( readsize == 0 )
+        return 0;
+
+      if ( readsize != sizeof(header) )
+        {
+          fprintf (stderr, "Unexpected end of tar stream\n");
+          return -1;
+        }
+
+      /* A zero block marks the end of the archive */
+      for ( idx = 0; idx < (int) sizeof(header) && header[idx] == 0; idx++ );
+      if ( idx == sizeof(header) )
+        return 0;
+
+      /* Checksum is the sum of header bytes with the checksum field as
+       * spaces, some old implementations summed signed bytes */
+      checksum = parsenumber ((char *) header + 148, 8);
+      for ( sum = 0, signedsum = 0, idx = 0; idx < (int) sizeof(header); idx++ )
+        {
+          sum += ( idx >= 148 && idx < 156 ) ? ' ' : header[idx];
+          signedsum += ( idx >= 148 && idx < 156 ) ? ' ' : (signed char) header[idx];
+        }
+
+      if ( checksum != sum && checksum != signedsum )
+        {
+          fprintf (stderr, "Invalid tar header checksum, input is not a tar stream\n");
+          return -1;
+        }
+
+      member->type = ( header[156] == '\0' || header[156] == '7' ) ? '0' : (char) header[156];
+      member->mtime = (time_t) parsenumber ((char *) header + 136, 12);
+
+      if ( parsenumber ((char *) header + 124, 12) < 0 )
+        {
+          fprintf (stderr, "Invalid tar member size\n");
+          return -1;
+        }
+      member->size = (uint64_t) parsenumber ((char *) header + 124, 12);
+
+      /* Name, prefixed by the ustar prefix field */
+      if ( ! memcmp (header + 257, "ustar", 5) && header[345] )
+        snprintf (member->name, sizeof(member->name), "%.155s/%.100s",
+                  (char *) header + 345, (char *) header);
+      else
+        snprintf (member->name, sizeof(member->name), "%.100s", (char *) header);
+
+      /* Extension headers apply to the following member */
+      if ( member->type == 'L' || member->type == 'x' )
+        {
+          if ( member->size >= NAME_LENGTH * 16 ||
+               ! (data = (char *) malloc (member->size + 1)) )
+            {
+              fprintf (stderr, "Unsupported extended header of %llu bytes\n",
+                       (unsigned long long int) member->size);
+              return -1;
+            }
+
+          if ( readinput (input, (uint8_t *) data, member->size) != (int64_t) member->size ||
+               skipinput (input, (512 - member->size % 512) % 512) )
+            {
+              fprintf (stderr, "Unexpected end of tar stream\n");
+              free (data);
+              return -1;
+            }
+
+          data[member->size] = '\0';
+
+          if ( member->type == 'L' )
+            snprintf (longname, sizeof(longname), "%s", data);
+          else
+            parsepax (data, member->size, &extended);
+
+          free (data);
+          continue;
+        }
+      else if ( member->type == 'K' || member->type == 'g' )
+        {
+          if ( skipinput (input, member->size + (512 - member->size % 512) % 512) )
+            return -1;
+
+          continue;
+        }
+
+      break;
+    }
+
+  if ( extended.name[0] )
+    snprintf (member->name, sizeof(member->name), "%s", extended.name);
+  else if ( longname[0] )
+    snprintf (member->name, sizeof(member->name), "%s", longname);
+
+  if ( extended.mtime >= 0 )
+    member->mtime = extended.mtime;
+
+  if ( extended.size != UINT64_MAX )
+    member->size = extended.size;
+
+  /* Only regular files have data in the stream, except for old
+   * directory members that are otherwise treated the same */
+  if ( member->type == '1' || member->type == '2' ||
+       member->type == '3' || member->type == '4' || member->type == '6' )
+    member->size = 0;
+
+  return 1;
+}
+
+
+/***************************************************************************
+ * parsenumber:
+ *
+ * Parse a tar header number field, octal or GNU base-256 when the
+ * high bit of the first byte is set.
+ *
+ * @return parsed value, or -1 for a negative or invalid number.
+ ***************************************************************************/
+static int64_t
+parsenumber (const char *field, int length)
+{
+  const uint8_t *bytes = (const uint8_t *) field;
+  int64_t value = 0;
+  int idx;
+
+  if ( bytes[0] & 0x80 )
+    {
+      /* Negative base-256 values are not sizes or times we accept */
+      if ( bytes[0] & 0x40 )
+        return -1;
+
+      value = bytes[0] & 0x3f;
+      for ( idx = 1; idx < length; idx++ )
+        {
+          if ( value > (INT64_MAX >> 8) )
+            return -1;
+
+          value = (value << 8) | bytes[idx];
+        }
+
+      return value;
+    }
+
+  for ( idx = 0; idx < length && (field[idx] == ' ' || field[idx] == '\0'); idx++ );
+
+  for ( ; idx < length && field[idx] >= '0' && field[idx] <= '7'; idx++ )
+    value = (value << 3) | (field[idx] - '0');
+
+  return value;
+}
+
+
+/***************************************************************************
+ * parsepax:
+ *
+ * Parse pax extended header records of the form "length key=value\n"
+ * and set the path, mtime and size of the member.
+ ***************************************************************************/
+static void
+parsepax (const char *data, int64_t size, TARmember *member)
+{
+  const char *record = data;
+  const char *key;
+  const char *value;
+  long long int length;
+  char *end;
+
+  while ( record < data + size )
+    {
+      length = strtoll (record, &end, 10);
+
+      if ( length <= 0 || record + length > data + size || *end != ' ' ||
+           record[length - 1] != '\n' )
+        break;
+
+      key = end + 1;
+      if ( ! (value = memchr (key, '=', record + length - key)) )
+        break;
+      value++;
+
+      if ( ! strncmp (key, "path=", 5) )
+        snprintf (member->name, sizeof(member->name), "%.*s",
+                  (int) (record + length - 1 - value), value);
+      else if ( ! strncmp (key, "mtime=", 6) )
+        member->mtime = (time_t) strtoll (value, NULL, 10);
+      else if ( ! strncmp (key, "size=", 5) )
+        member->size = strtoull (value, NULL, 10);
+
+      record += length;
+    }
+}
+
+
+/***************************************************************************
+ * entryname:
+ *
+ * Convert a member name to an archive entry name: leading "./" and
+ * "/" are removed and directory names end with a slash.
+ *
+ * @return entry name, or NULL if the member should be skipped.
+ ***************************************************************************/
+static char *
+entryname (TARmember *member)
+{
+  char *name = member->name;
+  size_t length;
+
+  while ( name[0] == '/' || (name[0] == '.' && name[1] == '/') )
+    name += ( name[0] == '/' ) ? 1 : 2;
+
+  length = strlen (name);
+
+  if ( length == 0 || ! strcmp (name, ".") )
+    return NULL;
+
+  if ( member->type == '5' && name[length - 1] != '/' )
+    {
+      if ( name + length + 1 >= member->name + sizeof(member->name) )
+        return NULL;
+
+      name[length++] = '/';
+      name[length] = '\0';
+    }
+
+  if ( length >= ZENTRY_NAME_LENGTH )
+    {
+      fprintf (stderr, "Skipping %s, name longer than %d bytes\n",
+               name, ZENTRY_NAME_LENGTH - 1);
+      return NULL;
+    }
+
+  return name;
+}
+
+
+#ifndef TZ_NOTHREADS
+/***************************************************************************
+ * worker:
+ *
+ * Thread submitting queued members to the archive until the pool is
+ * finished.
+ ***************************************************************************/
+static void *
+worker (void *arg)
+{
+  TARpool *pool = (TARpool *) arg;
+  TARjob *job;
+  int failed;
+
+  while ( 1 )
+    {
+      pthread_mutex_lock (&pool->lock);
+
+      while ( ! pool->head && ! pool->finished )
+        pthread_cond_wait (&pool->cond, &pool->lock);
+
+      if ( ! (job = pool->head) )
+        {
+          pthread_mutex_unlock (&pool->lock);
+          break;
+        }
+
+      if ( ! (pool->head = job->next) )
+        pool->tail = NULL;
+
+      pthread_mutex_unlock (&pool->lock);
+
+      failed = zs_submitentry (pool->zstream, job->data, job->size,
+                               job->name, job->mtime, job->method);
+
+      if ( failed )
+        fprintf (stderr, "Error submitting entry for %s\n", job->name);
+
+      free (job->data);
+      free (job->name);
+      free (job);
+
+      /* Wake the reader waiting for queue space */
+      pthread_mutex_lock (&pool->lock);
+      if ( failed )
+        pool->failed = 1;
+      pool->pending--;
+      pthread_cond_broadcast (&pool->cond);
+      pthread_mutex_unlock (&pool->lock);
+    }
+
+  return NULL;
+}
+
+
+/***************************************************************************
+ * startpool:
+ *
+ * Enable concurrent submission and start worker threads.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+startpool (TARpool *pool, ZIPstream *zstream, int threads)
+{
+  int rv;
+
+  memset (pool, 0, sizeof(TARpool));
+  pool->zstream = zstream;
+
+  if ( zs_setconcurrent (zstream) )
+    return -1;
+
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->cond, NULL);
+
+  for ( pool->count = 0; pool->count < threads; pool->count++ )
+    {
+      if ( (rv = pthread_create (&pool->threads[pool->count], NULL, worker, pool)) )
+        {
+          fprintf (stderr, "Cannot create thread: %s\n", strerror(rv));
+          stoppool (pool);
+          return -1;
+        }
+    }
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * queuejob:
+ *
+ * Queue a member for a worker thread, waiting while two members per
+ * thread are already queued to bound memory use.
+ *
+ * @return 0 on success and non-zero if a submission has failed.
+ ***************************************************************************/
+static int
+queuejob (TARpool *pool, TARjob *job)
+{
+  pthread_mutex_lock (&pool->lock);
+
+  while ( pool->pending >= 2 * pool->count && ! pool->failed )
+    pthread_cond_wait (&pool->cond, &pool->lock);
+
+  if ( pool->failed )
+    {
+      pthread_mutex_unlock (&pool->lock);
+      free (job->data);
+      free (job->name);
+      free (job);
+      return -1;
+    }
+
+  if ( pool->tail )
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pool->pending++;
+
+  pthread_cond_broadcast (&pool->cond);
+  pthread_mutex_unlock (&pool->lock);
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * stoppool:
+ *
+ * Let worker threads complete queued members and join them.
+ *
+ * @return 0 on success and non-zero if a submission has failed.
+ ***************************************************************************/
+static int
+stoppool (TARpool *pool)
+{
+  int idx;
+
+  pthread_mutex_lock (&pool->lock);
+  pool->finished = 1;
+  pthread_cond_broadcast (&pool->cond);
+  pthread_mutex_unlock (&pool->lock);
+
+  for ( idx = 0; idx < pool->count; idx++ )
+    pthread_join (pool->threads[idx], NULL);
+
+  pthread_cond_destroy (&pool->cond);
+  pthread_mutex_destroy (&pool->lock);
+
+  return pool->failed;
+}
+#endif
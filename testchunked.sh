@@ -0,0 +1,108 @@
+#!/bin/sh
+#
+# testchunked.sh
+#
+# Test chunked output of zipfiles -k (see zs_setchunked()) with the
+# zipunchunk decoder: the framing of every chunk, chunk sizes, the last,
+# zero-length chunk and the X-Zip-Entries trailer must be valid, and the
+# decoded body must be identical to the archive written without -k.
+# Archives are tested with unzip when it is available.
+#
+# Usage: ./testchunked.sh
+
+bindir=$(cd "$(dirname "$0")" && pwd)
+zipfiles=$bindir/zipfiles
+zipunchunk=$bindir/zipunchunk
+
+if [ ! -x "$zipfiles" ] || [ ! -x "$zipunchunk" ]; then
+  echo "Build zipfiles and zipunchunk first, e.g. make" >&2
+  exit 1
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+failures=0
+
+fail () {
+  echo "FAIL: $*" >&2
+  failures=$((failures + 1))
+}
+
+# Input of an empty file, random data and compressible text
+mkdir "$dir/input"
+: > "$dir/input/empty"
+head -c 300000 /dev/urandom > "$dir/input/random"
+yes "testchunked compressible line of text" | head -c 1000000 > "$dir/input/text"
+files="empty random text"
+
+unzip=$(command -v unzip)
+
+# Decode chunked output of zipfiles with options, check chunk sizes
+# against maxchunk and the entry count trailer, and compare with the
+# archive written without -k
+check () {
+  label=$1
+  maxchunk=$2
+  entries=$3
+  shift 3
+
+  (cd "$dir/input" && "$zipfiles" "$@" $files > "$dir/plain.zip" 2>/dev/null) ||
+    { fail "$label: cannot write archive"; return 1; }
+
+  (cd "$dir/input" && "$zipfiles" -k $maxchunk "$@" $files > "$dir/chunked" 2>/dev/null) ||
+    { fail "$label: cannot write chunked archive"; return 1; }
+
+  [ "$maxchunk" -eq 0 ] && maxchunk=262144
+
+  if ! "$zipunchunk" -m $maxchunk -t "$dir/trailers" < "$dir/chunked" > "$dir/body.zip" 2>"$dir/log"; then
+    fail "$label: $(cat "$dir/log")"
+    return 1
+  fi
+
+  if ! grep -qx "X-Zip-Entries: $entries" "$dir/trailers"; then
+    fail "$label: expected X-Zip-Entries: $entries trailer, got: $(cat "$dir/trailers")"
+    return 1
+  fi
+
+  if ! cmp -s "$dir/plain.zip" "$dir/body.zip"; then
+    fail "$label: decoded body differs from archive"
+    return 1
+  fi
+
+  if [ -n "$unzip" ] && ! unzip -tq "$dir/body.zip" > /dev/null 2>&1; then
+    fail "$label: unzip test failed"
+    return 1
+  fi
+
+  echo "ok: $label: $(cat "$dir/log")"
+}
+
+check "deflate, buffer size chunks" 0 3
+check "store, 1000 byte chunks" 1000 3 -0
+check "deflate, 4096 byte chunks, pipelined" 4096 3 -p 4
+check "hash manifest" 0 4 -H SUMS
+
+# Output ends with the last chunk and trailer, the decoder must reject
+# a body without them
+(cd "$dir/input" && "$zipfiles" -k 0 $files > "$dir/chunked" 2>/dev/null)
+printf '\r\n0\r\nX-Zip-Entries: 3\r\n\r\n' > "$dir/end"
+size=$(wc -c < "$dir/chunked")
+end=$(wc -c < "$dir/end")
+
+if ! tail -c $end "$dir/chunked" | cmp -s - "$dir/end"; then
+  fail "chunked output does not end with the last chunk and trailer"
+elif head -c $((size - end + 2)) "$dir/chunked" | "$zipunchunk" > /dev/null 2>&1; then
+  fail "decoder accepts a body without the last chunk"
+elif head -c $((size - 2)) "$dir/chunked" | "$zipunchunk" > /dev/null 2>&1; then
+  fail "decoder accepts a body without the end of the trailer section"
+else
+  echo "ok: output ends with the last chunk and trailer, truncation is detected"
+fi
+
+if [ $failures -gt 0 ]; then
+  echo "$failures test(s) failed" >&2
+  exit 1
+fi
+
+echo "All tests passed"
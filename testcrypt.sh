@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# testcrypt.sh
+#
+# Test that archives encrypted by zipfiles -e (see zs_setencryption())
+# hold no fingerprint of the plaintext: content hashes (-H) must be
+# refused with encryption, and the SHA-256 of no input file may appear
+# in an encrypted archive.  As a control, the digests must be found in
+# an unencrypted archive with content hashes.
+#
+# Usage: ./testcrypt.sh
+
+zipfiles=$(cd "$(dirname "$0")" && pwd)/zipfiles
+
+if [ ! -x "$zipfiles" ]; then
+  echo "Build zipfiles first, e.g. make" >&2
+  exit 1
+fi
+
+if ! command -v sha256sum > /dev/null; then
+  echo "sha256sum is required" >&2
+  exit 1
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+failures=0
+
+fail () {
+  echo "FAIL: $*" >&2
+  failures=$((failures + 1))
+}
+
+# Input of an empty file, random data and compressible text
+mkdir "$dir/input"
+: > "$dir/input/empty"
+head -c 300000 /dev/urandom > "$dir/input/random"
+yes "testcrypt compressible line of text" | head -c 1000000 > "$dir/input/text"
+files="empty random text"
+
+digests=$(cd "$dir/input" && sha256sum $files | cut -d ' ' -f 1)
+
+# Count input files whose digest appears in an archive
+found () {
+  od -An -tx1 -v "$1" | tr -d ' \n' > "$dir/hex"
+  count=0
+  for digest in $digests; do
+    grep -q "$digest" "$dir/hex" && count=$((count + 1))
+  done
+  echo $count
+}
+
+# Control: digests are stored in an unencrypted archive with hashes
+(cd "$dir/input" && "$zipfiles" -H SUMS $files > "$dir/hashed.zip" 2>/dev/null)
+if [ "$(found "$dir/hashed.zip")" -ne 3 ]; then
+  fail "digests not found in an archive with content hashes"
+else
+  echo "ok: digests found in an unencrypted archive with content hashes"
+fi
+
+# Content hashes are refused with encryption
+if (cd "$dir/input" && "$zipfiles" -e secret -H SUMS $files > "$dir/refused.zip" 2>/dev/null); then
+  fail "content hashes accepted with encryption"
+else
+  echo "ok: content hashes refused with encryption"
+fi
+
+for options in "-e secret" "-0 -e secret" "-p 4 -e secret"; do
+  if ! (cd "$dir/input" && "$zipfiles" $options $files > "$dir/encrypted.zip" 2>/dev/null); then
+    fail "$options: cannot write encrypted archive"
+  elif [ "$(found "$dir/encrypted.zip")" -ne 0 ]; then
+    fail "$options: plaintext digest found in encrypted archive"
+  else
+    echo "ok: $options: no plaintext digest in encrypted archive"
+  fi
+done
+
+if [ $failures -gt 0 ]; then
+  echo "$failures test(s) failed" >&2
+  exit 1
+fi
+
+echo "All tests passed"
@@ -0,0 +1,183 @@
+#!/bin/sh
+#
+# testplan.sh
+#
+# Test zs_predictsize() and zs_writerange() with the zipplan example:
+# for STORE'd, deflated and AES encrypted entries and the ZIP64 edge
+# cases of 65535 entries and offsets beyond 4 GiB, the predicted size
+# must match the archive written, and ranges written with
+# zs_writerange() must match the same bytes of the complete archive as
+# cut by dd.  Archives are tested with unzip when it is available.
+#
+# Usage: ./testplan.sh
+#
+# The archive beyond 4 GiB is only written as ranges near its end and
+# 4 GiB boundary, plus a sparse file for unzip to list.
+
+zipplan=$(cd "$(dirname "$0")" && pwd)/zipplan
+
+if [ ! -x "$zipplan" ]; then
+  echo "Build zipplan first, e.g. make zipplan" >&2
+  exit 1
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+failures=0
+
+fail () {
+  echo "FAIL: $*" >&2
+  failures=$((failures + 1))
+}
+
+# Cut length bytes at offset of a file, length 0 for the rest of it
+slice () {
+  if [ "$3" -eq 0 ]; then
+    dd if="$1" bs=65536 iflag=skip_bytes skip="$2" 2>/dev/null
+  else
+    dd if="$1" bs=65536 iflag=skip_bytes,count_bytes skip="$2" count="$3" 2>/dev/null
+  fi
+}
+
+# Check that the predicted size matches the archive written by adding
+# entries, and that the archive is valid
+checksize () {
+  label=$1
+  shift
+
+  predicted=$("$zipplan" -p "$@") || { fail "$label: cannot predict size"; return 1; }
+
+  if ! "$zipplan" "$@" > "$dir/full.zip"; then
+    fail "$label: cannot write archive"
+    return 1
+  fi
+
+  size=$(wc -c < "$dir/full.zip")
+  if [ "$size" -ne "$predicted" ]; then
+    fail "$label: predicted $predicted bytes, wrote $size bytes"
+    return 1
+  fi
+
+  # unzip cannot test AES encrypted entries and reports empty archives
+  case " $* " in
+    *" -e "*|*" -n 0 "*) ;;
+    *)
+      if [ -n "$unzip" ] && ! unzip -tq "$dir/full.zip" > /dev/null 2>&1; then
+        fail "$label: unzip test failed"
+        return 1
+      fi
+      ;;
+  esac
+
+  echo "ok: $label: $size bytes as predicted"
+}
+
+# Check ranges written with zs_writerange() against dd of the complete
+# archive written with zs_writerange()
+checkranges () {
+  label=$1
+  shift
+
+  if ! "$zipplan" -w "$@" > "$dir/range.zip"; then
+    fail "$label: cannot write archive with zs_writerange()"
+    return 1
+  fi
+
+  size=$(wc -c < "$dir/range.zip")
+  half=$((size / 2))
+
+  for range in 0:0 0:1 0:30 1:29 30:1000 100:0 \
+               $half:1 $half:65536 $((half - 100000)):200000 \
+               $((size - 22)):0 $((size - 100)):100 $((size - 1)):1 $size:0 $size:10; do
+    offset=${range%:*}
+    length=${range#*:}
+    [ "$offset" -lt 0 ] && continue
+
+    if ! "$zipplan" -r "$range" "$@" > "$dir/part"; then
+      fail "$label: cannot write range $range"
+      continue
+    fi
+
+    if ! slice "$dir/range.zip" "$offset" "$length" | cmp -s - "$dir/part"; then
+      fail "$label: range $range differs from the complete archive"
+      return 1
+    fi
+  done
+
+  echo "ok: $label: ranges match the complete archive of $size bytes"
+}
+
+unzip=$(command -v unzip)
+
+checksize "store" -n 8 -s 300000
+checksize "store, empty archive" -n 0
+checksize "deflate" -m deflate -n 8 -s 1000000
+checksize "AES store" -e secret -n 8 -s 300000
+checksize "AES deflate" -e secret -m deflate -n 8 -s 1000000
+checksize "65534 entries" -n 65534 -s 16
+checksize "65535 entries" -n 65535 -s 16
+checksize "70000 entries" -n 70000 -s 16
+
+checkranges "store" -n 8 -s 300000
+checkranges "deflate" -m deflate -n 8 -s 1000000
+checkranges "65535 entries" -n 65535 -s 16
+
+# Deflated entries are pre-encoded, zs_writerange() writes the same
+# archive as adding them
+"$zipplan" -m deflate -n 8 -s 1000000 > "$dir/full.zip"
+"$zipplan" -w -m deflate -n 8 -s 1000000 > "$dir/range.zip"
+if cmp -s "$dir/full.zip" "$dir/range.zip"; then
+  echo "ok: deflate: zs_writerange() archive matches added entries"
+else
+  fail "deflate: zs_writerange() archive differs from added entries"
+fi
+
+# Beyond 4 GiB: 5 entries of 0 to 4e9 bytes, the last starting at 6e9
+large="-n 5 -s 4000000000"
+predicted=$("$zipplan" -p $large)
+tail=$((predicted - 2000000))
+
+if ! "$zipplan" -r $tail:0 $large > "$dir/tail"; then
+  fail "4 GiB: cannot write the end of the archive"
+elif [ "$(wc -c < "$dir/tail")" -ne 2000000 ]; then
+  fail "4 GiB: end of archive is not at the predicted $predicted bytes"
+elif ! od -An -tx1 -v "$dir/tail" | tr -d ' \n' | grep -q 504b0606; then
+  fail "4 GiB: no ZIP64 End of Central Directory Record"
+else
+  echo "ok: 4 GiB: $predicted bytes as predicted, with ZIP64 end records"
+fi
+
+for range in $((tail + 1000000)):1000 $((predicted - 22)):22; do
+  offset=${range%:*}
+  length=${range#*:}
+  "$zipplan" -r $range $large > "$dir/part"
+  if ! slice "$dir/tail" $((offset - tail)) "$length" | cmp -s - "$dir/part"; then
+    fail "4 GiB: range $range differs"
+  fi
+done
+
+"$zipplan" -r 4294966000:5000 $large > "$dir/boundary"
+"$zipplan" -r 4294967000:2000 $large > "$dir/part"
+if slice "$dir/boundary" 1000 2000 | cmp -s - "$dir/part"; then
+  echo "ok: 4 GiB: ranges across the 4 GiB boundary match"
+else
+  fail "4 GiB: ranges across the 4 GiB boundary differ"
+fi
+
+# List the Central Directory from a sparse file of the archive size
+if [ -n "$unzip" ]; then
+  dd if="$dir/tail" of="$dir/sparse.zip" bs=65536 oflag=seek_bytes seek=$tail 2>/dev/null
+  if unzip -l "$dir/sparse.zip" 2>/dev/null | grep -q "entry0000004"; then
+    echo "ok: 4 GiB: unzip lists the Central Directory"
+  else
+    fail "4 GiB: unzip cannot list the Central Directory"
+  fi
+fi
+
+if [ $failures -gt 0 ]; then
+  echo "$failures test(s) failed" >&2
+  exit 1
+fi
+
+echo "All tests passed"
@@ -0,0 +1,130 @@
+/***************************************************************************
+ * zipcdbench.c
+ *
+ * Benchmark writing the Central Directory of an archive with many
+ * entries: add a number of one-byte STORE'd entries, default one
+ * million, and time adding them and zs_finish().  The archive is
+ * written to stdout, all diagnostics are printed to stderr.
+ *
+ * Compile with:
+ *   cc -O2 -Wall fdzipstream.c zipcdbench.c -o zipcdbench -lz -lpthread
+ *
+ * Example, median of several runs is recommended:
+ *   ./zipcdbench 1000000 > /tmp/cdbench.zip
+ *
+ * Copyright 2019 CTrabant
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  #include <io.h>
+  #include <fcntl.h>
+#endif
+
+#include "fdzipstream.h"
+
+/* Default number of entries */
+#define CDBENCH_ENTRIES 1000000
+
+static double seconds (void);
+
+int main (int argc, char *argv[])
+{
+  ZIPstream *zstream;
+  ZIPentry *zentry;
+
+  int64_t writestatus;
+  uint8_t data = 'x';
+  char name[32];
+  long entries = CDBENCH_ENTRIES;
+  long idx;
+  double start;
+  double added;
+  double finished;
+
+  if ( argc > 2 || (argc == 2 && (entries = atol (argv[1])) <= 0) )
+    {
+      fprintf (stderr, "zipcdbench: time writing an archive of many small entries to stdout\n");
+      fprintf (stderr, "Usage: zipcdbench [entries] > output.zip\n");
+      fprintf (stderr, "  entries  Number of one-byte STORE'd entries, default %d\n", CDBENCH_ENTRIES);
+      return 1;
+    }
+
+  /* Set stdout to binary mode for Windows platforms */
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  _setmode( _fileno( stdout ), _O_BINARY );
+  #endif
+
+  if ( (zstream = zs_init (fileno (stdout), NULL)) == NULL )
+    {
+      fprintf (stderr, "Error initializing ZIP archive\n");
+      return 1;
+    }
+
+  start = seconds ();
+
+  for ( idx = 0; idx < entries; idx++ )
+    {
+      snprintf (name, sizeof(name), "entry%07ld", idx);
+
+      if ( ! (zentry = zs_writeentry (zstream, &data, 1, name, 0, ZS_STORE, &writestatus)) )
+        {
+          fprintf (stderr, "Error adding entry %s (writestatus: %lld)\n",
+                   name, (long long int) writestatus);
+          zs_free (zstream);
+          return 1;
+        }
+    }
+
+  added = seconds ();
+
+  if ( zs_finish (zstream, &writestatus) )
+    {
+      fprintf (stderr, "Error finishing ZIP archive (writestatus: %lld)\n",
+               (long long int) writestatus);
+      zs_free (zstream);
+      return 1;
+    }
+
+  finished = seconds ();
+
+  fprintf (stderr, "%ld entries, %lld bytes: entries %.3f s, zs_finish() %.3f s\n",
+           entries, (long long int) zstream->WriteOffset,
+           added - start, finished - added);
+
+  zs_free (zstream);
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * seconds:
+ *
+ * Return the current wall clock time in seconds.
+ ***************************************************************************/
+static double
+seconds (void)
+{
+  struct timespec ts;
+
+  timespec_get (&ts, TIME_UTC);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
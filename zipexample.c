@@ -6,7 +6,7 @@
  * An example of how to use fdzipstream.[ch]
  *
  * Compile with:
- *   cc -Wall fdzipstream.c zipexample.c -o zipexample -lz
+ *   cc -Wall fdzipstream.c zipexample.c -o zipexample -lz -lpthread
  *
  * Copyright 2019 CTrabant
  *
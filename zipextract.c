@@ -0,0 +1,344 @@
+/***************************************************************************
+ * zipextract.c
+ *
+ * List or extract entries from a ZIP archive using fdzipreader.c.
+ * All diagnostics are printed to stderr.
+ *
+ * Compile with:
+ *   cc -Wall fdzipreader.c zipextract.c -o zipextract -lz -lpthread
+ *
+ * Copyright 2019 CTrabant
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fdzipreader.h"
+
+static int writefile (int fd, const uint8_t *data, int64_t dataSize);
+static int extractentry (ZIPreader *zr, ZIPrentry *zrentry,
+                         const uint8_t *data, int64_t dataSize, void *userdata);
+
+int main (int argc, char *argv[])
+{
+  ZIPreader *zr = NULL;
+  ZIPrentry *zrentry = NULL;
+
+  const uint8_t *data;
+  uint8_t *buffer;
+  int64_t dataSize;
+
+  char *archive = NULL;
+  char *directory = ".";
+  int list = 0;
+  int pipe = 0;
+  int threads = 1;
+  int names = 0;
+  int range = 0;
+  unsigned long long int rangeOffset = 0;
+  long long int rangeLength = 0;
+  int rv = 0;
+  int fd;
+  int idx;
+  int64_t eidx;
+
+  if ( argc < 2 )
+    {
+      fprintf (stderr, "zipextract: list or extract entries from a ZIP archive\n");
+      fprintf (stderr, "Usage: zipextract [-l] [-p [-R offset:length]] [-j threads] [-d dir] <archive.zip> [entry] ...\n");
+      fprintf (stderr, "  -l          List archive entries\n");
+      fprintf (stderr, "  -p          Write specified entries to stdout\n");
+      fprintf (stderr, "  -R off:len  With -p, write len bytes from offset off of specified entries\n");
+      fprintf (stderr, "  -j threads  Extract all entries using threads, default 1\n");
+      fprintf (stderr, "  -d dir      Extract entries into dir, default is current directory\n");
+      fprintf (stderr, "\n");
+      fprintf (stderr, "With no entries specified all entries are extracted.\n");
+      return 0;
+    }
+
+  /* Loop through input arguments and process options, shift entry names down */
+  for ( idx=1; idx < argc; idx++ )
+    {
+      if ( ! strcmp (argv[idx], "-l") )
+        {
+          list = 1;
+        }
+      else if ( ! strcmp (argv[idx], "-p") )
+        {
+          pipe = 1;
+        }
+      else if ( ! strcmp (argv[idx], "-R") && (idx+1) < argc )
+        {
+          if ( sscanf (argv[++idx], "%llu:%lld", &rangeOffset, &rangeLength) != 2 ||
+               rangeLength < 0 )
+            {
+              fprintf (stderr, "Invalid range: %s\n", argv[idx]);
+              return 1;
+            }
+          range = 1;
+        }
+      else if ( ! strcmp (argv[idx], "-j") && (idx+1) < argc )
+        {
+          threads = atoi (argv[++idx]);
+        }
+      else if ( ! strcmp (argv[idx], "-d") && (idx+1) < argc )
+        {
+          directory = argv[++idx];
+        }
+      else if ( ! archive )
+        {
+          archive = argv[idx];
+        }
+      else
+        {
+          argv[names++] = argv[idx];
+        }
+    }
+
+  if ( ! archive )
+    {
+      fprintf (stderr, "No archive specified\n");
+      return 1;
+    }
+
+  if ( (fd = open (archive, O_RDONLY)) < 0 )
+    {
+      fprintf (stderr, "Cannot open %s: %s\n", archive, strerror(errno));
+      return 1;
+    }
+
+  /* Map archive and index Central Directory */
+  if ( (zr = zr_open (fd)) == NULL )
+    {
+      fprintf (stderr, "Error reading ZIP archive %s\n", archive);
+      close (fd);
+      return 1;
+    }
+
+  if ( list )
+    {
+      for ( eidx = 0; eidx < zr->EntryCount; eidx++ )
+        {
+          zrentry = &zr->entries[eidx];
+
+          printf ("%12llu %12llu  %s  %.*s\n",
+                  (unsigned long long int) zrentry->UncompressedSize,
+                  (unsigned long long int) zrentry->CompressedSize,
+                  ( zrentry->CompressionMethod == ZS_STORE ) ? "store  " :
+                  ( zrentry->CompressionMethod == ZS_DEFLATE ) ? "deflate" : "other  ",
+                  zrentry->NameLength, zrentry->Name);
+        }
+    }
+  else if ( names == 0 )
+    {
+      if ( chdir (directory) )
+        {
+          fprintf (stderr, "Cannot change to directory %s: %s\n", directory, strerror(errno));
+          rv = 1;
+        }
+      else if ( zr_extractall (zr, threads, extractentry, NULL) )
+        {
+          fprintf (stderr, "Error extracting entries from %s\n", archive);
+          rv = 1;
+        }
+    }
+  else
+    {
+      if ( ! pipe && chdir (directory) )
+        {
+          fprintf (stderr, "Cannot change to directory %s: %s\n", directory, strerror(errno));
+          rv = 1;
+        }
+
+      for ( idx = 0; idx < names && rv == 0; idx++ )
+        {
+          if ( (zrentry = zr_find (zr, argv[idx])) == NULL )
+            {
+              fprintf (stderr, "Cannot find entry %s\n", argv[idx]);
+              rv = 1;
+              break;
+            }
+
+          /* Ranges are inflated from the nearest seek point */
+          if ( range && pipe )
+            {
+              if ( ! (buffer = (uint8_t *) malloc ((rangeLength) ? rangeLength : 1)) ||
+                   (dataSize = zr_extractrange (zr, zrentry, rangeOffset,
+                                                buffer, rangeLength)) < 0 )
+                {
+                  fprintf (stderr, "Cannot extract range of entry %s\n", argv[idx]);
+                  rv = 1;
+                }
+              else if ( writefile (fileno(stdout), buffer, dataSize) )
+                {
+                  rv = 1;
+                }
+
+              free (buffer);
+              continue;
+            }
+
+          /* STORE'd entries are used directly from the mapped archive,
+           * after verifying sizes and CRC */
+          if ( zrentry->CompressionMethod == ZS_STORE )
+            {
+              buffer = NULL;
+              data = zr_storeddata (zr, zrentry);
+            }
+          else
+            {
+              data = buffer = (uint8_t *) malloc ((zrentry->UncompressedSize) ?
+                                                  zrentry->UncompressedSize : 1);
+
+              if ( buffer &&
+                   zr_extract (zr, zrentry, buffer, zrentry->UncompressedSize) < 0 )
+                data = NULL;
+            }
+
+          if ( ! data )
+            {
+              fprintf (stderr, "Cannot extract entry %s\n", argv[idx]);
+              rv = 1;
+            }
+          else if ( pipe )
+            {
+              if ( writefile (fileno(stdout), data, zrentry->UncompressedSize) )
+                rv = 1;
+            }
+          else if ( extractentry (zr, zrentry, data, zrentry->UncompressedSize, NULL) )
+            {
+              rv = 1;
+            }
+
+          if ( buffer )
+            free (buffer);
+        }
+    }
+
+  zr_close (zr);
+  close (fd);
+
+  return rv;
+}
+
+
+/***************************************************************************
+ * writefile:
+ *
+ * Write all data to a file descriptor.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+writefile (int fd, const uint8_t *data, int64_t dataSize)
+{
+  ssize_t written;
+
+  while ( dataSize > 0 )
+    {
+      written = write (fd, data, ( dataSize > 1048576 ) ? 1048576 : dataSize);
+
+      if ( written <= 0 )
+        {
+          fprintf (stderr, "Error writing output: %s\n", strerror(errno));
+          return -1;
+        }
+
+      data += written;
+      dataSize -= written;
+    }
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * extractentry:
+ *
+ * Write entry content to a file named for the entry, relative to the
+ * current directory, creating parent directories as needed.  Entry
+ * names that are absolute or contain ".." components are refused.
+ *
+ * Used as the zr_extractall() callback and may be run concurrently.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+extractentry (ZIPreader *zr, ZIPrentry *zrentry,
+              const uint8_t *data, int64_t dataSize, void *userdata)
+{
+  char path[4096];
+  char *slash;
+  int fd;
+  int rv;
+
+  (void)zr;
+  (void)userdata;
+
+  if ( zrentry->NameLength == 0 || zrentry->NameLength >= sizeof(path) )
+    {
+      fprintf (stderr, "Skipping entry with unsupported name length %d\n",
+               zrentry->NameLength);
+      return 0;
+    }
+
+  memcpy (path, zrentry->Name, zrentry->NameLength);
+  path[zrentry->NameLength] = '\0';
+
+  if ( path[0] == '/' || ! strcmp (path, "..") || ! strncmp (path, "../", 3) ||
+       strstr (path, "/../") ||
+       ( strlen (path) >= 3 && ! strcmp (path + strlen (path) - 3, "/..") ) )
+    {
+      fprintf (stderr, "Skipping entry with unsafe name %s\n", path);
+      return 0;
+    }
+
+  /* Create parent directories, an existing directory is not an error */
+  for ( slash = strchr (path, '/'); slash; slash = strchr (slash + 1, '/') )
+    {
+      *slash = '\0';
+      if ( mkdir (path, 0777) && errno != EEXIST )
+        {
+          fprintf (stderr, "Cannot create directory %s: %s\n", path, strerror(errno));
+          return -1;
+        }
+      *slash = '/';
+    }
+
+  /* Directory entries end with a slash and have been created */
+  if ( path[zrentry->NameLength - 1] == '/' )
+    return 0;
+
+  if ( (fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 )
+    {
+      fprintf (stderr, "Cannot open %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  rv = writefile (fd, data, dataSize);
+
+  if ( close (fd) )
+    {
+      fprintf (stderr, "Error closing %s: %s\n", path, strerror(errno));
+      rv = -1;
+    }
+
+  return rv;
+}
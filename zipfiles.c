@@ -5,7 +5,7 @@
  * and write archive to stdout.  All diagnostics are printed to stderr.
  *
  * Compile with:
- *   cc -Wall fdzipstream.c zipfiles.c -o zipfiles -lz
+ *   cc -Wall fdzipstream.c zipfiles.c -o zipfiles -lz -lpthread
  *
  * Copyright 2019 CTrabant
  *
@@ -27,16 +27,117 @@
 #include <stdlib.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/stat.h>
 
+#include <fcntl.h>
+
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
-  #include <fcntl.h>
+  #include <io.h>
+  #define ZF_NOPOSIX 1   /* No threads or directory walking */
+#else
+  #include <unistd.h>
+  #include <dirent.h>
+  #include <pthread.h>
+  #include <sys/mman.h>
+  #define O_BINARY 0
 #endif
 
+#include <zlib.h>
+
 #include "fdzipstream.h"
 
 #define MAXIMUM_READ 10485760
 
+/* Number of input files opened ahead of the compressor */
+#define PREFETCH_DEPTH 64
+
+/* Default number of threads opening input files */
+#define PREFETCH_THREADS 4
+
+/* Leading bytes of each input file to request read-ahead for */
+#define PREFETCH_ADVISE 4194304
+
+/* Regular files at least this size are memory mapped instead of read */
+#define MMAP_MINIMUM 1048576
+
+/* Size of memory mapped window, unmapped after use to bound memory */
+#define MMAP_WINDOW 67108864
+
+/* Maximum number of additional copies of the archive */
+#define MAX_COPIES 8
+
+/* Input file, named and opened ahead of use */
+typedef struct inputfile_s
+{
+  char *path;
+  int fd;
+  int error;                     /* errno value of failed open/stat or 0 */
+  int ready;                     /* Flag: opened or failed */
+  struct stat st;
+} INPUTfile;
+
+#ifndef ZF_NOPOSIX
+/* Directory entry name and type from readdir() */
+typedef struct walkname_s
+{
+  char *name;
+  unsigned char type;
+} WALKname;
+
+/* Directory being walked in recursive mode */
+typedef struct walkdir_s
+{
+  DIR *dir;
+  char *path;
+  WALKname *names;
+  int count;
+  int next;
+  struct walkdir_s *parent;
+} WALKdir;
+#endif
+
+/* Ordered queue of input files: names are produced by walking
+ * arguments, standard input and directories, opened by prefetch
+ * threads and consumed in order by the compressor. */
+typedef struct inputqueue_s
+{
+  char **names;
+  int namecount;
+  int nextname;
+  int recursive;
+  int readstdin;
+  INPUTfile slot[PREFETCH_DEPTH];
+  uint64_t produced;
+  uint64_t claimed;
+  uint64_t consumed;
+  int finished;                  /* Flag: all names produced */
+#ifndef ZF_NOPOSIX
+  struct walkdir_s *walk;
+  int threads;
+  pthread_t producer;
+  pthread_t workers[PREFETCH_DEPTH];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+} INPUTqueue;
+
+static int nextpart (ZIPstream *zstream, int32_t partNumber, void *userdata);
+static int64_t parsesize (const char *string);
+static int comparename (const void *a, const void *b);
+static int inarchive (char **names, int count, const char *path, int gunzip);
+static int startinput (INPUTqueue *queue);
+static INPUTfile *nextinput (INPUTqueue *queue);
+static void doneinput (INPUTqueue *queue);
+static int producename (INPUTqueue *queue, char **path, int *error);
+static void openinput (INPUTfile *input);
+static int addgzip (ZIPstream *zstream, INPUTfile *input, uint8_t *buffer,
+                    uint64_t bufferlength, ZIPentry **zentry, int64_t *writestatus);
+#ifndef ZF_NOPOSIX
+static int addmapped (ZIPstream *zstream, ZIPentry *zentry, INPUTfile *input,
+                      int64_t *writestatus);
+#endif
+
 int main (int argc, char *argv[])
 {
   ZIPstream *zstream = NULL;
@@ -47,148 +148,1542 @@ int main (int argc, char *argv[])
   int64_t writestatus;
 
   int method = ZS_DEFLATE;
+  char *append = NULL;
+  char *resume = NULL;
+  char *checkpoint = NULL;
+  int32_t checkpointsec = 60;
+  int64_t chunksize = -1;
+  char entries[32];
+  char **resumed = NULL;
+  int resumedcount = 0;
+  char *prefix = NULL;
+  int64_t partsize = 0;
+  int32_t partentries = 0;
+  int files = 0;
   int fd;
   int idx;
 
-  FILE *input;
-  struct stat st;
+  INPUTqueue queue;
+  INPUTfile *input;
+  FILE *manifest;
+  ZIPpart *part;
+  char partname[4096];
 
-  uint64_t readsize;
+  int64_t readsize;
+  int mapped;
+  int gunzip = 0;
+  int gzipped;
+  int pipebuffers = 0;
+  int engine = ZS_ENGINE_WRITE;
+  int lowmem = 0;
+  int flushms = 0;
+  int64_t flushbytes = 0;
+  int64_t seekinterval = 0;
+  int adaptmin = 0;
+  int adaptmax = 0;
+  char *manifestname = NULL;
+  char *password = NULL;
+  char *copies[MAX_COPIES];
+  int copypolicy[MAX_COPIES];
+  int copyfds[MAX_COPIES];
+  int copycount = 0;
+  int predict = 0;
+  int64_t predicted = -1;
+  ZIPplanentry *plan;
+  struct stat st;
 
   if ( argc < 2 )
     {
       fprintf (stderr, "zipfiles: write a ZIP archive to stdout containing specified files\n");
-      fprintf (stderr, "Usage: zipfiles [-0] <file1> [file2] ... > output.zip\n");
+      fprintf (stderr, "Usage: zipfiles [-0] [-r] [-@] [-m] [-P threads] [-p buffers] [-E engine] [-f ms] [-b size] [-x size] [-A min:max] [-H name] [-e password] [-g] [-z] [-t|-T copy] [-k size] [-c state [-C sec]] [-a|-R archive] [-o prefix [-s size] [-n count]] <file1> [file2] ... > output.zip\n");
       fprintf (stderr, "  -0  Store archive entries, default is to deflate entries\n");
+      fprintf (stderr, "  -r  Recurse into directories, adding regular files\n");
+      fprintf (stderr, "  -@  Read file names from stdin, one per line, after any specified\n");
+      fprintf (stderr, "  -m  Use low-memory profile, smaller deflate window and buffers\n");
+      fprintf (stderr, "  -P threads  Number of threads opening files ahead, default %d\n", PREFETCH_THREADS);
+      fprintf (stderr, "  -p buffers  Write output in a separate thread through a ring of buffers\n");
+      fprintf (stderr, "  -E engine   Output engine for local files: direct (O_DIRECT) or mmap,\n");
+      fprintf (stderr, "              mmap requires read-write output, e.g. 1<> output.zip\n");
+      fprintf (stderr, "  -f ms       Flush entry data at least every ms milliseconds, for live streaming\n");
+      fprintf (stderr, "  -b size     Flush entry data after every size bytes of input\n");
+      fprintf (stderr, "  -x size     Add seek points to deflated entries every size bytes\n");
+      fprintf (stderr, "  -A min:max  Adapt deflate level to output speed, min 0 allows storing\n");
+      fprintf (stderr, "  -H name     Hash entries with SHA-256, add manifest entry name for sha256sum -c\n");
+      fprintf (stderr, "  -e password Encrypt entries with WinZip AES-256 using password\n");
+      fprintf (stderr, "  -g          Add single-member .gz files as DEFLATE entries of their content\n");
+      fprintf (stderr, "              without recompression, named without .gz\n");
+      fprintf (stderr, "  -z          With -0, predict archive size before writing and verify it\n");
+      fprintf (stderr, "  -t copy     Also write the archive to file copy, failing if it cannot be written\n");
+      fprintf (stderr, "  -T copy     Also write the archive to file copy, dropped if slow or failing\n");
+      fprintf (stderr, "  -k size     Write HTTP/1.1 chunked transfer encoding, chunks of at most size\n");
+      fprintf (stderr, "              bytes or 0 for the buffer size, with an X-Zip-Entries trailer\n");
+      fprintf (stderr, "  -c state    Checkpoint the archive to state file at entry boundaries\n");
+      fprintf (stderr, "  -C sec      Seconds between checkpoints, default 60\n");
+      fprintf (stderr, "  -a archive  Add entries to existing archive instead of writing to stdout\n");
+      fprintf (stderr, "  -R archive  Resume interrupted archive from -c state, skipping files in it\n");
+      fprintf (stderr, "  -o prefix   Write archive parts to prefix.NNN.zip and manifest to prefix.manifest\n");
+      fprintf (stderr, "  -s size     Start a new part after size bytes, with optional k, M or G suffix\n");
+      fprintf (stderr, "  -n count    Start a new part after count entries\n");
       fprintf (stderr, "\n");
       return 0;
     }
 
-  /* Set stdout to binary mode for Windows platforms */
-  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
-  _setmode( _fileno( stdout ), _O_BINARY );
-  #endif
+  memset (&queue, 0, sizeof(INPUTqueue));
+#ifndef ZF_NOPOSIX
+  queue.threads = PREFETCH_THREADS;
+#endif
+
+  /* Loop through input arguments and process options, shift file names down */
+  for ( idx=1; idx < argc; idx++ )
+    {
+      if ( ! strcmp (argv[idx], "-0") )
+        {
+          method = ZS_STORE;
+          fprintf (stderr, "Storing archive entries, no compression\n");
+        }
+      else if ( ! strcmp (argv[idx], "-r") )
+        {
+#ifdef ZF_NOPOSIX
+          fprintf (stderr, "Recursive mode is not supported on this platform\n");
+          return 1;
+#endif
+          queue.recursive = 1;
+        }
+      else if ( ! strcmp (argv[idx], "-@") )
+        {
+          queue.readstdin = 1;
+        }
+      else if ( ! strcmp (argv[idx], "-m") )
+        {
+          lowmem = 1;
+        }
+      else if ( ! strcmp (argv[idx], "-z") )
+        {
+          predict = 1;
+        }
+      else if ( ! strcmp (argv[idx], "-g") )
+        {
+          gunzip = 1;
+        }
+      else if ( (! strcmp (argv[idx], "-t") || ! strcmp (argv[idx], "-T")) && (idx+1) < argc )
+        {
+          if ( copycount >= MAX_COPIES )
+            {
+              fprintf (stderr, "Too many copies, maximum is %d\n", MAX_COPIES);
+              return 1;
+            }
 
-  /* Set output stream to stdout */
-  fd = fileno (stdout);
+          copypolicy[copycount] = ( argv[idx][1] == 't' ) ? ZS_OUTPUT_FAILALL : ZS_OUTPUT_DROP;
+          copies[copycount++] = argv[++idx];
+        }
+      else if ( ! strcmp (argv[idx], "-P") && (idx+1) < argc )
+        {
+#ifndef ZF_NOPOSIX
+          queue.threads = atoi (argv[++idx]);
+          if ( queue.threads < 0 || queue.threads > PREFETCH_DEPTH )
+            {
+              fprintf (stderr, "Invalid prefetch thread count: %s\n", argv[idx]);
+              return 1;
+            }
+#else
+          idx++;
+#endif
+        }
+      else if ( ! strcmp (argv[idx], "-p") && (idx+1) < argc )
+        {
+          if ( (pipebuffers = atoi (argv[++idx])) <= 1 )
+            {
+              fprintf (stderr, "Invalid pipeline buffer count: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-E") && (idx+1) < argc )
+        {
+          idx++;
+          if ( ! strcmp (argv[idx], "direct") )
+            engine = ZS_ENGINE_DIRECT;
+          else if ( ! strcmp (argv[idx], "mmap") )
+            engine = ZS_ENGINE_MMAP;
+          else
+            {
+              fprintf (stderr, "Invalid output engine: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-f") && (idx+1) < argc )
+        {
+          if ( (flushms = atoi (argv[++idx])) <= 0 )
+            {
+              fprintf (stderr, "Invalid flush interval: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-b") && (idx+1) < argc )
+        {
+          if ( (flushbytes = parsesize (argv[++idx])) <= 0 )
+            {
+              fprintf (stderr, "Invalid flush size: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-x") && (idx+1) < argc )
+        {
+          if ( (seekinterval = parsesize (argv[++idx])) <= 0 )
+            {
+              fprintf (stderr, "Invalid seek point interval: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-A") && (idx+1) < argc )
+        {
+          if ( sscanf (argv[++idx], "%d:%d", &adaptmin, &adaptmax) != 2 ||
+               adaptmin < 0 || adaptmax < 1 || adaptmax > 9 || adaptmin > adaptmax )
+            {
+              fprintf (stderr, "Invalid adaptive levels: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-H") && (idx+1) < argc )
+        {
+          manifestname = argv[++idx];
+        }
+      else if ( ! strcmp (argv[idx], "-e") && (idx+1) < argc )
+        {
+          password = argv[++idx];
+        }
+      else if ( ! strcmp (argv[idx], "-a") && (idx+1) < argc )
+        {
+          append = argv[++idx];
+        }
+      else if ( ! strcmp (argv[idx], "-k") && (idx+1) < argc )
+        {
+          if ( (chunksize = parsesize (argv[++idx])) < 0 )
+            {
+              fprintf (stderr, "Invalid chunk size: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-R") && (idx+1) < argc )
+        {
+          resume = argv[++idx];
+        }
+      else if ( ! strcmp (argv[idx], "-c") && (idx+1) < argc )
+        {
+          checkpoint = argv[++idx];
+        }
+      else if ( ! strcmp (argv[idx], "-C") && (idx+1) < argc )
+        {
+          if ( (checkpointsec = atoi (argv[++idx])) <= 0 )
+            {
+              fprintf (stderr, "Invalid checkpoint interval: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-o") && (idx+1) < argc )
+        {
+          prefix = argv[++idx];
+        }
+      else if ( ! strcmp (argv[idx], "-s") && (idx+1) < argc )
+        {
+          if ( (partsize = parsesize (argv[++idx])) <= 0 )
+            {
+              fprintf (stderr, "Invalid part size: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-n") && (idx+1) < argc )
+        {
+          if ( (partentries = atoi (argv[++idx])) <= 0 )
+            {
+              fprintf (stderr, "Invalid part entry count: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else
+        {
+          argv[files++] = argv[idx];
+        }
+    }
 
-  /* Initialize ZIP container */
-  if ( (zstream = zs_init (fd, NULL)) == NULL )
+  if ( resume && (! checkpoint || append || prefix || copycount) )
     {
-      fprintf (stderr, "Error initializing ZIP archive\n");
+      fprintf (stderr, "Resuming requires -c state and cannot be combined with -a, -o, -t or -T\n");
       return 1;
     }
 
-  /* Loop through input arguments and process options */
-  for ( idx=1; idx < argc; idx++ )
+  if ( resume )
     {
-      if ( ! strncmp (argv[idx], "-0", 2) )
+      /* Open interrupted archive, truncated at the last checkpoint */
+      if ( (fd = open (resume, O_RDWR | O_BINARY)) < 0 )
         {
-          method = ZS_STORE;
-          fprintf (stderr, "Storing archive entries, no compression\n");
-          continue;
+          fprintf (stderr, "Cannot open %s: %s\n", resume, strerror(errno));
+          return 1;
+        }
+
+      if ( (zstream = zs_resume (fd, NULL, checkpoint)) == NULL )
+        {
+          fprintf (stderr, "Error resuming %s from %s\n", resume, checkpoint);
+          return 1;
+        }
+
+      /* Sorted names of entries already in the archive, to skip */
+      if ( ! (resumed = (char **) malloc (((zstream->EntryCount) ? zstream->EntryCount : 1) *
+                                          sizeof(char *))) )
+        {
+          fprintf (stderr, "Cannot allocate memory for resumed entries\n");
+          return 1;
         }
+
+      for ( zentry = zstream->FirstEntry; zentry; zentry = zentry->next )
+        resumed[resumedcount++] = zentry->Name;
+
+      qsort (resumed, resumedcount, sizeof(char *), comparename);
+
+      fprintf (stderr, "Resuming %s with %d entries at offset %lld\n",
+               resume, zstream->EntryCount, (long long int) zstream->WriteOffset);
     }
+  else if ( append )
+    {
+      /* Open existing archive for reading and writing */
+      if ( (fd = open (append, O_RDWR | O_BINARY)) < 0 )
+        {
+          fprintf (stderr, "Cannot open %s: %s\n", append, strerror(errno));
+          return 1;
+        }
 
-  /* Loop through input files, skip options */
-  for ( idx=1; idx < argc; idx++ )
+      /* Initialize ZIP container from existing archive */
+      if ( (zstream = zs_initappend (fd, NULL)) == NULL )
+        {
+          fprintf (stderr, "Error reading existing ZIP archive %s\n", append);
+          return 1;
+        }
+
+      fprintf (stderr, "Adding to %s with %d existing entries\n",
+               append, zstream->EntryCount);
+    }
+  else if ( prefix )
     {
-      if ( ! strcmp (argv[idx], "-0") )
-        continue;
+      /* Open first part, initialize ZIP container and rotation */
+      if ( (fd = nextpart (NULL, 0, prefix)) < 0 )
+        return 1;
 
-      if ( (input = fopen (argv[idx], "rb")) == NULL )
+      if ( (zstream = zs_init (fd, NULL)) == NULL )
         {
-          fprintf (stderr, "Cannot open %s: %s\n", argv[idx], strerror(errno));
+          fprintf (stderr, "Error initializing ZIP archive\n");
           return 1;
         }
 
-      if ( fstat (fileno(input), &st) )
+      if ( (partsize || partentries) &&
+           zs_setrotation (zstream, partsize, partentries, nextpart, prefix) )
         {
-          fclose(input);
-          fprintf (stderr, "Cannot stat %s: %s\n", argv[idx], strerror(errno));
+          fprintf (stderr, "Error initializing ZIP archive rotation\n");
           return 1;
         }
+    }
+  else
+    {
+      /* Set stdout to binary mode for Windows platforms */
+      #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+      _setmode( _fileno( stdout ), _O_BINARY );
+      #endif
 
-      /* Allocate buffer */
-      if ( ! buffer )
+      /* Set output stream to stdout */
+      fd = fileno (stdout);
+
+      /* Initialize ZIP container */
+      if ( (zstream = zs_init (fd, NULL)) == NULL )
         {
-          bufferlength = 1048576;
-          if ( (buffer = malloc (bufferlength)) == NULL )
-            {
-              fclose(input);
-              fprintf (stderr, "Cannot allocate %lld bytes\n",
-                       (long long int) bufferlength);
-              return 1;
-            }
+          fprintf (stderr, "Error initializing ZIP archive\n");
+          return 1;
         }
+    }
 
-      /* Begin ZIP entry */
-      if ( ! (zentry = zs_entrybegin (zstream, argv[idx], st.st_mtime,
-                                      method, &writestatus)) )
+  /* Use low-memory profile */
+  if ( lowmem && zs_setmemoryprofile (zstream, ZS_LOWMEM_WINDOWBITS, ZS_LOWMEM_MEMLEVEL,
+                                      ZS_LOWMEM_BUFFERSIZE) )
+    {
+      fprintf (stderr, "Error setting low-memory profile\n");
+      return 1;
+    }
+
+  /* Enable pipelined output, compressing while the writer thread writes */
+  if ( pipebuffers && zs_setpipeline (zstream, pipebuffers) )
+    {
+      fprintf (stderr, "Error initializing pipelined output\n");
+      return 1;
+    }
+
+  /* Frame output as the chunked body of an HTTP/1.1 response */
+  if ( chunksize >= 0 && zs_setchunked (zstream, chunksize) )
+    {
+      fprintf (stderr, "Error setting chunked output\n");
+      return 1;
+    }
+
+  /* Write the archive to additional copies in the same pass, a closed
+   * pipe is a write error instead of terminating */
+#ifdef SIGPIPE
+  if ( copycount )
+    signal (SIGPIPE, SIG_IGN);
+#endif
+
+  for ( idx = 0; idx < copycount; idx++ )
+    {
+      if ( (copyfds[idx] = open (copies[idx], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0 )
         {
-          fclose(input);
-          zs_free (zstream);
-          free (buffer);
-          fprintf (stderr, "Cannot begin ZIP entry for %s (writestatus: %lld)\n",
-                   argv[idx], (long long int) writestatus);
+          fprintf (stderr, "Cannot open %s: %s\n", copies[idx], strerror(errno));
           return 1;
         }
 
-      /* Read file into buffer */
-      while ( ! feof (input) )
+      if ( zs_addoutput (zstream, copyfds[idx], copypolicy[idx], 0) )
         {
-          readsize = fread (buffer, 1, bufferlength, input);
+          fprintf (stderr, "Error adding output %s\n", copies[idx]);
+          return 1;
+        }
+    }
 
-          /* Add data to ZIP entry */
-          if ( ! zs_entrydata (zstream, zentry, buffer, readsize, &writestatus) )
+  /* Write output with O_DIRECT or through mapped windows of the file */
+  if ( engine != ZS_ENGINE_WRITE && zs_setengine (zstream, engine) )
+    {
+      fprintf (stderr, "Error initializing output engine\n");
+      return 1;
+    }
+
+  /* Set flush policy for low-latency streaming */
+  if ( (flushms || flushbytes) && zs_setflush (zstream, flushms, flushbytes) )
+    {
+      fprintf (stderr, "Error setting flush policy\n");
+      return 1;
+    }
+
+  /* Set seek point interval for random access to deflated entries */
+  if ( seekinterval && zs_setseekpoints (zstream, seekinterval) )
+    {
+      fprintf (stderr, "Error setting seek point interval\n");
+      return 1;
+    }
+
+  /* Adapt deflate level to whether output or compression is the bottleneck */
+  if ( adaptmax && zs_setadaptive (zstream, adaptmin, adaptmax, 0) )
+    {
+      fprintf (stderr, "Error setting adaptive compression\n");
+      return 1;
+    }
+
+  /* Hash entry content in the same pass as the CRC and add a manifest */
+  if ( manifestname && zs_sethash (zstream, ZS_HASH_SHA256, manifestname) )
+    {
+      fprintf (stderr, "Error setting content hash\n");
+      return 1;
+    }
+
+  /* Encrypt entries with AES in the same pass as compression */
+  if ( password && zs_setencryption (zstream, password) )
+    {
+      fprintf (stderr, "Error setting encryption\n");
+      return 1;
+    }
+
+  /* Predict the size of a stored archive from the sizes of named files */
+  if ( predict )
+    {
+      if ( method != ZS_STORE || queue.recursive || queue.readstdin )
+        {
+          fprintf (stderr, "Size can only be predicted for stored, named files\n");
+          return 1;
+        }
+
+      if ( ! (plan = (ZIPplanentry *) calloc ((files) ? files : 1, sizeof(ZIPplanentry))) )
+        {
+          fprintf (stderr, "Cannot allocate memory for size prediction\n");
+          return 1;
+        }
+
+      for ( idx = 0; idx < files; idx++ )
+        {
+          if ( stat (argv[idx], &st) || ! S_ISREG (st.st_mode) )
             {
-              zs_free (zstream);
-              free (buffer);
-              fclose(input);
-              fprintf (stderr, "Error adding entry data to ZIP for %s (writestatus: %lld)\n",
-                       argv[idx], (long long int) writestatus);
+              fprintf (stderr, "Cannot predict size, %s is not a regular file\n", argv[idx]);
               return 1;
             }
+
+          plan[idx].Name = argv[idx];
+          plan[idx].Size = st.st_size;
+          plan[idx].MethodID = ZS_STORE;
         }
 
-      /* End ZIP entry */
-      if ( ! zs_entryend (zstream, zentry, &writestatus) )
+      if ( (predicted = zs_predictsize (zstream, plan, files)) < 0 )
         {
-          zs_free (zstream);
-          free (buffer);
-          fclose(input);
-          fprintf (stderr, "Cannot end ZIP entry for %s (writestatus: %lld)\n",
-                   argv[idx], (long long int) writestatus);
+          fprintf (stderr, "Cannot predict archive size\n");
           return 1;
         }
 
-      fprintf (stderr, "Added %s: %lld -> %lld (%.1f%%)\n",
-               zentry->Name,
-               (long long int) zentry->UncompressedSize,
-               (long long int) zentry->CompressedSize,
-               (100.0 * zentry->CompressedSize / zentry->UncompressedSize));
-
-      fclose (input);
-    } /* Done looping over input files */
+      fprintf (stderr, "Predicted archive size: %lld bytes\n", (long long int) predicted);
+      free (plan);
+    }
 
-  /* Finish ZIP archive */
-  if ( zs_finish (zstream, &writestatus) )
+  /* Write checkpoints to continue an interrupted archive with -R */
+  if ( checkpoint && zs_setcheckpoint (zstream, checkpoint, checkpointsec, 0) )
     {
-      zs_free (zstream);
-      free (buffer);
-      fprintf (stderr, "Error finishing ZIP archive (writestatus: %lld)\n",
-               (long long int) writestatus);
+      fprintf (stderr, "Error setting checkpoints\n");
       return 1;
     }
 
-  fprintf (stderr, "Success, created archive with %d entries\n",
-           zstream->EntryCount);
+  /* Start naming and opening input files */
+  queue.names = argv;
+  queue.namecount = files;
 
-  /* Cleanup */
-  zs_free (zstream);
+  if ( startinput (&queue) )
+    {
+      fprintf (stderr, "Cannot start input file prefetching\n");
+      return 1;
+    }
 
-  if ( buffer )
-    free (buffer);
+  /* Loop through input files */
+  while ( (input = nextinput (&queue)) )
+    {
+      if ( input->error )
+        {
+          fprintf (stderr, "Cannot open %s: %s\n", input->path, strerror(input->error));
+          return 1;
+        }
 
-  return 0;
+      /* Skip files already in a resumed archive */
+      if ( resumedcount && inarchive (resumed, resumedcount, input->path, gunzip) )
+        {
+          fprintf (stderr, "Skipping %s, already in archive\n", input->path);
+          doneinput (&queue);
+          continue;
+        }
+
+      /* Allocate buffer */
+      if ( ! buffer )
+        {
+          bufferlength = 1048576;
+          if ( (buffer = malloc (bufferlength)) == NULL )
+            {
+              fprintf (stderr, "Cannot allocate %lld bytes\n",
+                       (long long int) bufferlength);
+              return 1;
+            }
+        }
+
+      /* Copy the deflate data of gzip files, otherwise added as is */
+      if ( gunzip &&
+           (gzipped = addgzip (zstream, input, buffer, bufferlength, &zentry, &writestatus)) )
+        {
+          if ( gzipped < 0 )
+            {
+              zs_free (zstream);
+              free (buffer);
+              fprintf (stderr, "Error adding gzip data to ZIP for %s (writestatus: %lld)\n",
+                       input->path, (long long int) writestatus);
+              return 1;
+            }
+
+          fprintf (stderr, "Added %s from %s without recompression: %lld -> %lld (%.1f%%)\n",
+                   zentry->Name, input->path,
+                   (long long int) zentry->UncompressedSize,
+                   (long long int) zentry->CompressedSize,
+                   (100.0 * zentry->CompressedSize / zentry->UncompressedSize));
+
+          doneinput (&queue);
+          continue;
+        }
+
+      /* Begin ZIP entry */
+      if ( ! (zentry = zs_entrybegin (zstream, input->path, input->st.st_mtime,
+                                      method, &writestatus)) )
+        {
+          zs_free (zstream);
+          free (buffer);
+          fprintf (stderr, "Cannot begin ZIP entry for %s (writestatus: %lld)\n",
+                   input->path, (long long int) writestatus);
+          return 1;
+        }
+
+      mapped = 0;
+      readsize = 0;
+
+#ifndef ZF_NOPOSIX
+      /* Map large regular files, falling back to reading if not supported */
+      if ( S_ISREG (input->st.st_mode) && input->st.st_size >= MMAP_MINIMUM &&
+           (mapped = addmapped (zstream, zentry, input, &writestatus)) < 0 )
+        {
+          zs_free (zstream);
+          free (buffer);
+          fprintf (stderr, "Error adding entry data to ZIP for %s (writestatus: %lld)\n",
+                   input->path, (long long int) writestatus);
+          return 1;
+        }
+#endif
+
+      /* Read file into buffer unless mapped */
+      while ( ! mapped &&
+              (readsize = read (input->fd, buffer, bufferlength)) > 0 )
+        {
+          /* Add data to ZIP entry */
+          if ( ! zs_entrydata (zstream, zentry, buffer, readsize, &writestatus) )
+            {
+              zs_free (zstream);
+              free (buffer);
+              fprintf (stderr, "Error adding entry data to ZIP for %s (writestatus: %lld)\n",
+                       input->path, (long long int) writestatus);
+              return 1;
+            }
+        }
+
+      if ( readsize < 0 )
+        {
+          zs_free (zstream);
+          free (buffer);
+          fprintf (stderr, "Error reading %s: %s\n", input->path, strerror(errno));
+          return 1;
+        }
+
+      /* End ZIP entry */
+      if ( ! zs_entryend (zstream, zentry, &writestatus) )
+        {
+          zs_free (zstream);
+          free (buffer);
+          fprintf (stderr, "Cannot end ZIP entry for %s (writestatus: %lld)\n",
+                   input->path, (long long int) writestatus);
+          return 1;
+        }
+
+      fprintf (stderr, "Added %s: %lld -> %lld (%.1f%%)",
+               zentry->Name,
+               (long long int) zentry->UncompressedSize,
+               (long long int) zentry->CompressedSize,
+               (100.0 * zentry->CompressedSize / zentry->UncompressedSize));
+
+      if ( flushms || flushbytes )
+        fprintf (stderr, ", %lld flushes", (long long int) zentry->FlushCount);
+
+      if ( adaptmax )
+        fprintf (stderr, ", level %d", ( zentry->CompressionMethod == ZS_STORE ) ?
+                 0 : zentry->CompressionLevel);
+
+      fprintf (stderr, "\n");
+
+      doneinput (&queue);
+    } /* Done looping over input files */
+
+  /* Entry count, including any hash manifest, as a trailer of chunked output */
+  if ( chunksize >= 0 )
+    {
+      snprintf (entries, sizeof(entries), "%d",
+                zstream->EntryCount + ( (manifestname) ? 1 : 0 ));
+
+      if ( zs_addtrailer (zstream, "X-Zip-Entries", entries) )
+        {
+          fprintf (stderr, "Error adding trailer\n");
+          return 1;
+        }
+    }
+
+  /* Finish ZIP archive */
+  if ( zs_finish (zstream, &writestatus) )
+    {
+      zs_free (zstream);
+      free (buffer);
+      fprintf (stderr, "Error finishing ZIP archive (writestatus: %lld)\n",
+               (long long int) writestatus);
+      return 1;
+    }
+
+  /* Write manifest of archive parts */
+  if ( zstream->FirstPart )
+    {
+      snprintf (partname, sizeof(partname), "%s.manifest", prefix);
+
+      if ( (manifest = fopen (partname, "w")) == NULL )
+        {
+          fprintf (stderr, "Cannot open %s: %s\n", partname, strerror(errno));
+          return 1;
+        }
+
+      fprintf (manifest, "# part first_entry entries offset size\n");
+
+      for ( part = zstream->FirstPart; part; part = part->next )
+        {
+          fprintf (manifest, "%s.%03d.zip %d %d %lld %lld\n",
+                   prefix, part->Number, part->FirstEntry, part->EntryCount,
+                   (long long int) part->Offset, (long long int) part->Size);
+        }
+
+      if ( fclose (manifest) )
+        {
+          fprintf (stderr, "Error writing %s: %s\n", partname, strerror(errno));
+          return 1;
+        }
+
+      fprintf (stderr, "Success, created %d archive parts with %d entries\n",
+               zstream->LastPart->Number + 1,
+               zstream->LastPart->FirstEntry + zstream->LastPart->EntryCount);
+    }
+  else
+    {
+      fprintf (stderr, "Success, created archive with %d entries\n",
+               zstream->EntryCount);
+    }
+
+  /* Verify prediction against the actual size */
+  if ( predict && predicted != zstream->WriteOffset )
+    {
+      fprintf (stderr, "Archive size %lld differs from predicted size %lld\n",
+               (long long int) zstream->WriteOffset, (long long int) predicted);
+      zs_free (zstream);
+      free (buffer);
+      return 1;
+    }
+
+  /* Cleanup */
+  zs_free (zstream);
+
+  if ( buffer )
+    free (buffer);
+
+  if ( resumed )
+    free (resumed);
+
+  if ( (append || resume || prefix) && close (fd) )
+    {
+      fprintf (stderr, "Error closing %s: %s\n",
+               (append) ? append : (resume) ? resume : prefix, strerror(errno));
+      return 1;
+    }
+
+  /* Archive is complete, checkpoints are no longer needed */
+  if ( checkpoint && remove (checkpoint) && errno != ENOENT )
+    {
+      fprintf (stderr, "Cannot remove %s: %s\n", checkpoint, strerror(errno));
+      return 1;
+    }
+
+  for ( idx = 0; idx < copycount; idx++ )
+    {
+      if ( close (copyfds[idx]) && copypolicy[idx] == ZS_OUTPUT_FAILALL )
+        {
+          fprintf (stderr, "Error closing %s: %s\n", copies[idx], strerror(errno));
+          return 1;
+        }
+    }
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * nextpart:
+ *
+ * Close the current archive part, if any, and open the next part
+ * named prefix.NNN.zip.  Used as the zs_setrotation() callback.
+ *
+ * @return file descriptor of next part on success and -1 on error.
+ ***************************************************************************/
+static int
+nextpart (ZIPstream *zstream, int32_t partNumber, void *userdata)
+{
+  char partname[4096];
+  int fd;
+
+  if ( zstream && close (zstream->fd) )
+    {
+      fprintf (stderr, "Error closing part %d: %s\n", partNumber - 1, strerror(errno));
+      return -1;
+    }
+
+  snprintf (partname, sizeof(partname), "%s.%03d.zip", (char *)userdata, partNumber);
+
+  /* Readable as well for the mmap output engine */
+  if ( (fd = open (partname, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0 )
+    {
+      fprintf (stderr, "Cannot open %s: %s\n", partname, strerror(errno));
+      return -1;
+    }
+
+  if ( zstream )
+    fprintf (stderr, "Starting part %s\n", partname);
+
+  return fd;
+}
+
+
+/***************************************************************************
+ * parsesize:
+ *
+ * Parse a byte count with an optional k, M or G (binary) suffix.
+ *
+ * @return byte count on success and -1 on error.
+ ***************************************************************************/
+static int64_t
+parsesize (const char *string)
+{
+  char *end;
+  int64_t size;
+
+  size = strtoll (string, &end, 10);
+
+  if ( end == string || size < 0 )
+    return -1;
+
+  if ( *end == 'k' || *end == 'K' )
+    size *= 1024, end++;
+  else if ( *end == 'M' )
+    size *= 1024 * 1024, end++;
+  else if ( *end == 'G' )
+    size *= 1024 * 1024 * 1024, end++;
+
+  return ( *end == '\0' ) ? size : -1;
+}
+
+
+/***************************************************************************
+ * comparename:
+ *
+ * Compare entry names for qsort() and bsearch().
+ ***************************************************************************/
+static int
+comparename (const void *a, const void *b)
+{
+  return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+
+/***************************************************************************
+ * inarchive:
+ *
+ * Determine if the entry for a file is in the sorted names of a
+ * resumed archive, with -g also named without a .gz suffix.
+ *
+ * @return 1 if present and 0 otherwise.
+ ***************************************************************************/
+static int
+inarchive (char **names, int count, const char *path, int gunzip)
+{
+  char name[ZENTRY_NAME_LENGTH];
+  const char *key = name;
+  size_t length = strlen (path);
+
+  if ( bsearch (&path, names, count, sizeof(char *), comparename) )
+    return 1;
+
+  if ( ! gunzip || length <= 3 || length - 3 >= sizeof(name) ||
+       strcmp (path + length - 3, ".gz") )
+    return 0;
+
+  memcpy (name, path, length - 3);
+  name[length - 3] = '\0';
+
+  return ( bsearch (&key, names, count, sizeof(char *), comparename) ) ? 1 : 0;
+}
+
+
+#ifndef ZF_NOPOSIX
+/***************************************************************************
+ * producer:
+ *
+ * Thread to produce input file names in order, waiting while the
+ * queue is full.
+ ***************************************************************************/
+static void *
+producer (void *arg)
+{
+  INPUTqueue *queue = arg;
+  INPUTfile *input;
+  char *path;
+  int error;
+
+  while ( producename (queue, &path, &error) )
+    {
+      pthread_mutex_lock (&queue->lock);
+      while ( queue->produced - queue->consumed >= PREFETCH_DEPTH )
+        pthread_cond_wait (&queue->cond, &queue->lock);
+
+      input = &queue->slot[queue->produced % PREFETCH_DEPTH];
+      input->path = path;
+      input->fd = -1;
+      input->error = error;
+      input->ready = 0;
+      queue->produced++;
+
+      pthread_cond_broadcast (&queue->cond);
+      pthread_mutex_unlock (&queue->lock);
+    }
+
+  pthread_mutex_lock (&queue->lock);
+  queue->finished = 1;
+  pthread_cond_broadcast (&queue->cond);
+  pthread_mutex_unlock (&queue->lock);
+
+  return NULL;
+}
+
+
+/***************************************************************************
+ * prefetcher:
+ *
+ * Thread to open named input files in order ahead of the compressor.
+ ***************************************************************************/
+static void *
+prefetcher (void *arg)
+{
+  INPUTqueue *queue = arg;
+  INPUTfile *input;
+
+  while ( 1 )
+    {
+      pthread_mutex_lock (&queue->lock);
+      while ( queue->claimed == queue->produced && ! queue->finished )
+        pthread_cond_wait (&queue->cond, &queue->lock);
+
+      if ( queue->claimed == queue->produced )
+        {
+          pthread_mutex_unlock (&queue->lock);
+          break;
+        }
+
+      input = &queue->slot[queue->claimed % PREFETCH_DEPTH];
+      queue->claimed++;
+      pthread_mutex_unlock (&queue->lock);
+
+      /* Slot is owned by this thread until marked ready */
+      if ( ! input->error )
+        openinput (input);
+
+      pthread_mutex_lock (&queue->lock);
+      input->ready = 1;
+      pthread_cond_broadcast (&queue->cond);
+      pthread_mutex_unlock (&queue->lock);
+    }
+
+  return NULL;
+}
+#endif
+
+
+#ifndef ZF_NOPOSIX
+/***************************************************************************
+ * addmapped:
+ *
+ * Add the content of a regular file to an entry by memory mapping it
+ * in windows of MMAP_WINDOW bytes, each passed whole to the library
+ * and unmapped after use, bounding memory use for files larger than
+ * RAM.  Sequential access and, where supported, huge pages are
+ * advised and read-ahead of the following window is requested.
+ *
+ * The file must not be truncated while mapped.
+ *
+ * @return 1 when added, 0 if the file cannot be mapped and nothing was
+ * added, and -1 on error.
+ ***************************************************************************/
+static int
+addmapped (ZIPstream *zstream, ZIPentry *zentry, INPUTfile *input,
+           int64_t *writestatus)
+{
+  uint8_t *window;
+  int64_t offset;
+  size_t length;
+
+  for ( offset = 0; offset < input->st.st_size; offset += length )
+    {
+      length = ( (input->st.st_size - offset) > MMAP_WINDOW ) ?
+        MMAP_WINDOW : (input->st.st_size - offset);
+
+      window = mmap (NULL, length, PROT_READ, MAP_PRIVATE, input->fd, offset);
+
+      if ( window == MAP_FAILED )
+        {
+          if ( offset == 0 )
+            return 0;
+
+          fprintf (stderr, "Cannot map %s: %s\n", input->path, strerror(errno));
+          return -1;
+        }
+
+      madvise (window, length, MADV_SEQUENTIAL);
+#if defined(MADV_HUGEPAGE)
+      madvise (window, length, MADV_HUGEPAGE);
+#endif
+#if defined(POSIX_FADV_WILLNEED)
+      if ( offset + (int64_t)length < input->st.st_size )
+        posix_fadvise (input->fd, offset + length, MMAP_WINDOW, POSIX_FADV_WILLNEED);
+#endif
+
+      if ( ! zs_entrydata (zstream, zentry, window, length, writestatus) )
+        {
+          munmap (window, length);
+          return -1;
+        }
+
+      munmap (window, length);
+    }
+
+  return 1;
+}
+#endif
+
+
+/***************************************************************************
+ * addgzip:
+ *
+ * Add a single-member gzip file, named *.gz, as a DEFLATE entry of its
+ * uncompressed content named without the suffix.  A gzip member is a
+ * raw deflate stream with the CRC-32 and size of the content in its
+ * trailer, the deflate stream is copied to the entry verbatim.
+ *
+ * The stream is first inflated, without keeping the output, to find
+ * its end and verify the trailer, which is much cheaper than
+ * compressing again.  Files with more than one member, trailing data,
+ * content over 4 GiB or errors are not added.
+ *
+ * @return 1 when added, 0 if the file is not suitable and nothing was
+ * added (the file is left at offset 0), and -1 on error.
+ ***************************************************************************/
+static int
+addgzip (ZIPstream *zstream, INPUTfile *input, uint8_t *buffer,
+         uint64_t bufferlength, ZIPentry **zentry, int64_t *writestatus)
+{
+  char name[ZENTRY_NAME_LENGTH];
+  uint8_t trailer[8];
+  uint8_t *output = buffer + bufferlength / 2;
+  uint64_t chunk = bufferlength / 2;
+  int64_t readsize;
+  int64_t start;
+  int64_t offset;
+  int64_t end = -1;
+  uint64_t size = 0;
+  uint32_t crc = 0;
+  uint32_t mtime;
+  size_t length = strlen (input->path);
+  z_stream strm;
+  int flags;
+  int zrv = Z_OK;
+
+  if ( ! S_ISREG (input->st.st_mode) || input->st.st_size < 18 ||
+       length <= 3 || length - 3 >= sizeof(name) ||
+       strcmp (input->path + length - 3, ".gz") )
+    return 0;
+
+  /* Header: magic, method, flags, mtime, extra flags and OS, then
+   * optional extra field, name, comment and header CRC */
+  if ( (readsize = read (input->fd, buffer, chunk)) < 18 ||
+       buffer[0] != 0x1f || buffer[1] != 0x8b || buffer[2] != 8 || (buffer[3] & 0xE0) )
+    {
+      fprintf (stderr, "Not a gzip file, adding %s as is\n", input->path);
+      return ( lseek (input->fd, 0, SEEK_SET) ) ? -1 : 0;
+    }
+
+  flags = buffer[3];
+  mtime = (uint32_t)buffer[4] | ((uint32_t)buffer[5] << 8) |
+    ((uint32_t)buffer[6] << 16) | ((uint32_t)buffer[7] << 24);
+  start = 10;
+
+  if ( flags & 0x04 )
+    start += 2 + ( buffer[10] | (buffer[11] << 8) );
+  if ( (flags & 0x08) && start < readsize )
+    start += strnlen ((char *) buffer + start, readsize - start) + 1;
+  if ( (flags & 0x10) && start < readsize )
+    start += strnlen ((char *) buffer + start, readsize - start) + 1;
+  if ( flags & 0x02 )
+    start += 2;
+
+  if ( start >= readsize || lseek (input->fd, input->st.st_size - 8, SEEK_SET) < 0 ||
+       read (input->fd, trailer, sizeof(trailer)) != sizeof(trailer) )
+    {
+      fprintf (stderr, "Unsupported gzip header, adding %s as is\n", input->path);
+      return ( lseek (input->fd, 0, SEEK_SET) ) ? -1 : 0;
+    }
+
+  /* Inflate to find the end of the deflate stream and check the trailer */
+  memset (&strm, 0, sizeof(strm));
+  if ( inflateInit2 (&strm, -MAX_WBITS) != Z_OK )
+    return -1;
+
+  offset = start;
+  while ( zrv == Z_OK )
+    {
+      if ( lseek (input->fd, offset, SEEK_SET) < 0 ||
+           (readsize = read (input->fd, buffer, chunk)) <= 0 )
+        break;
+
+      strm.next_in = buffer;
+      strm.avail_in = (uInt) readsize;
+
+      do
+        {
+          strm.next_out = output;
+          strm.avail_out = (uInt) chunk;
+          zrv = inflate (&strm, Z_NO_FLUSH);
+          crc = crc32 (crc, output, (uInt) (chunk - strm.avail_out));
+        }
+      while ( zrv == Z_OK && strm.avail_out == 0 );
+
+      /* No progress possible without more input */
+      if ( zrv == Z_BUF_ERROR && strm.avail_in == 0 )
+        zrv = Z_OK;
+
+      offset += readsize - strm.avail_in;
+    }
+
+  size = strm.total_out;
+  if ( zrv == Z_STREAM_END )
+    end = offset;
+  inflateEnd (&strm);
+
+  if ( end + 8 != input->st.st_size || size > 0xFFFFFFFF ||
+       crc != ((uint32_t)trailer[0] | ((uint32_t)trailer[1] << 8) |
+               ((uint32_t)trailer[2] << 16) | ((uint32_t)trailer[3] << 24)) ||
+       (uint32_t) size != ((uint32_t)trailer[4] | ((uint32_t)trailer[5] << 8) |
+                           ((uint32_t)trailer[6] << 16) | ((uint32_t)trailer[7] << 24)) )
+    {
+      fprintf (stderr, "Not a single-member gzip file or invalid, adding %s as is\n",
+               input->path);
+      return ( lseek (input->fd, 0, SEEK_SET) ) ? -1 : 0;
+    }
+
+  /* Copy the deflate stream verbatim */
+  memcpy (name, input->path, length - 3);
+  name[length - 3] = '\0';
+
+  if ( lseek (input->fd, start, SEEK_SET) < 0 ||
+       ! (*zentry = zs_entrybeginraw (zstream, name, ( mtime ) ? (time_t) mtime : input->st.st_mtime,
+                                      ZS_DEFLATE, crc, size, writestatus)) )
+    return -1;
+
+  for ( offset = start; offset < end; offset += readsize )
+    {
+      readsize = read (input->fd, buffer, ( end - offset > (int64_t) bufferlength ) ?
+                       bufferlength : (uint64_t) (end - offset));
+
+      if ( readsize <= 0 )
+        {
+          fprintf (stderr, "Error reading %s: %s\n", input->path,
+                   ( readsize ) ? strerror(errno) : "unexpected end of file");
+          return -1;
+        }
+
+      if ( ! zs_entrydata (zstream, *zentry, buffer, readsize, writestatus) )
+        return -1;
+    }
+
+  if ( ! zs_entryend (zstream, *zentry, writestatus) )
+    return -1;
+
+  return 1;
+}
+
+
+/***************************************************************************
+ * startinput:
+ *
+ * Start the producer and prefetch threads for an input queue.  With
+ * no prefetch threads, or on platforms without threads, files are
+ * named and opened on demand by nextinput().
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+startinput (INPUTqueue *queue)
+{
+#ifndef ZF_NOPOSIX
+  int idx;
+
+  if ( queue->threads <= 0 )
+    return 0;
+
+  pthread_mutex_init (&queue->lock, NULL);
+  pthread_cond_init (&queue->cond, NULL);
+
+  if ( pthread_create (&queue->producer, NULL, producer, queue) )
+    return -1;
+
+  for ( idx = 0; idx < queue->threads; idx++ )
+    {
+      if ( pthread_create (&queue->workers[idx], NULL, prefetcher, queue) )
+        return -1;
+    }
+#else
+  (void)queue;
+#endif
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * nextinput:
+ *
+ * Return the next input file, in order, once it has been opened.
+ * The file must be released with doneinput() before the next call.
+ *
+ * @return pointer to INPUTfile or NULL when no more files.
+ ***************************************************************************/
+static INPUTfile *
+nextinput (INPUTqueue *queue)
+{
+  INPUTfile *input = &queue->slot[queue->consumed % PREFETCH_DEPTH];
+#ifndef ZF_NOPOSIX
+  int idx;
+
+  if ( queue->threads > 0 )
+    {
+      pthread_mutex_lock (&queue->lock);
+      while ( ! (queue->consumed < queue->produced && input->ready) &&
+              ! (queue->finished && queue->consumed == queue->produced) )
+        pthread_cond_wait (&queue->cond, &queue->lock);
+
+      if ( queue->consumed == queue->produced )
+        input = NULL;
+      pthread_mutex_unlock (&queue->lock);
+
+      if ( ! input )
+        {
+          pthread_join (queue->producer, NULL);
+          for ( idx = 0; idx < queue->threads; idx++ )
+            pthread_join (queue->workers[idx], NULL);
+
+          pthread_cond_destroy (&queue->cond);
+          pthread_mutex_destroy (&queue->lock);
+          queue->threads = 0;
+          queue->finished = 1;
+        }
+
+      return input;
+    }
+#endif
+
+  if ( queue->finished || ! producename (queue, &input->path, &input->error) )
+    {
+      queue->finished = 1;
+      return NULL;
+    }
+
+  input->fd = -1;
+  if ( ! input->error )
+    openinput (input);
+
+  return input;
+}
+
+
+/***************************************************************************
+ * doneinput:
+ *
+ * Close and release the current input file, making room in the queue.
+ ***************************************************************************/
+static void
+doneinput (INPUTqueue *queue)
+{
+  INPUTfile *input = &queue->slot[queue->consumed % PREFETCH_DEPTH];
+
+  if ( input->fd >= 0 )
+    close (input->fd);
+
+  free (input->path);
+  input->path = NULL;
+  input->fd = -1;
+  input->ready = 0;
+
+#ifndef ZF_NOPOSIX
+  if ( queue->threads > 0 )
+    {
+      pthread_mutex_lock (&queue->lock);
+      queue->consumed++;
+      pthread_cond_broadcast (&queue->cond);
+      pthread_mutex_unlock (&queue->lock);
+      return;
+    }
+#endif
+
+  queue->consumed++;
+}
+
+
+/***************************************************************************
+ * openinput:
+ *
+ * Open and stat an input file and request read-ahead of the leading
+ * portion of regular files so data is cached before it is needed.
+ ***************************************************************************/
+static void
+openinput (INPUTfile *input)
+{
+  if ( (input->fd = open (input->path, O_RDONLY | O_BINARY)) < 0 )
+    {
+      input->error = errno;
+      return;
+    }
+
+  if ( fstat (input->fd, &input->st) )
+    {
+      input->error = errno;
+      close (input->fd);
+      input->fd = -1;
+      return;
+    }
+
+#if defined(POSIX_FADV_WILLNEED)
+  if ( S_ISREG (input->st.st_mode) && input->st.st_size > 0 )
+    {
+      posix_fadvise (input->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      posix_fadvise (input->fd, 0, ( input->st.st_size > PREFETCH_ADVISE ) ?
+                     PREFETCH_ADVISE : input->st.st_size, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
+
+#ifndef ZF_NOPOSIX
+/***************************************************************************
+ * namecmp:
+ *
+ * qsort() comparison of directory entry names.
+ ***************************************************************************/
+static int
+namecmp (const void *a, const void *b)
+{
+  return strcmp (((const WALKname *)a)->name, ((const WALKname *)b)->name);
+}
+
+
+/***************************************************************************
+ * popdirectory:
+ *
+ * Close and free the directory at the top of the walk stack.
+ ***************************************************************************/
+static void
+popdirectory (INPUTqueue *queue)
+{
+  WALKdir *walk = queue->walk;
+
+  queue->walk = walk->parent;
+
+  while ( walk->next < walk->count )
+    free (walk->names[walk->next++].name);
+
+  closedir (walk->dir);
+  free (walk->names);
+  free (walk->path);
+  free (walk);
+}
+
+
+/***************************************************************************
+ * pushdirectory:
+ *
+ * Read all names and types in a directory, opened relative to a parent
+ * directory descriptor, sort them for reproducible ordering and push
+ * the directory onto the walk stack.  The path is owned by the walk
+ * on success.
+ *
+ * @return 0 on success and errno value on error.
+ ***************************************************************************/
+static int
+pushdirectory (INPUTqueue *queue, int parentfd, const char *name, char *path)
+{
+  WALKdir *walk;
+  WALKname *names;
+  struct dirent *de;
+  int capacity = 0;
+  int fd;
+
+  if ( (fd = openat (parentfd, name, O_RDONLY | O_DIRECTORY)) < 0 )
+    return errno;
+
+  if ( ! (walk = (WALKdir *) calloc (1, sizeof(WALKdir))) )
+    {
+      close (fd);
+      return ENOMEM;
+    }
+
+  if ( ! (walk->dir = fdopendir (fd)) )
+    {
+      close (fd);
+      free (walk);
+      return errno;
+    }
+
+  /* Push first so a failure below is cleaned up by popping */
+  walk->parent = queue->walk;
+  queue->walk = walk;
+
+  while ( (de = readdir (walk->dir)) )
+    {
+      if ( ! strcmp (de->d_name, ".") || ! strcmp (de->d_name, "..") )
+        continue;
+
+      if ( walk->count == capacity )
+        {
+          capacity = ( capacity ) ? capacity * 2 : 64;
+          if ( ! (names = (WALKname *) realloc (walk->names, capacity * sizeof(WALKname))) )
+            {
+              popdirectory (queue);
+              return ENOMEM;
+            }
+          walk->names = names;
+        }
+
+      if ( ! (walk->names[walk->count].name = strdup (de->d_name)) )
+        {
+          popdirectory (queue);
+          return ENOMEM;
+        }
+
+      walk->names[walk->count++].type = de->d_type;
+    }
+
+  qsort (walk->names, walk->count, sizeof(WALKname), namecmp);
+
+  walk->path = path;
+
+  return 0;
+}
+#endif
+
+
+/***************************************************************************
+ * joinpath:
+ *
+ * Allocate a path joining a directory and name.
+ *
+ * @return allocated path on success and NULL on error.
+ ***************************************************************************/
+static char *
+joinpath (const char *directory, const char *name)
+{
+  size_t dirlength = strlen (directory);
+  char *path;
+
+  if ( ! (path = (char *) malloc (dirlength + strlen (name) + 2)) )
+    return NULL;
+
+  strcpy (path, directory);
+  if ( dirlength > 0 && directory[dirlength - 1] != '/' )
+    strcat (path, "/");
+  strcat (path, name);
+
+  return path;
+}
+
+
+/***************************************************************************
+ * producename:
+ *
+ * Produce the next input file path: from the walk of a directory in
+ * recursive mode, then specified file names, then names read from
+ * stdin.  In recursive mode directories are walked depth first, in
+ * sorted order, and only regular files are produced.
+ *
+ * Errors for a path are returned in error, with the path, so they
+ * can be reported in order.
+ *
+ * @return 1 if a path was produced and 0 when no more paths.
+ ***************************************************************************/
+static int
+producename (INPUTqueue *queue, char **path, int *error)
+{
+  char line[4096];
+  char *name;
+  size_t length;
+#ifndef ZF_NOPOSIX
+  WALKdir *walk;
+  struct stat st;
+  unsigned char type;
+#endif
+
+  *error = 0;
+
+  while ( 1 )
+    {
+#ifndef ZF_NOPOSIX
+      /* Continue walking the current directory */
+      if ( (walk = queue->walk) )
+        {
+          if ( walk->next >= walk->count )
+            {
+              popdirectory (queue);
+              continue;
+            }
+
+          name = walk->names[walk->next].name;
+          type = walk->names[walk->next++].type;
+          *path = joinpath (walk->path, name);
+
+          /* Type is usually known from readdir(), otherwise stat it */
+          if ( type == DT_UNKNOWN &&
+               fstatat (dirfd (walk->dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0 )
+            type = ( S_ISDIR (st.st_mode) ) ? DT_DIR : ( S_ISREG (st.st_mode) ) ? DT_REG : DT_LNK;
+
+          if ( ! *path )
+            {
+              free (name);
+              *error = ENOMEM;
+              return 1;
+            }
+
+          if ( type == DT_DIR )
+            {
+              if ( (*error = pushdirectory (queue, dirfd (walk->dir), name, *path)) )
+                {
+                  free (name);
+                  return 1;
+                }
+
+              free (name);
+              continue;
+            }
+
+          free (name);
+
+          if ( type == DT_REG )
+            return 1;
+
+          /* Skip symbolic links, devices and other special files */
+          free (*path);
+          continue;
+        }
+#endif
+
+      /* Next specified name, then next name from stdin */
+      if ( queue->nextname < queue->namecount )
+        {
+          name = queue->names[queue->nextname++];
+        }
+      else if ( queue->readstdin && fgets (line, sizeof(line), stdin) )
+        {
+          length = strlen (line);
+          while ( length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r') )
+            line[--length] = '\0';
+
+          if ( length == 0 )
+            continue;
+
+          name = line;
+        }
+      else
+        {
+          return 0;
+        }
+
+      if ( ! (*path = strdup (name)) )
+        {
+          *error = ENOMEM;
+          return 1;
+        }
+
+#ifndef ZF_NOPOSIX
+      /* Walk specified directories in recursive mode */
+      if ( queue->recursive && stat (name, &st) == 0 && S_ISDIR (st.st_mode) )
+        {
+          if ( (*error = pushdirectory (queue, AT_FDCWD, name, *path)) )
+            return 1;
+
+          continue;
+        }
+#endif
+
+      return 1;
+    }
 }
@@ -0,0 +1,109 @@
+/***************************************************************************
+ * zipmerge.c
+ *
+ * Merge ZIP archives into a single archive written to stdout without
+ * recompressing entries.  All diagnostics are printed to stderr.
+ *
+ * Compile with:
+ *   cc -Wall fdzipstream.c zipmerge.c -o zipmerge -lz -lpthread
+ *
+ * Copyright 2019 CTrabant
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  #include <io.h>
+#else
+  #include <unistd.h>
+  #define O_BINARY 0
+#endif
+
+#include "fdzipstream.h"
+
+int main (int argc, char *argv[])
+{
+  ZIPstream *zstream = NULL;
+
+  int64_t writestatus;
+  int32_t added;
+
+  int fd;
+  int idx;
+
+  if ( argc < 2 )
+    {
+      fprintf (stderr, "zipmerge: write a ZIP archive to stdout containing entries of specified archives\n");
+      fprintf (stderr, "Usage: zipmerge <archive1.zip> [archive2.zip] ... > output.zip\n");
+      fprintf (stderr, "\n");
+      fprintf (stderr, "Entries are copied without recompression, in the order specified.\n");
+      return 0;
+    }
+
+  /* Set stdout to binary mode for Windows platforms */
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  _setmode( _fileno( stdout ), _O_BINARY );
+  #endif
+
+  /* Initialize ZIP container with stdout */
+  if ( (zstream = zs_init (fileno (stdout), NULL)) == NULL )
+    {
+      fprintf (stderr, "Error initializing ZIP archive\n");
+      return 1;
+    }
+
+  /* Loop through input archives */
+  for ( idx=1; idx < argc; idx++ )
+    {
+      if ( (fd = open (argv[idx], O_RDONLY | O_BINARY)) < 0 )
+        {
+          fprintf (stderr, "Cannot open %s: %s\n", argv[idx], strerror(errno));
+          zs_free (zstream);
+          return 1;
+        }
+
+      if ( (added = zs_mergearchive (zstream, fd, &writestatus)) < 0 )
+        {
+          fprintf (stderr, "Error merging %s (writestatus: %lld)\n",
+                   argv[idx], (long long int) writestatus);
+          close (fd);
+          zs_free (zstream);
+          return 1;
+        }
+
+      fprintf (stderr, "Merged %s: %d entries\n", argv[idx], added);
+
+      close (fd);
+    }
+
+  /* Finish ZIP archive */
+  if ( zs_finish (zstream, &writestatus) )
+    {
+      zs_free (zstream);
+      fprintf (stderr, "Error finishing ZIP archive (writestatus: %lld)\n",
+               (long long int) writestatus);
+      return 1;
+    }
+
+  fprintf (stderr, "Success, created archive with %d entries\n",
+           zstream->EntryCount);
+
+  zs_free (zstream);
+
+  return 0;
+}
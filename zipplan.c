@@ -0,0 +1,445 @@
+/***************************************************************************
+ * zipplan.c
+ *
+ * Write a planned archive of generated entries to stdout, all or only
+ * a byte range of it, and verify its size against zs_predictsize().
+ * Entry data is generated deterministically, so every run with the
+ * same options produces the same archive and a range written with -r
+ * matches the same bytes of the complete archive.  All diagnostics are
+ * printed to stderr.  Used by testplan.sh.
+ *
+ * Compile with:
+ *   cc -Wall fdzipstream.c zipplan.c -o zipplan -lz -lpthread
+ *
+ * Examples:
+ *   ./zipplan -n 10 -s 1000000 > plan.zip
+ *   ./zipplan -n 10 -s 1000000 -r 4000000:65536 > range.bin
+ *
+ * Copyright 2019 CTrabant
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  #include <io.h>
+  #include <fcntl.h>
+#endif
+
+#include "fdzipstream.h"
+
+/* Size of the block of generated data that entries repeat */
+#define PLAN_BLOCK 65536
+
+/* Modification time of all entries, fixed for identical output */
+#define PLAN_MODTIME 1700000000
+
+/* Planned entries and their generated data */
+typedef struct plan_s
+{
+  ZIPplanentry *entries;
+  char (*names)[32];
+  uint8_t **encoded;             /* Deflated entry data, NULL for STORE */
+  int32_t count;
+} PLAN;
+
+static uint8_t block[PLAN_BLOCK];
+
+static void generate (int32_t index, uint64_t offset, uint8_t *buffer, int64_t length);
+static int makeplan (PLAN *plan, int32_t count, uint64_t size, int method);
+static int64_t readentry (int32_t index, uint64_t offset, uint8_t *buffer,
+                          int64_t length, void *userdata);
+static int writeentries (ZIPstream *zstream, PLAN *plan, int method);
+
+int main (int argc, char *argv[])
+{
+  ZIPstream *zstream;
+  PLAN plan;
+
+  int64_t writestatus;
+  int64_t predicted;
+  uint64_t size = 100000;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  int32_t count = 8;
+  int method = ZS_STORE;
+  int predictonly = 0;
+  int range = 0;
+  char *password = NULL;
+  char *end;
+  int idx;
+
+  for ( idx = 1; idx < argc; idx++ )
+    {
+      if ( ! strcmp (argv[idx], "-n") && (idx+1) < argc )
+        {
+          if ( (count = atoi (argv[++idx])) < 0 )
+            {
+              fprintf (stderr, "Invalid entry count: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-s") && (idx+1) < argc )
+        {
+          size = strtoull (argv[++idx], &end, 10);
+          if ( *end || size > 0xFFFFFFFF )
+            {
+              fprintf (stderr, "Invalid entry size: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-m") && (idx+1) < argc )
+        {
+          idx++;
+          if ( ! strcmp (argv[idx], "store") )
+            method = ZS_STORE;
+          else if ( ! strcmp (argv[idx], "deflate") )
+            method = ZS_DEFLATE;
+          else
+            {
+              fprintf (stderr, "Invalid method: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-e") && (idx+1) < argc )
+        {
+          password = argv[++idx];
+        }
+      else if ( ! strcmp (argv[idx], "-r") && (idx+1) < argc )
+        {
+          offset = strtoull (argv[++idx], &end, 10);
+          if ( *end == ':' )
+            length = strtoull (end + 1, &end, 10);
+          if ( *end )
+            {
+              fprintf (stderr, "Invalid range, must be offset:length: %s\n", argv[idx]);
+              return 1;
+            }
+          range = 1;
+        }
+      else if ( ! strcmp (argv[idx], "-w") )
+        {
+          range = 1;
+        }
+      else if ( ! strcmp (argv[idx], "-p") )
+        {
+          predictonly = 1;
+        }
+      else
+        {
+          fprintf (stderr, "zipplan: write a planned archive of generated entries to stdout\n");
+          fprintf (stderr, "Usage: zipplan [-n count] [-s size] [-m method] [-e password] [-p|-w|-r offset:length] > output.zip\n");
+          fprintf (stderr, "  -n count    Number of entries, default 8\n");
+          fprintf (stderr, "  -s size     Size of the largest entry, entries range from 0 to size bytes,\n");
+          fprintf (stderr, "              default 100000\n");
+          fprintf (stderr, "  -m method   store or deflate (pre-encoded with zlib), default store\n");
+          fprintf (stderr, "  -e password Encrypt entries with WinZip AES-256 using password\n");
+          fprintf (stderr, "  -p          Print the predicted archive size and exit\n");
+          fprintf (stderr, "  -w          Write the archive with zs_writerange() instead of adding entries\n");
+          fprintf (stderr, "  -r offset:length  Write only length bytes at offset with zs_writerange(),\n");
+          fprintf (stderr, "              length 0 for the rest of the archive\n");
+          return 1;
+        }
+    }
+
+  if ( range && password )
+    {
+      fprintf (stderr, "Ranges cannot be written with encryption\n");
+      return 1;
+    }
+
+  /* Set stdout to binary mode for Windows platforms */
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  _setmode( _fileno( stdout ), _O_BINARY );
+  #endif
+
+  if ( makeplan (&plan, count, size, method) )
+    return 1;
+
+  if ( (zstream = zs_init (fileno (stdout), NULL)) == NULL )
+    {
+      fprintf (stderr, "Error initializing ZIP archive\n");
+      return 1;
+    }
+
+  if ( password && zs_setencryption (zstream, password) )
+    {
+      fprintf (stderr, "Error setting encryption\n");
+      return 1;
+    }
+
+  if ( (predicted = zs_predictsize (zstream, plan.entries, plan.count)) < 0 )
+    {
+      fprintf (stderr, "Cannot predict archive size\n");
+      return 1;
+    }
+
+  if ( predictonly )
+    {
+      printf ("%lld\n", (long long int) predicted);
+      zs_free (zstream);
+      return 0;
+    }
+
+  if ( range )
+    {
+      if ( zs_writerange (zstream, plan.entries, plan.count, offset, length,
+                          readentry, &plan, &writestatus) )
+        {
+          fprintf (stderr, "Error writing range of ZIP archive (writestatus: %lld)\n",
+                   (long long int) writestatus);
+          return 1;
+        }
+    }
+  else if ( writeentries (zstream, &plan, method) )
+    {
+      return 1;
+    }
+
+  /* The archive size is counted also for output outside a range */
+  if ( zstream->WriteOffset != predicted )
+    {
+      fprintf (stderr, "Archive size %lld differs from predicted size %lld\n",
+               (long long int) zstream->WriteOffset, (long long int) predicted);
+      return 1;
+    }
+
+  zs_free (zstream);
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * generate:
+ *
+ * Generate length bytes of the data of entry index starting at offset.
+ * Entries repeat a block of data, rotated by entry index.
+ ***************************************************************************/
+static void
+generate ( int32_t index, uint64_t offset, uint8_t *buffer, int64_t length )
+{
+  uint64_t position = offset + (uint64_t)index * 7919;
+  int64_t idx;
+
+  for ( idx = 0; idx < length; idx++ )
+    buffer[idx] = block[(position + idx) % PLAN_BLOCK];
+}  /* End of generate() */
+
+
+/***************************************************************************
+ * makeplan:
+ *
+ * Plan count entries of sizes spread from 0 to size bytes.  Entries of
+ * method ZS_DEFLATE are generated and deflated in memory, for ZS_STORE
+ * only the CRC-32 is calculated, combining that of full blocks.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+makeplan ( PLAN *plan, int32_t count, uint64_t size, int method )
+{
+  z_stream zstrm;
+  uint8_t *data = NULL;
+  uint8_t fullblock[PLAN_BLOCK];
+  uint64_t entrysize;
+  uint64_t done;
+  uint32_t seed = 1;
+  uLong blockcrc = 0;
+  uLong crc;
+  int32_t idx;
+
+  /* Pseudo-random text, compressible to about two thirds */
+  for ( idx = 0; idx < PLAN_BLOCK; idx++ )
+    {
+      seed = seed * 1103515245 + 12345;
+      block[idx] = "abcdefghijklmnopqrstuvwxyz .,\n"[(seed >> 16) % 30];
+    }
+
+  plan->count = count;
+  plan->entries = (ZIPplanentry *) calloc ((count) ? count : 1, sizeof(ZIPplanentry));
+  plan->names = calloc ((count) ? count : 1, sizeof(*plan->names));
+  plan->encoded = (uint8_t **) calloc ((count) ? count : 1, sizeof(uint8_t *));
+
+  if ( ! plan->entries || ! plan->names || ! plan->encoded )
+    {
+      fprintf (stderr, "Cannot allocate memory for plan\n");
+      return -1;
+    }
+
+  for ( idx = 0; idx < count; idx++ )
+    {
+      entrysize = ( count > 1 ) ? size * idx / (count - 1) : size;
+
+      snprintf (plan->names[idx], sizeof(plan->names[idx]), "entry%07d", idx);
+      plan->entries[idx].Name = plan->names[idx];
+      plan->entries[idx].MethodID = method;
+      plan->entries[idx].ModTime = PLAN_MODTIME;
+      plan->entries[idx].UncompressedSize = entrysize;
+
+      if ( method == ZS_DEFLATE )
+        {
+          if ( ! (data = (uint8_t *) realloc (data, (entrysize) ? entrysize : 1)) )
+            {
+              fprintf (stderr, "Cannot allocate memory for entry data\n");
+              return -1;
+            }
+
+          generate (idx, 0, data, entrysize);
+          plan->entries[idx].CRC32 = crc32 (0L, data, entrysize);
+
+          memset (&zstrm, 0, sizeof(zstrm));
+          if ( deflateInit2 (&zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                             8, Z_DEFAULT_STRATEGY) != Z_OK ||
+               ! (plan->encoded[idx] = (uint8_t *) malloc (deflateBound (&zstrm, entrysize))) )
+            {
+              fprintf (stderr, "Cannot initialize deflate\n");
+              return -1;
+            }
+
+          zstrm.next_in = data;
+          zstrm.avail_in = entrysize;
+          zstrm.next_out = plan->encoded[idx];
+          zstrm.avail_out = deflateBound (&zstrm, entrysize);
+
+          if ( deflate (&zstrm, Z_FINISH) != Z_STREAM_END )
+            {
+              fprintf (stderr, "Cannot deflate entry data\n");
+              return -1;
+            }
+
+          plan->entries[idx].Size = zstrm.total_out;
+          deflateEnd (&zstrm);
+        }
+      else
+        {
+          plan->entries[idx].Size = entrysize;
+
+          /* Every full block of an entry has the same CRC-32 */
+          crc = crc32 (0L, Z_NULL, 0);
+          if ( entrysize >= PLAN_BLOCK )
+            {
+              generate (idx, 0, fullblock, PLAN_BLOCK);
+              blockcrc = crc32 (0L, fullblock, PLAN_BLOCK);
+            }
+
+          for ( done = 0; done + PLAN_BLOCK <= entrysize; done += PLAN_BLOCK )
+            crc = crc32_combine (crc, blockcrc, PLAN_BLOCK);
+
+          generate (idx, done, fullblock, entrysize - done);
+          plan->entries[idx].CRC32 = crc32 (crc, fullblock, entrysize - done);
+        }
+    }
+
+  free (data);
+
+  return 0;
+}  /* End of makeplan() */
+
+
+/***************************************************************************
+ * readentry:
+ *
+ * Read callback for zs_writerange(), return generated or deflated entry
+ * data.
+ *
+ * @return number of bytes read.
+ ***************************************************************************/
+static int64_t
+readentry ( int32_t index, uint64_t offset, uint8_t *buffer,
+            int64_t length, void *userdata )
+{
+  PLAN *plan = (PLAN *) userdata;
+
+  if ( plan->encoded[index] )
+    memcpy (buffer, plan->encoded[index] + offset, length);
+  else
+    generate (index, offset, buffer, length);
+
+  return length;
+}  /* End of readentry() */
+
+
+/***************************************************************************
+ * writeentries:
+ *
+ * Write the planned archive by adding each entry, STORE'd entries with
+ * zs_entrybegin() and deflated entries as pre-encoded data.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+writeentries ( ZIPstream *zstream, PLAN *plan, int method )
+{
+  ZIPentry *zentry;
+  uint8_t buffer[PLAN_BLOCK];
+  int64_t writestatus;
+  uint64_t done;
+  int64_t chunk;
+  int32_t idx;
+
+  for ( idx = 0; idx < plan->count; idx++ )
+    {
+      if ( method == ZS_STORE )
+        zentry = zs_entrybegin (zstream, plan->names[idx], PLAN_MODTIME,
+                                ZS_STORE, &writestatus);
+      else
+        zentry = zs_entrybeginraw (zstream, plan->names[idx], PLAN_MODTIME, method,
+                                   plan->entries[idx].CRC32,
+                                   plan->entries[idx].UncompressedSize, &writestatus);
+
+      if ( ! zentry )
+        {
+          fprintf (stderr, "Cannot begin ZIP entry for %s (writestatus: %lld)\n",
+                   plan->names[idx], (long long int) writestatus);
+          return -1;
+        }
+
+      for ( done = 0; done < plan->entries[idx].Size; done += chunk )
+        {
+          chunk = ( plan->entries[idx].Size - done > PLAN_BLOCK ) ?
+            PLAN_BLOCK : (int64_t)(plan->entries[idx].Size - done);
+
+          readentry (idx, done, buffer, chunk, plan);
+
+          if ( ! zs_entrydata (zstream, zentry, buffer, chunk, &writestatus) )
+            {
+              fprintf (stderr, "Error adding entry data for %s (writestatus: %lld)\n",
+                       plan->names[idx], (long long int) writestatus);
+              return -1;
+            }
+        }
+
+      if ( ! zs_entryend (zstream, zentry, &writestatus) )
+        {
+          fprintf (stderr, "Error ending ZIP entry for %s (writestatus: %lld)\n",
+                   plan->names[idx], (long long int) writestatus);
+          return -1;
+        }
+    }
+
+  if ( zs_finish (zstream, &writestatus) )
+    {
+      fprintf (stderr, "Error finishing ZIP archive (writestatus: %lld)\n",
+               (long long int) writestatus);
+      return -1;
+    }
+
+  return 0;
+}  /* End of writeentries() */
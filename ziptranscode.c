@@ -0,0 +1,1124 @@
+/***************************************************************************
+ * ziptranscode.c
+ *
+ * Recompress the entries of a ZIP archive read from stdin and write
+ * the new archive to stdout.  The input is parsed in streaming fashion
+ * from Local File Headers, entries are recompressed in parallel by a
+ * pool of threads and written in their original order.  Entries that
+ * do not get smaller are passed through unchanged.  All diagnostics
+ * are printed to stderr.
+ *
+ * Compile with:
+ *   cc -Wall fdzipstream.c ziptranscode.c -o ziptranscode -lz -lpthread
+ *
+ * For zstd compressed entries add -DZIPTRANSCODE_ZSTD and -lzstd.
+ *
+ * Copyright 2019 CTrabant
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <zlib.h>
+
+#ifdef ZIPTRANSCODE_ZSTD
+  #include <zstd.h>
+#endif
+
+#include "fdzipstream.h"
+
+/* ZIP method ID of zstd compression */
+#define ZSTD_METHOD 93
+
+/* Size of buffer for input read from the descriptor */
+#define INPUT_SIZE 1048576
+
+/* Maximum number of transcoding threads */
+#define TRANSCODE_THREADS 64
+
+/* Default limit of entry data held in memory by queued entries */
+#define TRANSCODE_MEMORY 268435456
+
+/* Input archive stream */
+typedef struct zipinput_s
+{
+  int fd;
+  uint8_t raw[INPUT_SIZE];
+  size_t rawsize;
+  size_t rawused;
+  int raweof;                    /* Flag: descriptor at end of file */
+} ZIPinput;
+
+/* Entry read from the input and its transcoded result */
+typedef struct transcodejob_s
+{
+  char name[ZENTRY_NAME_LENGTH];
+  time_t mtime;
+  int method;                    /* Method of input entry */
+  uint32_t crc;
+  uint64_t size;                 /* Uncompressed size */
+  uint8_t *raw;                  /* Entry data as read */
+  int64_t rawsize;
+  int64_t rawallocated;
+  uint8_t *data;                 /* Uncompressed data, NULL until decoded */
+  int64_t datasize;
+  uint8_t *output;               /* Data to write, raw, data or allocated */
+  int64_t outputsize;
+  int outputmethod;
+  int done;                      /* Flag: transcoded by a worker */
+  int failed;                    /* Flag: transcoding failed */
+  struct transcodejob_s *next;   /* Next entry queued for workers */
+  struct transcodejob_s *following; /* Next entry in archive order */
+} TRANSCODEjob;
+
+/* Pool of worker threads and the in-order queue of entries */
+typedef struct transcodepool_s
+{
+  pthread_t threads[TRANSCODE_THREADS];
+  int count;
+  int level;                     /* Target compression level */
+  int method;                    /* Target method, ZS_DEFLATE or ZSTD_METHOD */
+  TRANSCODEjob *head;            /* Queued for workers */
+  TRANSCODEjob *tail;
+  TRANSCODEjob *first;           /* Oldest entry not yet written */
+  TRANSCODEjob *last;
+  int pending;                   /* Entries not yet written */
+  int64_t memory;                /* Entry data held by pending entries */
+  int finished;                  /* Flag: no more entries */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} TRANSCODEpool;
+
+static int readentry (ZIPinput *input, TRANSCODEjob *job);
+static int transcode (TRANSCODEpool *pool, TRANSCODEjob *job);
+static int writeentry (ZIPstream *zstream, TRANSCODEjob *job);
+static int writecompleted (ZIPstream *zstream, TRANSCODEpool *pool,
+                           int64_t memory, int discard);
+static void *worker (void *arg);
+static void freejob (TRANSCODEjob *job);
+static time_t dostounix (uint16_t date, uint16_t time);
+static void usage (void);
+
+int main (int argc, char *argv[])
+{
+  ZIPstream *zstream = NULL;
+  ZIPinput *input = NULL;
+  TRANSCODEpool pool;
+  TRANSCODEjob *job;
+
+  int64_t writestatus;
+  int64_t memory = TRANSCODE_MEMORY;
+  int threads;
+  int pipebuffers = 0;
+  int rv = 0;
+  int idx;
+
+  memset (&pool, 0, sizeof(TRANSCODEpool));
+  pool.method = ZS_DEFLATE;
+  pool.level = 9;
+
+  if ( (threads = (int) sysconf (_SC_NPROCESSORS_ONLN)) < 1 )
+    threads = 1;
+  if ( threads > TRANSCODE_THREADS )
+    threads = TRANSCODE_THREADS;
+
+  /* Loop through input arguments and process options */
+  for ( idx=1; idx < argc; idx++ )
+    {
+      if ( ! strcmp (argv[idx], "-l") && (idx+1) < argc )
+        {
+          pool.method = ZS_DEFLATE;
+          if ( (pool.level = atoi (argv[++idx])) < 1 || pool.level > 9 )
+            {
+              fprintf (stderr, "Invalid deflate level: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-z") && (idx+1) < argc )
+        {
+#ifdef ZIPTRANSCODE_ZSTD
+          pool.method = ZSTD_METHOD;
+          if ( (pool.level = atoi (argv[++idx])) < 1 || pool.level > ZSTD_maxCLevel () )
+            {
+              fprintf (stderr, "Invalid zstd level: %s\n", argv[idx]);
+              return 1;
+            }
+#else
+          fprintf (stderr, "zstd is not supported, rebuild with -DZIPTRANSCODE_ZSTD -lzstd\n");
+          return 1;
+#endif
+        }
+      else if ( ! strcmp (argv[idx], "-j") && (idx+1) < argc )
+        {
+          if ( (threads = atoi (argv[++idx])) < 1 || threads > TRANSCODE_THREADS )
+            {
+              fprintf (stderr, "Invalid thread count: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-M") && (idx+1) < argc )
+        {
+          if ( (memory = (int64_t) atoi (argv[++idx]) * 1048576) <= 0 )
+            {
+              fprintf (stderr, "Invalid memory limit: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-p") && (idx+1) < argc )
+        {
+          if ( (pipebuffers = atoi (argv[++idx])) <= 1 )
+            {
+              fprintf (stderr, "Invalid pipeline buffer count: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else
+        {
+          usage ();
+          return ( strcmp (argv[idx], "-h") ) ? 1 : 0;
+        }
+    }
+
+  /* Print usage instead of waiting for an archive from a terminal,
+   * e.g. when run without arguments */
+  if ( isatty (fileno (stdin)) )
+    {
+      usage ();
+      return ( argc < 2 ) ? 0 : 1;
+    }
+
+  if ( ! (input = (ZIPinput *) calloc (1, sizeof(ZIPinput))) )
+    {
+      fprintf (stderr, "Cannot allocate memory\n");
+      return 1;
+    }
+  input->fd = fileno(stdin);
+
+  if ( (zstream = zs_init (fileno(stdout), NULL)) == NULL )
+    {
+      fprintf (stderr, "Error initializing ZIP archive\n");
+      return 1;
+    }
+
+  if ( pipebuffers && zs_setpipeline (zstream, pipebuffers) )
+    {
+      fprintf (stderr, "Error setting up output pipeline\n");
+      return 1;
+    }
+
+  pthread_mutex_init (&pool.lock, NULL);
+  pthread_cond_init (&pool.cond, NULL);
+
+  for ( pool.count = 0; pool.count < threads; pool.count++ )
+    {
+      if ( (rv = pthread_create (&pool.threads[pool.count], NULL, worker, &pool)) )
+        {
+          fprintf (stderr, "Cannot create thread: %s\n", strerror(rv));
+          return 1;
+        }
+    }
+
+  /* Read entries, queue them for workers and write completed entries in order */
+  while ( rv == 0 )
+    {
+      if ( ! (job = (TRANSCODEjob *) calloc (1, sizeof(TRANSCODEjob))) )
+        {
+          fprintf (stderr, "Cannot allocate memory\n");
+          rv = -1;
+          break;
+        }
+
+      if ( (rv = readentry (input, job)) <= 0 )
+        {
+          freejob (job);
+          break;
+        }
+      rv = 0;
+
+      pthread_mutex_lock (&pool.lock);
+
+      if ( pool.tail )
+        pool.tail->next = job;
+      else
+        pool.head = job;
+      pool.tail = job;
+
+      if ( pool.last )
+        pool.last->following = job;
+      else
+        pool.first = job;
+      pool.last = job;
+
+      pool.pending++;
+      pool.memory += job->rawallocated + job->size;
+
+      pthread_cond_broadcast (&pool.cond);
+      pthread_mutex_unlock (&pool.lock);
+
+      rv = writecompleted (zstream, &pool, memory, 0);
+    }
+
+  /* Write remaining entries as they complete */
+  pthread_mutex_lock (&pool.lock);
+  pool.finished = 1;
+  pthread_cond_broadcast (&pool.cond);
+  pthread_mutex_unlock (&pool.lock);
+
+  if ( writecompleted (zstream, &pool, memory, rv) )
+    rv = -1;
+
+  for ( idx = 0; idx < pool.count; idx++ )
+    pthread_join (pool.threads[idx], NULL);
+
+  if ( rv )
+    {
+      zs_free (zstream);
+      return 1;
+    }
+
+  /* Finish ZIP archive */
+  if ( zs_finish (zstream, &writestatus) )
+    {
+      fprintf (stderr, "Error finishing ZIP archive (writestatus: %lld)\n",
+               (long long int) writestatus);
+      return 1;
+    }
+
+  fprintf (stderr, "Success, created archive with %d entries\n", zstream->EntryCount);
+
+  /* Cleanup */
+  zs_free (zstream);
+  pthread_cond_destroy (&pool.cond);
+  pthread_mutex_destroy (&pool.lock);
+  free (input);
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * usage:
+ *
+ * Print usage to stderr.
+ ***************************************************************************/
+static void
+usage (void)
+{
+  fprintf (stderr, "ziptranscode: recompress entries of a ZIP archive on stdin to stdout\n");
+  fprintf (stderr, "Usage: ziptranscode [-l level | -z level] [-j threads] [-M MiB] [-p buffers] < input.zip > output.zip\n");
+  fprintf (stderr, "  -l level    Deflate entries with level 1-9, default 9\n");
+  fprintf (stderr, "  -z level    Compress entries with zstd (method 93) at level%s\n",
+#ifdef ZIPTRANSCODE_ZSTD
+           ""
+#else
+           ", not built in"
+#endif
+           );
+  fprintf (stderr, "  -j threads  Number of transcoding threads, default is number of CPUs\n");
+  fprintf (stderr, "  -M MiB      Limit entry data queued in memory, default %d MiB\n",
+           TRANSCODE_MEMORY / 1048576);
+  fprintf (stderr, "  -p buffers  Write output in a separate thread through a ring of buffers\n");
+  fprintf (stderr, "\n");
+  fprintf (stderr, "Entries are written in original order, entries that are not made\n");
+  fprintf (stderr, "smaller are passed through unchanged.  Each entry is held in memory.\n");
+}  /* End of usage() */
+
+
+/***************************************************************************
+ * Little-endian readers for header fields.
+ ***************************************************************************/
+static uint16_t
+getunit16 (const uint8_t *bytes)
+{
+  return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+static uint32_t
+getunit32 (const uint8_t *bytes)
+{
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+    ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t
+getunit64 (const uint8_t *bytes)
+{
+  return (uint64_t)getunit32 (bytes) | ((uint64_t)getunit32 (bytes + 4) << 32);
+}
+
+
+/***************************************************************************
+ * peekinput:
+ *
+ * Make at least want bytes of input available in the buffer, unless
+ * the end of input is reached, moving unconsumed bytes to the start.
+ *
+ * @return number of available bytes and -1 on error.
+ ***************************************************************************/
+static int64_t
+peekinput (ZIPinput *input, size_t want)
+{
+  ssize_t readsize;
+
+  if ( input->rawsize - input->rawused >= want )
+    return input->rawsize - input->rawused;
+
+  if ( input->rawused > 0 )
+    {
+      memmove (input->raw, input->raw + input->rawused, input->rawsize - input->rawused);
+      input->rawsize -= input->rawused;
+      input->rawused = 0;
+    }
+
+  while ( input->rawsize < want && ! input->raweof )
+    {
+      readsize = read (input->fd, input->raw + input->rawsize,
+                       sizeof(input->raw) - input->rawsize);
+
+      if ( readsize < 0 && errno == EINTR )
+        continue;
+
+      if ( readsize < 0 )
+        {
+          fprintf (stderr, "Error reading input: %s\n", strerror(errno));
+          return -1;
+        }
+
+      if ( readsize == 0 )
+        input->raweof = 1;
+
+      input->rawsize += readsize;
+    }
+
+  return input->rawsize;
+}
+
+
+/***************************************************************************
+ * appendraw:
+ *
+ * Consume length bytes of input and append them to the entry data.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+appendraw (ZIPinput *input, TRANSCODEjob *job, size_t length)
+{
+  uint8_t *raw;
+  int64_t allocated;
+
+  if ( job->rawsize + (int64_t) length > job->rawallocated )
+    {
+      for ( allocated = ( job->rawallocated ) ? job->rawallocated : 65536;
+            allocated < job->rawsize + (int64_t) length; allocated *= 2 );
+
+      if ( ! (raw = (uint8_t *) realloc (job->raw, allocated)) )
+        {
+          fprintf (stderr, "Cannot allocate memory for %s\n", job->name);
+          return -1;
+        }
+
+      job->raw = raw;
+      job->rawallocated = allocated;
+    }
+
+  memcpy (job->raw + job->rawsize, input->raw + input->rawused, length);
+  job->rawsize += length;
+  input->rawused += length;
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * readentry:
+ *
+ * Read the next Local File Header and entry data from the input.
+ *
+ * When the sizes are deferred to a Data Descriptor (general purpose
+ * flag bit 3), the end of DEFLATE data is found by inflating it, which
+ * also decodes the entry, and the end of STORE data by finding a Data
+ * Descriptor signature followed by the CRC-32 and sizes of the data
+ * preceding it.
+ *
+ * @return 1 for an entry, 0 at the Central Directory or end of input
+ * and -1 on error.
+ ***************************************************************************/
+static int
+readentry (ZIPinput *input, TRANSCODEjob *job)
+{
+  uint8_t *header;
+  uint8_t *extra;
+  uint8_t *data;
+  uint64_t compressedsize;
+  int64_t available;
+  int64_t allocated;
+  size_t idx;
+  uint16_t flags;
+  uint16_t namelength;
+  uint16_t extralength;
+  int zip64 = 0;
+  int deferred;
+  int zrv;
+  z_stream strm;
+#ifdef ZIPTRANSCODE_ZSTD
+  ZSTD_DCtx *dctx;
+  ZSTD_inBuffer zin;
+  ZSTD_outBuffer zout;
+  size_t zsrv;
+#endif
+
+  if ( (available = peekinput (input, 30)) < 0 )
+    return -1;
+
+  header = input->raw + input->rawused;
+
+  /* Central Directory, end records or end of input */
+  if ( available == 0 ||
+       ( available >= 4 && header[0] == 'P' && header[1] == 'K' &&
+         ( (header[2] == 1 && header[3] == 2) || (header[2] == 5 && header[3] == 6) ||
+           (header[2] == 6 && header[3] == 6) ) ) )
+    return 0;
+
+  if ( available < 30 || getunit32 (header) != 0x04034b50 )
+    {
+      fprintf (stderr, "Invalid Local File Header, input is not a ZIP archive\n");
+      return -1;
+    }
+
+  flags = getunit16 (header + 6);
+  job->method = getunit16 (header + 8);
+  job->mtime = dostounix (getunit16 (header + 12), getunit16 (header + 10));
+  job->crc = getunit32 (header + 14);
+  compressedsize = getunit32 (header + 18);
+  job->size = getunit32 (header + 22);
+  namelength = getunit16 (header + 26);
+  extralength = getunit16 (header + 28);
+  input->rawused += 30;
+
+  if ( (available = peekinput (input, namelength + extralength)) < namelength + extralength )
+    {
+      fprintf (stderr, "Unexpected end of input\n");
+      return -1;
+    }
+
+  if ( namelength >= sizeof(job->name) )
+    {
+      fprintf (stderr, "Entry name longer than %d bytes\n", (int) sizeof(job->name) - 1);
+      return -1;
+    }
+
+  memcpy (job->name, input->raw + input->rawused, namelength);
+  job->name[namelength] = '\0';
+
+  /* ZIP64 extra field, sizes present if the header fields are saturated */
+  extra = input->raw + input->rawused + namelength;
+  for ( idx = 0; idx + 4 <= extralength; idx += 4 + getunit16 (extra + idx + 2) )
+    {
+      if ( getunit16 (extra + idx) == 0x0001 )
+        {
+          zip64 = 1;
+          data = extra + idx + 4;
+
+          if ( job->size == 0xFFFFFFFF && data + 8 <= extra + extralength )
+            {
+              job->size = getunit64 (data);
+              data += 8;
+            }
+          if ( compressedsize == 0xFFFFFFFF && data + 8 <= extra + extralength )
+            compressedsize = getunit64 (data);
+        }
+    }
+
+  input->rawused += namelength + extralength;
+
+  if ( flags & 0x0001 )
+    {
+      fprintf (stderr, "Entry %s is encrypted, not supported\n", job->name);
+      return -1;
+    }
+
+  deferred = ( flags & 0x0008 ) && compressedsize == 0;
+
+  if ( ! deferred )
+    {
+      /* Sizes known, read data */
+      while ( (uint64_t) job->rawsize < compressedsize )
+        {
+          if ( (available = peekinput (input, 1)) <= 0 )
+            {
+              fprintf (stderr, "Unexpected end of input in %s\n", job->name);
+              return -1;
+            }
+
+          if ( (uint64_t) available > compressedsize - job->rawsize )
+            available = compressedsize - job->rawsize;
+
+          if ( appendraw (input, job, available) )
+            return -1;
+        }
+    }
+  else if ( job->method == ZS_DEFLATE )
+    {
+      /* Inflate to find the end, keeping both the data and output */
+      memset (&strm, 0, sizeof(strm));
+      if ( inflateInit2 (&strm, -MAX_WBITS) != Z_OK )
+        return -1;
+
+      allocated = 0;
+      zrv = Z_OK;
+
+      while ( zrv != Z_STREAM_END )
+        {
+          if ( (available = peekinput (input, 1)) <= 0 )
+            {
+              fprintf (stderr, "Unexpected end of input in %s\n", job->name);
+              inflateEnd (&strm);
+              return -1;
+            }
+
+          if ( job->datasize + 65536 > allocated )
+            {
+              allocated = ( allocated ) ? allocated * 2 : 262144;
+              if ( ! (data = (uint8_t *) realloc (job->data, allocated)) )
+                {
+                  fprintf (stderr, "Cannot allocate memory for %s\n", job->name);
+                  inflateEnd (&strm);
+                  return -1;
+                }
+              job->data = data;
+            }
+
+          strm.next_in = input->raw + input->rawused;
+          strm.avail_in = (uInt) available;
+          strm.next_out = job->data + job->datasize;
+          strm.avail_out = (uInt) (allocated - job->datasize);
+
+          zrv = inflate (&strm, Z_NO_FLUSH);
+
+          if ( zrv != Z_OK && zrv != Z_STREAM_END && zrv != Z_BUF_ERROR )
+            {
+              fprintf (stderr, "Error inflating %s: %s\n", job->name,
+                       ( strm.msg ) ? strm.msg : "unknown error");
+              inflateEnd (&strm);
+              return -1;
+            }
+
+          job->datasize = allocated - strm.avail_out;
+
+          if ( appendraw (input, job, available - strm.avail_in) )
+            {
+              inflateEnd (&strm);
+              return -1;
+            }
+        }
+
+      inflateEnd (&strm);
+      job->size = job->datasize;
+    }
+#ifdef ZIPTRANSCODE_ZSTD
+  else if ( job->method == ZSTD_METHOD )
+    {
+      /* Decompress to the end of the frame, keeping both the data and output */
+      if ( ! (dctx = ZSTD_createDCtx ()) )
+        return -1;
+
+      allocated = 0;
+      zsrv = 1;
+
+      while ( zsrv != 0 )
+        {
+          if ( (available = peekinput (input, 1)) <= 0 )
+            {
+              fprintf (stderr, "Unexpected end of input in %s\n", job->name);
+              ZSTD_freeDCtx (dctx);
+              return -1;
+            }
+
+          if ( job->datasize + 65536 > allocated )
+            {
+              allocated = ( allocated ) ? allocated * 2 : 262144;
+              if ( ! (data = (uint8_t *) realloc (job->data, allocated)) )
+                {
+                  fprintf (stderr, "Cannot allocate memory for %s\n", job->name);
+                  ZSTD_freeDCtx (dctx);
+                  return -1;
+                }
+              job->data = data;
+            }
+
+          zin.src = input->raw + input->rawused;
+          zin.size = available;
+          zin.pos = 0;
+          zout.dst = job->data;
+          zout.size = allocated;
+          zout.pos = job->datasize;
+
+          zsrv = ZSTD_decompressStream (dctx, &zout, &zin);
+
+          if ( ZSTD_isError (zsrv) )
+            {
+              fprintf (stderr, "Error decompressing %s: %s\n", job->name,
+                       ZSTD_getErrorName (zsrv));
+              ZSTD_freeDCtx (dctx);
+              return -1;
+            }
+
+          job->datasize = zout.pos;
+
+          if ( appendraw (input, job, zin.pos) )
+            {
+              ZSTD_freeDCtx (dctx);
+              return -1;
+            }
+        }
+
+      ZSTD_freeDCtx (dctx);
+      job->size = job->datasize;
+    }
+#endif
+  else if ( job->method == ZS_STORE )
+    {
+      /* Find a Data Descriptor matching the data before it */
+      job->crc = crc32 (0L, Z_NULL, 0);
+
+      while ( 1 )
+        {
+          if ( (available = peekinput (input, 24)) < 16 )
+            {
+              fprintf (stderr, "Unexpected end of input in %s\n", job->name);
+              return -1;
+            }
+
+          header = input->raw + input->rawused;
+
+          for ( idx = 0; idx + 16 <= (size_t) available; idx++ )
+            if ( header[idx] == 'P' && getunit32 (header + idx) == 0x08074b50 )
+              break;
+
+          job->crc = crc32 (job->crc, header, idx);
+          if ( appendraw (input, job, idx) )
+            return -1;
+
+          if ( idx + 16 > (size_t) available )
+            continue;
+
+          if ( (available = peekinput (input, 24)) < 16 )
+            return -1;
+          header = input->raw + input->rawused;
+
+          if ( getunit32 (header + 4) == job->crc &&
+               ( ( getunit32 (header + 8) == job->rawsize &&
+                   getunit32 (header + 12) == job->rawsize ) ||
+                 ( zip64 && available >= 24 &&
+                   getunit64 (header + 8) == (uint64_t) job->rawsize &&
+                   getunit64 (header + 16) == (uint64_t) job->rawsize ) ) )
+            break;
+
+          /* Signature in the data */
+          job->crc = crc32 (job->crc, header, 1);
+          if ( appendraw (input, job, 1) )
+            return -1;
+        }
+
+      job->size = job->rawsize;
+    }
+  else
+    {
+      fprintf (stderr, "Cannot find the end of %s, method %d with deferred sizes\n",
+               job->name, job->method);
+      return -1;
+    }
+
+  /* Data Descriptor, with optional signature */
+  if ( flags & 0x0008 )
+    {
+      if ( (available = peekinput (input, 24)) < 12 )
+        {
+          fprintf (stderr, "Unexpected end of input in %s\n", job->name);
+          return -1;
+        }
+
+      header = input->raw + input->rawused;
+      idx = ( getunit32 (header) == 0x08074b50 ) ? 4 : 0;
+
+      job->crc = getunit32 (header + idx);
+
+      input->rawused += idx + 4 + (( zip64 ) ? 16 : 8);
+    }
+
+  return 1;
+}
+
+
+/***************************************************************************
+ * transcode:
+ *
+ * Decode an entry if needed, verify its CRC-32 and size and compress
+ * it with the target method.  The smallest of the original data (if
+ * stored or already in the target method), the recompressed data and
+ * the uncompressed data is selected for output.  Entries with methods
+ * that cannot be decoded are passed through.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+transcode (TRANSCODEpool *pool, TRANSCODEjob *job)
+{
+  uint8_t *output = NULL;
+  int64_t outputsize = 0;
+  z_stream strm;
+  int zrv;
+
+  /* Original data unless something smaller is found */
+  job->output = job->raw;
+  job->outputsize = job->rawsize;
+  job->outputmethod = job->method;
+
+  if ( job->method == ZS_STORE )
+    {
+      job->data = job->raw;
+      job->datasize = job->rawsize;
+    }
+  else if ( job->method == ZS_DEFLATE && ! job->data )
+    {
+      if ( ! (job->data = (uint8_t *) malloc ((job->size) ? job->size : 1)) )
+        {
+          fprintf (stderr, "Cannot allocate memory for %s\n", job->name);
+          return -1;
+        }
+
+      memset (&strm, 0, sizeof(strm));
+      if ( inflateInit2 (&strm, -MAX_WBITS) != Z_OK )
+        return -1;
+
+      strm.next_in = job->raw;
+      strm.avail_in = (uInt) job->rawsize;
+      strm.next_out = job->data;
+      strm.avail_out = (uInt) job->size;
+
+      zrv = inflate (&strm, Z_FINISH);
+      job->datasize = strm.total_out;
+      inflateEnd (&strm);
+
+      if ( zrv != Z_STREAM_END )
+        {
+          fprintf (stderr, "Error inflating %s\n", job->name);
+          return -1;
+        }
+    }
+#ifdef ZIPTRANSCODE_ZSTD
+  else if ( job->method == ZSTD_METHOD && ! job->data )
+    {
+      if ( ! (job->data = (uint8_t *) malloc ((job->size) ? job->size : 1)) )
+        {
+          fprintf (stderr, "Cannot allocate memory for %s\n", job->name);
+          return -1;
+        }
+
+      job->datasize = ZSTD_decompress (job->data, job->size, job->raw, job->rawsize);
+
+      if ( ZSTD_isError (job->datasize) )
+        {
+          fprintf (stderr, "Error decompressing %s: %s\n", job->name,
+                   ZSTD_getErrorName (job->datasize));
+          return -1;
+        }
+    }
+#endif
+  else if ( ! job->data )
+    {
+      /* Unknown method, pass through */
+      return 0;
+    }
+
+  if ( (uint64_t) job->datasize != job->size ||
+       crc32 (crc32 (0L, Z_NULL, 0), job->data, job->datasize) != job->crc )
+    {
+      fprintf (stderr, "CRC-32 or size mismatch for %s\n", job->name);
+      return -1;
+    }
+
+  /* Original data is only kept if stored or in the target method,
+   * otherwise stored unless recompressed smaller */
+  if ( job->datasize < job->outputsize ||
+       ( job->method != ZS_STORE && job->method != pool->method ) )
+    {
+      job->output = job->data;
+      job->outputsize = job->datasize;
+      job->outputmethod = ZS_STORE;
+    }
+
+  if ( pool->method == ZS_DEFLATE && job->datasize > 0 )
+    {
+      memset (&strm, 0, sizeof(strm));
+      if ( deflateInit2 (&strm, pool->level, Z_DEFLATED, -MAX_WBITS, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK )
+        return -1;
+
+      outputsize = deflateBound (&strm, job->datasize);
+
+      if ( ! (output = (uint8_t *) malloc (outputsize)) )
+        {
+          fprintf (stderr, "Cannot allocate memory for %s\n", job->name);
+          deflateEnd (&strm);
+          return -1;
+        }
+
+      strm.next_in = job->data;
+      strm.avail_in = (uInt) job->datasize;
+      strm.next_out = output;
+      strm.avail_out = (uInt) outputsize;
+
+      zrv = deflate (&strm, Z_FINISH);
+      outputsize = strm.total_out;
+      deflateEnd (&strm);
+
+      if ( zrv != Z_STREAM_END )
+        {
+          fprintf (stderr, "Error deflating %s\n", job->name);
+          free (output);
+          return -1;
+        }
+    }
+#ifdef ZIPTRANSCODE_ZSTD
+  else if ( pool->method == ZSTD_METHOD && job->datasize > 0 )
+    {
+      outputsize = ZSTD_compressBound (job->datasize);
+
+      if ( ! (output = (uint8_t *) malloc (outputsize)) )
+        {
+          fprintf (stderr, "Cannot allocate memory for %s\n", job->name);
+          return -1;
+        }
+
+      outputsize = ZSTD_compress (output, outputsize, job->data, job->datasize, pool->level);
+
+      if ( ZSTD_isError (outputsize) )
+        {
+          fprintf (stderr, "Error compressing %s: %s\n", job->name,
+                   ZSTD_getErrorName (outputsize));
+          free (output);
+          return -1;
+        }
+    }
+#endif
+
+  if ( output && outputsize < job->outputsize )
+    {
+      job->output = output;
+      job->outputsize = outputsize;
+      job->outputmethod = pool->method;
+    }
+  else if ( output )
+    {
+      free (output);
+    }
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * writeentry:
+ *
+ * Write a transcoded entry to the archive as pre-encoded data.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+writeentry (ZIPstream *zstream, TRANSCODEjob *job)
+{
+  ZIPentry *zentry;
+  int64_t writestatus;
+
+  if ( ! (zentry = zs_entrybeginraw (zstream, job->name, job->mtime, job->outputmethod,
+                                     job->crc, job->size, &writestatus)) )
+    {
+      fprintf (stderr, "Cannot begin ZIP entry for %s (writestatus: %lld)\n",
+               job->name, (long long int) writestatus);
+      return -1;
+    }
+
+  if ( job->outputsize > 0 &&
+       ! zs_entrydata (zstream, zentry, job->output, job->outputsize, &writestatus) )
+    {
+      fprintf (stderr, "Error adding entry data to ZIP for %s (writestatus: %lld)\n",
+               job->name, (long long int) writestatus);
+      return -1;
+    }
+
+  if ( ! zs_entryend (zstream, zentry, &writestatus) )
+    {
+      fprintf (stderr, "Cannot end ZIP entry for %s (writestatus: %lld)\n",
+               job->name, (long long int) writestatus);
+      return -1;
+    }
+
+  fprintf (stderr, "%s %s: method %d -> %d, %lld -> %lld bytes\n",
+           ( job->output == job->raw && job->outputmethod == job->method ) ?
+           "Passed" : "Transcoded", job->name, job->method, job->outputmethod,
+           (long long int) job->rawsize, (long long int) job->outputsize);
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * writecompleted:
+ *
+ * Write transcoded entries in archive order.  Waits for the oldest
+ * entry while more than two entries per thread or more than memory
+ * bytes of entry data are queued, or until all are written after the
+ * pool is finished.  With discard, entries are freed without writing.
+ *
+ * @return 0 on success and non-zero on error.
+ ***************************************************************************/
+static int
+writecompleted (ZIPstream *zstream, TRANSCODEpool *pool, int64_t memory, int discard)
+{
+  TRANSCODEjob *job;
+  int rv = 0;
+
+  pthread_mutex_lock (&pool->lock);
+
+  while ( pool->first )
+    {
+      if ( ! pool->first->done )
+        {
+          if ( pool->finished || pool->pending > 2 * pool->count || pool->memory > memory )
+            {
+              pthread_cond_wait (&pool->cond, &pool->lock);
+              continue;
+            }
+
+          break;
+        }
+
+      job = pool->first;
+      if ( ! (pool->first = job->following) )
+        pool->last = NULL;
+      pool->pending--;
+      pool->memory -= job->rawallocated + job->size;
+
+      pthread_mutex_unlock (&pool->lock);
+
+      if ( ! discard && ! rv && (job->failed || writeentry (zstream, job)) )
+        rv = -1;
+      freejob (job);
+
+      pthread_mutex_lock (&pool->lock);
+    }
+
+  pthread_mutex_unlock (&pool->lock);
+
+  return rv;
+}
+
+
+/***************************************************************************
+ * worker:
+ *
+ * Thread transcoding queued entries until the pool is finished.
+ ***************************************************************************/
+static void *
+worker (void *arg)
+{
+  TRANSCODEpool *pool = (TRANSCODEpool *) arg;
+  TRANSCODEjob *job;
+  int failed;
+
+  while ( 1 )
+    {
+      pthread_mutex_lock (&pool->lock);
+
+      while ( ! pool->head && ! pool->finished )
+        pthread_cond_wait (&pool->cond, &pool->lock);
+
+      if ( ! (job = pool->head) )
+        {
+          pthread_mutex_unlock (&pool->lock);
+          break;
+        }
+
+      pool->head = job->next;
+      if ( ! pool->head )
+        pool->tail = NULL;
+
+      pthread_mutex_unlock (&pool->lock);
+
+      failed = transcode (pool, job);
+
+      pthread_mutex_lock (&pool->lock);
+      job->failed = failed;
+      job->done = 1;
+      pthread_cond_broadcast (&pool->cond);
+      pthread_mutex_unlock (&pool->lock);
+    }
+
+  return NULL;
+}
+
+
+/***************************************************************************
+ * freejob:
+ *
+ * Free an entry and its data.
+ ***************************************************************************/
+static void
+freejob (TRANSCODEjob *job)
+{
+  if ( job->output && job->output != job->raw && job->output != job->data )
+    free (job->output);
+  if ( job->data && job->data != job->raw )
+    free (job->data);
+  free (job->raw);
+  free (job);
+}
+
+
+/***************************************************************************
+ * dostounix:
+ *
+ * Convert an MS-DOS date and time, in UTC as written by this library,
+ * to a Unix time.
+ ***************************************************************************/
+static time_t
+dostounix (uint16_t date, uint16_t time)
+{
+  int64_t year = 1980 + (date >> 9);
+  int64_t month = (date >> 5) & 0x0F;
+  int64_t day = date & 0x1F;
+  int64_t days;
+
+  if ( month < 1 || month > 12 )
+    month = 1;
+  if ( day < 1 )
+    day = 1;
+
+  /* Days since 1970-01-01 of a proleptic Gregorian date */
+  if ( month <= 2 )
+    year--;
+  days = year * 365 + year / 4 - year / 100 + year / 400 +
+    (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1 - 719468;
+
+  return (time_t) (days * 86400 + (time >> 11) * 3600 +
+                   ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2);
+}
@@ -0,0 +1,228 @@
+/***************************************************************************
+ * zipunchunk.c
+ *
+ * Decode an HTTP/1.1 chunked transfer encoded body, as written by
+ * zs_setchunked(), from stdin and write the data to stdout.  The
+ * framing is checked strictly: each chunk size line and chunk must end
+ * with CRLF, the body must end with the last, zero-length chunk and
+ * trailer section, and nothing may follow it.  Trailer fields are
+ * written to stderr or a file, all diagnostics are printed to stderr.
+ * Used by testchunked.sh.
+ *
+ * Compile with:
+ *   cc -Wall zipunchunk.c -o zipunchunk
+ *
+ * Example:
+ *   ./zipfiles -k 0 file1 file2 | ./zipunchunk -t trailers.txt > output.zip
+ *
+ * Copyright 2019 CTrabant
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  #include <io.h>
+  #include <fcntl.h>
+#endif
+
+/* Maximum length of a chunk size or trailer line */
+#define LINE_LENGTH 8192
+
+static int readline (FILE *input, char *line, size_t size);
+
+int main (int argc, char *argv[])
+{
+  FILE *trailers = stderr;
+  char line[LINE_LENGTH];
+  char buffer[65536];
+  char *end;
+  unsigned long long int maxchunk = 0;
+  unsigned long long int chunksize;
+  unsigned long long int remaining;
+  unsigned long long int total = 0;
+  long chunks = 0;
+  long fields = 0;
+  size_t readsize;
+  int idx;
+
+  for ( idx = 1; idx < argc; idx++ )
+    {
+      if ( ! strcmp (argv[idx], "-m") && (idx+1) < argc )
+        {
+          maxchunk = strtoull (argv[++idx], &end, 10);
+          if ( *end || maxchunk == 0 )
+            {
+              fprintf (stderr, "Invalid maximum chunk size: %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else if ( ! strcmp (argv[idx], "-t") && (idx+1) < argc )
+        {
+          if ( ! (trailers = fopen (argv[++idx], "w")) )
+            {
+              fprintf (stderr, "Cannot open %s\n", argv[idx]);
+              return 1;
+            }
+        }
+      else
+        {
+          fprintf (stderr, "zipunchunk: decode HTTP/1.1 chunked data from stdin to stdout\n");
+          fprintf (stderr, "Usage: zipunchunk [-m size] [-t file] < chunked > output\n");
+          fprintf (stderr, "  -m size  Fail on chunks larger than size bytes\n");
+          fprintf (stderr, "  -t file  Write trailer fields to file instead of stderr\n");
+          return 1;
+        }
+    }
+
+  /* Set stdin and stdout to binary mode for Windows platforms */
+  #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+  _setmode( _fileno( stdin ), _O_BINARY );
+  _setmode( _fileno( stdout ), _O_BINARY );
+  #endif
+
+  for (;;)
+    {
+      if ( readline (stdin, line, sizeof(line)) < 0 )
+        {
+          fprintf (stderr, "Missing last chunk after %lld chunks\n", (long long int) chunks);
+          return 1;
+        }
+
+      /* Chunk size in hex, optionally followed by extensions */
+      chunksize = strtoull (line, &end, 16);
+      if ( end == line || ! isxdigit ((unsigned char) line[0]) || (*end && *end != ';') )
+        {
+          fprintf (stderr, "Invalid chunk size line after %lld chunks: '%s'\n",
+                   (long long int) chunks, line);
+          return 1;
+        }
+
+      if ( chunksize == 0 )
+        break;
+
+      if ( maxchunk && chunksize > maxchunk )
+        {
+          fprintf (stderr, "Chunk %lld of %llu bytes is larger than %llu bytes\n",
+                   (long long int) chunks, chunksize, maxchunk);
+          return 1;
+        }
+
+      for ( remaining = chunksize; remaining > 0; remaining -= readsize )
+        {
+          readsize = ( remaining > sizeof(buffer) ) ? sizeof(buffer) : (size_t) remaining;
+
+          if ( fread (buffer, 1, readsize, stdin) != readsize )
+            {
+              fprintf (stderr, "Truncated chunk %lld\n", (long long int) chunks);
+              return 1;
+            }
+
+          if ( fwrite (buffer, 1, readsize, stdout) != readsize )
+            {
+              fprintf (stderr, "Error writing output\n");
+              return 1;
+            }
+        }
+
+      if ( readline (stdin, line, sizeof(line)) != 0 )
+        {
+          fprintf (stderr, "Chunk %lld not followed by CRLF\n", (long long int) chunks);
+          return 1;
+        }
+
+      total += chunksize;
+      chunks++;
+    }
+
+  /* Trailer fields up to the empty line ending the body */
+  for (;;)
+    {
+      if ( readline (stdin, line, sizeof(line)) < 0 )
+        {
+          fprintf (stderr, "Missing end of trailer section\n");
+          return 1;
+        }
+
+      if ( ! *line )
+        break;
+
+      if ( ! strchr (line, ':') || line[0] == ':' )
+        {
+          fprintf (stderr, "Invalid trailer field: '%s'\n", line);
+          return 1;
+        }
+
+      fprintf (trailers, "%s\n", line);
+      fields++;
+    }
+
+  if ( fgetc (stdin) != EOF )
+    {
+      fprintf (stderr, "Data after last chunk\n");
+      return 1;
+    }
+
+  if ( trailers != stderr )
+    fclose (trailers);
+
+  if ( fflush (stdout) )
+    {
+      fprintf (stderr, "Error writing output\n");
+      return 1;
+    }
+
+  fprintf (stderr, "%lld chunks, %llu bytes, %lld trailer fields\n",
+           (long long int) chunks, total, (long long int) fields);
+
+  return 0;
+}
+
+
+/***************************************************************************
+ * readline:
+ *
+ * Read a line ending with CRLF into line, without the CRLF.
+ *
+ * @return length of line on success and -1 on end of input, a line
+ * too long or not ending with CRLF.
+ ***************************************************************************/
+static int
+readline ( FILE *input, char *line, size_t size )
+{
+  size_t length = 0;
+  int c;
+
+  while ( (c = fgetc (input)) != EOF )
+    {
+      if ( c == '\r' )
+        {
+          if ( fgetc (input) != '\n' )
+            return -1;
+
+          line[length] = '\0';
+          return (int) length;
+        }
+
+      if ( c == '\n' || length + 1 >= size )
+        return -1;
+
+      line[length++] = (char) c;
+    }
+
+  return -1;
+}  /* End of readline() */